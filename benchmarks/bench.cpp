@@ -0,0 +1,497 @@
+#include "timer.h"
+#include <iostream>
+#include <iomanip>
+#include <fstream>
+#include <vector>
+#include <thread>
+#include <chrono>
+#include <atomic>
+#include <algorithm>
+#include <functional>
+#include <map>
+#include <cstdlib>
+#include <nlohmann/json.hpp>
+
+// Regression harness for the overhead of the timer: recording, dumping and merging.
+// Every case runs a few times and its median is reported, on stdout as a table and, with --json,
+// as a results file that a later run can be compared against with --baseline.
+//
+// Usage: distributed_timer_bench [--quick] [--repetitions N] [--filter TEXT] [--json PATH]
+//                                [--baseline PATH] [--threshold PERCENT]
+
+namespace {
+
+using Clock = std::chrono::steady_clock;
+
+const fs::path kDirectory = fs::temp_directory_path() / "distributed_timer_bench";
+
+struct options_t {
+    bool quick = false;        // Smaller workloads, for smoke runs.
+    size_t repetitions = 5;
+    std::string filter;        // Only run cases whose name contains it.
+    std::string jsonPath;
+    std::string baselinePath;
+    double threshold = 10;     // Percent slower than the baseline that counts as a regression.
+};
+
+/**
+ * @brief One run of a case: how many operations took how long.
+ */
+struct sample_t {
+    double ops;
+    double seconds;
+};
+
+/**
+ * @brief Summary of every run of a case. Lower is better for every unit.
+ */
+struct result_t {
+    std::string name;
+    std::string unit;
+    double median;
+    double min;
+    double max;
+};
+
+double elapsed(Clock::time_point begin)
+{
+    return std::chrono::duration<double>(Clock::now() - begin).count();
+}
+
+/**
+ * @brief Runs the cases that pass the filter and collects their results.
+ */
+class Harness {
+private:
+    options_t options_;
+    std::vector<result_t> results_;
+
+public:
+    explicit Harness(const options_t &options) : options_(options) {}
+
+    bool quick() const { return options_.quick; }
+
+    bool selected(const std::string &name) const { return name.find(options_.filter) != std::string::npos; }
+
+    // Runs a case and records the median cost per operation, as nanoseconds (ns/op) or seconds per million operations (s/Mop).
+    void run(const std::string &name, const std::string &unit, const std::function<sample_t()> &body) {
+        if (!selected(name))
+            return;
+        std::vector<double> costs;
+        for (size_t i = 0; i < options_.repetitions; ++i) {
+            sample_t sample = body();
+            double scale = unit == "ns/op" ? 1e9 : 1e6;
+            costs.push_back(sample.seconds * scale / std::max(1.0, sample.ops));
+        }
+        std::sort(costs.begin(), costs.end());
+        result_t result{name, unit, costs[costs.size() / 2], costs.front(), costs.back()};
+        std::cout << std::left << std::setw(48) << name << std::right << std::fixed << std::setprecision(3)
+                  << std::setw(14) << result.median << std::setw(14) << result.min << std::setw(14) << result.max
+                  << "  " << unit << std::endl;
+        results_.push_back(result);
+    }
+
+    const std::vector<result_t> &results() const { return results_; }
+};
+
+// Average cost of start and stop per thread, numThreads threads recording at once.
+// setup configures the timer before the threads start, e.g. to sample or read performance counters.
+sample_t startStop(unsigned int numThreads, size_t itersPerThread, bool measureMemory, const std::function<void(Timer &)> &setup = nullptr)
+{
+    Timer timer((kDirectory / "bench-record.json").string(), TimerOperation::Chrome);
+    if (setup)
+        setup(timer);
+    std::unordered_map<std::string, std::string> emptyArgs;
+    std::atomic<unsigned int> ready{0};
+    std::atomic<bool> go{false};
+    std::vector<double> seconds(numThreads);
+    std::vector<std::thread> threads;
+    for (unsigned int t = 0; t < numThreads; ++t)
+    {
+        threads.emplace_back([&, t]() {
+            const std::string category = "Worker " + std::to_string(t);
+            ready.fetch_add(1);
+            while (!go.load()) {}
+            auto begin = Clock::now();
+            for (size_t i = 0; i < itersPerThread; ++i)
+            {
+                timer.start(category, "Iteration", emptyArgs, measureMemory);
+                timer.stop(category, "Iteration", emptyArgs, measureMemory);
+            }
+            seconds[t] = elapsed(begin);
+        });
+    }
+    while (ready.load() != numThreads) {}
+    go.store(true);
+    for (auto &thread : threads)
+        thread.join();
+    double total = 0;
+    for (double s : seconds)
+        total += s;
+    return {2.0 * itersPerThread, total / numThreads};
+}
+
+sample_t counters(size_t iters)
+{
+    Timer timer((kDirectory / "bench-counters.json").string(), TimerOperation::Chrome);
+    std::unordered_map<std::string, std::string> emptyArgs;
+    auto begin = Clock::now();
+    for (size_t i = 0; i < iters; ++i)
+        timer.addCounterEvent("Queue", "Depth", i, emptyArgs);
+    return {double(iters), elapsed(begin)};
+}
+
+// Cost of a start/stop pair carrying argCount args per event, passed as a string map (what callers
+// had before typed args, numbers formatted on every call) or typed with traceArg().
+sample_t withArgs(size_t argCount, bool typed, size_t iters)
+{
+    Timer timer((kDirectory / "bench-args.json").string(), TimerOperation::Chrome);
+    const std::string category = "Request Loop";
+    const std::string name = "Handle Request";
+    auto begin = Clock::now();
+    for (size_t i = 0; i < iters; ++i)
+    {
+        int64_t value = static_cast<int64_t>(i);
+        if (!typed)
+        {
+            std::unordered_map<std::string, std::string> args;
+            if (argCount >= 2)
+                args = {{"iteration", std::to_string(value)}, {"size", std::to_string(value * 3)}};
+            if (argCount >= 8)
+                args.insert({{"offset", std::to_string(value * 7)}, {"ratio", std::to_string(value * 0.5)}, {"cached", value % 2 ? "true" : "false"},
+                             {"retries", std::to_string(value % 3)}, {"shard", std::to_string(value % 16)}, {"queue", "requests"}});
+            timer.start(category, name, args, false);
+            timer.stop(category, name, args, false);
+        }
+        else if (argCount == 0)
+        {
+            timer.start(category, name, {}, false);
+            timer.stop(category, name, {}, false);
+        }
+        else if (argCount == 2)
+        {
+            timer.start(category, name, traceArg("iteration", value), traceArg("size", value * 3));
+            timer.stop(category, name, traceArg("iteration", value), traceArg("size", value * 3));
+        }
+        else
+        {
+            timer.start(category, name, traceArg("iteration", value), traceArg("size", value * 3), traceArg("offset", value * 7), traceArg("ratio", value * 0.5),
+                        traceArg("cached", value % 2 != 0), traceArg("retries", value % 3), traceArg("shard", value % 16), traceArg("queue", "requests"));
+            timer.stop(category, name, traceArg("iteration", value), traceArg("size", value * 3), traceArg("offset", value * 7), traceArg("ratio", value * 0.5),
+                       traceArg("cached", value % 2 != 0), traceArg("retries", value % 3), traceArg("shard", value % 16), traceArg("queue", "requests"));
+        }
+    }
+    return {2.0 * iters, elapsed(begin)};
+}
+
+// Caller-thread cost of a start/stop pair of a pre-registered span, numThreads threads at once:
+// through a handle, through a site recorded synchronously, or through a site deferred to the consumer thread.
+enum class SitePath { Handle, Site, Deferred };
+
+sample_t preRegistered(SitePath path, unsigned int numThreads, size_t itersPerThread)
+{
+    Timer timer((kDirectory / "bench-sites.json").string(), TimerOperation::Chrome);
+    if (path == SitePath::Deferred)
+        timer.enableDeferredRecording();
+    std::atomic<unsigned int> ready{0};
+    std::atomic<bool> go{false};
+    std::vector<double> seconds(numThreads);
+    std::vector<std::thread> threads;
+    for (unsigned int t = 0; t < numThreads; ++t)
+    {
+        threads.emplace_back([&, t]() {
+            const std::string category = "Worker " + std::to_string(t);
+            span_handle_t handle = timer.handle(category, "Iteration");
+            trace_site_t site = timer.site(category, "Iteration", "iteration");
+            ready.fetch_add(1);
+            while (!go.load()) {}
+            auto begin = Clock::now();
+            for (size_t i = 0; i < itersPerThread; ++i)
+            {
+                if (path == SitePath::Handle)
+                {
+                    timer.start(handle);
+                    timer.stop(handle);
+                }
+                else
+                {
+                    timer.start(site, static_cast<int64_t>(i));
+                    timer.stop(site, static_cast<int64_t>(i));
+                }
+            }
+            seconds[t] = elapsed(begin);
+        });
+    }
+    while (ready.load() != numThreads) {}
+    go.store(true);
+    for (auto &thread : threads)
+        thread.join();
+    double total = 0;
+    for (double s : seconds)
+        total += s;
+    return {2.0 * itersPerThread, total / numThreads};
+}
+
+// Checks that stops carry non-zero task clock and page fault deltas, or that spans are still
+// recorded, without counter args, when perf_event_open is refused. Prints what is wrong otherwise.
+bool checkPerfSoftware()
+{
+    constexpr int kSpans = 100;
+    fs::path path = kDirectory / "bench-perf.json";
+    bool enabled;
+    {
+        Timer timer(path.string(), TimerOperation::Chrome);
+        enabled = timer.enablePerfCounters({PerfCounter::TaskClock, PerfCounter::PageFaults});
+        for (int i = 0; i < kSpans; ++i)
+        {
+            timer.start("Perf", "Touch", {}, false);
+            std::vector<char> pages(1 << 20, 1); // Large enough to be mapped afresh, so writing it faults.
+            timer.stop("Perf", "Touch", traceArg("first", int64_t(pages.front())));
+        }
+        timer.dumpLogs();
+    }
+
+    std::ifstream in(path);
+    nlohmann::json trace = nlohmann::json::parse(in, nullptr, false);
+    int stops = 0;
+    uint64_t taskClock = 0;
+    uint64_t pageFaults = 0;
+    bool hasCounters = false;
+    for (const auto &event : trace.is_array() ? trace : nlohmann::json::array())
+    {
+        if (event.value("ph", "") != "E" || event.value("name", "") != "Touch")
+            continue;
+        ++stops;
+        const nlohmann::json args = event.value("args", nlohmann::json::object());
+        hasCounters |= args.contains(PerfCounterGroup::name(PerfCounter::TaskClock)) || args.contains(PerfCounterGroup::name(PerfCounter::PageFaults));
+        taskClock += args.value(PerfCounterGroup::name(PerfCounter::TaskClock), uint64_t(0));
+        pageFaults += args.value(PerfCounterGroup::name(PerfCounter::PageFaults), uint64_t(0));
+    }
+
+    if (stops != kSpans)
+    {
+        std::cerr << "perf_software: " << stops << " of " << kSpans << " spans were recorded" << std::endl;
+        return false;
+    }
+    if (!enabled)
+    {
+        std::cerr << "perf_software: performance counters are unavailable, spans were recorded without them" << std::endl;
+        if (hasCounters)
+            std::cerr << "perf_software: spans carry counters although enablePerfCounters() failed" << std::endl;
+        return !hasCounters;
+    }
+    if (taskClock == 0 || pageFaults == 0)
+    {
+        std::cerr << "perf_software: spans carry " << taskClock << " ns of task clock and " << pageFaults
+                  << " page faults in total, both should be non-zero" << std::endl;
+        return false;
+    }
+    return true;
+}
+
+// Records events / 2 start/stop pairs with two args each.
+void fill(Timer &timer, size_t events)
+{
+    std::unordered_map<std::string, std::string> args = {{"iteration", "0"}, {"size", "42"}};
+    for (size_t i = 0; i < events / 2; ++i)
+    {
+        args["iteration"] = std::to_string(i);
+        timer.start("Request Loop", "Handle Request", args, false);
+        timer.stop("Request Loop", "Handle Request", args, false);
+    }
+}
+
+sample_t dump(TimerOperation operation, size_t events)
+{
+    Timer timer((kDirectory / "bench-dump").string(), operation);
+    fill(timer, events);
+    auto begin = Clock::now();
+    timer.dumpLogs();
+    return {double(events), elapsed(begin)};
+}
+
+// Writes numFiles traces of eventsPerFile events once, then times the merge tool on them.
+sample_t merge(TimerOperation operation, size_t numFiles, size_t eventsPerFile)
+{
+    std::string extension = operation == TimerOperation::Binary ? ".bin" : operation == TimerOperation::Perfetto ? ".pftrace" : ".json";
+    fs::path inputs = kDirectory / ("merge-" + std::to_string(numFiles) + "x" + std::to_string(eventsPerFile) + extension);
+    fs::create_directories(inputs);
+    // Perfetto traces are merged into a Perfetto trace, which concatenates them.
+    fs::path output = kDirectory / (operation == TimerOperation::Perfetto ? "bench-merged.pftrace" : "bench-merged.json");
+    std::string command = std::string("\"") + DISTRIBUTED_TIMER_MERGE_TOOL + "\" --no-clock-sync \"" + output.string() + "\"";
+    for (size_t i = 0; i < numFiles; ++i)
+    {
+        fs::path path = inputs / ("trace-" + std::to_string(i) + extension);
+        if (!fs::exists(path))
+        {
+            Timer timer(path.string(), operation);
+            fill(timer, eventsPerFile);
+            timer.dumpLogs();
+        }
+        command += " \"" + path.string() + "\"";
+    }
+    command += " > /dev/null";
+
+    auto begin = Clock::now();
+    if (std::system(command.c_str()) != 0)
+        std::cerr << "Merge tool failed: " << command << std::endl;
+    return {double(numFiles * eventsPerFile), elapsed(begin)};
+}
+
+nlohmann::json toJson(const std::vector<result_t> &results)
+{
+    nlohmann::json jResults = nlohmann::json::array();
+    for (const result_t &result : results)
+        jResults.push_back({{"name", result.name}, {"unit", result.unit}, {"median", result.median}, {"min", result.min}, {"max", result.max}});
+    return {
+        {"version", DISTRIBUTED_TIMER_VERSION},
+        {"clock", DISTRIBUTED_TIMER_CLOCK_NAME},
+        {"hardwareConcurrency", std::thread::hardware_concurrency()},
+        {"timestamp", std::chrono::duration_cast<std::chrono::seconds>(std::chrono::system_clock::now().time_since_epoch()).count()},
+        {"results", jResults},
+    };
+}
+
+// Prints every case slower than in the baseline by more than the threshold. Returns their number.
+size_t compare(const std::vector<result_t> &results, const nlohmann::json &baseline, double threshold)
+{
+    std::map<std::string, double> previous;
+    for (const auto &entry : baseline.value("results", nlohmann::json::array()))
+        previous[entry.value("name", std::string())] = entry.value("median", 0.0);
+
+    size_t regressions = 0;
+    std::cout << "\ncompared with " << baseline.value("version", std::string("?")) << ", threshold " << std::defaultfloat << threshold << "%" << std::fixed << std::endl;
+    for (const result_t &result : results)
+    {
+        auto it = previous.find(result.name);
+        if (it == previous.end() || it->second <= 0)
+            continue;
+        double change = 100 * (result.median - it->second) / it->second;
+        bool regressed = change > threshold;
+        regressions += regressed;
+        std::cout << std::left << std::setw(48) << result.name << std::right << std::showpos << std::setprecision(1)
+                  << std::setw(10) << change << "%" << std::noshowpos << (regressed ? "  REGRESSION" : "") << std::endl;
+    }
+    return regressions;
+}
+
+} // namespace
+
+int main(int argc, char **argv)
+{
+    options_t options;
+    for (int i = 1; i < argc; ++i)
+    {
+        std::string arg = argv[i];
+        bool hasValue = i + 1 < argc;
+        if (arg == "--quick")
+            options.quick = true;
+        else if (arg == "--repetitions" && hasValue)
+            options.repetitions = std::max(1ul, std::stoul(argv[++i]));
+        else if (arg == "--filter" && hasValue)
+            options.filter = argv[++i];
+        else if (arg == "--json" && hasValue)
+            options.jsonPath = argv[++i];
+        else if (arg == "--baseline" && hasValue)
+            options.baselinePath = argv[++i];
+        else if (arg == "--threshold" && hasValue)
+            options.threshold = std::stod(argv[++i]);
+        else
+        {
+            std::cerr << "Usage: " << argv[0] << " [--quick] [--repetitions N] [--filter TEXT] [--json PATH] [--baseline PATH] [--threshold PERCENT]" << std::endl;
+            return 1;
+        }
+    }
+    if (options.quick && options.repetitions == 5)
+        options.repetitions = 1;
+    fs::create_directories(kDirectory);
+
+    Harness harness(options);
+    const size_t scale = harness.quick() ? 10 : 1;
+    std::cout << std::left << std::setw(48) << "case" << std::right << std::setw(14) << "median"
+              << std::setw(14) << "min" << std::setw(14) << "max" << std::endl;
+
+    unsigned int maxThreads = std::max(1u, std::thread::hardware_concurrency());
+    for (unsigned int threads = 1; threads <= maxThreads; threads *= 2)
+    {
+        for (bool memory : {false, true})
+        {
+            std::string name = "record/start_stop/threads:" + std::to_string(threads) + (memory ? "/memory" : "");
+            // Reading /proc for every memory counter is orders of magnitude slower.
+            size_t iters = (memory ? 20000 : 200000) / scale;
+            harness.run(name, "ns/op", [&]() { return startStop(threads, iters, memory); });
+        }
+    }
+    harness.run("record/start_stop/one_in_100", "ns/op", [&]() {
+        return startStop(1, 200000 / scale, false, [](Timer &timer) { timer.setSamplingPolicy(sampling_policy_t::oneInN(100)); });
+    });
+    harness.run("record/start_stop/longer_than_1ms", "ns/op", [&]() {
+        return startStop(1, 200000 / scale, false, [](Timer &timer) { timer.setSamplingPolicy(sampling_policy_t::longerThan(std::chrono::milliseconds(1))); });
+    });
+    // Software events exist on any Linux kernel, so this case runs wherever perf_event_open is allowed.
+    bool perfChecked = !harness.selected("record/start_stop/perf_software") || checkPerfSoftware();
+    harness.run("record/start_stop/perf_software", "ns/op", [&]() {
+        return startStop(1, 20000 / scale, false, [](Timer &timer) {
+            timer.enablePerfCounters({PerfCounter::TaskClock, PerfCounter::PageFaults, PerfCounter::ContextSwitches});
+        });
+    });
+    harness.run("record/start_stop/perf_hardware", "ns/op", [&]() {
+        return startStop(1, 20000 / scale, false, [](Timer &timer) { timer.enablePerfCounters(); });
+    });
+    for (size_t argCount : {0, 2, 8})
+    {
+        harness.run("record/args/map/args:" + std::to_string(argCount), "ns/op", [&]() { return withArgs(argCount, false, 100000 / scale); });
+        if (argCount > 0)
+            harness.run("record/args/typed/args:" + std::to_string(argCount), "ns/op", [&]() { return withArgs(argCount, true, 100000 / scale); });
+    }
+    for (unsigned int threads : {1u, 4u})
+    {
+        const std::string suffix = "/threads:" + std::to_string(threads);
+        harness.run("record/pre_registered/handle" + suffix, "ns/op", [&]() { return preRegistered(SitePath::Handle, threads, 200000 / scale); });
+        harness.run("record/pre_registered/site" + suffix, "ns/op", [&]() { return preRegistered(SitePath::Site, threads, 200000 / scale); });
+        harness.run("record/pre_registered/deferred" + suffix, "ns/op", [&]() { return preRegistered(SitePath::Deferred, threads, 200000 / scale); });
+    }
+    harness.run("record/add_counter_event", "ns/op", [&]() { return counters(400000 / scale); });
+
+    for (size_t events : {10000, 100000, 1000000})
+    {
+        events /= scale;
+        harness.run("dump/json/events:" + std::to_string(events), "ns/op", [&]() { return dump(TimerOperation::Chrome, events); });
+        harness.run("dump/binary/events:" + std::to_string(events), "ns/op", [&]() { return dump(TimerOperation::Binary, events); });
+        harness.run("dump/perfetto/events:" + std::to_string(events), "ns/op", [&]() { return dump(TimerOperation::Perfetto, events); });
+        harness.run("dump/stats/events:" + std::to_string(events), "ns/op", [&]() { return dump(TimerOperation::Stats, events); });
+    }
+
+    for (size_t files : {2, 8})
+    {
+        size_t events = 100000 / scale;
+        std::string suffix = "/files:" + std::to_string(files) + "/events:" + std::to_string(events);
+        harness.run("merge/json" + suffix, "s/Mop", [&]() { return merge(TimerOperation::Chrome, files, events); });
+        harness.run("merge/binary" + suffix, "s/Mop", [&]() { return merge(TimerOperation::Binary, files, events); });
+        harness.run("merge/perfetto" + suffix, "s/Mop", [&]() { return merge(TimerOperation::Perfetto, files, events); });
+    }
+
+    if (!options.jsonPath.empty())
+    {
+        std::ofstream out(options.jsonPath);
+        out << std::setw(2) << toJson(harness.results()) << std::endl;
+        if (!out)
+        {
+            std::cerr << "Failed to write " << options.jsonPath << std::endl;
+            return 1;
+        }
+    }
+    if (!options.baselinePath.empty())
+    {
+        std::ifstream in(options.baselinePath);
+        nlohmann::json baseline = nlohmann::json::parse(in, nullptr, false);
+        if (baseline.is_discarded())
+        {
+            std::cerr << "Failed to read baseline " << options.baselinePath << std::endl;
+            return 1;
+        }
+        if (compare(harness.results(), baseline, options.threshold) > 0)
+            return 2;
+    }
+    return perfChecked ? 0 : 1;
+}
@@ -0,0 +1,75 @@
+#include "timer.h"
+#include <iostream>
+#include <iomanip>
+#include <algorithm>
+#include <limits>
+
+// Compares the read cost and the observable resolution of every timestamp source,
+// and the per-event cost of Timer with the source it was built with.
+
+namespace {
+
+template <typename Clock>
+void measureClock(const std::string &label, size_t iters)
+{
+    Clock::calibrate();
+
+    // Smallest non-zero step between two consecutive reads, in nanoseconds.
+    int64_t resolution = std::numeric_limits<int64_t>::max();
+    int64_t previous = Clock::toEpochNanos(Clock::now());
+    for (size_t i = 0; i < iters; ++i)
+    {
+        int64_t current = Clock::toEpochNanos(Clock::now());
+        if (current != previous)
+            resolution = std::min(resolution, current - previous);
+        previous = current;
+    }
+
+    int64_t sink = 0;
+    auto begin = std::chrono::steady_clock::now();
+    for (size_t i = 0; i < iters; ++i)
+        sink += Clock::now();
+    double ns = std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - begin).count() / iters;
+
+    std::cout << std::setw(10) << label << std::setw(14) << std::fixed << std::setprecision(1) << ns
+              << std::setw(18) << resolution << (sink == 0 ? " " : "") << std::endl;
+}
+
+} // namespace
+
+int main(int argc, char **argv)
+{
+    size_t iters = 10000000;
+    if (argc > 1)
+        iters = std::stoul(argv[1]);
+
+    std::cout << std::setw(10) << "clock" << std::setw(14) << "ns/read" << std::setw(18) << "resolution ns" << std::endl;
+    measureClock<trace_clock::SystemClock>("system", iters);
+    measureClock<trace_clock::SteadyClock>("steady", iters);
+#ifdef DISTRIBUTED_TIMER_HAS_TSC
+    measureClock<trace_clock::TscClock>("tsc", iters);
+#endif
+
+    Timer timer((fs::temp_directory_path() / "distributed_timer_bench" / "clock-sources.json").string(), TimerOperation::Chrome);
+    std::unordered_map<std::string, std::string> emptyArgs;
+    const std::string category = "Request Loop";
+    const std::string name = "Handle Request";
+    size_t events = std::min<size_t>(iters, 1000000);
+    auto begin = std::chrono::steady_clock::now();
+    for (size_t i = 0; i < events / 2; ++i)
+    {
+        timer.start(category, name, emptyArgs, false);
+        timer.stop(category, name, emptyArgs, false);
+    }
+    double ns = std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - begin).count() / events;
+    std::cout << "\nTimer built with DISTRIBUTED_TIMER_CLOCK="
+#if defined(DISTRIBUTED_TIMER_CLOCK_TSC)
+              << "tsc"
+#elif defined(DISTRIBUTED_TIMER_CLOCK_STEADY)
+              << "steady"
+#else
+              << "system"
+#endif
+              << ": " << std::fixed << std::setprecision(1) << ns << " ns per start/stop call" << std::endl;
+    return 0;
+}
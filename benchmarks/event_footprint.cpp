@@ -0,0 +1,121 @@
+#include "timer.h"
+#include <iostream>
+#include <iomanip>
+#include <atomic>
+#include <cstdlib>
+#include <new>
+
+// Reports heap bytes and allocations per start/stop call for the current Timer record path,
+// next to a replica of the previous std::string/std::unordered_map based raw_event_t.
+
+namespace {
+
+std::atomic<size_t> allocations{0};
+std::atomic<size_t> allocatedBytes{0};
+
+struct AllocationCounter
+{
+    size_t allocations;
+    size_t bytes;
+
+    AllocationCounter() : allocations(::allocations.load()), bytes(::allocatedBytes.load()) {}
+
+    void report(const std::string &label, size_t calls) const
+    {
+        std::cout << std::setw(10) << label
+                  << std::setw(16) << std::fixed << std::setprecision(1) << double(::allocatedBytes.load() - bytes) / calls
+                  << std::setw(16) << std::setprecision(3) << double(::allocations.load() - allocations) / calls << std::endl;
+    }
+};
+
+// The event record used before string interning.
+struct legacy_event_t {
+    std::string name;
+    std::string cat;
+    void *id;
+    int64_t ts;
+    uint32_t pid;
+    uint32_t tid;
+    char ph;
+    std::unordered_map<std::string, std::string> args;
+};
+
+// Mirrors what the previous Timer::start/stop pushed per call: the self-instrumentation pair and the user event.
+void legacyRecord(std::vector<legacy_event_t> &logs, const std::string &category, const std::string &name, char ph,
+                  const std::unordered_map<std::string, std::string> &args)
+{
+    auto push = [&logs](const std::string &cat, const std::string &eventName, char eventPh, const std::unordered_map<std::string, std::string> &eventArgs) {
+        legacy_event_t event;
+        event.name = eventName;
+        event.cat = cat;
+        event.pid = 1;
+        event.tid = std::hash<std::string>{}(cat);
+        event.ts = std::chrono::high_resolution_clock::now().time_since_epoch().count() / 1000;
+        event.ph = eventPh;
+        event.args = eventArgs;
+        logs.push_back(event);
+    };
+    push("Timer", ph == 'B' ? "start Function" : "stop Function", 'B', {});
+    push(category, name, ph, args);
+    push("Timer", ph == 'B' ? "start Function" : "stop Function", 'E', {});
+}
+
+} // namespace
+
+void *operator new(size_t size)
+{
+    allocations.fetch_add(1, std::memory_order_relaxed);
+    allocatedBytes.fetch_add(size, std::memory_order_relaxed);
+    if (void *ptr = std::malloc(size))
+        return ptr;
+    throw std::bad_alloc();
+}
+
+void operator delete(void *ptr) noexcept
+{
+    std::free(ptr);
+}
+
+void operator delete(void *ptr, size_t) noexcept
+{
+    std::free(ptr);
+}
+
+int main(int argc, char **argv)
+{
+    size_t iters = 1000000;
+    if (argc > 1)
+        iters = std::stoul(argv[1]);
+
+    const std::string category = "Request Loop";
+    const std::string name = "Handle Request";
+    const std::unordered_map<std::string, std::string> args = {{"iteration", "123456"}, {"size", "42"}};
+    const size_t calls = 2 * iters;
+
+    std::cout << std::setw(10) << "path" << std::setw(16) << "bytes/call" << std::setw(16) << "allocs/call" << std::endl;
+    {
+        std::vector<legacy_event_t> logs;
+        AllocationCounter counter;
+        for (size_t i = 0; i < iters; ++i)
+        {
+            legacyRecord(logs, category, name, 'B', args);
+            legacyRecord(logs, category, name, 'E', args);
+        }
+        counter.report("legacy", calls);
+    }
+    {
+        Timer timer((fs::temp_directory_path() / "distributed_timer_bench" / "event-footprint.json").string(), TimerOperation::Chrome);
+        // Warm up the thread buffer and intern caches so only steady-state recording is counted.
+        timer.start(category, name, args, false);
+        timer.stop(category, name, args, false);
+
+        AllocationCounter counter;
+        for (size_t i = 0; i < iters; ++i)
+        {
+            timer.start(category, name, args, false);
+            timer.stop(category, name, args, false);
+        }
+        counter.report("interned", calls);
+    }
+    return 0;
+}
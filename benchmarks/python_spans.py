@@ -0,0 +1,82 @@
+"""Per-span overhead of the Python bindings.
+
+Run from the build directory, next to timer_python_module:
+    python -m pytest ../benchmarks/python_spans.py -s
+"""
+import os
+import tempfile
+import time
+
+import pytest
+
+tm = pytest.importorskip("timer_python_module")
+
+ITERATIONS = 200000
+
+
+@pytest.fixture
+def timer():
+    path = os.path.join(tempfile.gettempdir(), "distributed_timer_bench", "python-spans.json")
+    return tm.Timer(path, tm.TimerOperation.Chrome)
+
+
+def ns_per_span(body):
+    begin = time.perf_counter_ns()
+    for _ in range(ITERATIONS):
+        body()
+    return (time.perf_counter_ns() - begin) / ITERATIONS
+
+
+def test_span_overhead(timer):
+    span = timer.span("Request Loop", "Handle Request")
+
+    def empty():
+        pass
+
+    def dict_args():
+        timer.start("Request Loop", "Handle Request", {}, False)
+        timer.stop("Request Loop", "Handle Request", {}, False)
+
+    def handle():
+        span.start()
+        span.stop()
+
+    def context_manager():
+        with span:
+            pass
+
+    @span
+    def decorated():
+        pass
+
+    results = {
+        "empty call": ns_per_span(empty),
+        "start/stop with dict": ns_per_span(dict_args),
+        "span.start/stop": ns_per_span(handle),
+        "with span": ns_per_span(context_manager),
+        "@span": ns_per_span(decorated),
+    }
+    print()
+    for label, ns in results.items():
+        print(f"{label:>24} {ns:10.1f} ns/span")
+
+    # Handles skip the string and dict conversions, so they must not be slower than the string API.
+    assert results["span.start/stop"] < results["start/stop with dict"]
+
+
+def test_take_events(timer):
+    span = timer.span("Request Loop", "Handle Request")
+    for _ in range(1000):
+        with span:
+            pass
+
+    begin = time.perf_counter_ns()
+    events, strings = timer.takeEvents()
+    print(f"\ntakeEvents: {len(events)} events in {(time.perf_counter_ns() - begin) / 1e3:.1f} us")
+
+    assert len(events) == 2000
+    assert events.dtype.itemsize == 32
+    assert strings[events["cat"][0]] == "Request Loop"
+    assert strings[events["name"][0]] == "Handle Request"
+    assert (events["ph"] == b"B").sum() == 1000
+    assert (events["ts"][1:] >= events["ts"][:-1]).all()
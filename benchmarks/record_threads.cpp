@@ -0,0 +1,97 @@
+#include "timer.h"
+#include <iostream>
+#include <iomanip>
+#include <vector>
+#include <thread>
+#include <chrono>
+#include <atomic>
+#include <algorithm>
+
+// Measures the per-event cost of Timer::start/Timer::stop as the number of recording threads grows.
+// With per-thread buffers the cost should stay roughly flat from 1 to N threads.
+// The mapped column records into a pre-faulted memory-mapped file (Timer::enableMappedBuffer) instead.
+// A last single-thread run enables self-profiling to show its cost and the stats it reports.
+
+namespace {
+
+double recordNsPerEvent(unsigned int numThreads, size_t itersPerThread, bool mapped = false, uint32_t selfProfileEvery = 0, std::vector<api_profile_t> *profiles = nullptr)
+{
+    const fs::path directory = fs::temp_directory_path() / "distributed_timer_bench";
+    Timer timer((directory / "record-threads.json").string(), TimerOperation::Chrome);
+    if (mapped)
+        timer.enableMappedBuffer((directory / "record-threads.dtring").string());
+    timer.enableSelfProfiling(selfProfileEvery);
+    std::unordered_map<std::string, std::string> emptyArgs;
+    std::atomic<unsigned int> ready{0};
+    std::atomic<bool> go{false};
+    std::vector<double> nsPerEvent(numThreads);
+
+    std::vector<std::thread> threads;
+    for (unsigned int t = 0; t < numThreads; ++t)
+    {
+        threads.emplace_back([&, t]() {
+            const std::string category = "Worker " + std::to_string(t);
+            const std::string name = "Iteration";
+            ready.fetch_add(1);
+            while (!go.load()) {}
+
+            auto begin = std::chrono::steady_clock::now();
+            for (size_t i = 0; i < itersPerThread; ++i)
+            {
+                timer.start(category, name, emptyArgs, false);
+                timer.stop(category, name, emptyArgs, false);
+            }
+            auto end = std::chrono::steady_clock::now();
+            // Each start/stop pair records one user event per call.
+            nsPerEvent[t] = std::chrono::duration<double, std::nano>(end - begin).count() / (2.0 * itersPerThread);
+        });
+    }
+    while (ready.load() != numThreads) {}
+    go.store(true);
+    for (auto &thread : threads)
+        thread.join();
+
+    double total = 0;
+    for (double ns : nsPerEvent)
+        total += ns;
+
+    if (profiles != nullptr)
+        *profiles = timer.selfProfile();
+    return total / numThreads;
+}
+
+} // namespace
+
+int main(int argc, char **argv)
+{
+    unsigned int maxThreads = std::max(1u, std::thread::hardware_concurrency());
+    size_t itersPerThread = 100000;
+    if (argc > 1)
+        maxThreads = std::stoul(argv[1]);
+    if (argc > 2)
+        itersPerThread = std::stoul(argv[2]);
+
+    std::cout << std::setw(10) << "threads" << std::setw(16) << "ns/event" << std::setw(16) << "mapped" << std::endl;
+    for (unsigned int threads = 1; threads <= maxThreads; threads *= 2)
+    {
+        std::cout << std::setw(10) << threads << std::setw(16) << std::fixed << std::setprecision(1)
+                  << recordNsPerEvent(threads, itersPerThread)
+                  << std::setw(16) << recordNsPerEvent(threads, itersPerThread, true) << std::endl;
+    }
+
+    const uint32_t selfProfileEvery = 16;
+    std::cout << "\nself-profiling, one call in " << selfProfileEvery << " timed" << std::endl;
+    std::vector<api_profile_t> profiles;
+    double ns = recordNsPerEvent(1, itersPerThread, false, selfProfileEvery, &profiles);
+    std::cout << std::setw(10) << 1 << std::setw(16) << std::fixed << std::setprecision(1) << ns << "\n" << std::endl;
+
+    std::cout << std::setw(20) << "api" << std::setw(12) << "calls" << std::setw(12) << "sampled"
+              << std::setw(14) << "total ms" << std::setw(10) << "p50 ns" << std::setw(10) << "p99 ns" << std::endl;
+    for (const api_profile_t &profile : profiles)
+    {
+        std::cout << std::setw(20) << profile.api << std::setw(12) << profile.calls << std::setw(12) << profile.sampled
+                  << std::setw(14) << std::setprecision(2) << profile.totalNanos / 1e6
+                  << std::setw(10) << profile.p50Nanos << std::setw(10) << profile.p99Nanos << std::endl;
+    }
+    return 0;
+}
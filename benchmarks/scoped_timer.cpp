@@ -0,0 +1,81 @@
+#include "scoped_timer.h"
+#include <iostream>
+#include <iomanip>
+#include <atomic>
+#include <cstdlib>
+#include <new>
+
+// Compares the cost of DT_SCOPE with an empty loop and with hand paired start/stop calls.
+// Built twice: distributed_timer_bench_scoped_timer_disabled defines DISTRIBUTED_TIMER_DISABLED,
+// where DT_SCOPE must cost the same as the empty loop.
+
+namespace {
+
+std::atomic<size_t> allocations{0};
+
+// Keeps the loop counter alive so the compiler cannot drop an empty loop.
+inline void keep(size_t value)
+{
+    asm volatile("" : : "r"(value) : "memory");
+}
+
+template <typename Body>
+void measure(const std::string &label, size_t iters, Body &&body)
+{
+    size_t allocationsBefore = allocations.load();
+    auto begin = std::chrono::steady_clock::now();
+    for (size_t i = 0; i < iters; ++i)
+        body(i);
+    double ns = std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - begin).count() / iters;
+    std::cout << std::setw(24) << label << std::setw(14) << std::fixed << std::setprecision(2) << ns
+              << std::setw(16) << std::setprecision(3) << double(allocations.load() - allocationsBefore) / iters << std::endl;
+}
+
+} // namespace
+
+void *operator new(size_t size)
+{
+    allocations.fetch_add(1, std::memory_order_relaxed);
+    if (void *ptr = std::malloc(size))
+        return ptr;
+    throw std::bad_alloc();
+}
+
+void operator delete(void *ptr) noexcept
+{
+    std::free(ptr);
+}
+
+void operator delete(void *ptr, size_t) noexcept
+{
+    std::free(ptr);
+}
+
+int main(int argc, char **argv)
+{
+    size_t iters = 1000000;
+    if (argc > 1)
+        iters = std::stoul(argv[1]);
+
+    Timer timer((fs::temp_directory_path() / "distributed_timer_bench" / "scoped-timer.json").string(), TimerOperation::Chrome);
+    std::unordered_map<std::string, std::string> emptyArgs;
+
+#ifdef DISTRIBUTED_TIMER_DISABLED
+    std::cout << "DT_SCOPE compiled out (DISTRIBUTED_TIMER_DISABLED)" << std::endl;
+#else
+    std::cout << "DT_SCOPE compiled in" << std::endl;
+#endif
+    std::cout << std::setw(24) << "" << std::setw(14) << "ns/scope" << std::setw(16) << "allocs/scope" << std::endl;
+
+    measure("empty loop", iters, [](size_t i) { keep(i); });
+    measure("DT_SCOPE", iters, [&](size_t i) {
+        DT_SCOPE(timer, "Request Loop", "Handle Request With A Long Name");
+        keep(i);
+    });
+    measure("start/stop std::string", iters, [&](size_t i) {
+        timer.start("Request Loop", "Handle Request With A Long Name", emptyArgs, false);
+        keep(i);
+        timer.stop("Request Loop", "Handle Request With A Long Name", emptyArgs, false);
+    });
+    return 0;
+}
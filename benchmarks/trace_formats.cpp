@@ -0,0 +1,56 @@
+#include "timer.h"
+#include <iostream>
+#include <iomanip>
+#include <chrono>
+
+// Compares output size and dumpLogs() throughput of the JSON, binary, CSV and Perfetto trace formats.
+// CSV sizes include the counters table, which stays empty here.
+
+namespace {
+
+void run(const std::string &label, TimerOperation operation, size_t iters)
+{
+    fs::path path = fs::temp_directory_path() / "distributed_timer_bench" / ("trace-formats-" + label);
+    size_t events = 0;
+    double seconds = 0;
+    {
+        Timer timer(path.string(), operation);
+        std::unordered_map<std::string, std::string> args = {{"iteration", "0"}, {"size", "42"}};
+        for (size_t i = 0; i < iters; ++i)
+        {
+            args["iteration"] = std::to_string(i);
+            timer.start("Request Loop", "Handle Request", args, false);
+            timer.stop("Request Loop", "Handle Request", args, false);
+        }
+        events = 2 * iters;
+
+        auto begin = std::chrono::steady_clock::now();
+        timer.dumpLogs();
+        seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - begin).count();
+    }
+    size_t bytes = fs::file_size(path);
+    if (operation == TimerOperation::CSV)
+        bytes += fs::file_size(csv_format::countersPath(path));
+    std::cout << std::setw(10) << label
+              << std::setw(14) << bytes
+              << std::setw(14) << std::fixed << std::setprecision(1) << double(bytes) / events
+              << std::setw(14) << std::setprecision(3) << seconds
+              << std::setw(16) << std::setprecision(0) << events / seconds << std::endl;
+}
+
+} // namespace
+
+int main(int argc, char **argv)
+{
+    size_t iters = 200000;
+    if (argc > 1)
+        iters = std::stoul(argv[1]);
+
+    std::cout << std::setw(10) << "format" << std::setw(14) << "bytes" << std::setw(14) << "bytes/event"
+              << std::setw(14) << "dump s" << std::setw(16) << "events/s" << std::endl;
+    run("json", TimerOperation::Chrome, iters);
+    run("binary", TimerOperation::Binary, iters);
+    run("csv", TimerOperation::CSV, iters);
+    run("perfetto", TimerOperation::Perfetto, iters);
+    return 0;
+}
@@ -0,0 +1,239 @@
+#pragma once
+#include <cstdint>
+#include <cstddef>
+#include <cstring>
+#include <istream>
+#include <ostream>
+#include <string>
+#include <string_view>
+#include <vector>
+#include "trace_event.h"
+
+/**
+ * @brief Layout of the binary trace written by TimerOperation::Binary.
+ *
+ * A file starts with kMagic and is followed by length-prefixed blocks, all in host byte order:
+ * - Strings: `uint32_t firstId, uint32_t count`, then per string `uint32_t size` and its bytes.
+ * - Events: `uint32_t eventCount, uint32_t slotCount`, then eventCount raw_event_t records
+ *   whose args index into the slotCount arg_slot_t that follow them. Timestamps are
+ *   nanoseconds since the epoch.
+ * - Threads: `uint32_t pid, uint32_t threadCount`, the process name, then per thread its
+ *   `uint32_t tid` and name. Names are a `uint32_t size` and the bytes. Each Threads block
+ *   replaces the previous table; raw_event_t::thread indexes into it.
+ *
+ * A Strings block always precedes the first Events block referencing its ids, a Threads block
+ * precedes the first Events block recorded by its threads, and Events blocks
+ * hold at most kMaxBlockEvents events, in timestamp order within a block. Readers stop at
+ * the first incomplete block, so a file cut short by a crash still yields every complete block.
+ */
+namespace binary_format {
+
+constexpr char kMagic[8] = {'D', 'T', 'T', 'R', 'A', 'C', 'E', '1'};
+
+// Writers split larger batches so readers can hold a whole block in memory.
+constexpr size_t kMaxBlockEvents = 1 << 16;
+
+enum class BlockType : uint32_t {
+    Strings = 1,
+    Events = 2,
+    Threads = 3
+};
+
+struct block_header_t {
+    BlockType type;
+    uint32_t reserved;
+    uint64_t size; ///< Payload size in bytes, excluding this header.
+};
+
+static_assert(sizeof(block_header_t) == 16, "block_header_t is expected to be 16 bytes");
+
+/**
+ * @brief Write the strings [firstId, strings.size()) as a Strings block.
+ */
+inline void writeStrings(std::ostream &out, const std::vector<std::string_view> &strings, uint32_t firstId)
+{
+    uint32_t count = static_cast<uint32_t>(strings.size()) - firstId;
+    block_header_t header{BlockType::Strings, 0, 2 * sizeof(uint32_t)};
+    for (uint32_t id = firstId; id < strings.size(); ++id)
+        header.size += sizeof(uint32_t) + strings[id].size();
+
+    out.write(reinterpret_cast<const char *>(&header), sizeof(header));
+    out.write(reinterpret_cast<const char *>(&firstId), sizeof(firstId));
+    out.write(reinterpret_cast<const char *>(&count), sizeof(count));
+    for (uint32_t id = firstId; id < strings.size(); ++id)
+    {
+        uint32_t size = static_cast<uint32_t>(strings[id].size());
+        out.write(reinterpret_cast<const char *>(&size), sizeof(size));
+        out.write(strings[id].data(), size);
+    }
+}
+
+/**
+ * @brief Write events and the arg slots they index into as an Events block.
+ */
+inline void writeEvents(std::ostream &out, const raw_event_t *events, uint32_t eventCount, const arg_slot_t *slots, uint32_t slotCount)
+{
+    block_header_t header{BlockType::Events, 0, 2 * sizeof(uint32_t) + eventCount * sizeof(raw_event_t) + slotCount * sizeof(arg_slot_t)};
+    out.write(reinterpret_cast<const char *>(&header), sizeof(header));
+    out.write(reinterpret_cast<const char *>(&eventCount), sizeof(eventCount));
+    out.write(reinterpret_cast<const char *>(&slotCount), sizeof(slotCount));
+    out.write(reinterpret_cast<const char *>(events), eventCount * sizeof(raw_event_t));
+    out.write(reinterpret_cast<const char *>(slots), slotCount * sizeof(arg_slot_t));
+}
+
+/**
+ * @brief Write the process and its thread table as a Threads block.
+ */
+inline void writeThreads(std::ostream &out, const process_info_t &process)
+{
+    uint32_t counts[2] = {process.pid, static_cast<uint32_t>(process.threads.size())};
+    block_header_t header{BlockType::Threads, 0, sizeof(counts) + sizeof(uint32_t) + process.name.size()};
+    for (const thread_info_t &thread : process.threads)
+        header.size += 2 * sizeof(uint32_t) + thread.name.size();
+
+    auto writeName = [&out](const std::string &name) {
+        uint32_t size = static_cast<uint32_t>(name.size());
+        out.write(reinterpret_cast<const char *>(&size), sizeof(size));
+        out.write(name.data(), size);
+    };
+    out.write(reinterpret_cast<const char *>(&header), sizeof(header));
+    out.write(reinterpret_cast<const char *>(counts), sizeof(counts));
+    writeName(process.name);
+    for (const thread_info_t &thread : process.threads)
+    {
+        out.write(reinterpret_cast<const char *>(&thread.tid), sizeof(thread.tid));
+        writeName(thread.name);
+    }
+}
+
+/**
+ * @brief Check whether a stream starts with the binary trace magic. Leaves the stream at its start.
+ */
+inline bool isBinaryTrace(std::istream &in)
+{
+    char magic[sizeof(kMagic)] = {};
+    in.read(magic, sizeof(magic));
+    bool matches = in.gcount() == sizeof(magic) && std::memcmp(magic, kMagic, sizeof(kMagic)) == 0;
+    in.clear();
+    in.seekg(0);
+    return matches;
+}
+
+/**
+ * @brief Sequential reader of a binary trace.
+ */
+class Reader
+{
+private:
+    std::istream &in_;
+    std::vector<std::string> strings_;
+    process_info_t process_;
+
+    bool _readName(std::string &name)
+    {
+        uint32_t size;
+        if (!_read(&size, 1))
+            return false;
+        name.resize(size);
+        return _read(name.data(), size);
+    }
+
+    template <typename T>
+    bool _read(T *data, size_t count)
+    {
+        in_.read(reinterpret_cast<char *>(data), count * sizeof(T));
+        return static_cast<size_t>(in_.gcount()) == count * sizeof(T);
+    }
+
+public:
+    /**
+     * @brief Construct a reader positioned after the magic of the stream.
+     */
+    explicit Reader(std::istream &in) : in_(in)
+    {
+        char magic[sizeof(kMagic)];
+        _read(magic, sizeof(magic));
+    }
+
+    /**
+     * @brief Construct a reader of a stream continuing a previous one, whose strings are already known.
+     */
+    Reader(std::istream &in, std::vector<std::string> &&strings) : Reader(in)
+    {
+        strings_ = std::move(strings);
+    }
+
+    /**
+     * @brief Strings read so far, indexed by id.
+     */
+    const std::vector<std::string> &strings() const { return strings_; }
+
+    /**
+     * @brief Process and thread table of the last Threads block read.
+     */
+    const process_info_t &process() const { return process_; }
+
+    /**
+     * @brief Move the strings out, to continue with another stream.
+     */
+    std::vector<std::string> takeStrings() { return std::move(strings_); }
+
+    /**
+     * @brief Read up to the next Events block, absorbing the Strings blocks before it.
+     *
+     * @param events Receives the events of the block.
+     * @param slots Receives the arg slots of the block.
+     * @return bool False at the end of the file or at the first incomplete block.
+     */
+    bool next(std::vector<raw_event_t> &events, std::vector<arg_slot_t> &slots)
+    {
+        block_header_t header;
+        while (_read(&header, 1))
+        {
+            std::streampos payload = in_.tellg();
+            uint32_t counts[2];
+            if (!_read(counts, 2))
+                return false;
+
+            if (header.type == BlockType::Strings)
+            {
+                strings_.resize(counts[0]);
+                for (uint32_t i = 0; i < counts[1]; ++i)
+                {
+                    uint32_t size;
+                    std::string str;
+                    if (!_read(&size, 1))
+                        return false;
+                    str.resize(size);
+                    if (!_read(str.data(), size))
+                        return false;
+                    strings_.push_back(std::move(str));
+                }
+            }
+            else if (header.type == BlockType::Events)
+            {
+                events.resize(counts[0]);
+                slots.resize(counts[1]);
+                if (!_read(events.data(), events.size()) || !_read(slots.data(), slots.size()))
+                    return false;
+                return true;
+            }
+            else if (header.type == BlockType::Threads)
+            {
+                process_.pid = counts[0];
+                process_.threads.resize(counts[1]);
+                if (!_readName(process_.name))
+                    return false;
+                for (thread_info_t &thread : process_.threads)
+                {
+                    if (!_read(&thread.tid, 1) || !_readName(thread.name))
+                        return false;
+                }
+            }
+            in_.seekg(payload + static_cast<std::streamoff>(header.size));
+        }
+        return false;
+    }
+};
+
+} // namespace binary_format
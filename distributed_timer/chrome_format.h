@@ -0,0 +1,226 @@
+#pragma once
+#include <charconv>
+#include <cmath>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <string_view>
+#include <nlohmann/json.hpp>
+#include "trace_context.h"
+#include "trace_event.h"
+
+/**
+ * @brief Conversion of compact event records to Chrome trace events.
+ */
+namespace chrome_format {
+
+/**
+ * @brief Number of slots used by a string payload of the given size.
+ */
+inline size_t payloadSlots(size_t size)
+{
+    return (size + sizeof(arg_slot_t) - 1) / sizeof(arg_slot_t);
+}
+
+/**
+ * @brief Number of slots used by an arg, header included.
+ */
+inline size_t argSlots(const arg_slot_t &header)
+{
+    return 1 + (header.header.type == ArgType::String ? payloadSlots(header.header.value) : 0);
+}
+
+/**
+ * @brief Number of slots used by an arg block.
+ */
+inline size_t argBlockSlots(const arg_slot_t *slots, uint16_t argCount)
+{
+    size_t total = 0;
+    for (uint16_t i = 0; i < argCount; ++i)
+        total += argSlots(slots[total]);
+    return total;
+}
+
+/**
+ * @brief Decode an arg block into a JSON object.
+ *
+ * @param slots First slot of the block.
+ * @param argCount Number of arguments in the block.
+ * @param strings Interned strings indexed by id.
+ */
+template <typename Strings>
+nlohmann::json decodeArgs(const arg_slot_t *slots, uint16_t argCount, const Strings &strings)
+{
+    nlohmann::json args = nlohmann::json::object();
+    for (uint16_t i = 0; i < argCount; ++i)
+    {
+        const arg_slot_t &header = *slots;
+        nlohmann::json &arg = args[std::string(strings[header.header.key])];
+        uint64_t value = header.header.value;
+        switch (header.header.type)
+        {
+        case ArgType::Int64:
+            arg = static_cast<int64_t>(value);
+            break;
+        case ArgType::Double:
+        {
+            double number;
+            std::memcpy(&number, &value, sizeof(number));
+            arg = number;
+            break;
+        }
+        case ArgType::Bool:
+            arg = value != 0;
+            break;
+        default:
+            arg = std::string(slots[1].bytes, value);
+            break;
+        }
+        slots += argSlots(header);
+    }
+    return args;
+}
+
+/**
+ * @brief Append nanoseconds as exact decimal microseconds, e.g. 1792229551244642.5.
+ *
+ * Chrome timestamps are fractional microseconds, but a double only resolves 0.25 us at epoch magnitudes.
+ */
+inline void appendMicros(std::string &out, int64_t nanos)
+{
+    if (nanos < 0)
+        out += '-';
+    uint64_t magnitude = nanos < 0 ? 0 - static_cast<uint64_t>(nanos) : static_cast<uint64_t>(nanos);
+    char digits[24];
+    out.append(digits, std::to_chars(digits, digits + sizeof(digits), magnitude / 1000).ptr);
+    uint32_t fraction = static_cast<uint32_t>(magnitude % 1000);
+    if (fraction == 0)
+        return;
+    char decimals[4] = {'.', char('0' + fraction / 100), char('0' + fraction / 10 % 10), char('0' + fraction % 10)};
+    size_t size = sizeof(decimals);
+    while (decimals[size - 1] == '0')
+        --size;
+    out.append(decimals, size);
+}
+
+/**
+ * @brief Read a JSON number of microseconds as nanoseconds.
+ *
+ * Plain decimals are read exactly, rounding past the third decimal; numbers with an exponent go through a double.
+ *
+ * @param text Text starting with the number.
+ * @return bool False if text does not start with a number.
+ */
+inline bool parseMicros(std::string_view text, int64_t &nanos)
+{
+    size_t end = text.find_first_not_of("+-.0123456789eE");
+    std::string_view number = text.substr(0, end);
+    if (number.find_first_of("eE") != std::string_view::npos)
+    {
+        std::string copy(number);
+        char *parsed = nullptr;
+        double micros = std::strtod(copy.c_str(), &parsed);
+        if (parsed == copy.c_str())
+            return false;
+        nanos = std::llround(micros * 1000);
+        return true;
+    }
+    bool negative = !number.empty() && number[0] == '-';
+    const char *first = number.data() + (negative ? 1 : 0);
+    const char *last = number.data() + number.size();
+    uint64_t micros = 0;
+    std::from_chars_result parsed = std::from_chars(first, last, micros);
+    if (parsed.ec != std::errc())
+        return false;
+    uint64_t magnitude = micros * 1000;
+    if (parsed.ptr != last && *parsed.ptr == '.')
+    {
+        const char *digit = parsed.ptr + 1;
+        for (uint64_t scale = 100; scale > 0 && digit != last; scale /= 10, ++digit)
+            magnitude += (*digit - '0') * scale;
+        if (digit != last && *digit >= '5')
+            ++magnitude;
+    }
+    nanos = negative ? -static_cast<int64_t>(magnitude) : static_cast<int64_t>(magnitude);
+    return true;
+}
+
+/**
+ * @brief Serialize a trace event with its "ts" written exactly from nanoseconds, replacing the double it may hold.
+ *
+ * @param event The event, whose "ts" is erased.
+ * @param nanos Timestamp of the event in nanoseconds.
+ */
+inline std::string dump(nlohmann::json &event, int64_t nanos)
+{
+    event.erase("ts");
+    std::string rest = event.dump();
+    std::string text = "{\"ts\":";
+    appendMicros(text, nanos);
+    if (rest.size() > 2)
+        text += ',';
+    text.append(rest, 1, std::string::npos);
+    return text;
+}
+
+/**
+ * @brief Track of a category in the category view, where each category gets its own timeline instead of each thread.
+ */
+inline uint32_t categoryTid(std::string_view category)
+{
+    return static_cast<uint32_t>(std::hash<std::string_view>{}(category));
+}
+
+/**
+ * @brief Build the Chrome trace event of a record. Write it with dump(), which keeps every nanosecond of its timestamp.
+ *
+ * @param event The record, with its timestamp in nanoseconds since the epoch.
+ * @param slots Arg slots that event.args indexes into.
+ * @param strings Interned strings indexed by id.
+ * @param process The recording process, whose thread table event.thread indexes into.
+ */
+template <typename Strings>
+nlohmann::json toJson(const raw_event_t &event, const arg_slot_t *slots, const Strings &strings, const process_info_t &process)
+{
+    std::string_view category = strings[event.cat];
+
+    nlohmann::json jEvent;
+    jEvent["pid"] = process.pid;
+    jEvent["tid"] = process.tid(event);
+    jEvent["ts"] = event.ts / 1000.0; // Only rounded this way for readers; dump() writes it exactly
+    jEvent["ph"] = std::string(1, event.ph);
+    jEvent["name"] = strings[event.name];
+    jEvent["cat"] = category;
+    jEvent["args"] = decodeArgs(slots + event.args, event.argCount, strings);
+    if (event.ph == 'C')
+        jEvent["args"][std::string(strings[event.name])] = event.value; // adding the counter value
+    else if (event.ph == 's' || event.ph == 't' || event.ph == 'f')
+    {
+        jEvent["id"] = trace_context::format(event.value);
+        if (event.ph != 's')
+            jEvent["bp"] = "e"; // bind to the enclosing span rather than the next one
+    }
+    else if (event.ph == 'b' || event.ph == 'e')
+        jEvent["id2"]["global"] = trace_context::format(event.value); // the span may end in another process
+    return jEvent;
+}
+
+/**
+ * @brief Build the process_name and thread_name metadata events of a process.
+ *
+ * Threads that did not register a name are left out, so the viewer shows their id.
+ */
+inline nlohmann::json metadataEvents(const process_info_t &process)
+{
+    nlohmann::json metadata = nlohmann::json::array();
+    if (!process.name.empty())
+        metadata.push_back({{"name", "process_name"}, {"ph", "M"}, {"pid", process.pid}, {"tid", 0}, {"args", {{"name", process.name}}}});
+    for (const thread_info_t &thread : process.threads)
+    {
+        if (!thread.name.empty())
+            metadata.push_back({{"name", "thread_name"}, {"ph", "M"}, {"pid", process.pid}, {"tid", thread.tid}, {"args", {{"name", thread.name}}}});
+    }
+    return metadata;
+}
+
+} // namespace chrome_format
@@ -0,0 +1,112 @@
+#pragma once
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <iostream>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <cpuid.h>
+#include <x86intrin.h>
+#define DISTRIBUTED_TIMER_HAS_TSC 1
+#endif
+
+/**
+ * @brief Timestamp sources of the trace.
+ *
+ * Each source reads raw ticks with now() on the record path and converts them to
+ * nanoseconds since the Unix epoch with toEpochNanos() when events are written.
+ * The source used by Timer is chosen at build time with the DISTRIBUTED_TIMER_CLOCK
+ * CMake option and exposed as TraceClock.
+ */
+namespace trace_clock {
+
+/**
+ * @brief Wall clock (std::chrono::system_clock). Ticks are already epoch nanoseconds.
+ */
+struct SystemClock
+{
+    static int64_t now()
+    {
+        return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::system_clock::now().time_since_epoch()).count();
+    }
+
+    static int64_t toEpochNanos(int64_t ticks) { return ticks; }
+
+    static void calibrate() {}
+};
+
+/**
+ * @brief Monotonic clock (std::chrono::steady_clock), anchored to the wall clock once per process.
+ */
+struct SteadyClock
+{
+    static int64_t now()
+    {
+        return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+    }
+
+    static int64_t toEpochNanos(int64_t ticks)
+    {
+        static const int64_t epochOffset = SystemClock::now() - now();
+        return ticks + epochOffset;
+    }
+
+    static void calibrate() { toEpochNanos(0); }
+};
+
+#ifdef DISTRIBUTED_TIMER_HAS_TSC
+/**
+ * @brief Time stamp counter read with rdtsc, calibrated against steady_clock once per process.
+ *
+ * Only meaningful on CPUs with an invariant TSC; calibration warns when the CPU does not report one.
+ */
+struct TscClock
+{
+    struct calibration_t
+    {
+        int64_t ticks;       ///< TSC at the anchor.
+        int64_t epochNanos;  ///< Wall clock at the anchor.
+        long double nanosPerTick;
+    };
+
+    static int64_t now() { return static_cast<int64_t>(__rdtsc()); }
+
+    static const calibration_t &calibration()
+    {
+        static const calibration_t calibration = []() {
+            unsigned int eax, ebx, ecx, edx;
+            if (!__get_cpuid(0x80000007, &eax, &ebx, &ecx, &edx) || !(edx & (1u << 8)))
+                std::cerr << "Warning: the CPU does not report an invariant TSC, TSC timestamps may drift." << std::endl;
+
+            // Spin for a short while and compare the two clocks over that interval.
+            int64_t steadyBegin = SteadyClock::now();
+            int64_t ticksBegin = now();
+            int64_t epochBegin = SystemClock::now();
+            int64_t steadyEnd = steadyBegin;
+            while (steadyEnd - steadyBegin < 10'000'000)
+                steadyEnd = SteadyClock::now();
+            int64_t ticksEnd = now();
+            return calibration_t{ticksBegin, epochBegin, static_cast<long double>(steadyEnd - steadyBegin) / (ticksEnd - ticksBegin)};
+        }();
+        return calibration;
+    }
+
+    static int64_t toEpochNanos(int64_t ticks)
+    {
+        const calibration_t &c = calibration();
+        return c.epochNanos + std::llround((ticks - c.ticks) * c.nanosPerTick);
+    }
+
+    static void calibrate() { calibration(); }
+};
+#endif
+
+} // namespace trace_clock
+
+#if defined(DISTRIBUTED_TIMER_CLOCK_TSC) && defined(DISTRIBUTED_TIMER_HAS_TSC)
+using TraceClock = trace_clock::TscClock;
+#elif defined(DISTRIBUTED_TIMER_CLOCK_STEADY) || defined(DISTRIBUTED_TIMER_CLOCK_TSC)
+using TraceClock = trace_clock::SteadyClock;
+#else
+using TraceClock = trace_clock::SystemClock;
+#endif
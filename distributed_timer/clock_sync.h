@@ -0,0 +1,182 @@
+#pragma once
+#include <algorithm>
+#include <array>
+#include <cmath>
+#include <cstddef>
+#include <iterator>
+#include <map>
+#include <optional>
+#include <queue>
+#include <string>
+#include <vector>
+
+/**
+ * @brief Estimation of the clock offset and drift between traced nodes.
+ *
+ * Nodes record clock sync markers around request/reply exchanges sharing a sync id:
+ * the initiator marks its send (t1) and the reply's receive (t4), the responder marks
+ * the request's receive (t2) and its reply's send (t3). As in NTP, the responder's clock
+ * reads theta = ((t2 - t1) + (t3 - t4)) / 2 ahead of the initiator's for an exchange whose
+ * round trip took (t4 - t1) - (t3 - t2). Sync ids that do not have both markers on exactly
+ * two nodes are ignored.
+ */
+namespace clock_sync {
+
+/**
+ * @brief Affine map x -> scale * x + offset from a node's clock to the reference clock.
+ */
+struct clock_map_t {
+    long double scale = 1;
+    long double offset = 0;
+
+    double apply(double ts) const { return static_cast<double>(scale * ts + offset); }
+
+    // Same map on nanoseconds; the long double keeps every nanosecond of an epoch timestamp.
+    int64_t applyNanos(int64_t nanos) const { return std::llround(scale * nanos + offset * 1000); }
+
+    // this(other(x))
+    clock_map_t after(const clock_map_t &other) const { return {scale * other.scale, scale * other.offset + offset}; }
+};
+
+/**
+ * @brief A clock sync marker read from a node's trace.
+ */
+struct marker_t {
+    std::string syncId;
+    bool send;
+    double ts;
+};
+
+/**
+ * @brief Estimated relation of one node's clock to the reference node's.
+ */
+struct node_estimate_t {
+    clock_map_t toReference;
+    bool synchronized = false; ///< False when the node shares no exchange with the reference's component.
+    size_t exchanges = 0;      ///< Exchanges used for the link to its parent node.
+    double offsetMicros = 0;   ///< Offset at the first exchange, relative to the reference.
+    double driftPpm = 0;       ///< Drift relative to the reference, in parts per million.
+    double minRoundTripMicros = 0;
+};
+
+namespace detail {
+
+struct exchange_t {
+    double t1, t2, t3, t4;
+};
+
+// Fits theta(t1) = a + b * t1 on the exchanges with the shortest round trips, which carry the least
+// asymmetric queuing delay. Returns the map from the responder's clock to the initiator's.
+inline clock_map_t fit(std::vector<exchange_t> exchanges, double &minRoundTrip)
+{
+    auto roundTrip = [](const exchange_t &e) { return (e.t4 - e.t1) - (e.t3 - e.t2); };
+    std::sort(exchanges.begin(), exchanges.end(), [&](const exchange_t &a, const exchange_t &b) { return roundTrip(a) < roundTrip(b); });
+    minRoundTrip = roundTrip(exchanges.front());
+    exchanges.resize(std::max<size_t>(1, exchanges.size() / 2));
+
+    // Centered least squares; timestamps are too large to square directly.
+    long double meanT = 0, meanTheta = 0;
+    for (const exchange_t &e : exchanges)
+    {
+        meanT += e.t1;
+        meanTheta += ((e.t2 - e.t1) + (e.t3 - e.t4)) / 2;
+    }
+    meanT /= exchanges.size();
+    meanTheta /= exchanges.size();
+
+    long double covariance = 0, variance = 0;
+    for (const exchange_t &e : exchanges)
+    {
+        long double dt = e.t1 - meanT;
+        long double theta = ((e.t2 - e.t1) + (e.t3 - e.t4)) / 2;
+        covariance += dt * (theta - meanTheta);
+        variance += dt * dt;
+    }
+    long double drift = variance > 0 ? covariance / variance : 0;
+
+    // responder = initiator + meanTheta + drift * (initiator - meanT)
+    long double scale = 1 + drift;
+    long double offset = meanTheta - drift * meanT;
+    return {1 / scale, -offset / scale};
+}
+
+} // namespace detail
+
+/**
+ * @brief Estimate the clock map of every node to node 0.
+ *
+ * @param markers Markers of each node, indexed by node.
+ * @return std::vector<node_estimate_t> One estimate per node. Node 0 is the identity.
+ */
+inline std::vector<node_estimate_t> estimate(const std::vector<std::vector<marker_t>> &markers)
+{
+    // syncId -> (node, marker)
+    std::map<std::string, std::vector<std::pair<size_t, marker_t>>> bySyncId;
+    for (size_t node = 0; node < markers.size(); ++node)
+        for (const marker_t &marker : markers[node])
+            bySyncId[marker.syncId].push_back({node, marker});
+
+    // (initiator, responder) -> exchanges
+    std::map<std::pair<size_t, size_t>, std::vector<detail::exchange_t>> links;
+    for (const auto &[syncId, entries] : bySyncId)
+    {
+        // node -> [receive ts, send ts]
+        std::map<size_t, std::array<std::optional<double>, 2>> sides;
+        for (const auto &[node, marker] : entries)
+            sides[node][marker.send] = marker.ts;
+        if (sides.size() != 2)
+            continue;
+
+        // The initiator sends before it receives on its own clock, the responder receives first.
+        auto first = sides.begin();
+        auto second = std::next(first);
+        if (!first->second[0] || !first->second[1] || !second->second[0] || !second->second[1])
+            continue;
+        bool firstInitiates = *first->second[1] < *first->second[0];
+        auto &initiator = firstInitiates ? *first : *second;
+        auto &responder = firstInitiates ? *second : *first;
+        detail::exchange_t exchange{*initiator.second[1], *responder.second[0], *responder.second[1], *initiator.second[0]};
+        if (exchange.t4 < exchange.t1 || exchange.t3 < exchange.t2)
+            continue;
+        links[{initiator.first, responder.first}].push_back(exchange);
+    }
+
+    // Breadth-first from node 0, composing the pairwise maps.
+    std::vector<node_estimate_t> estimates(markers.size());
+    if (estimates.empty())
+        return estimates;
+    estimates[0].synchronized = true;
+    std::queue<size_t> pending;
+    pending.push(0);
+    while (!pending.empty())
+    {
+        size_t known = pending.front();
+        pending.pop();
+        for (const auto &[link, exchanges] : links)
+        {
+            bool forward = link.first == known && !estimates[link.second].synchronized;
+            bool backward = link.second == known && !estimates[link.first].synchronized;
+            if (!forward && !backward)
+                continue;
+
+            double minRoundTrip = 0;
+            clock_map_t responderToInitiator = detail::fit(exchanges, minRoundTrip);
+            size_t other = forward ? link.second : link.first;
+            clock_map_t otherToKnown = forward ? responderToInitiator
+                                               : clock_map_t{1 / responderToInitiator.scale, -responderToInitiator.offset / responderToInitiator.scale};
+
+            node_estimate_t &estimate = estimates[other];
+            estimate.toReference = estimates[known].toReference.after(otherToKnown);
+            estimate.synchronized = true;
+            estimate.exchanges = exchanges.size();
+            estimate.minRoundTripMicros = minRoundTrip;
+            double at = forward ? exchanges.front().t2 : exchanges.front().t1;
+            estimate.offsetMicros = at - estimate.toReference.apply(at);
+            estimate.driftPpm = static_cast<double>((1 / estimate.toReference.scale - 1) * 1e6);
+            pending.push(other);
+        }
+    }
+    return estimates;
+}
+
+} // namespace clock_sync
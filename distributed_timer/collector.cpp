@@ -0,0 +1,318 @@
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <vector>
+#include <map>
+#include <queue>
+#include <chrono>
+#include <csignal>
+#include <limits>
+#include <algorithm>
+#include <cstring>
+#include <iomanip>
+#include <unistd.h>
+#include <nlohmann/json.hpp>
+#include "binary_format.h"
+#include "chrome_format.h"
+#include "trace_metadata.h"
+#include "zmq_sink.h"
+
+namespace {
+
+volatile std::sig_atomic_t stopRequested = 0;
+
+void requestStop(int)
+{
+    stopRequested = 1;
+}
+
+struct options_t {
+    std::string endpoint;
+    std::string outputPath;
+    size_t expectedSources = 0;         // Exit once this many sources are done, 0 to run until interrupted.
+    std::chrono::milliseconds idle{2000}; // Sources silent for longer no longer hold back the output.
+    size_t maxPending = 1 << 20;        // Events held for ordering before the oldest are written regardless.
+    int receiveHighWaterMark = 1000;    // Messages queued before ZMQ pushes back on the sources.
+    std::chrono::milliseconds statsInterval{5000};
+    bool byCategory = false;            // One track per category instead of per thread.
+};
+
+/**
+ * @brief Everything the collector knows about one sending process.
+ */
+struct source_t {
+    std::vector<std::string> strings;
+    uint64_t nextSequence = 0;
+    int64_t watermark = std::numeric_limits<int64_t>::min();
+    std::chrono::steady_clock::time_point lastSeen;
+    bool done = false;
+    uint64_t batches = 0;
+    uint64_t events = 0;
+    uint64_t droppedBatches = 0; // Dropped by the source, as last reported.
+    uint64_t droppedEvents = 0;
+    uint64_t lostBatches = 0;    // Sequence gaps.
+    uint64_t undecodable = 0;    // Events referencing strings that were lost with a batch.
+};
+
+/**
+ * @brief An event waiting for every live source's watermark to pass it.
+ */
+struct pending_t {
+    int64_t ts;
+    uint64_t sequence; // Keeps equal timestamps in arrival order.
+    std::string text;
+};
+
+struct later {
+    bool operator()(const pending_t &a, const pending_t &b) const {
+        return a.ts != b.ts ? a.ts > b.ts : a.sequence > b.sequence;
+    }
+};
+
+/**
+ * @brief Receives batches from ZmqSinks and writes them as a single Chrome trace, in timestamp order.
+ *
+ * Each source's batches are sorted and carry a watermark below which that source sends nothing more,
+ * so an event can be written once every live source's watermark has passed it.
+ */
+class Collector {
+private:
+    options_t options_;
+    const uint32_t pid_ = static_cast<uint32_t>(getpid());
+    std::ofstream output_;
+    bool first_ = true;
+    std::map<std::string, source_t> sources_;
+    std::priority_queue<pending_t, std::vector<pending_t>, later> pending_;
+    uint64_t sequence_ = 0;
+    uint64_t forced_ = 0; // Events written before their watermark because too many were pending.
+    MetadataCollector metadata_;
+    std::vector<raw_event_t> events_;
+    std::vector<arg_slot_t> slots_;
+
+    void _write(const std::string &text) {
+        output_ << (first_ ? "[\n" : ",\n") << text;
+        first_ = false;
+    }
+
+    // The strings of lost batches are unknown, and a corrupt batch must not send us out of bounds.
+    bool _decodable(const raw_event_t &event, const std::vector<arg_slot_t> &slots, size_t stringCount) const {
+        if (event.cat >= stringCount || event.name >= stringCount)
+            return false;
+        size_t slot = event.args;
+        for (uint16_t i = 0; i < event.argCount; ++i) {
+            if (slot >= slots.size() || slots[slot].header.key >= stringCount)
+                return false;
+            slot += chrome_format::argSlots(slots[slot]);
+        }
+        return slot <= slots.size();
+    }
+
+    void _receiveBatch(const std::string &name, const collector_protocol::batch_header_t &header, const std::string &batch) {
+        source_t &source = sources_[name];
+        source.lastSeen = std::chrono::steady_clock::now();
+        if (header.sequence != source.nextSequence) {
+            source.lostBatches += header.sequence - source.nextSequence;
+        }
+        source.nextSequence = header.sequence + 1;
+        source.droppedBatches = header.droppedBatches;
+        source.droppedEvents = header.droppedEvents;
+        source.watermark = std::max(source.watermark, header.watermarkNanos);
+        source.done = (header.flags & collector_protocol::kLastBatch) != 0;
+        ++source.batches;
+        if (batch.empty())
+            return;
+
+        std::istringstream in(batch);
+        binary_format::Reader reader(in, std::move(source.strings));
+        while (reader.next(events_, slots_)) {
+            for (const raw_event_t &event : events_) {
+                if (!_decodable(event, slots_, reader.strings().size())) {
+                    ++source.undecodable;
+                    continue;
+                }
+                nlohmann::json jEvent = chrome_format::toJson(event, slots_.data(), reader.strings(), reader.process());
+                if (options_.byCategory)
+                    jEvent["tid"] = chrome_format::categoryTid(reader.strings()[event.cat]);
+                metadata_.add(jEvent);
+                pending_.push({event.ts, sequence_++, chrome_format::dump(jEvent, event.ts)});
+                ++source.events;
+            }
+        }
+        for (const auto &entry : chrome_format::metadataEvents(reader.process()))
+            metadata_.add(entry);
+        source.strings = reader.takeStrings();
+    }
+
+    // Oldest time a live source may still send.
+    int64_t _watermark() const {
+        auto now = std::chrono::steady_clock::now();
+        int64_t watermark = std::numeric_limits<int64_t>::max();
+        for (const auto &[name, source] : sources_) {
+            if (!source.done && now - source.lastSeen < options_.idle)
+                watermark = std::min(watermark, source.watermark);
+        }
+        return watermark;
+    }
+
+    void _addCounter(const std::string &name, const std::string &source, uint64_t value, int64_t ts) {
+        nlohmann::json jCounter;
+        jCounter["cat"] = "collector";
+        jCounter["name"] = name;
+        jCounter["ph"] = "C";
+        jCounter["pid"] = pid_;
+        jCounter["tid"] = chrome_format::categoryTid("collector");
+        jCounter["args"][source] = value;
+        pending_.push({ts, sequence_++, chrome_format::dump(jCounter, ts)});
+    }
+
+public:
+    explicit Collector(const options_t &options) : options_(options), output_(options.outputPath), metadata_(options.byCategory) {}
+
+    bool ok() const { return static_cast<bool>(output_); }
+
+    bool finished() const {
+        if (options_.expectedSources == 0)
+            return false;
+        size_t done = std::count_if(sources_.begin(), sources_.end(), [](const auto &entry) { return entry.second.done; });
+        return done >= options_.expectedSources;
+    }
+
+    void receive(const std::vector<zmq::message_t> &frames) {
+        if (frames.size() != 3 || frames[1].size() != sizeof(collector_protocol::batch_header_t)) {
+            std::cerr << "Ignoring a message that is not a batch (" << frames.size() << " frames)" << std::endl;
+            return;
+        }
+        std::string name(static_cast<const char *>(frames[0].data()), frames[0].size());
+        collector_protocol::batch_header_t header;
+        std::memcpy(&header, frames[1].data(), sizeof(header));
+        std::string batch(static_cast<const char *>(frames[2].data()), frames[2].size());
+        _receiveBatch(name, header, batch);
+    }
+
+    // Writes every event older than all live watermarks, and the oldest ones past maxPending.
+    void release(bool all) {
+        int64_t watermark = all ? std::numeric_limits<int64_t>::max() : _watermark();
+        while (!pending_.empty() && (pending_.top().ts <= watermark || pending_.size() > options_.maxPending)) {
+            if (pending_.top().ts > watermark)
+                ++forced_;
+            _write(pending_.top().text);
+            pending_.pop();
+        }
+        output_.flush();
+    }
+
+    // Prints the drop counters and records them in the trace.
+    void reportStats() {
+        int64_t now = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::system_clock::now().time_since_epoch()).count();
+        std::cerr << "source                          batches      events  dropped batches  dropped events  lost batches  undecodable" << std::endl;
+        for (const auto &[name, source] : sources_) {
+            std::cerr << name << std::string(name.size() < 30 ? 30 - name.size() : 1, ' ')
+                      << std::setw(9) << source.batches << std::setw(12) << source.events
+                      << std::setw(17) << source.droppedBatches << std::setw(16) << source.droppedEvents
+                      << std::setw(14) << source.lostBatches << std::setw(13) << source.undecodable
+                      << (source.done ? "  done" : "") << std::endl;
+            _addCounter("dropped events", name, source.droppedEvents, now);
+            _addCounter("lost batches", name, source.lostBatches, now);
+        }
+        if (forced_ > 0)
+            std::cerr << forced_ << " events were written before every source had caught up with them (--max-pending)." << std::endl;
+    }
+
+    void close() {
+        release(true);
+        for (const auto &entry : metadata_.toJson())
+            _write(entry.dump());
+        output_ << (first_ ? "[]\n" : "\n]\n");
+        output_.close();
+    }
+};
+
+} // namespace
+
+int main(int argc, char *argv[])
+{
+    const std::string usage = std::string("Usage: ") + argv[0] +
+        " [--sources N] [--idle-ms N] [--max-pending N] [--receive-hwm N] [--stats-ms N] [--by-category] <endpoint> <output file path>";
+
+    options_t options;
+    std::vector<std::string> positional;
+    for (int i = 1; i < argc; ++i)
+    {
+        std::string arg = argv[i];
+        bool hasValue = i + 1 < argc;
+        if (arg == "--sources" && hasValue)
+            options.expectedSources = std::stoul(argv[++i]);
+        else if (arg == "--idle-ms" && hasValue)
+            options.idle = std::chrono::milliseconds(std::stol(argv[++i]));
+        else if (arg == "--max-pending" && hasValue)
+            options.maxPending = std::stoul(argv[++i]);
+        else if (arg == "--receive-hwm" && hasValue)
+            options.receiveHighWaterMark = std::stoi(argv[++i]);
+        else if (arg == "--stats-ms" && hasValue)
+            options.statsInterval = std::chrono::milliseconds(std::stol(argv[++i]));
+        else if (arg == "--by-category")
+            options.byCategory = true;
+        else
+            positional.push_back(arg);
+    }
+    if (positional.size() != 2)
+    {
+        std::cerr << usage << std::endl;
+        return 1;
+    }
+    options.endpoint = positional[0];
+    options.outputPath = positional[1];
+
+    Collector collector(options);
+    if (!collector.ok())
+    {
+        std::cerr << "Failed to open output file: " << options.outputPath << '\n';
+        return 1;
+    }
+
+    zmq::context_t context(1);
+    zmq::socket_t socket(context, zmq::socket_type::pull);
+    socket.setsockopt(ZMQ_RCVHWM, options.receiveHighWaterMark);
+    socket.setsockopt(ZMQ_RCVTIMEO, 100); // Wake up regularly to release events and notice signals.
+    socket.bind(options.endpoint);
+    std::signal(SIGINT, requestStop);
+    std::signal(SIGTERM, requestStop);
+    std::cout << "Collecting on " << options.endpoint << " into " << options.outputPath << std::endl;
+
+    auto lastStats = std::chrono::steady_clock::now();
+    std::vector<zmq::message_t> frames;
+    while (!stopRequested && !collector.finished())
+    {
+        frames.clear();
+        try
+        {
+            frames.emplace_back();
+            if (socket.recv(frames.back(), zmq::recv_flags::none))
+            {
+                while (frames.back().more())
+                {
+                    frames.emplace_back();
+                    socket.recv(frames.back(), zmq::recv_flags::none);
+                }
+                collector.receive(frames);
+            }
+        }
+        catch (const zmq::error_t &e)
+        {
+            // Interrupted by a signal.
+            if (!stopRequested)
+                std::cerr << "Receive failed: " << e.what() << std::endl;
+        }
+        collector.release(false);
+
+        if (std::chrono::steady_clock::now() - lastStats >= options.statsInterval)
+        {
+            collector.reportStats();
+            lastStats = std::chrono::steady_clock::now();
+        }
+    }
+
+    collector.reportStats();
+    collector.close();
+    return 0;
+}
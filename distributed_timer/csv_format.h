@@ -0,0 +1,134 @@
+#pragma once
+#include <charconv>
+#include <cstdint>
+#include <filesystem>
+#include <ostream>
+#include <string>
+#include <string_view>
+#include <vector>
+
+/**
+ * @brief Tables written by TimerOperation::CSV.
+ *
+ * The spans table has one row per completed span, the counters table one row per counter event:
+ * - spans: `start_ns,duration_ns,category,name,thread`
+ * - counters: `ts_ns,category,name,value,thread`
+ *
+ * Timestamps are nanoseconds since the epoch. Strings are quoted only when they contain a comma,
+ * a quote or a line break, as in RFC 4180. Event arguments are not exported.
+ */
+namespace csv_format {
+
+constexpr char kSpansHeader[] = "start_ns,duration_ns,category,name,thread\n";
+constexpr char kCountersHeader[] = "ts_ns,category,name,value,thread\n";
+
+/**
+ * @brief Path of the counters table written next to the spans table, e.g. trace.csv -> trace.counters.csv.
+ */
+inline std::filesystem::path countersPath(const std::filesystem::path &spansPath)
+{
+    return spansPath.parent_path() / (spansPath.stem().string() + ".counters" + spansPath.extension().string());
+}
+
+/**
+ * @brief Buffered row formatter. Numbers go through std::to_chars, strings are copied as is.
+ */
+class Writer
+{
+public:
+    explicit Writer(std::ostream &out) : out_(out) { buffer_.reserve(kFlushBytes + 1024); }
+
+    ~Writer() { flush(); }
+
+    Writer(const Writer &) = delete;
+    Writer &operator=(const Writer &) = delete;
+
+    Writer &field(int64_t value)
+    {
+        char digits[24];
+        char *end = std::to_chars(digits, digits + sizeof(digits), value).ptr;
+        buffer_.append(digits, end);
+        buffer_ += ',';
+        return *this;
+    }
+
+    Writer &field(uint64_t value)
+    {
+        char digits[24];
+        char *end = std::to_chars(digits, digits + sizeof(digits), value).ptr;
+        buffer_.append(digits, end);
+        buffer_ += ',';
+        return *this;
+    }
+
+    // `escaped` must already be escaped, see escape().
+    Writer &field(std::string_view escaped)
+    {
+        buffer_.append(escaped);
+        buffer_ += ',';
+        return *this;
+    }
+
+    // Replaces the trailing separator with a line break.
+    void endRow()
+    {
+        buffer_.back() = '\n';
+        if (buffer_.size() >= kFlushBytes)
+            flush();
+    }
+
+    void flush()
+    {
+        out_.write(buffer_.data(), buffer_.size());
+        buffer_.clear();
+    }
+
+private:
+    static constexpr size_t kFlushBytes = 1 << 20;
+
+    std::ostream &out_;
+    std::string buffer_;
+};
+
+/**
+ * @brief Quote a string if it holds a separator, a quote or a line break.
+ */
+inline std::string escape(std::string_view value)
+{
+    if (value.find_first_of(",\"\r\n") == std::string_view::npos)
+        return std::string(value);
+    std::string escaped = "\"";
+    for (char c : value)
+    {
+        if (c == '"')
+            escaped += '"';
+        escaped += c;
+    }
+    escaped += '"';
+    return escaped;
+}
+
+/**
+ * @brief Escaped strings of a string table, computed once per id.
+ */
+class EscapedStrings
+{
+public:
+    std::string_view get(const std::vector<std::string_view> &strings, uint32_t id)
+    {
+        if (escaped_.size() < strings.size())
+        {
+            escaped_.reserve(strings.size());
+            for (size_t i = escaped_.size(); i < strings.size(); ++i)
+                escaped_.push_back(escape(strings[i]));
+        }
+        return escaped_[id];
+    }
+
+    void clear() { escaped_.clear(); }
+
+private:
+    std::vector<std::string> escaped_;
+};
+
+} // namespace csv_format
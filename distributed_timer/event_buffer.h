@@ -0,0 +1,131 @@
+#pragma once
+#include <atomic>
+#include <cstddef>
+#include <limits>
+#include <utility>
+
+/**
+ * @brief Unbounded single-producer/single-consumer buffer made of fixed-size chunks.
+ *
+ * The owning thread appends with push() without taking any lock. A single consumer
+ * (serialized externally, e.g. by the Timer's registry mutex) drains published events
+ * with drain() while the producer keeps recording. Fully consumed chunks are handed
+ * back to the producer for reuse once it has moved on to a newer chunk, so a buffer
+ * that is drained regularly stops allocating.
+ *
+ * @tparam T Event type stored in the buffer.
+ * @tparam ChunkSize Number of events per chunk.
+ */
+template <typename T, size_t ChunkSize = 4096>
+class EventBuffer
+{
+private:
+    struct Chunk
+    {
+        T events[ChunkSize];
+        std::atomic<size_t> size{0};
+        std::atomic<Chunk *> next{nullptr};
+    };
+
+    // Consumer side
+    Chunk *head_;
+    size_t readPos_ = 0;
+
+    // Producer side
+    Chunk *tail_;
+
+    // Consumed chunk waiting to be reused by the producer.
+    std::atomic<Chunk *> spare_{nullptr};
+
+    Chunk *_newChunk()
+    {
+        Chunk *chunk = spare_.exchange(nullptr, std::memory_order_acquire);
+        if (chunk == nullptr)
+            return new Chunk;
+        chunk->size.store(0, std::memory_order_relaxed);
+        chunk->next.store(nullptr, std::memory_order_relaxed);
+        return chunk;
+    }
+
+    void _recycleChunk(Chunk *chunk)
+    {
+        delete spare_.exchange(chunk, std::memory_order_release);
+    }
+
+public:
+    EventBuffer() : head_(new Chunk), tail_(head_) {}
+
+    EventBuffer(const EventBuffer &) = delete;
+    EventBuffer &operator=(const EventBuffer &) = delete;
+
+    ~EventBuffer()
+    {
+        while (head_ != nullptr)
+        {
+            Chunk *next = head_->next.load(std::memory_order_relaxed);
+            delete head_;
+            head_ = next;
+        }
+        delete spare_.load(std::memory_order_relaxed);
+    }
+
+    /**
+     * @brief Append an event. Must only be called from the producer thread.
+     *
+     * @param event Event to append.
+     */
+    void push(const T &event)
+    {
+        T copy = event;
+        push(std::move(copy));
+    }
+
+    /**
+     * @brief Append an event. Must only be called from the producer thread.
+     *
+     * @param event Event to append.
+     */
+    void push(T &&event)
+    {
+        size_t size = tail_->size.load(std::memory_order_relaxed);
+        if (size == ChunkSize)
+        {
+            Chunk *chunk = _newChunk();
+            tail_->next.store(chunk, std::memory_order_release);
+            tail_ = chunk;
+            size = 0;
+        }
+        tail_->events[size] = std::move(event);
+        tail_->size.store(size + 1, std::memory_order_release);
+    }
+
+    /**
+     * @brief Consume every event published so far. Must only be called from one consumer at a time.
+     *
+     * @param fn Callable invoked with each event (as T&) in recording order.
+     * @param maxCount Maximum number of events to consume.
+     * @return size_t Number of events consumed.
+     */
+    template <typename Fn>
+    size_t drain(Fn &&fn, size_t maxCount = std::numeric_limits<size_t>::max())
+    {
+        size_t consumed = 0;
+        while (consumed < maxCount)
+        {
+            size_t size = head_->size.load(std::memory_order_acquire);
+            for (; readPos_ < size && consumed < maxCount; ++readPos_, ++consumed)
+                fn(head_->events[readPos_]);
+
+            if (readPos_ < ChunkSize)
+                return consumed;
+
+            Chunk *next = head_->next.load(std::memory_order_acquire);
+            if (next == nullptr)
+                return consumed;
+            _recycleChunk(head_);
+            head_ = next;
+            readPos_ = 0;
+        }
+        return consumed;
+    }
+};
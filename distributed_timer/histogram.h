@@ -0,0 +1,128 @@
+#pragma once
+#include <array>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <limits>
+#include <vector>
+
+/**
+ * @brief Log-linear histogram of non-negative integer samples (e.g. durations in nanoseconds).
+ *
+ * Each power of two is split into kSubBuckets linear buckets, so a reported quantile is
+ * within 1 / kSubBuckets of the recorded value. Single writer: only one thread records,
+ * while any thread may read a snapshot at the same time.
+ */
+class LogHistogram
+{
+public:
+    static constexpr unsigned kSubBits = 3;
+    static constexpr size_t kSubBuckets = size_t(1) << kSubBits;
+    static constexpr size_t kBuckets = (64 - kSubBits + 1) * kSubBuckets;
+
+    /**
+     * @brief Plain copy of a histogram, or the sum of several.
+     */
+    struct snapshot_t
+    {
+        std::vector<uint64_t> buckets = std::vector<uint64_t>(kBuckets, 0);
+        uint64_t count = 0;
+        uint64_t total = 0;
+        uint64_t min = std::numeric_limits<uint64_t>::max();
+        uint64_t max = 0;
+
+        double mean() const { return count ? static_cast<double>(total) / count : 0; }
+
+        // Midpoint of the bucket holding the q-th sample, clamped to the recorded range.
+        uint64_t quantile(double q) const
+        {
+            if (count == 0)
+                return 0;
+            uint64_t rank = static_cast<uint64_t>(q * (count - 1));
+            uint64_t seen = 0;
+            for (size_t i = 0; i < kBuckets; ++i)
+            {
+                seen += buckets[i];
+                if (seen > rank)
+                {
+                    uint64_t value = bucketLow(i) + (bucketHigh(i) - bucketLow(i)) / 2;
+                    return value < min ? min : value > max ? max : value;
+                }
+            }
+            return max;
+        }
+    };
+
+    static size_t bucketIndex(uint64_t value)
+    {
+        if (value < kSubBuckets)
+            return static_cast<size_t>(value);
+        unsigned exponent = 63 - __builtin_clzll(value);
+        size_t sub = static_cast<size_t>(value >> (exponent - kSubBits)) & (kSubBuckets - 1);
+        return ((exponent - kSubBits + 1) << kSubBits) + sub;
+    }
+
+    static uint64_t bucketLow(size_t index)
+    {
+        if (index < kSubBuckets)
+            return index;
+        unsigned exponent = static_cast<unsigned>(index >> kSubBits) + kSubBits - 1;
+        return (kSubBuckets + (index & (kSubBuckets - 1))) << (exponent - kSubBits);
+    }
+
+    static uint64_t bucketHigh(size_t index)
+    {
+        if (index < kSubBuckets)
+            return index;
+        unsigned exponent = static_cast<unsigned>(index >> kSubBits) + kSubBits - 1;
+        return bucketLow(index) + ((uint64_t(1) << (exponent - kSubBits)) - 1);
+    }
+
+    LogHistogram()
+    {
+        for (auto &bucket : buckets_)
+            bucket.store(0, std::memory_order_relaxed);
+    }
+
+    LogHistogram(const LogHistogram &) = delete;
+    LogHistogram &operator=(const LogHistogram &) = delete;
+
+    // Only the owning thread records, so plain load/store pairs are enough; no locked instructions.
+    void record(uint64_t value)
+    {
+        bump(buckets_[bucketIndex(value)], 1);
+        bump(count_, 1);
+        bump(total_, value);
+        if (value < min_.load(std::memory_order_relaxed))
+            min_.store(value, std::memory_order_relaxed);
+        if (value > max_.load(std::memory_order_relaxed))
+            max_.store(value, std::memory_order_relaxed);
+    }
+
+    uint64_t count() const { return count_.load(std::memory_order_relaxed); }
+
+    // Adds this histogram to `into`. May run concurrently with record().
+    void snapshot(snapshot_t &into) const
+    {
+        for (size_t i = 0; i < kBuckets; ++i)
+            into.buckets[i] += buckets_[i].load(std::memory_order_relaxed);
+        into.count += count_.load(std::memory_order_relaxed);
+        into.total += total_.load(std::memory_order_relaxed);
+        uint64_t min = min_.load(std::memory_order_relaxed);
+        uint64_t max = max_.load(std::memory_order_relaxed);
+        into.min = min < into.min ? min : into.min;
+        into.max = max > into.max ? max : into.max;
+    }
+
+private:
+    static void bump(std::atomic<uint64_t> &counter, uint64_t by)
+    {
+        counter.store(counter.load(std::memory_order_relaxed) + by, std::memory_order_relaxed);
+    }
+
+    std::array<std::atomic<uint64_t>, kBuckets> buckets_;
+    std::atomic<uint64_t> count_{0};
+    std::atomic<uint64_t> total_{0};
+    std::atomic<uint64_t> min_{std::numeric_limits<uint64_t>::max()};
+    std::atomic<uint64_t> max_{0};
+};
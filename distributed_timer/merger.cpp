@@ -3,63 +3,684 @@
 #include <vector>
 #include <filesystem>
 #include <unordered_map>
+#include <map>
+#include <cmath>
+#include <cstring>
+#include <limits>
+#include <string_view>
 #include <algorithm>
 #include <unordered_set>
+#include <memory>
+#include <queue>
+#include <deque>
+#include <chrono>
+#include <mutex>
+#include <condition_variable>
 #include <nlohmann/json.hpp>
+#include "clock_sync.h"
+#include "histogram.h"
+#include "trace_metadata.h"
+#include "thread_pool.h"
+#include "trace_analysis.h"
+#include "trace_source.h"
 
 namespace fs = std::filesystem;
 
 
-nlohmann::json generateMetadata(const nlohmann::json& traceData) {
-    struct metadata_t {
-        size_t tid;
-        size_t pid;
-        std::string cat;
+/**
+ * @brief An event ready to be written: its timestamp and its serialized JSON.
+ */
+struct merged_event_t {
+    int64_t ts; // Nanoseconds.
+    std::string text;
+};
 
-        // Equality comparator for metadata_t
-        bool operator==(const metadata_t& other) const {
-            return tid == other.tid && pid == other.pid && cat == other.cat;
-        }
+/**
+ * @brief Links the points of every flow ('s'/'t'/'f') and async span ('b'/'e') by id, across inputs.
+ *
+ * Only the first start and the last finish of each id are kept, which is enough to report the
+ * end-to-end latency of requests that cross process boundaries.
+ */
+class FlowLinker {
+private:
+    struct ends_t {
+        std::string name;
+        bool async = false;
+        double start = std::numeric_limits<double>::infinity();
+        double finish = -std::numeric_limits<double>::infinity();
+        size_t input = 0;         // First input the id was seen in.
+        bool crossInput = false;  // Whether other inputs have points of it too.
     };
 
-    // Custom hash function for metadata_t
-    struct metadata_hash {
-        size_t operator()(const metadata_t& meta) const {
-            return std::hash<size_t>()(meta.tid) ^
-                   std::hash<size_t>()(meta.pid) ^
-                   std::hash<std::string>()(meta.cat);
+    std::unordered_map<std::string, ends_t> ends_; // Keyed by kind and id.
+
+public:
+    void add(const nlohmann::json& event) {
+        std::string ph = event.value("ph", std::string());
+        if (ph.size() != 1 || std::string_view("stfbe").find(ph[0]) == std::string_view::npos)
+            return;
+        bool async = ph[0] == 'b' || ph[0] == 'e';
+        const nlohmann::json* id = async && event.contains("id2") ? &event["id2"] : event.contains("id") ? &event["id"] : nullptr;
+        if (id == nullptr)
+            return;
+
+        ends_t& ends = ends_[(async ? "a" : "f") + id->dump()];
+        ends.async = async;
+        double ts = event.value("ts", 0.0);
+        if (ph[0] == 's' || ph[0] == 'b') {
+            if (ts < ends.start) {
+                ends.start = ts;
+                ends.name = event.value("name", std::string());
+            }
+        } else if (ph[0] != 't') {
+            ends.finish = std::max(ends.finish, ts);
+        }
+    }
+
+    /**
+     * @brief Add the ends seen by the linker of one input.
+     */
+    void merge(const FlowLinker& other, size_t input) {
+        for (const auto& [key, theirs] : other.ends_) {
+            auto [it, inserted] = ends_.try_emplace(key, theirs);
+            ends_t& ours = it->second;
+            if (inserted) {
+                ours.input = input;
+                continue;
+            }
+            ours.crossInput |= ours.input != input;
+            if (theirs.start < ours.start) {
+                ours.start = theirs.start;
+                ours.name = theirs.name;
+            }
+            ours.finish = std::max(ours.finish, theirs.finish);
+        }
+    }
+
+    /**
+     * @brief Print the end-to-end latency of every flow and async span name.
+     */
+    void report(std::ostream& out) const {
+        struct summary_t {
+            LogHistogram latency;
+            size_t crossInput = 0;
+        };
+        std::map<std::pair<bool, std::string>, summary_t> summaries;
+        size_t unfinished = 0, unstarted = 0;
+        for (const auto& [key, ends] : ends_) {
+            if (std::isinf(ends.start) || std::isinf(ends.finish)) {
+                ++(std::isinf(ends.start) ? unstarted : unfinished);
+                continue;
+            }
+            summary_t& summary = summaries[{ends.async, ends.name}];
+            summary.latency.record(static_cast<uint64_t>(std::max(0.0, ends.finish - ends.start) * 1000)); // us -> ns
+            summary.crossInput += ends.crossInput;
+        }
+        if (ends_.empty())
+            return;
+
+        out << "End-to-end latency of " << ends_.size() << " flows and async spans (us):\n";
+        for (const auto& [kind, summary] : summaries) {
+            LogHistogram::snapshot_t snapshot;
+            summary.latency.snapshot(snapshot);
+            out << "  " << (kind.first ? "async" : "flow ") << " \"" << kind.second << "\": " << snapshot.count << " complete, "
+                << summary.crossInput << " across files, mean " << snapshot.mean() / 1000 << ", p50 " << snapshot.quantile(0.5) / 1000.0
+                << ", p99 " << snapshot.quantile(0.99) / 1000.0 << ", max " << snapshot.max / 1000.0 << '\n';
+        }
+        if (unfinished > 0 || unstarted > 0)
+            out << "  " << unfinished << " never finished, " << unstarted << " never started\n";
+    }
+};
+
+/**
+ * @brief Encodes Chrome events as the packets of one Perfetto sequence.
+ *
+ * Events must be converted in the order their packets are written, as the first packet using a
+ * string or a track carries its definition and timestamps are relative to the previous packet.
+ */
+class PerfettoConverter {
+private:
+    perfetto_format::Encoder encoder_;
+
+    static uint32_t _uint(const nlohmann::json& event, const char* key) {
+        auto it = event.find(key);
+        return it != event.end() && it->is_number() ? it->get<uint32_t>() : 0;
+    }
+
+    // Ids are "0x" strings when written by the timer, but can be any number or string in other traces.
+    static uint64_t _id(const nlohmann::json& event) {
+        const nlohmann::json* id = nullptr;
+        if (auto id2 = event.find("id2"); id2 != event.end() && id2->is_object())
+            id = id2->contains("global") ? &(*id2)["global"] : id2->contains("local") ? &(*id2)["local"] : nullptr;
+        else if (auto it = event.find("id"); it != event.end())
+            id = &*it;
+        if (id == nullptr)
+            return 0;
+        if (id->is_number())
+            return id->get<uint64_t>();
+        uint64_t value = 0;
+        if (id->is_string() && !trace_context::parse(id->get_ref<const std::string&>(), value))
+            value = std::hash<std::string>{}(id->get<std::string>());
+        return value;
+    }
+
+    void _arg(const std::string& key, const nlohmann::json& value) {
+        uint64_t bits = 0;
+        if (value.is_boolean())
+            encoder_.arg(key, ArgType::Bool, value.get<bool>());
+        else if (value.is_number_integer())
+            encoder_.arg(key, ArgType::Int64, static_cast<uint64_t>(value.get<int64_t>()));
+        else if (value.is_number()) {
+            double number = value.get<double>();
+            std::memcpy(&bits, &number, sizeof(bits));
+            encoder_.arg(key, ArgType::Double, bits);
+        }
+        else if (value.is_string())
+            encoder_.arg(key, ArgType::String, 0, value.get_ref<const std::string&>());
+        else
+            encoder_.arg(key, ArgType::String, 0, value.dump());
+    }
+
+public:
+    explicit PerfettoConverter(uint32_t sequenceId) : encoder_(sequenceId) {}
+
+    /**
+     * @brief Append the packets of an event. Events of phases Perfetto has no equivalent for are dropped.
+     *
+     * @param nanos Exact timestamp of the event, which its "ts" only holds rounded.
+     */
+    void convert(const nlohmann::json& event, int64_t nanos, std::string& out) {
+        using perfetto_format::EventType;
+        std::string ph = event.value("ph", std::string());
+        if (ph.size() != 1)
+            return;
+        uint32_t pid = _uint(event, "pid");
+        uint32_t tid = _uint(event, "tid");
+        std::string category = event.value("cat", std::string());
+        std::string name = event.value("name", std::string());
+        const nlohmann::json& args = event.contains("args") && event["args"].is_object() ? event["args"] : nlohmann::json::object();
+
+        perfetto_format::track_event_t trackEvent;
+        trackEvent.ts = nanos;
+        trackEvent.category = category;
+        trackEvent.name = name;
+        switch (ph[0]) {
+        case 'B': case 'X': case 'b': trackEvent.type = EventType::SliceBegin; break;
+        case 'E': case 'e': trackEvent.type = EventType::SliceEnd; trackEvent.name = {}; break;
+        case 'i': case 'I': case 's': case 't': case 'f': trackEvent.type = EventType::Instant; break;
+        case 'C':
+            // Every numeric arg is a series of the counter, named as in chrome://tracing.
+            trackEvent.type = EventType::Counter;
+            for (const auto& [key, value] : args.items()) {
+                if (!value.is_number())
+                    continue;
+                trackEvent.track = encoder_.counterTrack(out, pid, key == name ? name : name + " " + key);
+                trackEvent.isDouble = value.is_number_float();
+                trackEvent.counter = trackEvent.isDouble ? 0 : value.get<int64_t>();
+                trackEvent.doubleCounter = value.get<double>();
+                encoder_.event(out, trackEvent);
+            }
+            return;
+        default:
+            return;
+        }
+
+        if (ph[0] == 'b' || ph[0] == 'e')
+            trackEvent.track = encoder_.asyncTrack(out, _id(event), name);
+        else
+            trackEvent.track = encoder_.threadTrack(out, pid, tid, {});
+        if (ph[0] == 's' || ph[0] == 't' || ph[0] == 'f') {
+            trackEvent.flow = _id(event);
+            trackEvent.terminatesFlow = ph[0] == 'f';
         }
+        for (const auto& [key, value] : args.items())
+            _arg(key, value);
+        encoder_.event(out, trackEvent);
+
+        if (ph[0] == 'X') {
+            trackEvent.type = EventType::SliceEnd;
+            trackEvent.ts += std::llround(event.value("dur", 0.0) * 1000);
+            trackEvent.name = {};
+            encoder_.event(out, trackEvent, false);
+        }
+    }
+
+    /**
+     * @brief Append the descriptors naming the track of a process_name or thread_name metadata event.
+     */
+    void metadata(const nlohmann::json& event, std::string& out) {
+        std::string name = event.value("name", std::string());
+        std::string trackName = event.contains("args") ? event["args"].value("name", std::string()) : std::string();
+        if (name == "process_name")
+            encoder_.processTrack(out, _uint(event, "pid"), trackName);
+        else if (name == "thread_name")
+            encoder_.threadTrack(out, _uint(event, "pid"), _uint(event, "tid"), trackName);
+    }
+};
+
+/**
+ * @brief Presents a source in timestamp order, assuming it is already sorted up to a window.
+ *
+ * Streamed traces can hold an event slightly behind its neighbours, so each source keeps the
+ * next window events in a min-heap. Memory stays proportional to the window; an unbounded window
+ * sorts the whole source. Events are serialized and their metadata collected as they are read,
+ * so all per-event work happens here.
+ */
+class OrderedSource {
+public:
+    static constexpr size_t kReorderWindow = 1024;
+    static constexpr size_t kWholeSource = std::numeric_limits<size_t>::max();
+
+private:
+
+    struct entry_t {
+        uint64_t sequence; // Keeps equal timestamps in file order.
+        merged_event_t event;
+        nlohmann::json json; // The event itself when encoding Perfetto packets, which happens in timestamp order.
     };
+    struct later {
+        bool operator()(const entry_t& a, const entry_t& b) const {
+            return a.event.ts != b.event.ts ? a.event.ts > b.event.ts : a.sequence > b.sequence;
+        }
+    };
+
+    std::unique_ptr<TraceSource> source_;
+    clock_sync::clock_map_t clock_;
+    bool aligned_;
+    bool byCategory_;
+    size_t windowSize_;
+    std::vector<entry_t> window_; // Min-heap ordered by later.
+    uint64_t sequence_ = 0;
+    bool exhausted_ = false;
+    MetadataCollector metadata_;
+    FlowLinker flows_;
+    size_t events_ = 0;
+    size_t outOfOrder_ = 0;
+    int64_t lastTs_ = std::numeric_limits<int64_t>::min();
+    std::unique_ptr<PerfettoConverter> perfetto_;
+
+    void _fill() {
+        nlohmann::json event;
+        int64_t ts;
+        while (!exhausted_ && window_.size() < windowSize_) {
+            if (!source_->next(event, ts)) {
+                exhausted_ = true;
+                break;
+            }
+            bool timed = event.contains("ts");
+            if (aligned_ && timed) {
+                ts = clock_.applyNanos(ts);
+                event["ts"] = ts / 1000.0;
+            }
+            if (byCategory_ && event.contains("cat"))
+                event["tid"] = chrome_format::categoryTid(event["cat"].get<std::string>());
+            if (metadata_.add(event))
+                continue;
+            flows_.add(event);
+            if (perfetto_)
+                window_.push_back({sequence_++, {ts, {}}, std::move(event)});
+            else
+                window_.push_back({sequence_++, {ts, timed ? chrome_format::dump(event, ts) : event.dump()}, {}});
+            std::push_heap(window_.begin(), window_.end(), later());
+        }
+    }
+
+public:
+    /**
+     * @param perfettoSequence Sequence of the Perfetto packets the events are encoded as, 0 to serialize them as JSON.
+     * @param window Number of events read ahead and reordered, kWholeSource to sort the whole source.
+     */
+    OrderedSource(std::unique_ptr<TraceSource> source, const clock_sync::clock_map_t& clock, bool byCategory, uint32_t perfettoSequence, size_t window)
+        : source_(std::move(source)), clock_(clock), aligned_(clock.scale != 1 || clock.offset != 0),
+          byCategory_(byCategory), windowSize_(window), metadata_(byCategory),
+          perfetto_(perfettoSequence != 0 ? std::make_unique<PerfettoConverter>(perfettoSequence) : nullptr) {}
+
+    bool empty() {
+        _fill();
+        return window_.empty();
+    }
+
+    merged_event_t pop() {
+        _fill();
+        std::pop_heap(window_.begin(), window_.end(), later());
+        merged_event_t event = std::move(window_.back().event);
+        if (perfetto_)
+            perfetto_->convert(window_.back().json, event.ts, event.text);
+        window_.pop_back();
+        ++events_;
+        if (event.ts < lastTs_)
+            ++outOfOrder_;
+        lastTs_ = std::max(lastTs_, event.ts);
+        return event;
+    }
+
+    const MetadataCollector& metadata() const { return metadata_; }
 
-    std::unordered_set<metadata_t, metadata_hash> metadata;
-
-    for (const auto& event : traceData) {
-        metadata_t data;
-        data.tid = event["tid"].get<size_t>();
-        data.pid = event["pid"].get<size_t>();
-        data.cat = event["cat"].get<std::string>();
-        metadata.insert(data);
-    }
-
-    nlohmann::json metadataList = nlohmann::json::array();
-    for (const auto& entry : metadata) {
-        metadataList.push_back({
-            {"cat", "__metadata"},
-            {"name", "thread_name"},
-            {"ph", "M"},
-            {"pid", entry.pid},
-            {"tid", entry.tid},
-            {"args", {{"name", entry.cat}}}
+    const FlowLinker& flows() const { return flows_; }
+
+    size_t events() const { return events_; }
+
+    // Events further out of order than the window, which were returned late.
+    size_t outOfOrder() const { return outOfOrder_; }
+};
+
+/**
+ * @brief Reads an OrderedSource ahead of the merge on a thread pool.
+ *
+ * At most one read task per source is in flight, and at most kMaxBatches batches are kept
+ * ready, so sources never block pool threads and memory stays bounded per source.
+ */
+class PrefetchingSource {
+private:
+    static constexpr size_t kBatchSize = 4096;
+    static constexpr size_t kMaxBatches = 2;
+
+    OrderedSource source_;
+    ThreadPool& pool_;
+    std::mutex mutex_;
+    std::condition_variable ready_;
+    std::deque<std::vector<merged_event_t>> batches_;
+    bool inFlight_ = false;
+    bool exhausted_ = false;
+
+    // Consumer side
+    std::vector<merged_event_t> current_;
+    size_t position_ = 0;
+
+    // Requires mutex_.
+    void _schedule() {
+        if (inFlight_ || exhausted_ || batches_.size() >= kMaxBatches)
+            return;
+        inFlight_ = true;
+        pool_.submit([this]() { _read(); });
+    }
+
+    void _read() {
+        std::vector<merged_event_t> batch;
+        batch.reserve(kBatchSize);
+        while (batch.size() < kBatchSize && !source_.empty())
+            batch.push_back(source_.pop());
+        bool exhausted = source_.empty();
+
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (!batch.empty())
+            batches_.push_back(std::move(batch));
+        exhausted_ = exhausted;
+        inFlight_ = false;
+        _schedule();
+        ready_.notify_one();
+    }
+
+public:
+    PrefetchingSource(std::unique_ptr<TraceSource> source, const clock_sync::clock_map_t& clock, bool byCategory, uint32_t perfettoSequence,
+                      size_t window, ThreadPool& pool)
+        : source_(std::move(source), clock, byCategory, perfettoSequence, window), pool_(pool) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        _schedule();
+    }
+
+    /**
+     * @brief Next event of the source, waiting for it to be read if needed. Consumer thread only.
+     *
+     * @return merged_event_t* The event, or nullptr once the source is exhausted.
+     */
+    merged_event_t* peek() {
+        if (position_ < current_.size())
+            return &current_[position_];
+
+        std::unique_lock<std::mutex> lock(mutex_);
+        ready_.wait(lock, [this]() { return !batches_.empty() || (exhausted_ && !inFlight_); });
+        if (batches_.empty())
+            return nullptr;
+        current_ = std::move(batches_.front());
+        batches_.pop_front();
+        position_ = 0;
+        _schedule();
+        return &current_[0];
+    }
+
+    /**
+     * @brief Consume the event returned by peek(). Consumer thread only.
+     */
+    merged_event_t take() {
+        return std::move(current_[position_++]);
+    }
+
+    /**
+     * @brief The source's metadata, flows and event counts. Only complete once peek() returned nullptr.
+     */
+    const OrderedSource& source() const { return source_; }
+};
+
+
+/**
+ * @brief Estimate how to map each input's clock onto the first input's from their clock sync markers.
+ *
+ * Markers are collected from all inputs concurrently on the pool.
+ *
+ * @param filePaths Paths of the traces.
+ * @param pool Pool reading the traces.
+ * @return std::vector<clock_sync::clock_map_t> One map per input, identity when it cannot be synchronized.
+ */
+std::vector<clock_sync::clock_map_t> estimateClocks(const std::vector<std::string>& filePaths, ThreadPool& pool)
+{
+    std::vector<std::vector<clock_sync::marker_t>> markers(filePaths.size());
+    std::mutex mutex;
+    std::condition_variable done;
+    size_t remaining = filePaths.size();
+    for (size_t i = 0; i < filePaths.size(); ++i)
+    {
+        pool.submit([&, i]() {
+            if (auto source = openTraceSource(filePaths[i]))
+            {
+                source->setCategoryFilter("clock_sync");
+                nlohmann::json event;
+                while (source->next(event))
+                {
+                    const nlohmann::json& args = event.value("args", nlohmann::json::object());
+                    if (!args.contains("sync_id"))
+                        continue;
+                    markers[i].push_back({args["sync_id"].get<std::string>(), event.value("name", std::string()) == "send", event.value("ts", 0.0)});
+                }
+            }
+            std::lock_guard<std::mutex> lock(mutex);
+            if (--remaining == 0)
+                done.notify_one();
         });
     }
+    {
+        std::unique_lock<std::mutex> lock(mutex);
+        done.wait(lock, [&]() { return remaining == 0; });
+    }
+
+    size_t numMarkers = 0;
+    for (const auto& nodeMarkers : markers)
+        numMarkers += nodeMarkers.size();
+    std::vector<clock_sync::clock_map_t> clocks(filePaths.size());
+    if (numMarkers == 0)
+        return clocks;
+
+    std::vector<clock_sync::node_estimate_t> estimates = clock_sync::estimate(markers);
+    std::cout << "Clock alignment relative to " << filePaths[0] << ":\n";
+    for (size_t i = 0; i < filePaths.size(); ++i)
+    {
+        const clock_sync::node_estimate_t& estimate = estimates[i];
+        std::cout << "\t" << filePaths[i] << ": ";
+        if (i == 0)
+            std::cout << "reference";
+        else if (!estimate.synchronized)
+            std::cout << "no clock sync exchanges with the other inputs, left as is";
+        else
+            std::cout << "offset " << estimate.offsetMicros << " us, drift " << estimate.driftPpm << " ppm, "
+                      << estimate.exchanges << " exchanges, min round trip " << estimate.minRoundTripMicros << " us";
+        std::cout << std::endl;
+        clocks[i] = estimate.toReference;
+    }
+    return clocks;
+}
+
+
+/**
+ * @brief Whether a merged trace is to be written in Perfetto's format, which its extension tells.
+ */
+bool isPerfettoPath(const std::string& path)
+{
+    std::string extension = fs::path(path).extension().string();
+    return extension == ".pftrace" || extension == ".perfetto-trace";
+}
+
+/**
+ * @brief Concatenate Perfetto traces, renumbering their packet sequences so no two inputs share one.
+ *
+ * @return size_t Number of packets written.
+ */
+size_t concatenatePerfetto(const std::vector<std::string>& inputs, std::ostream& out)
+{
+    static constexpr size_t kFlushBytes = 1 << 20;
+    uint32_t nextSequenceId = 1;
+    size_t packets = 0;
+    std::string packet, buffer;
+    for (const auto& path : inputs)
+    {
+        std::ifstream input(path, std::ios::binary);
+        perfetto_format::PacketReader reader(input);
+        std::unordered_map<uint64_t, uint32_t> sequenceIds;
+        while (reader.next(packet))
+        {
+            perfetto_format::renumberPacket(packet, sequenceIds, nextSequenceId, buffer);
+            ++packets;
+            if (buffer.size() >= kFlushBytes)
+            {
+                out.write(buffer.data(), static_cast<std::streamsize>(buffer.size()));
+                buffer.clear();
+            }
+        }
+        out.write(buffer.data(), static_cast<std::streamsize>(buffer.size()));
+        buffer.clear();
+    }
+    return packets;
+}
+
+/**
+ * @brief What one merge pass of the inputs wrote.
+ */
+struct merge_pass_t {
+    size_t events = 0;
+    size_t sources = 0;
+    FlowLinker flows;
+    std::vector<size_t> unsorted; // Inputs further out of timestamp order than the reorder window.
+};
+
+/**
+ * @brief K-way merge the inputs by timestamp into the output, followed by their metadata.
+ *
+ * @param wholeSource Inputs to sort in full instead of within the reorder window.
+ */
+merge_pass_t mergePass(const std::vector<std::string>& inputs, const std::vector<clock_sync::clock_map_t>& clocks, const std::vector<bool>& wholeSource,
+                       std::ostream& outputFile, bool perfetto, bool byCategory, ThreadPool& pool)
+{
+    // Every source is read to its end below, so no pool task still refers to one when they go away.
+    std::vector<std::unique_ptr<PrefetchingSource>> sources;
+    std::vector<size_t> sourceInputs;
+    for (size_t i = 0; i < inputs.size(); ++i)
+    {
+        if (auto source = openTraceSource(inputs[i]))
+        {
+            sources.push_back(std::make_unique<PrefetchingSource>(std::move(source), clocks[i], byCategory,
+                                                                  perfetto ? static_cast<uint32_t>(sources.size() + 1) : 0,
+                                                                  wholeSource[i] ? OrderedSource::kWholeSource : OrderedSource::kReorderWindow, pool));
+            sourceInputs.push_back(i);
+        }
+    }
+
+    // k-way merge: the heap holds the next timestamp of every non-empty source.
+    using head_t = std::pair<int64_t, size_t>;
+    std::priority_queue<head_t, std::vector<head_t>, std::greater<head_t>> heads;
+    for (size_t i = 0; i < sources.size(); ++i)
+        if (merged_event_t* event = sources[i]->peek())
+            heads.push({event->ts, i});
+
+    bool first = true;
+    auto write = [&](const std::string& text) {
+        if (perfetto)
+            outputFile << text; // Packets need no separator.
+        else
+            outputFile << (first ? "[\n" : ",\n") << text;
+        first = false;
+    };
+
+    while (!heads.empty())
+    {
+        size_t index = heads.top().second;
+        heads.pop();
+        PrefetchingSource& source = *sources[index];
+
+        write(source.take().text);
+
+        if (merged_event_t* next = source.peek())
+            heads.push({next->ts, index});
+    }
 
-    return metadataList;
+    // Metadata only needs to appear somewhere in the trace, so it goes last instead of being buffered.
+    merge_pass_t pass;
+    pass.sources = sources.size();
+    MetadataCollector metadata(byCategory);
+    for (size_t i = 0; i < sources.size(); ++i)
+    {
+        metadata.merge(sources[i]->source().metadata());
+        pass.flows.merge(sources[i]->source().flows(), i);
+        pass.events += sources[i]->source().events();
+        if (sources[i]->source().outOfOrder() > 0)
+            pass.unsorted.push_back(sourceInputs[i]);
+    }
+    if (perfetto)
+    {
+        // Names go in a sequence of their own, after every source's.
+        PerfettoConverter names(static_cast<uint32_t>(sources.size() + 1));
+        std::string packets;
+        for (const auto& entry : metadata.toJson())
+            names.metadata(entry, packets);
+        outputFile << packets;
+    }
+    else
+    {
+        for (const auto& entry : metadata.toJson())
+            write(entry.dump());
+        outputFile << (first ? "[]\n" : "\n]\n");
+    }
+    return pass;
 }
 
-void mergeFiles(const std::vector<std::string>& filePaths, const std::string& outputPath)
+/**
+ * @brief Merge traces into one Chrome JSON trace, or one Perfetto trace if the output path ends in .pftrace.
+ *
+ * Inputs are read, parsed and serialized concurrently on numThreads pool threads while the
+ * calling thread k-way merges them by timestamp into the output. Perfetto inputs that need no
+ * clock alignment are concatenated into a Perfetto output without being decoded. Inputs found
+ * further out of order than the reorder window are sorted in full by a second pass.
+ *
+ * @param filePaths Paths of the JSON, binary or Perfetto traces to merge.
+ * @param outputPath Path of the merged trace.
+ * @param numThreads Number of threads reading the inputs.
+ * @param syncClocks Whether to align the inputs' timestamps using their clock sync markers.
+ * @param byCategory Whether to give each category its own track instead of each thread.
+ */
+void mergeFiles(const std::vector<std::string>& filePaths, const std::string& outputPath, size_t numThreads, bool syncClocks, bool byCategory)
 {
-    nlohmann::json masterList = nlohmann::json::array();
+    auto begin = std::chrono::steady_clock::now();
+    bool perfetto = isPerfettoPath(outputPath);
+    std::ios::openmode mode = perfetto ? std::ios::binary : std::ios::out;
 
+    std::ofstream outputFile(outputPath, mode);
+    if (!outputFile)
+    {
+        std::cerr << "Failed to open output file: " << outputPath << '\n';
+        return;
+    }
+
+    ThreadPool pool(numThreads);
+    std::vector<std::string> inputs;
+    bool allPerfetto = true;
     for (const auto& path : filePaths)
     {
         if (!fs::exists(path))
@@ -67,58 +688,340 @@ void mergeFiles(const std::vector<std::string>& filePaths, const std::string& ou
             std::cerr << "File does not exist: " << path << '\n';
             continue;
         }
+        inputs.push_back(path);
+        std::ifstream input(path, std::ios::binary);
+        allPerfetto &= perfetto_format::isPerfettoTrace(input);
+    }
 
-        std::ifstream inputFile(path);
-        if (!inputFile)
+    std::vector<clock_sync::clock_map_t> clocks(inputs.size());
+    if (syncClocks)
+        clocks = estimateClocks(inputs, pool);
+    bool aligned = std::any_of(clocks.begin(), clocks.end(), [](const clock_sync::clock_map_t& clock) { return clock.scale != 1 || clock.offset != 0; });
+    if (perfetto && allPerfetto && !aligned && !byCategory)
+    {
+        size_t packets = concatenatePerfetto(inputs, outputFile);
+        double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - begin).count();
+        std::cout << "Concatenated " << packets << " packets from " << inputs.size() << " files in " << seconds << " s" << std::endl;
+        return;
+    }
+
+    std::vector<bool> wholeSource(inputs.size(), false);
+    merge_pass_t pass = mergePass(inputs, clocks, wholeSource, outputFile, perfetto, byCategory, pool);
+    if (!pass.unsorted.empty())
+    {
+        // Their late events are already written, so the output is rewritten with those inputs sorted in memory.
+        for (size_t i : pass.unsorted)
         {
-            std::cerr << "Failed to open file: " << path << '\n';
-            continue;
+            std::cerr << "Warning: " << inputs[i] << " is further out of timestamp order than the reorder window, sorting it in full.\n";
+            wholeSource[i] = true;
         }
-
-        nlohmann::json currentList;
-        inputFile >> currentList;
-        masterList.insert(masterList.end(), currentList.begin(), currentList.end());
+        outputFile.close();
+        outputFile.open(outputPath, mode);
+        pass = mergePass(inputs, clocks, wholeSource, outputFile, perfetto, byCategory, pool);
     }
+    outputFile.close();
+
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - begin).count();
+    std::cout << "Merged " << pass.events << " events from " << pass.sources << " files with " << pool.size() << " threads in "
+              << seconds << " s (" << static_cast<size_t>(pass.events / std::max(seconds, 1e-9)) << " events/s)" << std::endl;
+    pass.flows.report(std::cout);
+}
 
-    // Sort masterList by the "ts" timestamp
-    std::sort(masterList.begin(), masterList.end(),
-              [](const nlohmann::json& a, const nlohmann::json& b) { return a["ts"] < b["ts"]; });
-    nlohmann::json metadata = generateMetadata(masterList);
-    masterList.insert(masterList.begin(), metadata.begin(), metadata.end());
 
-    // Write the merged content to the output file
+/**
+ * @brief What --analyze prints, and where it writes the reduced trace.
+ */
+struct analysis_options_t {
+    trace_analysis::filter_t filter;
+    bool stats = false;
+    size_t top = 0;
+    bool criticalPath = false;
+    bool json = false;
+    std::string reducedPath; // Empty: no reduced trace.
+};
+
+/**
+ * @brief Reads every event of the inputs, in order, aligning their clocks. Visit gets each event and its timestamp in nanoseconds.
+ */
+template <typename Visit>
+void readInputs(const std::vector<std::string>& inputs, const std::vector<clock_sync::clock_map_t>& clocks, Visit visit)
+{
+    for (size_t i = 0; i < inputs.size(); ++i)
+    {
+        std::unique_ptr<TraceSource> source = openTraceSource(inputs[i]);
+        if (!source)
+            continue;
+        bool aligned = clocks[i].scale != 1 || clocks[i].offset != 0;
+        nlohmann::json event;
+        int64_t nanos;
+        while (source->next(event, nanos))
+        {
+            if (aligned && event.contains("ts"))
+            {
+                nanos = clocks[i].applyNanos(nanos);
+                event["ts"] = nanos / 1000.0;
+            }
+            visit(event, nanos);
+        }
+    }
+}
+
+/**
+ * @brief Write the events of the spans and the other events kept by a filter, and all metadata, as a Chrome trace.
+ *
+ * The inputs are read again and their spans paired the same way as when indexing, so each event
+ * finds its span's row.
+ */
+size_t writeReducedTrace(const std::vector<std::string>& inputs, const std::vector<clock_sync::clock_map_t>& clocks,
+                         const trace_analysis::SpanIndex& index, const trace_analysis::filter_t& filter, const std::string& outputPath)
+{
     std::ofstream outputFile(outputPath);
     if (!outputFile)
     {
         std::cerr << "Failed to open output file: " << outputPath << '\n';
-        return;
+        return 0;
     }
-    outputFile << masterList.dump(4);
+    std::vector<bool> kept(index.size());
+    for (uint32_t span = 0; span < index.size(); ++span)
+        kept[span] = index.matches(span, filter);
+
+    trace_analysis::SpanPairer pairer;
+    MetadataCollector metadata;
+    size_t written = 0;
+    auto write = [&](nlohmann::json& event, int64_t nanos) {
+        outputFile << (written++ == 0 ? "[\n" : ",\n") << (event.contains("ts") ? chrome_format::dump(event, nanos) : event.dump());
+    };
+    readInputs(inputs, clocks, [&](nlohmann::json& event, int64_t nanos) {
+        if (metadata.add(event))
+            return;
+        auto [role, span] = pairer.pair(event);
+        if (span != trace_analysis::kNone)
+        {
+            if (kept[span])
+                write(event, nanos);
+            return;
+        }
+        if (role == trace_analysis::SpanPairer::Role::Orphan)
+            return;
+        double ts = event.value("ts", 0.0) - index.origin();
+        const std::vector<std::string>& categories = filter.categories;
+        if (ts >= filter.from && ts <= filter.to
+            && (categories.empty() || std::find(categories.begin(), categories.end(), event.value("cat", std::string())) != categories.end()))
+            write(event, nanos);
+    });
+    size_t events = written;
+    for (auto entry : metadata.toJson())
+        write(entry, 0);
+    outputFile << (written == 0 ? "[]\n" : "\n]\n");
+    return events;
+}
+
+/**
+ * @brief Index the spans of traces and answer the queries of options, as tables or as one JSON object.
+ *
+ * @param filePaths Paths of the JSON or binary traces, usually one merged trace.
+ * @param numThreads Number of threads estimating the clock alignment of several inputs.
+ * @param syncClocks Whether to align several inputs using their clock sync markers.
+ * @param options Queries, filter and reduced trace.
+ */
+void analyzeFiles(const std::vector<std::string>& filePaths, size_t numThreads, bool syncClocks, const analysis_options_t& options)
+{
+    using namespace trace_analysis;
+    auto begin = std::chrono::steady_clock::now();
+    std::ostream& log = options.json ? std::cerr : std::cout; // Keeps stdout parseable.
+
+    std::vector<std::string> inputs;
+    for (const auto& path : filePaths)
+    {
+        if (fs::exists(path))
+            inputs.push_back(path);
+        else
+            std::cerr << "File does not exist: " << path << '\n';
+    }
+    std::vector<clock_sync::clock_map_t> clocks(inputs.size());
+    if (syncClocks && inputs.size() > 1)
+    {
+        ThreadPool pool(numThreads);
+        clocks = estimateClocks(inputs, pool);
+    }
+
+    SpanIndex index;
+    size_t numEvents = 0;
+    readInputs(inputs, clocks, [&](const nlohmann::json& event, int64_t) {
+        index.add(event);
+        ++numEvents;
+    });
+    index.finish();
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - begin).count();
+    log << "Indexed " << index.size() << " spans from " << numEvents << " events in " << seconds << " s";
+    if (index.orphans() > 0)
+        log << ", " << index.orphans() << " end events had no span to end";
+    log << std::endl;
+
+    nlohmann::json result = nlohmann::json::object();
+    if (options.stats)
+    {
+        std::vector<span_stats_t> stats = index.stats(options.filter);
+        if (options.json)
+        {
+            nlohmann::json& rows = result["stats"] = nlohmann::json::array();
+            for (const span_stats_t& row : stats)
+                rows.push_back({{"cat", row.category}, {"name", row.name}, {"count", row.count}, {"total", row.total},
+                                {"mean", row.mean}, {"p50", row.p50}, {"p99", row.p99}, {"max", row.max}});
+        }
+        else
+        {
+            std::cout << "\nSpan durations (us):\n";
+            Table table({"category", "name", "count", "total", "mean", "p50", "p99", "max"});
+            for (const span_stats_t& row : stats)
+                table.add({row.category, row.name, std::to_string(row.count), Table::number(row.total), Table::number(row.mean),
+                           Table::number(row.p50), Table::number(row.p99), Table::number(row.max)});
+            table.print(std::cout);
+        }
+    }
+
+    if (options.top > 0)
+    {
+        std::vector<uint32_t> top = index.top(options.top, options.filter);
+        if (options.json)
+        {
+            nlohmann::json& rows = result["top"] = nlohmann::json::array();
+            for (uint32_t span : top)
+                rows.push_back(spanJson(index, span));
+        }
+        else
+        {
+            std::cout << "\n" << top.size() << " longest spans (us, start from the beginning of the trace):\n";
+            Table table({"category", "name", "pid", "tid", "start", "duration"});
+            for (uint32_t span : top)
+                table.add({index.string(index.category[span]), index.string(index.name[span]) + ((index.flags[span] & SpanIndex::Open) ? " (open)" : ""),
+                           std::to_string(index.pid[span]), std::to_string(index.tid[span]), Table::number(index.start[span] - index.origin()),
+                           Table::number(index.duration(span))});
+            table.print(std::cout);
+        }
+    }
+
+    if (options.criticalPath)
+    {
+        uint32_t root = index.criticalRoot(options.filter);
+        std::vector<path_segment_t> path = root != kNone ? mergeSegments(index.criticalPath(root)) : std::vector<path_segment_t>();
+        auto summary = pathSummary(index, path);
+        if (options.json)
+        {
+            nlohmann::json& critical = result["critical_path"] = nlohmann::json::object();
+            if (root != kNone)
+            {
+                critical["root"] = spanJson(index, root);
+                nlohmann::json& segments = critical["segments"] = nlohmann::json::array();
+                for (const path_segment_t& segment : path)
+                {
+                    nlohmann::json row = spanJson(index, segment.span);
+                    row["path_start"] = segment.start - index.origin();
+                    row["path_dur"] = segment.end - segment.start;
+                    segments.push_back(row);
+                }
+                nlohmann::json& bySpan = critical["by_name"] = nlohmann::json::array();
+                for (const auto& [category, name, total] : summary)
+                    bySpan.push_back({{"cat", category}, {"name", name}, {"total", total}});
+            }
+        }
+        else if (root == kNone)
+        {
+            std::cout << "\nNo span matches the filter, no critical path.\n";
+        }
+        else
+        {
+            double length = index.duration(root);
+            std::cout << "\nCritical path of \"" << index.string(index.category[root]) << "/" << index.string(index.name[root]) << "\" (pid "
+                      << index.pid[root] << ", tid " << index.tid[root] << "), " << Table::number(length) << " us through " << path.size() << " segments:\n";
+            Table table({"category", "name", "on path (us)", "share"});
+            for (const auto& [category, name, total] : summary)
+                table.add({category, name, Table::number(total), Table::number(length > 0 ? 100 * total / length : 0) + "%"});
+            table.print(std::cout);
+        }
+    }
+
+    if (!options.reducedPath.empty())
+    {
+        size_t written = writeReducedTrace(inputs, clocks, index, options.filter, options.reducedPath);
+        log << "Wrote " << written << " events to " << options.reducedPath << std::endl;
+    }
+    if (options.json)
+        std::cout << result.dump(2) << std::endl;
 }
 
 
 int main(int argc, char* argv[])
 {
-    if (argc < 3)
+    const std::string usage = std::string("Usage: ") + argv[0] + " [--threads N] [--no-clock-sync] [--by-category] <output file path> <input file pattern1> [<input file pattern2> ...]\n"
+        + "       " + argv[0] + " --analyze [--stats] [--top N] [--critical-path] [--from US] [--to US] [--category CAT]... [--name NAME]\n"
+        + "           [--json] [--reduce <output file path>] [--threads N] [--no-clock-sync] <input file pattern1> [<input file pattern2> ...]\n"
+        + "       --from and --to are microseconds from the start of the trace; --stats is the default query.\n"
+        + "       Inputs can be Chrome JSON, binary or Perfetto traces. Merged traces are written in Perfetto's format\n"
+        + "       when the output path ends in .pftrace or .perfetto-trace.";
+
+    size_t numThreads = std::max(1u, std::thread::hardware_concurrency());
+    bool syncClocks = true;
+    bool byCategory = false;
+    bool analyze = false;
+    analysis_options_t analysis;
+    std::vector<std::string> positional;
+    for (int i = 1; i < argc; ++i)
     {
-        std::cerr << "Usage: " << argv[0] << " <output file path> <input file pattern1> [<input file pattern2> ...]" << std::endl;
+        std::string arg = argv[i];
+        if (arg == "--threads" && i + 1 < argc)
+            numThreads = std::stoul(argv[++i]);
+        else if (arg.rfind("--threads=", 0) == 0)
+            numThreads = std::stoul(arg.substr(10));
+        else if (arg == "--no-clock-sync")
+            syncClocks = false;
+        else if (arg == "--by-category")
+            byCategory = true;
+        else if (arg == "--analyze")
+            analyze = true;
+        else if (arg == "--stats")
+            analysis.stats = true;
+        else if (arg == "--top" && i + 1 < argc)
+            analysis.top = std::stoul(argv[++i]);
+        else if (arg == "--critical-path")
+            analysis.criticalPath = true;
+        else if (arg == "--from" && i + 1 < argc)
+            analysis.filter.from = std::stod(argv[++i]);
+        else if (arg == "--to" && i + 1 < argc)
+            analysis.filter.to = std::stod(argv[++i]);
+        else if (arg == "--category" && i + 1 < argc)
+            analysis.filter.categories.push_back(argv[++i]);
+        else if (arg == "--name" && i + 1 < argc)
+            analysis.filter.name = argv[++i];
+        else if (arg == "--json")
+            analysis.json = true;
+        else if (arg == "--reduce" && i + 1 < argc)
+            analysis.reducedPath = argv[++i];
+        else
+            positional.push_back(arg);
+    }
+    if (analyze && !positional.empty())
+    {
+        if (!analysis.stats && analysis.top == 0 && !analysis.criticalPath && analysis.reducedPath.empty())
+            analysis.stats = true;
+        analyzeFiles(positional, numThreads, syncClocks, analysis);
+        return 0;
+    }
+    if (positional.size() < 2)
+    {
+        std::cerr << usage << std::endl;
         return 1;
     }
 
-    std::string outputPath = argv[1];
+    std::string outputPath = positional[0];
 
-    std::vector<std::string> filePaths;
-    for (int i = 2; i < argc; ++i)
-    {
-        filePaths.push_back(argv[i]);
-       
-    }
+    std::vector<std::string> filePaths(positional.begin() + 1, positional.end());
     std::cout << "Merging the following files:\n";
     for(const auto& path: filePaths){
         std::cout <<"\t" <<path << std::endl;
     }
 
-    mergeFiles(filePaths, outputPath);
+    mergeFiles(filePaths, outputPath, numThreads, syncClocks, byCategory);
 
     return 0;
 }
@@ -0,0 +1,159 @@
+#pragma once
+#include <array>
+#include <cerrno>
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <vector>
+
+#ifdef __linux__
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+/**
+ * @brief Performance counters that Timer::enablePerfCounters can attach to spans.
+ *
+ * The first four are hardware events, often unavailable in virtual machines and containers; the
+ * others are software events the kernel always provides.
+ */
+enum class PerfCounter : uint8_t {
+    Cycles,
+    Instructions,
+    CacheMisses,
+    BranchMisses,
+    ContextSwitches,
+    TaskClock,  ///< Nanoseconds the thread ran on a CPU.
+    PageFaults,
+};
+
+/**
+ * @brief A group of perf_event_open counters measuring the calling thread, read with one system call.
+ *
+ * Counters the kernel refuses (no PMU, perf_event_paranoid, seccomp) are left out of the group;
+ * if none can be opened the group is empty and reads return nothing.
+ */
+class PerfCounterGroup
+{
+public:
+    static constexpr size_t kMaxCounters = 8;
+    using values_t = std::array<uint64_t, kMaxCounters>;
+
+    PerfCounterGroup() = default;
+    PerfCounterGroup(const PerfCounterGroup &) = delete;
+    PerfCounterGroup &operator=(const PerfCounterGroup &) = delete;
+
+    ~PerfCounterGroup()
+    {
+#ifdef __linux__
+        for (int fd : fds_)
+            close(fd);
+#endif
+    }
+
+    static const char *name(PerfCounter counter)
+    {
+        static const char *const names[] = {"cycles", "instructions", "cache_misses", "branch_misses", "context_switches", "task_clock_ns", "page_faults"};
+        return names[static_cast<size_t>(counter)];
+    }
+
+    /**
+     * @brief Open the counters for the calling thread.
+     *
+     * @param counters Counters to open, at most kMaxCounters.
+     * @param error Receives the reason the first refused counter was refused.
+     * @return bool Whether at least one counter was opened.
+     */
+    bool open(const std::vector<PerfCounter> &counters, std::string &error)
+    {
+#ifdef __linux__
+        for (PerfCounter counter : counters)
+        {
+            if (fds_.size() == kMaxCounters)
+                break;
+            int fd = _open(counter, fds_.empty() ? -1 : fds_.front());
+            if (fd < 0)
+            {
+                if (error.empty())
+                    error = std::string(name(counter)) + ": " + std::strerror(errno);
+                continue;
+            }
+            fds_.push_back(fd);
+            counters_.push_back(counter);
+        }
+        if (fds_.empty())
+            return false;
+        ioctl(fds_.front(), PERF_EVENT_IOC_RESET, PERF_IOC_FLAG_GROUP);
+        ioctl(fds_.front(), PERF_EVENT_IOC_ENABLE, PERF_IOC_FLAG_GROUP);
+        return true;
+#else
+        (void)counters;
+        error = "performance counters are only supported on Linux";
+        return false;
+#endif
+    }
+
+    /**
+     * @brief Counters that were opened, in the order read() returns their values.
+     */
+    const std::vector<PerfCounter> &counters() const { return counters_; }
+
+    /**
+     * @brief Read the current value of every counter.
+     *
+     * @return bool False if the group is empty or the read failed.
+     */
+    bool read(values_t &values) const
+    {
+#ifdef __linux__
+        if (fds_.empty())
+            return false;
+        // PERF_FORMAT_GROUP: the number of counters, then their values.
+        uint64_t buffer[1 + kMaxCounters];
+        ssize_t size = ::read(fds_.front(), buffer, sizeof(buffer));
+        if (size < static_cast<ssize_t>(sizeof(uint64_t)) || buffer[0] != fds_.size())
+            return false;
+        std::memcpy(values.data(), buffer + 1, fds_.size() * sizeof(uint64_t));
+        return true;
+#else
+        (void)values;
+        return false;
+#endif
+    }
+
+private:
+    std::vector<int> fds_; // Leader first.
+    std::vector<PerfCounter> counters_;
+
+#ifdef __linux__
+    static int _open(PerfCounter counter, int groupFd)
+    {
+        perf_event_attr attr;
+        std::memset(&attr, 0, sizeof(attr));
+        attr.size = sizeof(attr);
+        switch (counter)
+        {
+        case PerfCounter::Cycles: attr.type = PERF_TYPE_HARDWARE; attr.config = PERF_COUNT_HW_CPU_CYCLES; break;
+        case PerfCounter::Instructions: attr.type = PERF_TYPE_HARDWARE; attr.config = PERF_COUNT_HW_INSTRUCTIONS; break;
+        case PerfCounter::CacheMisses: attr.type = PERF_TYPE_HARDWARE; attr.config = PERF_COUNT_HW_CACHE_MISSES; break;
+        case PerfCounter::BranchMisses: attr.type = PERF_TYPE_HARDWARE; attr.config = PERF_COUNT_HW_BRANCH_MISSES; break;
+        case PerfCounter::ContextSwitches: attr.type = PERF_TYPE_SOFTWARE; attr.config = PERF_COUNT_SW_CONTEXT_SWITCHES; break;
+        case PerfCounter::TaskClock: attr.type = PERF_TYPE_SOFTWARE; attr.config = PERF_COUNT_SW_TASK_CLOCK; break;
+        case PerfCounter::PageFaults: attr.type = PERF_TYPE_SOFTWARE; attr.config = PERF_COUNT_SW_PAGE_FAULTS; break;
+        }
+        attr.read_format = PERF_FORMAT_GROUP;
+        attr.disabled = groupFd < 0; // The leader enables the whole group at once.
+        attr.exclude_hv = 1;
+        int fd = static_cast<int>(syscall(SYS_perf_event_open, &attr, 0, -1, groupFd, PERF_FLAG_FD_CLOEXEC));
+        if (fd < 0 && errno == EACCES)
+        {
+            // perf_event_paranoid >= 2 only allows user space counting to unprivileged processes.
+            attr.exclude_kernel = 1;
+            fd = static_cast<int>(syscall(SYS_perf_event_open, &attr, 0, -1, groupFd, PERF_FLAG_FD_CLOEXEC));
+        }
+        return fd;
+    }
+#endif
+};
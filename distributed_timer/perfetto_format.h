@@ -0,0 +1,1102 @@
+#pragma once
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <deque>
+#include <istream>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+#include "trace_event.h"
+
+/**
+ * @brief Perfetto's protobuf trace format, written by TimerOperation::Perfetto and read by the merge tool.
+ *
+ * A trace is a sequence of Trace.packet fields, so traces can be appended to and concatenated as
+ * long as their packet sequence ids differ. The timer writes one sequence per thread, whose thread
+ * track is the default track of its events. A sequence's first packet clears its incremental state,
+ * anchors the sequence's incremental clock to CLOCK_REALTIME with a clock snapshot and makes it
+ * the default clock, so every later packet only carries the nanoseconds since the previous one.
+ * Categories, names and arg keys are interned: the packet of the first event using a string also
+ * carries its id. Tracks are described once per sequence:
+ * - every thread, and in the category view every category, has a thread track;
+ * - every counter has a counter track under its process;
+ * - every async span id has a global track, as its begin and end may come from different processes.
+ *
+ * Flow points are instants carrying flow ids. Only the fields below are encoded; protobuf is
+ * written by hand so no protobuf library is needed. Field numbers are those of perfetto/trace/.
+ */
+namespace perfetto_format {
+
+enum class WireType : uint8_t {
+    Varint = 0,
+    Fixed64 = 1,
+    Bytes = 2,
+    Fixed32 = 5
+};
+
+// Field numbers of the messages used here.
+namespace field {
+constexpr uint32_t kTracePacket = 1;
+
+// TracePacket
+constexpr uint32_t kClockSnapshot = 6;
+constexpr uint32_t kTimestamp = 8;
+constexpr uint32_t kTrustedPacketSequenceId = 10;
+constexpr uint32_t kTrackEvent = 11;
+constexpr uint32_t kInternedData = 12;
+constexpr uint32_t kSequenceFlags = 13;
+constexpr uint32_t kIncrementalStateCleared = 41;
+constexpr uint32_t kTimestampClockId = 58;
+constexpr uint32_t kTracePacketDefaults = 59;
+constexpr uint32_t kTrackDescriptor = 60;
+
+// ClockSnapshot, ClockSnapshot.Clock
+constexpr uint32_t kClocks = 1;
+constexpr uint32_t kPrimaryTraceClock = 2;
+constexpr uint32_t kClockId = 1;
+constexpr uint32_t kClockTimestamp = 2;
+constexpr uint32_t kClockIsIncremental = 3;
+constexpr uint32_t kClockUnitMultiplierNs = 4;
+
+// TracePacketDefaults, TrackEventDefaults
+constexpr uint32_t kDefaultTimestampClockId = 58;
+constexpr uint32_t kTrackEventDefaults = 11;
+constexpr uint32_t kDefaultTrackUuid = 11;
+
+// InternedData, and EventCategory, EventName and DebugAnnotationName
+constexpr uint32_t kEventCategories = 1;
+constexpr uint32_t kEventNames = 2;
+constexpr uint32_t kDebugAnnotationNames = 3;
+constexpr uint32_t kIid = 1;
+constexpr uint32_t kInternedName = 2;
+
+// TrackEvent
+constexpr uint32_t kCategoryIids = 3;
+constexpr uint32_t kDebugAnnotations = 4;
+constexpr uint32_t kType = 9;
+constexpr uint32_t kNameIid = 10;
+constexpr uint32_t kTrackUuid = 11;
+constexpr uint32_t kCategories = 22;
+constexpr uint32_t kName = 23;
+constexpr uint32_t kCounterValue = 30;
+constexpr uint32_t kFlowIdsOld = 36;
+constexpr uint32_t kTerminatingFlowIdsOld = 42;
+constexpr uint32_t kDoubleCounterValue = 44;
+constexpr uint32_t kFlowIds = 47;
+constexpr uint32_t kTerminatingFlowIds = 48;
+
+// DebugAnnotation
+constexpr uint32_t kAnnotationNameIid = 1;
+constexpr uint32_t kBoolValue = 2;
+constexpr uint32_t kUintValue = 3;
+constexpr uint32_t kIntValue = 4;
+constexpr uint32_t kDoubleValue = 5;
+constexpr uint32_t kStringValue = 6;
+constexpr uint32_t kLegacyJsonValue = 9;
+constexpr uint32_t kAnnotationName = 10;
+
+// TrackDescriptor, ProcessDescriptor, ThreadDescriptor
+constexpr uint32_t kUuid = 1;
+constexpr uint32_t kTrackName = 2;
+constexpr uint32_t kProcess = 3;
+constexpr uint32_t kThread = 4;
+constexpr uint32_t kParentUuid = 5;
+constexpr uint32_t kCounter = 8;
+constexpr uint32_t kPid = 1;
+constexpr uint32_t kTid = 2;
+constexpr uint32_t kProcessName = 6;
+constexpr uint32_t kThreadName = 5;
+} // namespace field
+
+constexpr uint32_t kRealtimeClock = 1;     // BUILTIN_CLOCK_REALTIME
+constexpr uint32_t kBoottimeClock = 6;     // BUILTIN_CLOCK_BOOTTIME, the default of packets that name no clock.
+constexpr uint32_t kIncrementalClock = 64; // First sequence-scoped clock id.
+
+// TracePacket.sequence_flags
+constexpr uint32_t kSeqIncrementalStateCleared = 1;
+constexpr uint32_t kSeqNeedsIncrementalState = 2;
+
+enum class EventType : uint8_t {
+    SliceBegin = 1,
+    SliceEnd = 2,
+    Instant = 3,
+    Counter = 4
+};
+
+inline void putVarint(std::string &out, uint64_t value)
+{
+    while (value >= 0x80)
+    {
+        out.push_back(static_cast<char>(value | 0x80));
+        value >>= 7;
+    }
+    out.push_back(static_cast<char>(value));
+}
+
+inline void putTag(std::string &out, uint32_t number, WireType wire)
+{
+    putVarint(out, (uint64_t(number) << 3) | static_cast<uint8_t>(wire));
+}
+
+inline void putUint(std::string &out, uint32_t number, uint64_t value)
+{
+    putTag(out, number, WireType::Varint);
+    putVarint(out, value);
+}
+
+inline void putFixed64(std::string &out, uint32_t number, uint64_t value)
+{
+    putTag(out, number, WireType::Fixed64);
+    char bytes[sizeof(value)];
+    for (size_t i = 0; i < sizeof(value); ++i)
+        bytes[i] = static_cast<char>(value >> (8 * i)); // Little endian whatever the host.
+    out.append(bytes, sizeof(bytes));
+}
+
+inline void putDouble(std::string &out, uint32_t number, double value)
+{
+    uint64_t bits;
+    std::memcpy(&bits, &value, sizeof(bits));
+    putFixed64(out, number, bits);
+}
+
+inline void putBytes(std::string &out, uint32_t number, std::string_view bytes)
+{
+    putTag(out, number, WireType::Bytes);
+    putVarint(out, bytes.size());
+    out.append(bytes.data(), bytes.size());
+}
+
+/**
+ * @brief Decode a varint, advancing position past it.
+ *
+ * @return bool False if the varint is cut short by end or longer than 10 bytes.
+ */
+inline bool readVarint(const char *&position, const char *end, uint64_t &value)
+{
+    value = 0;
+    for (unsigned shift = 0; shift < 64 && position < end; shift += 7)
+    {
+        uint8_t byte = static_cast<uint8_t>(*position++);
+        value |= uint64_t(byte & 0x7f) << shift;
+        if ((byte & 0x80) == 0)
+            return true;
+    }
+    return false;
+}
+
+/**
+ * @brief A field of a message: its number, its wire type, and its value or bytes.
+ */
+struct proto_field_t {
+    uint32_t number = 0;
+    WireType wire = WireType::Varint;
+    uint64_t value = 0;     ///< Varint and fixed values.
+    std::string_view bytes; ///< Length-delimited values.
+};
+
+/**
+ * @brief Iterates over the fields of an encoded message, without copying it.
+ */
+class ProtoDecoder
+{
+private:
+    const char *position_;
+    const char *end_;
+
+public:
+    explicit ProtoDecoder(std::string_view message) : position_(message.data()), end_(message.data() + message.size()) {}
+
+    /**
+     * @brief Where the next field starts.
+     */
+    const char *position() const { return position_; }
+
+    /**
+     * @brief Decode the next field.
+     *
+     * @return bool False at the end of the message, or at a malformed or unsupported field.
+     */
+    bool next(proto_field_t &field)
+    {
+        uint64_t tag;
+        if (position_ == end_ || !readVarint(position_, end_, tag))
+            return false;
+        field.number = static_cast<uint32_t>(tag >> 3);
+        field.wire = static_cast<WireType>(tag & 7);
+        switch (field.wire)
+        {
+        case WireType::Varint:
+            return readVarint(position_, end_, field.value);
+        case WireType::Fixed64:
+        case WireType::Fixed32:
+        {
+            size_t size = field.wire == WireType::Fixed64 ? 8 : 4;
+            if (static_cast<size_t>(end_ - position_) < size)
+                return false;
+            field.value = 0;
+            for (size_t i = 0; i < size; ++i)
+                field.value |= uint64_t(static_cast<uint8_t>(position_[i])) << (8 * i);
+            position_ += size;
+            return true;
+        }
+        case WireType::Bytes:
+        {
+            uint64_t size;
+            if (!readVarint(position_, end_, size) || size > static_cast<uint64_t>(end_ - position_))
+                return false;
+            field.bytes = std::string_view(position_, size);
+            position_ += size;
+            return true;
+        }
+        default:
+            return false; // Groups are deprecated and never used by traces.
+        }
+    }
+};
+
+/**
+ * @brief Uuid of the track of a process.
+ */
+inline uint64_t processUuid(uint32_t pid)
+{
+    return (uint64_t(pid) << 32) | 0x8000'0000u | 1;
+}
+
+/**
+ * @brief Uuid of the track of a thread, or of a category in the category view.
+ */
+inline uint64_t threadUuid(uint32_t pid, uint32_t tid)
+{
+    // splitmix64 of both ids, kept apart from the process uuids by its low bit.
+    uint64_t x = (uint64_t(pid) << 32 | tid) + 0x9e3779b97f4a7c15ull;
+    x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ull;
+    x = (x ^ (x >> 27)) * 0x94d049bb133111ebull;
+    return (x ^ (x >> 31)) & ~uint64_t(1);
+}
+
+/**
+ * @brief Uuid of the track of a counter of a process.
+ */
+inline uint64_t counterUuid(uint32_t pid, std::string_view name)
+{
+    uint64_t hash = 0xcbf29ce484222325ull; // FNV-1a, the same in every build.
+    for (char c : name)
+        hash = (hash ^ static_cast<uint8_t>(c)) * 0x100000001b3ull;
+    return threadUuid(pid, static_cast<uint32_t>(hash ^ (hash >> 32))) ^ (hash & 0xffff'ffff'0000'0000ull);
+}
+
+constexpr uint64_t kAsyncUuidMask = 0x5a17'0000'0000'0001ull;
+
+/**
+ * @brief Uuid of the track of an async span id. Readers recover the id with asyncId.
+ */
+inline uint64_t asyncUuid(uint64_t id) { return id ^ kAsyncUuidMask; }
+inline uint64_t asyncId(uint64_t uuid) { return uuid ^ kAsyncUuidMask; }
+
+/**
+ * @brief An event to encode. Strings only need to live until Encoder::event returns.
+ */
+struct track_event_t {
+    int64_t ts = 0; ///< Nanoseconds since the epoch.
+    EventType type = EventType::Instant;
+    uint64_t track = 0;
+    std::string_view category;
+    std::string_view name;         ///< Left out of slice ends, which end the last slice begun on their track.
+    uint64_t flow = 0;             ///< Flow id the event is a point of, 0 if none.
+    bool terminatesFlow = false;
+    int64_t counter = 0;           ///< Value of counter events.
+    double doubleCounter = 0;
+    bool isDouble = false;         ///< Whether doubleCounter holds the value instead of counter.
+};
+
+/**
+ * @brief Encodes the packets of one sequence.
+ *
+ * Interned ids and described tracks are remembered until reset(), so a sequence must be written
+ * to its output in the order the packets were encoded.
+ */
+class Encoder
+{
+private:
+    uint32_t sequenceId_;
+    uint64_t defaultTrack_; // Track of the events that do not name one, 0 if none.
+    bool started_ = false;
+    int64_t lastTs_ = 0;
+
+    // Interned strings, keyed by views of internedStorage_.
+    std::deque<std::string> internedStorage_;
+    std::unordered_map<std::string_view, uint64_t> categories_, names_, annotationNames_;
+    std::unordered_map<uint64_t, std::string> tracks_; // Described track uuid -> name
+
+    // Scratch buffers, reused from event to event.
+    std::string packet_, event_, interned_, args_, annotation_, message_;
+
+    uint64_t _intern(std::unordered_map<std::string_view, uint64_t> &ids, uint32_t kind, std::string_view text)
+    {
+        auto it = ids.find(text);
+        if (it != ids.end())
+            return it->second;
+        uint64_t iid = ids.size() + 1; // 0 means no string.
+        ids.emplace(internedStorage_.emplace_back(text), iid);
+        message_.clear();
+        putUint(message_, field::kIid, iid);
+        putBytes(message_, field::kInternedName, text);
+        putBytes(interned_, kind, message_);
+        return iid;
+    }
+
+    void _packet(std::string &out)
+    {
+        putUint(packet_, field::kTrustedPacketSequenceId, sequenceId_);
+        putBytes(out, field::kTracePacket, packet_);
+        packet_.clear();
+    }
+
+    // Clears the incremental state and anchors the incremental clock at ts.
+    void _start(std::string &out, int64_t ts)
+    {
+        std::string clock, snapshot;
+        putUint(clock, field::kClockId, kIncrementalClock);
+        putUint(clock, field::kClockTimestamp, static_cast<uint64_t>(ts));
+        putUint(clock, field::kClockIsIncremental, 1);
+        putBytes(snapshot, field::kClocks, clock);
+        clock.clear();
+        putUint(clock, field::kClockId, kRealtimeClock);
+        putUint(clock, field::kClockTimestamp, static_cast<uint64_t>(ts));
+        putBytes(snapshot, field::kClocks, clock);
+        putUint(snapshot, field::kPrimaryTraceClock, kRealtimeClock);
+
+        std::string defaults, trackDefaults;
+        putUint(defaults, field::kDefaultTimestampClockId, kIncrementalClock);
+        if (defaultTrack_ != 0)
+        {
+            putUint(trackDefaults, field::kDefaultTrackUuid, defaultTrack_);
+            putBytes(defaults, field::kTrackEventDefaults, trackDefaults);
+        }
+
+        putBytes(packet_, field::kClockSnapshot, snapshot);
+        putBytes(packet_, field::kTracePacketDefaults, defaults);
+        putUint(packet_, field::kSequenceFlags, kSeqIncrementalStateCleared);
+        _packet(out);
+
+        categories_.clear();
+        names_.clear();
+        annotationNames_.clear();
+        internedStorage_.clear();
+        started_ = true;
+        lastTs_ = ts;
+    }
+
+    // Describes a track unless it already was, under the same name.
+    bool _describe(uint64_t uuid, std::string_view name)
+    {
+        auto it = tracks_.find(uuid);
+        if (it != tracks_.end() && (name.empty() || it->second == name))
+            return false;
+        tracks_[uuid] = name;
+        return true;
+    }
+
+    void _descriptor(std::string &out, std::string_view descriptor)
+    {
+        putBytes(packet_, field::kTrackDescriptor, descriptor);
+        _packet(out);
+    }
+
+public:
+    /**
+     * @param sequenceId Id of the sequence, unique within the trace.
+     * @param defaultTrack Track of the events that leave it out, usually the thread track of the
+     *        thread the sequence belongs to; 0 if every event names its track.
+     */
+    explicit Encoder(uint32_t sequenceId = 1, uint64_t defaultTrack = 0) : sequenceId_(sequenceId), defaultTrack_(defaultTrack) {}
+
+    /**
+     * @brief Start over: the next event clears the incremental state again, and tracks are described again.
+     */
+    void reset()
+    {
+        started_ = false;
+        tracks_.clear();
+        args_.clear();
+        interned_.clear();
+    }
+
+    /**
+     * @brief Describe the track of a process, if not done yet or if its name changed.
+     */
+    uint64_t processTrack(std::string &out, uint32_t pid, std::string_view name)
+    {
+        uint64_t uuid = processUuid(pid);
+        if (!_describe(uuid, name))
+            return uuid;
+        std::string process, descriptor;
+        putUint(process, field::kPid, pid);
+        if (!name.empty())
+            putBytes(process, field::kProcessName, name);
+        putUint(descriptor, field::kUuid, uuid);
+        putBytes(descriptor, field::kProcess, process);
+        _descriptor(out, descriptor);
+        return uuid;
+    }
+
+    /**
+     * @brief Describe the track of a thread, if not done yet or if its name changed.
+     */
+    uint64_t threadTrack(std::string &out, uint32_t pid, uint32_t tid, std::string_view name)
+    {
+        uint64_t uuid = threadUuid(pid, tid);
+        if (!_describe(uuid, name))
+            return uuid;
+        std::string thread, descriptor;
+        putUint(thread, field::kPid, pid);
+        putUint(thread, field::kTid, tid);
+        if (!name.empty())
+            putBytes(thread, field::kThreadName, name);
+        putUint(descriptor, field::kUuid, uuid);
+        putBytes(descriptor, field::kThread, thread);
+        _descriptor(out, descriptor);
+        return uuid;
+    }
+
+    /**
+     * @brief Describe the track of a counter of a process, and the process' track, if not done yet.
+     */
+    uint64_t counterTrack(std::string &out, uint32_t pid, std::string_view name)
+    {
+        uint64_t uuid = counterUuid(pid, name);
+        if (tracks_.count(uuid) > 0)
+            return uuid;
+        uint64_t parent = processTrack(out, pid, {});
+        _describe(uuid, name);
+        std::string descriptor;
+        putUint(descriptor, field::kUuid, uuid);
+        putBytes(descriptor, field::kTrackName, name);
+        putUint(descriptor, field::kParentUuid, parent);
+        putBytes(descriptor, field::kCounter, {});
+        _descriptor(out, descriptor);
+        return uuid;
+    }
+
+    /**
+     * @brief Describe the track of an async span id, if not done yet.
+     */
+    uint64_t asyncTrack(std::string &out, uint64_t id, std::string_view name)
+    {
+        uint64_t uuid = asyncUuid(id);
+        if (tracks_.count(uuid) > 0)
+            return uuid;
+        _describe(uuid, name);
+        std::string descriptor;
+        putUint(descriptor, field::kUuid, uuid);
+        putBytes(descriptor, field::kTrackName, name);
+        _descriptor(out, descriptor);
+        return uuid;
+    }
+
+    /**
+     * @brief Attach an arg to the next event.
+     *
+     * @param key Name of the arg.
+     * @param type Type of the value.
+     * @param value Bits of the int64, double or bool.
+     * @param text Value of string args.
+     */
+    void arg(std::string_view key, ArgType type, uint64_t value, std::string_view text = {})
+    {
+        annotation_.clear();
+        putUint(annotation_, field::kAnnotationNameIid, _intern(annotationNames_, field::kDebugAnnotationNames, key));
+        switch (type)
+        {
+        case ArgType::Int64: putUint(annotation_, field::kIntValue, value); break;
+        case ArgType::Double: putFixed64(annotation_, field::kDoubleValue, value); break;
+        case ArgType::Bool: putUint(annotation_, field::kBoolValue, value != 0); break;
+        default: putBytes(annotation_, field::kStringValue, text); break;
+        }
+        putBytes(args_, field::kDebugAnnotations, annotation_);
+    }
+
+    /**
+     * @brief Append the packet of an event, with the args attached since the previous one.
+     *
+     * @param out Receives the packets.
+     * @param event The event.
+     * @param advanceClock False for events written out of order on purpose, such as the end of a
+     *        complete event. They, and events older than the previous one, carry an absolute
+     *        timestamp and leave the incremental clock alone.
+     */
+    void event(std::string &out, const track_event_t &event, bool advanceClock = true)
+    {
+        if (!started_)
+            _start(out, event.ts);
+
+        putUint(event_, field::kType, static_cast<uint64_t>(event.type));
+        if (event.track != defaultTrack_ || defaultTrack_ == 0)
+            putUint(event_, field::kTrackUuid, event.track);
+        if (!event.category.empty())
+            putUint(event_, field::kCategoryIids, _intern(categories_, field::kEventCategories, event.category));
+        if (!event.name.empty())
+            putUint(event_, field::kNameIid, _intern(names_, field::kEventNames, event.name));
+        if (event.type == EventType::Counter)
+        {
+            if (event.isDouble)
+                putDouble(event_, field::kDoubleCounterValue, event.doubleCounter);
+            else
+                putUint(event_, field::kCounterValue, static_cast<uint64_t>(event.counter));
+        }
+        if (event.flow != 0)
+            putFixed64(event_, event.terminatesFlow ? field::kTerminatingFlowIds : field::kFlowIds, event.flow);
+        event_ += args_;
+
+        if (advanceClock && event.ts >= lastTs_)
+        {
+            putUint(packet_, field::kTimestamp, static_cast<uint64_t>(event.ts - lastTs_));
+            lastTs_ = event.ts;
+        }
+        else
+        {
+            putUint(packet_, field::kTimestamp, static_cast<uint64_t>(event.ts));
+            putUint(packet_, field::kTimestampClockId, kRealtimeClock);
+        }
+        putBytes(packet_, field::kTrackEvent, event_);
+        if (!interned_.empty())
+            putBytes(packet_, field::kInternedData, interned_);
+        putUint(packet_, field::kSequenceFlags, kSeqNeedsIncrementalState);
+        _packet(out);
+
+        event_.clear();
+        args_.clear();
+        interned_.clear();
+    }
+};
+
+/**
+ * @brief Check whether a stream starts like a Perfetto trace: a packet whose first field is well formed.
+ * Leaves the stream at its start.
+ */
+inline bool isPerfettoTrace(std::istream &in)
+{
+    char head[16] = {};
+    in.read(head, sizeof(head));
+    size_t size = static_cast<size_t>(in.gcount());
+    in.clear();
+    in.seekg(0);
+    const char *position = head + 1;
+    uint64_t length, tag;
+    if (size < 3 || head[0] != char((field::kTracePacket << 3) | static_cast<uint8_t>(WireType::Bytes))
+        || !readVarint(position, head + size, length) || length == 0 || !readVarint(position, head + size, tag))
+        return false;
+    // JSON starting with a newline gets here too, but its next characters are not a valid tag.
+    WireType wire = static_cast<WireType>(tag & 7);
+    return (tag >> 3) != 0 && (wire == WireType::Varint || wire == WireType::Fixed64 || wire == WireType::Bytes || wire == WireType::Fixed32);
+}
+
+/**
+ * @brief Reads the packets of a trace one at a time.
+ */
+class PacketReader
+{
+private:
+    static constexpr uint64_t kMaxPacketSize = uint64_t(1) << 30;
+
+    std::istream &in_;
+
+    bool _readVarint(uint64_t &value)
+    {
+        value = 0;
+        for (unsigned shift = 0; shift < 64; shift += 7)
+        {
+            int byte = in_.get();
+            if (byte == std::char_traits<char>::eof())
+                return false;
+            value |= uint64_t(byte & 0x7f) << shift;
+            if ((byte & 0x80) == 0)
+                return true;
+        }
+        return false;
+    }
+
+public:
+    explicit PacketReader(std::istream &in) : in_(in) {}
+
+    /**
+     * @brief Read the next packet, skipping other fields of the trace.
+     *
+     * @return bool False at the end of the stream, or at the first incomplete or malformed packet.
+     */
+    bool next(std::string &packet)
+    {
+        uint64_t tag, size;
+        while (_readVarint(tag))
+        {
+            if (static_cast<WireType>(tag & 7) != WireType::Bytes || !_readVarint(size) || size > kMaxPacketSize)
+                return false;
+            packet.resize(size);
+            in_.read(packet.data(), static_cast<std::streamsize>(size));
+            if (static_cast<uint64_t>(in_.gcount()) != size)
+                return false;
+            if ((tag >> 3) == field::kTracePacket)
+                return true;
+        }
+        return false;
+    }
+};
+
+/**
+ * @brief Copy a packet, replacing its sequence id.
+ *
+ * @param packet The encoded packet.
+ * @param sequenceIds Maps the sequence ids found to the replacements, which are numbered from
+ *        nextSequenceId on first sight.
+ * @param out Receives the packet, as a Trace.packet field.
+ */
+inline void renumberPacket(std::string_view packet, std::unordered_map<uint64_t, uint32_t> &sequenceIds, uint32_t &nextSequenceId, std::string &out)
+{
+    std::string copy;
+    copy.reserve(packet.size() + 4);
+    ProtoDecoder decoder(packet);
+    proto_field_t field;
+    const char *fieldStart = packet.data();
+    while (decoder.next(field))
+    {
+        if (field.number == field::kTrustedPacketSequenceId && field.wire == WireType::Varint)
+        {
+            auto [it, inserted] = sequenceIds.try_emplace(field.value, nextSequenceId);
+            if (inserted)
+                ++nextSequenceId;
+            putUint(copy, field::kTrustedPacketSequenceId, it->second);
+        }
+        else
+            copy.append(fieldStart, decoder.position());
+        fieldStart = decoder.position();
+    }
+    putBytes(out, field::kTracePacket, copy);
+}
+
+/**
+ * @brief What a reader knows of a track.
+ */
+struct track_info_t {
+    enum class Kind : uint8_t {
+        Thread,
+        Process,
+        Counter,
+        Other ///< Async span tracks, and tracks of other writers this reader does not know about.
+    };
+
+    Kind kind = Kind::Other;
+    uint32_t pid = 0;
+    uint32_t tid = 0;
+    std::string name;   ///< Track name, or process or thread name.
+    uint64_t parent = 0;
+    std::vector<std::pair<std::string, std::string>> open; // Category and name of the slices begun and not ended yet.
+};
+
+/**
+ * @brief An arg of a decoded event.
+ */
+struct decoded_arg_t {
+    std::string_view key;
+    ArgType type;
+    uint64_t value;        ///< Bits of the int64, double or bool.
+    std::string_view text; ///< Value of string args.
+};
+
+/**
+ * @brief A decoded track event. Its strings live until the next call to Reader::next.
+ */
+struct decoded_event_t {
+    int64_t ts = 0; ///< Nanoseconds, on CLOCK_REALTIME when the trace relates its clocks to it.
+    EventType type = EventType::Instant;
+    uint64_t track = 0;
+    std::string_view category;
+    std::string_view name;
+    bool hasCounter = false;
+    bool isDouble = false;
+    int64_t counter = 0;
+    double doubleCounter = 0;
+    std::vector<uint64_t> flows;
+    std::vector<uint64_t> terminatingFlows;
+    std::vector<decoded_arg_t> args;
+};
+
+/**
+ * @brief Sequential reader of the track events of a Perfetto trace.
+ *
+ * Timestamps are converted to the reference clock of the clock snapshots, CLOCK_REALTIME when
+ * they include it. Only the last snapshot of each clock is used, so clocks drifting apart within
+ * a trace are not followed. Unsupported packets are skipped.
+ */
+class Reader
+{
+private:
+    struct clock_t {
+        bool incremental = false;
+        uint64_t multiplier = 1;
+        int64_t value = 0;  // Last value of incremental clocks.
+        int64_t offset = 0; // Reference clock - this clock.
+    };
+
+    struct sequence_t {
+        std::unordered_map<uint64_t, std::string> categories, names, annotationNames;
+        std::unordered_map<uint32_t, clock_t> clocks; // Sequence-scoped clocks.
+        uint32_t defaultClock = 0;
+        uint64_t defaultTrack = 0;
+        uint32_t pid = 0; // Of the first process or thread described on the sequence.
+    };
+
+    PacketReader packets_;
+    std::string packet_;
+    std::unordered_map<uint32_t, sequence_t> sequences_;
+    std::unordered_map<uint32_t, int64_t> offsets_; // Global clock -> reference clock - that clock.
+    std::unordered_map<uint64_t, track_info_t> tracks_;
+    std::string endedCategory_, endedName_; // Of the slice ended by the last event.
+    uint32_t lastPid_ = 0;
+
+    static void _interned(std::string_view data, std::unordered_map<uint64_t, std::string> &strings)
+    {
+        ProtoDecoder decoder(data);
+        proto_field_t field;
+        uint64_t iid = 0;
+        std::string_view name;
+        while (decoder.next(field))
+        {
+            if (field.number == field::kIid)
+                iid = field.value;
+            else if (field.number == field::kInternedName)
+                name = field.bytes;
+        }
+        strings[iid] = std::string(name);
+    }
+
+    void _clockSnapshot(std::string_view data, sequence_t &sequence)
+    {
+        struct snapshot_clock_t {
+            uint32_t id = 0;
+            int64_t ts = 0;
+            bool incremental = false;
+            uint64_t multiplier = 1;
+        };
+        std::vector<snapshot_clock_t> clocks;
+        uint32_t primary = 0;
+        ProtoDecoder decoder(data);
+        proto_field_t field;
+        while (decoder.next(field))
+        {
+            if (field.number == field::kPrimaryTraceClock)
+                primary = static_cast<uint32_t>(field.value);
+            if (field.number != field::kClocks || field.wire != WireType::Bytes)
+                continue;
+            snapshot_clock_t clock;
+            ProtoDecoder clockDecoder(field.bytes);
+            proto_field_t clockField;
+            while (clockDecoder.next(clockField))
+            {
+                if (clockField.number == field::kClockId)
+                    clock.id = static_cast<uint32_t>(clockField.value);
+                else if (clockField.number == field::kClockTimestamp)
+                    clock.ts = static_cast<int64_t>(clockField.value);
+                else if (clockField.number == field::kClockIsIncremental)
+                    clock.incremental = clockField.value != 0;
+                else if (clockField.number == field::kClockUnitMultiplierNs)
+                    clock.multiplier = std::max<uint64_t>(1, clockField.value);
+            }
+            clocks.push_back(clock);
+        }
+
+        // The reference is CLOCK_REALTIME, else the primary clock, else the first global clock.
+        auto find = [&](auto matches) -> const snapshot_clock_t * {
+            auto it = std::find_if(clocks.begin(), clocks.end(), matches);
+            return it != clocks.end() ? &*it : nullptr;
+        };
+        const snapshot_clock_t *reference = find([](const snapshot_clock_t &clock) { return clock.id == kRealtimeClock; });
+        if (reference == nullptr && primary != 0)
+            reference = find([&](const snapshot_clock_t &clock) { return clock.id == primary; });
+        if (reference == nullptr)
+            reference = find([](const snapshot_clock_t &clock) { return clock.id < kIncrementalClock; });
+        if (reference == nullptr)
+            return;
+        int64_t referenceNs = reference->ts * static_cast<int64_t>(reference->multiplier);
+        for (const snapshot_clock_t &clock : clocks)
+        {
+            int64_t ns = clock.ts * static_cast<int64_t>(clock.multiplier);
+            if (clock.id < kIncrementalClock)
+                offsets_[clock.id] = referenceNs - ns;
+            else
+                sequence.clocks[clock.id] = {clock.incremental, clock.multiplier, ns, referenceNs - ns};
+        }
+    }
+
+    void _defaults(std::string_view data, sequence_t &sequence)
+    {
+        ProtoDecoder decoder(data);
+        proto_field_t field;
+        while (decoder.next(field))
+        {
+            if (field.number == field::kDefaultTimestampClockId)
+                sequence.defaultClock = static_cast<uint32_t>(field.value);
+            else if (field.number == field::kTrackEventDefaults && field.wire == WireType::Bytes)
+            {
+                ProtoDecoder trackDecoder(field.bytes);
+                proto_field_t trackField;
+                while (trackDecoder.next(trackField))
+                    if (trackField.number == field::kDefaultTrackUuid)
+                        sequence.defaultTrack = trackField.value;
+            }
+        }
+    }
+
+    void _descriptor(std::string_view data, sequence_t &sequence)
+    {
+        uint64_t uuid = 0;
+        track_info_t described;
+        ProtoDecoder decoder(data);
+        proto_field_t field;
+        while (decoder.next(field))
+        {
+            if (field.number == field::kUuid)
+                uuid = field.value;
+            else if (field.number == field::kTrackName && field.wire == WireType::Bytes)
+                described.name = std::string(field.bytes);
+            else if (field.number == field::kParentUuid)
+                described.parent = field.value;
+            else if (field.number == field::kCounter)
+                described.kind = track_info_t::Kind::Counter;
+            else if ((field.number == field::kProcess || field.number == field::kThread) && field.wire == WireType::Bytes)
+            {
+                bool thread = field.number == field::kThread;
+                described.kind = thread ? track_info_t::Kind::Thread : track_info_t::Kind::Process;
+                ProtoDecoder inner(field.bytes);
+                proto_field_t innerField;
+                while (inner.next(innerField))
+                {
+                    if (innerField.number == field::kPid)
+                        described.pid = static_cast<uint32_t>(innerField.value);
+                    else if (thread && innerField.number == field::kTid)
+                        described.tid = static_cast<uint32_t>(innerField.value);
+                    else if (innerField.number == (thread ? field::kThreadName : field::kProcessName) && innerField.wire == WireType::Bytes)
+                        described.name = std::string(innerField.bytes);
+                }
+                if (sequence.pid == 0)
+                    sequence.pid = described.pid;
+            }
+        }
+        if (described.kind == track_info_t::Kind::Counter)
+        {
+            auto parent = tracks_.find(described.parent);
+            described.pid = parent != tracks_.end() ? parent->second.pid : sequence.pid;
+        }
+        track_info_t &track = tracks_[uuid];
+        if (track.name.empty() || !described.name.empty())
+            track.name = std::move(described.name);
+        track.kind = described.kind;
+        track.pid = described.pid;
+        track.tid = described.tid;
+        track.parent = described.parent;
+    }
+
+    int64_t _timestamp(uint64_t ts, uint32_t clockId, sequence_t &sequence)
+    {
+        if (clockId >= kIncrementalClock)
+        {
+            auto it = sequence.clocks.find(clockId);
+            if (it == sequence.clocks.end())
+                return static_cast<int64_t>(ts);
+            clock_t &clock = it->second;
+            int64_t ns = static_cast<int64_t>(ts * clock.multiplier);
+            if (clock.incremental)
+                ns = clock.value += ns;
+            return ns + clock.offset;
+        }
+        auto it = offsets_.find(clockId);
+        return static_cast<int64_t>(ts) + (it != offsets_.end() ? it->second : 0);
+    }
+
+    static std::string_view _lookup(const std::unordered_map<uint64_t, std::string> &strings, uint64_t iid)
+    {
+        auto it = strings.find(iid);
+        return it != strings.end() ? std::string_view(it->second) : std::string_view();
+    }
+
+    void _annotation(std::string_view data, const sequence_t &sequence, decoded_event_t &event)
+    {
+        decoded_arg_t arg{{}, ArgType::String, 0, {}};
+        bool hasValue = false;
+        ProtoDecoder decoder(data);
+        proto_field_t field;
+        while (decoder.next(field))
+        {
+            switch (field.number)
+            {
+            case field::kAnnotationNameIid: arg.key = _lookup(sequence.annotationNames, field.value); break;
+            case field::kAnnotationName: arg.key = field.bytes; break;
+            case field::kBoolValue: arg.type = ArgType::Bool; arg.value = field.value != 0; hasValue = true; break;
+            case field::kUintValue:
+            case field::kIntValue: arg.type = ArgType::Int64; arg.value = field.value; hasValue = true; break;
+            case field::kDoubleValue: arg.type = ArgType::Double; arg.value = field.value; hasValue = true; break;
+            case field::kStringValue:
+            case field::kLegacyJsonValue: arg.type = ArgType::String; arg.text = field.bytes; hasValue = true; break;
+            default: break; // Nested values are not supported.
+            }
+        }
+        if (hasValue)
+            event.args.push_back(arg);
+    }
+
+    void _trackEvent(std::string_view data, sequence_t &sequence, decoded_event_t &event)
+    {
+        event.type = EventType::Instant;
+        event.track = sequence.defaultTrack;
+        event.category = {};
+        event.name = {};
+        event.hasCounter = false;
+        event.isDouble = false;
+        event.flows.clear();
+        event.terminatingFlows.clear();
+        event.args.clear();
+
+        ProtoDecoder decoder(data);
+        proto_field_t field;
+        while (decoder.next(field))
+        {
+            switch (field.number)
+            {
+            case field::kType: event.type = static_cast<EventType>(field.value); break;
+            case field::kTrackUuid: event.track = field.value; break;
+            case field::kCategoryIids:
+                if (field.wire == WireType::Varint)
+                    event.category = _lookup(sequence.categories, field.value);
+                else
+                {
+                    // Packed; only the first category is kept.
+                    const char *position = field.bytes.data();
+                    uint64_t iid;
+                    if (readVarint(position, field.bytes.data() + field.bytes.size(), iid))
+                        event.category = _lookup(sequence.categories, iid);
+                }
+                break;
+            case field::kCategories: if (event.category.empty()) event.category = field.bytes; break;
+            case field::kNameIid: event.name = _lookup(sequence.names, field.value); break;
+            case field::kName: event.name = field.bytes; break;
+            case field::kCounterValue: event.hasCounter = true; event.counter = static_cast<int64_t>(field.value); break;
+            case field::kDoubleCounterValue:
+                event.hasCounter = event.isDouble = true;
+                std::memcpy(&event.doubleCounter, &field.value, sizeof(event.doubleCounter));
+                break;
+            case field::kFlowIds:
+            case field::kFlowIdsOld: event.flows.push_back(field.value); break;
+            case field::kTerminatingFlowIds:
+            case field::kTerminatingFlowIdsOld: event.terminatingFlows.push_back(field.value); break;
+            case field::kDebugAnnotations: _annotation(field.bytes, sequence, event); break;
+            default: break;
+            }
+        }
+
+        // Slice ends usually leave out their name, which is the last one begun on the track.
+        track_info_t &track = tracks_[event.track];
+        if (event.type == EventType::SliceBegin)
+            track.open.emplace_back(std::string(event.category), std::string(event.name));
+        else if (event.type == EventType::SliceEnd && !track.open.empty())
+        {
+            endedCategory_ = std::move(track.open.back().first);
+            endedName_ = std::move(track.open.back().second);
+            track.open.pop_back();
+            if (event.category.empty())
+                event.category = endedCategory_;
+            if (event.name.empty())
+                event.name = endedName_;
+        }
+    }
+
+public:
+    explicit Reader(std::istream &in) : packets_(in) {}
+
+    /**
+     * @brief Tracks described so far, by uuid.
+     */
+    const std::unordered_map<uint64_t, track_info_t> &tracks() const { return tracks_; }
+
+    /**
+     * @brief Pid of the first process or thread described on the sequence of the last event.
+     */
+    uint32_t sequencePid() const { return lastPid_; }
+
+    /**
+     * @brief Read up to the next track event, absorbing the packets before it.
+     *
+     * @return bool False at the end of the trace or at the first incomplete packet.
+     */
+    bool next(decoded_event_t &event)
+    {
+        while (packets_.next(packet_))
+        {
+            uint64_t ts = 0;
+            bool hasTimestamp = false;
+            uint32_t clockId = 0, sequenceId = 0, flags = 0;
+            std::string_view trackEvent, interned, snapshot, defaults, descriptor;
+            ProtoDecoder decoder(packet_);
+            proto_field_t field;
+            while (decoder.next(field))
+            {
+                switch (field.number)
+                {
+                case field::kTimestamp: ts = field.value; hasTimestamp = true; break;
+                case field::kTimestampClockId: clockId = static_cast<uint32_t>(field.value); break;
+                case field::kTrustedPacketSequenceId: sequenceId = static_cast<uint32_t>(field.value); break;
+                case field::kSequenceFlags: flags = static_cast<uint32_t>(field.value); break;
+                case field::kIncrementalStateCleared: if (field.value != 0) flags |= kSeqIncrementalStateCleared; break;
+                case field::kTrackEvent: trackEvent = field.bytes; break;
+                case field::kInternedData: interned = field.bytes; break;
+                case field::kClockSnapshot: snapshot = field.bytes; break;
+                case field::kTracePacketDefaults: defaults = field.bytes; break;
+                case field::kTrackDescriptor: descriptor = field.bytes; break;
+                default: break;
+                }
+            }
+
+            sequence_t &sequence = sequences_[sequenceId];
+            if (flags & kSeqIncrementalStateCleared)
+            {
+                sequence.categories.clear();
+                sequence.names.clear();
+                sequence.annotationNames.clear();
+                sequence.defaultClock = 0;
+                sequence.defaultTrack = 0;
+            }
+            if (!defaults.empty())
+                _defaults(defaults, sequence);
+            if (!snapshot.empty())
+                _clockSnapshot(snapshot, sequence);
+            if (!descriptor.empty())
+                _descriptor(descriptor, sequence);
+            if (!interned.empty())
+            {
+                ProtoDecoder internedDecoder(interned);
+                while (internedDecoder.next(field))
+                {
+                    if (field.number == field::kEventCategories)
+                        _interned(field.bytes, sequence.categories);
+                    else if (field.number == field::kEventNames)
+                        _interned(field.bytes, sequence.names);
+                    else if (field.number == field::kDebugAnnotationNames)
+                        _interned(field.bytes, sequence.annotationNames);
+                }
+            }
+            if (trackEvent.data() == nullptr)
+                continue;
+
+            if (clockId == 0)
+                clockId = sequence.defaultClock != 0 ? sequence.defaultClock : kBoottimeClock;
+            event.ts = hasTimestamp ? _timestamp(ts, clockId, sequence) : 0;
+            _trackEvent(trackEvent, sequence, event);
+            lastPid_ = sequence.pid;
+            return true;
+        }
+        return false;
+    }
+};
+
+} // namespace perfetto_format
@@ -1,9 +1,41 @@
 #include <pybind11/pybind11.h>
 #include <pybind11/stl.h>
+#include <pybind11/chrono.h>
+#include <pybind11/numpy.h>
 #include "timer.h"
 
 namespace py = pybind11;
 
+namespace {
+
+// Python side of a span_handle_t. Usable as a context manager and as a decorator.
+struct PySpan {
+    Timer *timer;
+    span_handle_t handle;
+};
+
+// Structured dtype matching raw_event_t, so taken events are exposed without conversion.
+py::dtype eventDtype()
+{
+    py::list names, formats, offsets;
+    auto field = [&](const char *name, const char *format, size_t offset) {
+        names.append(name);
+        formats.append(format);
+        offsets.append(offset);
+    };
+    field("ts", "<i8", offsetof(raw_event_t, ts));
+    field("value", "<u8", offsetof(raw_event_t, value));
+    field("cat", "<u4", offsetof(raw_event_t, cat));
+    field("name", "<u4", offsetof(raw_event_t, name));
+    field("args", "<u4", offsetof(raw_event_t, args));
+    field("thread", "<u2", offsetof(raw_event_t, thread));
+    field("argCount", "u1", offsetof(raw_event_t, argCount));
+    field("ph", "S1", offsetof(raw_event_t, ph));
+    return py::dtype(names, formats, offsets, sizeof(raw_event_t));
+}
+
+} // namespace
+
 PYBIND11_MODULE(timer_python_module, m) {
     m.doc() = "Python binding for Timer class";
 
@@ -12,17 +44,142 @@ PYBIND11_MODULE(timer_python_module, m) {
         .value("Chrome", TimerOperation::Chrome)
         .value("Firefox", TimerOperation::Firefox)
         .value("CSV", TimerOperation::CSV)
+        .value("Binary", TimerOperation::Binary)
+        .value("Stats", TimerOperation::Stats)
+        .value("Perfetto", TimerOperation::Perfetto)
+        .export_values();
+
+    py::enum_<ClockSyncPoint>(m, "ClockSyncPoint")
+        .value("Send", ClockSyncPoint::Send)
+        .value("Receive", ClockSyncPoint::Receive)
+        .export_values();
+
+    py::enum_<TrackLayout>(m, "TrackLayout")
+        .value("Threads", TrackLayout::Threads)
+        .value("Categories", TrackLayout::Categories)
+        .export_values();
+
+    py::enum_<FlowPoint>(m, "FlowPoint")
+        .value("Start", FlowPoint::Start)
+        .value("Step", FlowPoint::Step)
+        .value("End", FlowPoint::End)
+        .export_values();
+
+    py::enum_<PerfCounter>(m, "PerfCounter")
+        .value("Cycles", PerfCounter::Cycles)
+        .value("Instructions", PerfCounter::Instructions)
+        .value("CacheMisses", PerfCounter::CacheMisses)
+        .value("BranchMisses", PerfCounter::BranchMisses)
+        .value("ContextSwitches", PerfCounter::ContextSwitches)
+        .value("TaskClock", PerfCounter::TaskClock)
+        .value("PageFaults", PerfCounter::PageFaults)
         .export_values();
 
+    py::class_<sampling_policy_t>(m, "SamplingPolicy")
+        .def_static("all", &sampling_policy_t::all)
+        .def_static("oneInN", &sampling_policy_t::oneInN, py::arg("every"))
+        .def_static("withProbability", &sampling_policy_t::withProbability, py::arg("probability"))
+        .def_static("rateLimit", &sampling_policy_t::rateLimit, py::arg("eventsPerSecond"), py::arg("burst") = 1.0)
+        .def_static("longerThan", &sampling_policy_t::longerThan, py::arg("minDuration"));
+
+    py::class_<api_profile_t>(m, "ApiProfile")
+        .def_readonly("api", &api_profile_t::api)
+        .def_readonly("calls", &api_profile_t::calls)
+        .def_readonly("sampled", &api_profile_t::sampled)
+        .def_readonly("totalNanos", &api_profile_t::totalNanos)
+        .def_readonly("p50Nanos", &api_profile_t::p50Nanos)
+        .def_readonly("p99Nanos", &api_profile_t::p99Nanos);
+
+    py::class_<PySpan>(m, "Span")
+        .def("start", [](const PySpan &span) { span.timer->start(span.handle); }, py::call_guard<py::gil_scoped_release>())
+        .def("stop", [](const PySpan &span) { span.timer->stop(span.handle); }, py::call_guard<py::gil_scoped_release>())
+        .def("__enter__", [](const PySpan &span) { span.timer->start(span.handle); }, py::call_guard<py::gil_scoped_release>())
+        .def("__exit__", [](const PySpan &span, py::args) { span.timer->stop(span.handle); }, py::call_guard<py::gil_scoped_release>())
+        .def("__call__", [](const PySpan &span, py::function function) {
+            py::cpp_function wrapper([span, function](py::args args, py::kwargs kwargs) {
+                {
+                    py::gil_scoped_release release;
+                    span.timer->start(span.handle);
+                }
+                // Python objects are only touched while holding the GIL, the timer only without it.
+                py::object result;
+                try {
+                    result = function(*args, **kwargs);
+                } catch (...) {
+                    {
+                        py::gil_scoped_release release;
+                        span.timer->stop(span.handle);
+                    }
+                    throw;
+                }
+                {
+                    py::gil_scoped_release release;
+                    span.timer->stop(span.handle);
+                }
+                return result;
+            });
+            return py::module_::import("functools").attr("wraps")(function)(wrapper);
+        });
+
     py::class_<Timer>(m, "Timer")
         .def(py::init<const std::string &, TimerOperation>(), py::arg("outputPath"), py::arg("operation") = TimerOperation::Chrome)
         .def("setOperation", &Timer::setOperation)
         .def("getOperation", &Timer::getOperation)
-        .def("addCounterEvent", &Timer::addCounterEvent, 
+        .def("addCounterEvent", py::overload_cast<const std::string &, const std::string &, size_t, const std::unordered_map<std::string, std::string> &>(&Timer::addCounterEvent), py::call_guard<py::gil_scoped_release>(),
              py::arg("event_category"), py::arg("event_name"), py::arg("value"), py::arg("args") = std::unordered_map<std::string, std::string>{})
-        .def("start", &Timer::start, 
+        .def("start", py::overload_cast<const std::string &, const std::string &, const std::unordered_map<std::string, std::string> &, bool>(&Timer::start),
+             py::call_guard<py::gil_scoped_release>(),
              py::arg("event_category"), py::arg("event_name"), py::arg("args") = std::unordered_map<std::string, std::string>{}, py::arg("measureMemory") = true)
-        .def("stop", &Timer::stop, 
+        .def("stop", py::overload_cast<const std::string &, const std::string &, const std::unordered_map<std::string, std::string> &, bool>(&Timer::stop),
+             py::call_guard<py::gil_scoped_release>(),
              py::arg("event_category"), py::arg("event_name"), py::arg("args") = std::unordered_map<std::string, std::string>{}, py::arg("measureMemory") = true)
+        .def("span", [](Timer &timer, const std::string &event_category, const std::string &event_name) {
+            return PySpan{&timer, timer.handle(event_category, event_name)};
+        }, py::keep_alive<0, 1>(), py::arg("event_category"), py::arg("event_name"))
+        .def("takeEvents", [](Timer &timer) {
+            auto events = std::make_unique<std::vector<raw_event_t>>();
+            std::vector<std::string> strings;
+            {
+                py::gil_scoped_release release;
+                timer.takeEvents(*events, strings);
+            }
+            // The array is a view of the vector, which the capsule frees with the array.
+            std::vector<py::ssize_t> shape{static_cast<py::ssize_t>(events->size())};
+            std::vector<py::ssize_t> strides{static_cast<py::ssize_t>(sizeof(raw_event_t))};
+            const raw_event_t *data = events->data();
+            py::capsule owner(events.get(), [](void *vector) { delete static_cast<std::vector<raw_event_t> *>(vector); });
+            events.release();
+            py::array array(eventDtype(), shape, strides, data, owner);
+            return py::make_tuple(array, strings);
+        })
+        .def("enableStreaming", py::overload_cast<size_t, std::chrono::milliseconds>(&Timer::enableStreaming),
+             py::arg("highWaterMarkBytes") = 4 << 20, py::arg("flushInterval") = std::chrono::milliseconds(100))
+        .def("enableMemorySampler", &Timer::enableMemorySampler, py::arg("interval") = std::chrono::milliseconds(10))
+        .def("enablePerfCounters", &Timer::enablePerfCounters,
+             py::arg("counters") = std::vector<PerfCounter>{PerfCounter::Cycles, PerfCounter::Instructions, PerfCounter::CacheMisses,
+                                                            PerfCounter::BranchMisses, PerfCounter::ContextSwitches})
+        .def("enableSelfProfiling", &Timer::enableSelfProfiling, py::arg("sampleEvery") = 1)
+        .def("selfProfile", &Timer::selfProfile)
+        .def("setThreadName", &Timer::setThreadName, py::arg("name"))
+        .def("setProcessName", &Timer::setProcessName, py::arg("name"))
+        .def("setTrackLayout", &Timer::setTrackLayout, py::arg("layout"))
+        .def("setSamplingPolicy", py::overload_cast<const std::string &, const sampling_policy_t &>(&Timer::setSamplingPolicy),
+             py::arg("event_category"), py::arg("policy"))
+        .def("setSamplingPolicy", py::overload_cast<const sampling_policy_t &>(&Timer::setSamplingPolicy), py::arg("policy"))
+        .def("threads", [](Timer &timer) {
+            // (tid, name) of every thread, indexed like the "thread" field of takeEvents()
+            py::list threads;
+            for (const thread_info_t &thread : timer.processInfo().threads)
+                threads.append(py::make_tuple(thread.tid, thread.name));
+            return threads;
+        })
+        .def("addClockSyncMarker", &Timer::addClockSyncMarker, py::arg("sync_id"), py::arg("point"))
+        .def_static("newTraceId", &Timer::newTraceId)
+        .def("addFlowEvent", &Timer::addFlowEvent, py::arg("event_category"), py::arg("event_name"), py::arg("id"), py::arg("point"),
+             py::call_guard<py::gil_scoped_release>())
+        .def("startAsync", &Timer::startAsync, py::arg("event_category"), py::arg("event_name"), py::arg("id"),
+             py::arg("args") = std::unordered_map<std::string, std::string>(), py::call_guard<py::gil_scoped_release>())
+        .def("stopAsync", &Timer::stopAsync, py::arg("event_category"), py::arg("event_name"), py::arg("id"),
+             py::arg("args") = std::unordered_map<std::string, std::string>(), py::call_guard<py::gil_scoped_release>())
         .def("dumpLogs", &Timer::dumpLogs);
 }
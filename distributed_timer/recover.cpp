@@ -0,0 +1,73 @@
+#include <iostream>
+#include <fstream>
+#include <iterator>
+#include <vector>
+#include <algorithm>
+#include <nlohmann/json.hpp>
+#include "chrome_format.h"
+#include "ring_format.h"
+
+/**
+ * Turns the file of a Timer::enableMappedBuffer() ring into a Chrome trace, e.g. after the
+ * recording process crashed before dumpLogs().
+ */
+int main(int argc, char *argv[])
+{
+    if (argc != 3)
+    {
+        std::cerr << "Usage: " << argv[0] << " <mapped buffer file> <output file path>" << std::endl;
+        return 1;
+    }
+
+    std::ifstream input(argv[1], std::ios::binary);
+    if (!input)
+    {
+        std::cerr << "Failed to open " << argv[1] << std::endl;
+        return 1;
+    }
+    std::vector<char> data((std::istreambuf_iterator<char>(input)), std::istreambuf_iterator<char>());
+
+    ring_format::ring_contents_t contents;
+    std::string error;
+    if (!ring_format::readRing(data.data(), data.size(), contents, true, error))
+    {
+        std::cerr << argv[1] << ": " << error << std::endl;
+        return 1;
+    }
+
+    // Blocks come out in claim order, which interleaves the threads.
+    std::stable_sort(contents.events.begin(), contents.events.end(),
+                     [](const raw_event_t &a, const raw_event_t &b) { return a.ts < b.ts; });
+
+    std::ofstream output(argv[2]);
+    if (!output)
+    {
+        std::cerr << "Failed to open output file: " << argv[2] << std::endl;
+        return 1;
+    }
+    bool first = true;
+    output << "[\n";
+    for (const raw_event_t &event : contents.events)
+    {
+        nlohmann::json jEvent = chrome_format::toJson(event, contents.slots.data(), contents.strings, contents.process);
+        output << (first ? "" : ",\n") << chrome_format::dump(jEvent, event.ts);
+        first = false;
+    }
+    for (const auto &entry : chrome_format::metadataEvents(contents.process))
+    {
+        output << (first ? "" : ",\n") << entry.dump();
+        first = false;
+    }
+    output << "\n]\n";
+
+    std::cout << "Recovered " << contents.events.size() << " events of " << contents.process.name << " (pid " << contents.process.pid
+              << ", " << contents.process.threads.size() << " threads) into " << argv[2] << std::endl;
+    if (contents.claimedBlocks > contents.blockCount)
+        std::cout << "The buffer wrapped around: the oldest " << contents.claimedBlocks - contents.blockCount
+                  << " of " << contents.claimedBlocks << " blocks were overwritten." << std::endl;
+    if (contents.tornRecords > 0)
+        std::cout << contents.tornRecords << " records were cut short and left out." << std::endl;
+    if (contents.missingStrings > 0)
+        std::cout << contents.missingStrings << " names were not stored in the buffer and are shown as placeholders." << std::endl;
+    return 0;
+}
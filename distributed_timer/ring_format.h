@@ -0,0 +1,413 @@
+#pragma once
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <string_view>
+#include <vector>
+#include "chrome_format.h"
+#include "trace_event.h"
+
+#ifndef _WIN32
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
+
+/**
+ * @brief Layout of the memory-mapped file written by Timer::enableMappedBuffer.
+ *
+ * The file is created at its final size and mapped shared, so whatever the process wrote is kept by
+ * the OS when it crashes or is killed. It holds, at fixed offsets:
+ * - a file_header_t, padded to kHeaderBytes, with the geometry and the tick to epoch mapping;
+ * - the thread table: maxThreads thread_slot_t, indexed like process_info_t::threads;
+ * - the strings: per interned string, in id order, a `uint32_t size` and its bytes;
+ * - blockCount blocks of blockBytes. Each starts with a block_header_t and holds the records of one
+ *   thread: a raw_event_t (ticks in ts) followed by its arg slots, in recording order.
+ *
+ * Threads claim blocks in turn, so once every block has been claimed the oldest blocks are
+ * overwritten. A record is committed when its block's `used` counter covers it; a record torn by
+ * a crash never is.
+ */
+namespace ring_format {
+
+constexpr char kMagic[8] = {'D', 'T', 'R', 'I', 'N', 'G', '1', '\0'};
+constexpr size_t kHeaderBytes = 4096;
+constexpr size_t kBlockBytes = 32 << 10;
+constexpr size_t kMaxThreads = 1024;
+constexpr size_t kThreadNameBytes = 60;
+constexpr size_t kProcessNameBytes = 64;
+
+struct file_header_t {
+    char magic[8];
+    uint32_t pid;
+    uint32_t blockBytes;
+    uint64_t blockCount;
+    uint64_t threadsOffset;
+    uint64_t maxThreads;
+    uint64_t stringsOffset;
+    uint64_t stringsBytes;
+    uint64_t blocksOffset;
+    int64_t tickOrigin;   ///< A tick count...
+    int64_t epochOrigin;  ///< ...and the epoch nanoseconds it corresponds to.
+    double nanosPerTick;
+    char processName[kProcessNameBytes];
+    std::atomic<uint64_t> claimedBlocks; ///< Blocks claimed since the file was created.
+    std::atomic<uint64_t> stringsUsed;   ///< Bytes of the strings region in use.
+    std::atomic<uint32_t> stringCount;   ///< Strings stored, ids [0, stringCount).
+    std::atomic<uint32_t> threadCount;   ///< Slots of the thread table in use.
+};
+
+struct thread_slot_t {
+    uint32_t tid;
+    char name[kThreadNameBytes]; ///< Null terminated, truncated to fit.
+};
+
+struct block_header_t {
+    std::atomic<uint64_t> sequence; ///< Claim number, 0 for a block never claimed.
+    std::atomic<uint32_t> thread;   ///< Index of the owning thread in the thread table.
+    std::atomic<uint32_t> used;     ///< Committed bytes after the header.
+    std::atomic<uint32_t> active;   ///< Set while a thread writes to the block, so it is not claimed again.
+    uint32_t reserved[3];
+};
+
+static_assert(sizeof(file_header_t) <= kHeaderBytes, "file_header_t must fit in the header page");
+static_assert(sizeof(thread_slot_t) == 64, "thread_slot_t is expected to be 64 bytes");
+static_assert(sizeof(block_header_t) == 32, "block_header_t is expected to be 32 bytes");
+static_assert(std::atomic<uint64_t>::is_always_lock_free && std::atomic<uint32_t>::is_always_lock_free,
+              "atomics shared through a file must be lock-free");
+
+/**
+ * @brief Check whether a buffer starts with the ring magic.
+ */
+inline bool isRing(const char *data, size_t size)
+{
+    return size >= sizeof(kMagic) && std::memcmp(data, kMagic, sizeof(kMagic)) == 0;
+}
+
+/**
+ * @brief Writer side of a ring file: creates, pre-faults and maps it, and hands out blocks.
+ *
+ * Blocks are claimed and released by the recording threads without locks. Strings and threads
+ * must be added by one thread at a time.
+ */
+class MappedRing
+{
+public:
+    MappedRing() = default;
+    MappedRing(const MappedRing &) = delete;
+    MappedRing &operator=(const MappedRing &) = delete;
+
+    ~MappedRing()
+    {
+#ifndef _WIN32
+        if (base_ != nullptr)
+            munmap(base_, size_);
+#endif
+    }
+
+    /**
+     * @brief Create the file at its final size, map it and touch every page so recording never faults.
+     *
+     * @param path Path of the file, replaced if it exists.
+     * @param bytes Size of the file. At least two blocks are always allocated.
+     * @param pid Id of the recording process.
+     * @param processName Name of the recording process.
+     * @param tickOrigin,epochOrigin,nanosPerTick Mapping of the recorded ticks to epoch nanoseconds.
+     * @param error Receives the reason of a failure.
+     * @return bool False if the file could not be created or mapped.
+     */
+    bool open(const std::string &path, size_t bytes, uint32_t pid, const std::string &processName,
+              int64_t tickOrigin, int64_t epochOrigin, double nanosPerTick, std::string &error)
+    {
+#ifdef _WIN32
+        error = "memory-mapped buffers are not supported on Windows";
+        return false;
+#else
+        size_t threadsBytes = kMaxThreads * sizeof(thread_slot_t);
+        size_t stringsBytes = std::max<size_t>(256 << 10, bytes / 16);
+        size_t blocksOffset = kHeaderBytes + threadsBytes + stringsBytes;
+        size_t blockCount = std::max<size_t>(2, bytes > blocksOffset ? (bytes - blocksOffset) / kBlockBytes : 0);
+        size_t size = blocksOffset + blockCount * kBlockBytes;
+
+        int fd = ::open(path.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+        if (fd < 0)
+        {
+            error = std::strerror(errno);
+            return false;
+        }
+        // Reserve the disk space now: a full disk must fail here, not as a SIGBUS while recording.
+        int result = posix_fallocate(fd, 0, static_cast<off_t>(size));
+        void *base = result == 0 ? mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, 0) : MAP_FAILED;
+        if (result == 0 && base == MAP_FAILED)
+            result = errno;
+        ::close(fd);
+        if (result != 0)
+        {
+            error = std::strerror(result);
+            return false;
+        }
+        base_ = static_cast<char *>(base);
+        size_ = size;
+
+        // Populated pages are only readable; writing each one once makes the first records fault-free too.
+        long pageSize = sysconf(_SC_PAGESIZE);
+        for (size_t offset = 0; offset < size_; offset += pageSize)
+            base_[offset] = 0;
+
+        file_header_t *header = new (base_) file_header_t{};
+        header->pid = pid;
+        header->blockBytes = kBlockBytes;
+        header->blockCount = blockCount;
+        header->threadsOffset = kHeaderBytes;
+        header->maxThreads = kMaxThreads;
+        header->stringsOffset = kHeaderBytes + threadsBytes;
+        header->stringsBytes = stringsBytes;
+        header->blocksOffset = blocksOffset;
+        header->tickOrigin = tickOrigin;
+        header->epochOrigin = epochOrigin;
+        header->nanosPerTick = nanosPerTick;
+        std::strncpy(header->processName, processName.c_str(), kProcessNameBytes - 1);
+        for (size_t i = 0; i < blockCount; ++i)
+            new (base_ + blocksOffset + i * kBlockBytes) block_header_t{};
+        std::memcpy(header->magic, kMagic, sizeof(kMagic)); // Last, so a half-created file is never read.
+        return true;
+#endif
+    }
+
+    const char *data() const { return base_; }
+    size_t size() const { return size_; }
+
+    static constexpr size_t payloadBytes() { return kBlockBytes - sizeof(block_header_t); }
+
+    /**
+     * @brief Claim the next block that no thread is writing to, for the thread at index thread.
+     *
+     * @return block_header_t* The block, emptied, or nullptr if every block is being written to.
+     */
+    block_header_t *claim(uint32_t thread)
+    {
+        file_header_t &header = _header();
+        for (size_t attempt = 0; attempt < header.blockCount; ++attempt)
+        {
+            uint64_t sequence = header.claimedBlocks.fetch_add(1, std::memory_order_relaxed) + 1;
+            block_header_t *block = _block((sequence - 1) % header.blockCount);
+            uint32_t idle = 0;
+            if (!block->active.compare_exchange_strong(idle, 1, std::memory_order_acquire))
+                continue;
+            // Emptied before it is renumbered, so a reader never pairs the new sequence with old records.
+            block->used.store(0, std::memory_order_release);
+            block->thread.store(thread, std::memory_order_relaxed);
+            block->sequence.store(sequence, std::memory_order_release);
+            return block;
+        }
+        return nullptr;
+    }
+
+    /**
+     * @brief Hand a block back once its thread moves on to another one.
+     */
+    void release(block_header_t *block) { block->active.store(0, std::memory_order_release); }
+
+    static char *payload(block_header_t *block) { return reinterpret_cast<char *>(block + 1); }
+
+    /**
+     * @brief Append the string of the next id.
+     *
+     * @return bool False once the strings region is full; later ids are then recovered as placeholders.
+     */
+    bool addString(std::string_view str)
+    {
+        file_header_t &header = _header();
+        uint64_t used = header.stringsUsed.load(std::memory_order_relaxed);
+        uint32_t size = static_cast<uint32_t>(str.size());
+        if (used + sizeof(size) + size > header.stringsBytes)
+            return false;
+        char *at = base_ + header.stringsOffset + used;
+        std::memcpy(at, &size, sizeof(size));
+        std::memcpy(at + sizeof(size), str.data(), size);
+        header.stringsUsed.store(used + sizeof(size) + size, std::memory_order_relaxed);
+        header.stringCount.fetch_add(1, std::memory_order_release);
+        return true;
+    }
+
+    /**
+     * @brief Set the OS id and name of the thread at an index of the thread table.
+     */
+    void setThread(size_t index, uint32_t tid, const std::string &name)
+    {
+        file_header_t &header = _header();
+        if (index >= header.maxThreads)
+            return;
+        thread_slot_t *slot = reinterpret_cast<thread_slot_t *>(base_ + header.threadsOffset) + index;
+        slot->tid = tid;
+        std::memset(slot->name, 0, kThreadNameBytes);
+        std::strncpy(slot->name, name.c_str(), kThreadNameBytes - 1);
+        if (header.threadCount.load(std::memory_order_relaxed) <= index)
+            header.threadCount.store(static_cast<uint32_t>(index + 1), std::memory_order_release);
+    }
+
+private:
+    char *base_ = nullptr;
+    size_t size_ = 0;
+
+    file_header_t &_header() { return *reinterpret_cast<file_header_t *>(base_); }
+    block_header_t *_block(size_t index) { return reinterpret_cast<block_header_t *>(base_ + _header().blocksOffset + index * kBlockBytes); }
+};
+
+/**
+ * @brief Everything recovered from a ring.
+ */
+struct ring_contents_t {
+    std::vector<raw_event_t> events;  ///< Committed records, in block order; args index into slots.
+    std::vector<arg_slot_t> slots;
+    std::vector<std::string> strings; ///< Strings by id, with placeholders for ids that were not stored.
+    process_info_t process;
+    uint64_t claimedBlocks = 0;       ///< Blocks claimed over the life of the ring.
+    uint64_t blockCount = 0;
+    uint32_t missingStrings = 0;      ///< Referenced ids the strings region had no room for.
+    uint64_t tornRecords = 0;         ///< Records cut short or pointing outside their block.
+};
+
+/**
+ * @brief How far a reader of a live mapping got in one block, so the next read resumes there.
+ */
+struct block_cursor_t {
+    uint64_t sequence = 0; ///< Claim of the block the offset belongs to.
+    uint32_t offset = 0;   ///< Payload bytes already read.
+};
+
+/**
+ * @brief Read the committed records of a ring, from a file's content or from a live mapping.
+ *
+ * @param data Start of the ring.
+ * @param size Size of the ring in bytes.
+ * @param out Receives the contents. Timestamps are ticks unless epochTimestamps is set.
+ * @param epochTimestamps Whether to convert timestamps to epoch nanoseconds with the header's mapping.
+ * @param error Receives the reason of a failure.
+ * @param cursors Per block, where the previous read stopped; only the records after it are read, and
+ *                the cursors are moved past them. Every committed record is read when null.
+ * @return bool False if data is not a ring or its header is inconsistent with its size.
+ */
+inline bool readRing(const char *data, size_t size, ring_contents_t &out, bool epochTimestamps, std::string &error,
+                     std::vector<block_cursor_t> *cursors = nullptr)
+{
+    if (size < kHeaderBytes || !isRing(data, size))
+    {
+        error = "not a ring buffer file";
+        return false;
+    }
+    const file_header_t &header = *reinterpret_cast<const file_header_t *>(data);
+    if (header.blockBytes != kBlockBytes || header.maxThreads > kMaxThreads ||
+        header.threadsOffset + header.maxThreads * sizeof(thread_slot_t) > size ||
+        header.stringsOffset + header.stringsBytes > size ||
+        header.blocksOffset + header.blockCount * header.blockBytes > size)
+    {
+        error = "ring buffer header does not match the file size";
+        return false;
+    }
+    out.claimedBlocks = header.claimedBlocks.load(std::memory_order_relaxed);
+    out.blockCount = header.blockCount;
+
+    out.process.pid = header.pid;
+    out.process.name.assign(header.processName, strnlen(header.processName, kProcessNameBytes));
+    const thread_slot_t *slots = reinterpret_cast<const thread_slot_t *>(data + header.threadsOffset);
+    uint32_t threadCount = std::min<uint32_t>(header.threadCount.load(std::memory_order_acquire), header.maxThreads);
+    out.process.threads.clear();
+    for (uint32_t i = 0; i < threadCount; ++i)
+        out.process.threads.push_back({slots[i].tid, std::string(slots[i].name, strnlen(slots[i].name, kThreadNameBytes))});
+
+    out.strings.clear();
+    uint32_t stringCount = header.stringCount.load(std::memory_order_acquire);
+    const char *strings = data + header.stringsOffset;
+    for (uint64_t offset = 0; out.strings.size() < stringCount && offset + sizeof(uint32_t) <= header.stringsBytes;)
+    {
+        uint32_t length;
+        std::memcpy(&length, strings + offset, sizeof(length));
+        offset += sizeof(length);
+        if (offset + length > header.stringsBytes)
+            break;
+        out.strings.emplace_back(strings + offset, length);
+        offset += length;
+    }
+
+    // Blocks are read in claim order so each thread's records come out in recording order.
+    auto blockAt = [&](uint64_t index) { return reinterpret_cast<const block_header_t *>(data + header.blocksOffset + index * header.blockBytes); };
+    std::vector<std::pair<uint64_t, uint64_t>> blocks; // Sequence and index.
+    for (uint64_t i = 0; i < header.blockCount; ++i)
+    {
+        uint64_t sequence = blockAt(i)->sequence.load(std::memory_order_acquire);
+        if (sequence != 0)
+            blocks.emplace_back(sequence, i);
+    }
+    std::sort(blocks.begin(), blocks.end());
+    if (cursors != nullptr)
+        cursors->resize(header.blockCount);
+
+    size_t payloadBytes = header.blockBytes - sizeof(block_header_t);
+    uint32_t maxId = 0;
+    for (const auto &[sequence, index] : blocks)
+    {
+        const block_header_t *block = blockAt(index);
+        const char *payload = reinterpret_cast<const char *>(block + 1);
+        uint32_t used = std::min<uint32_t>(block->used.load(std::memory_order_acquire), payloadBytes);
+        // A live block claimed again since its sequence was read holds the new claim's records, read next time.
+        if (block->sequence.load(std::memory_order_acquire) != sequence)
+            continue;
+        uint16_t thread = static_cast<uint16_t>(std::min<uint32_t>(block->thread.load(std::memory_order_relaxed), 0xffff));
+        block_cursor_t *cursor = cursors != nullptr ? &(*cursors)[index] : nullptr;
+        size_t offset = cursor != nullptr && cursor->sequence == sequence ? cursor->offset : 0;
+        size_t consumed = offset;
+        while (offset + sizeof(raw_event_t) <= used)
+        {
+            raw_event_t event;
+            std::memcpy(&event, payload + offset, sizeof(event));
+            offset += sizeof(event);
+            // Arg headers are checked before their payload sizes are trusted.
+            size_t slotCount = 0;
+            bool complete = true;
+            for (uint8_t i = 0; i < event.argCount && complete; ++i)
+            {
+                if (offset + (slotCount + 1) * sizeof(arg_slot_t) > used)
+                {
+                    complete = false;
+                    break;
+                }
+                arg_slot_t argHeader;
+                std::memcpy(&argHeader, payload + offset + slotCount * sizeof(arg_slot_t), sizeof(argHeader));
+                slotCount += chrome_format::argSlots(argHeader);
+                maxId = std::max(maxId, argHeader.header.key);
+            }
+            if (!complete || offset + slotCount * sizeof(arg_slot_t) > used)
+            {
+                ++out.tornRecords;
+                break;
+            }
+            event.args = static_cast<uint32_t>(out.slots.size());
+            event.thread = thread;
+            if (epochTimestamps)
+                event.ts = header.epochOrigin + static_cast<int64_t>((event.ts - header.tickOrigin) * header.nanosPerTick);
+            const arg_slot_t *first = reinterpret_cast<const arg_slot_t *>(payload + offset);
+            out.slots.insert(out.slots.end(), first, first + slotCount);
+            offset += slotCount * sizeof(arg_slot_t);
+            maxId = std::max({maxId, event.cat, event.name});
+            out.events.push_back(event);
+            consumed = offset;
+        }
+        if (cursor != nullptr)
+            *cursor = {sequence, static_cast<uint32_t>(consumed)};
+    }
+
+    // Ids whose string did not fit, or were interned but not yet stored when the process died.
+    if (!out.events.empty() && maxId >= out.strings.size())
+    {
+        out.missingStrings = maxId + 1 - static_cast<uint32_t>(out.strings.size());
+        for (uint32_t id = static_cast<uint32_t>(out.strings.size()); id <= maxId; ++id)
+            out.strings.push_back("<string " + std::to_string(id) + ">");
+    }
+    return true;
+}
+
+} // namespace ring_format
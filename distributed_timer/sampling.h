@@ -0,0 +1,187 @@
+#pragma once
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include "clock.h"
+
+/**
+ * @brief How the spans and counters of a category are sampled. See Timer::setSamplingPolicy.
+ */
+struct sampling_policy_t
+{
+    enum class Mode : uint8_t {
+        All,         ///< Record everything.
+        OneInN,      ///< Record one span or counter in every.
+        Probability, ///< Record each span or counter with probability.
+        RateLimit,   ///< Token bucket: at most eventsPerSecond on average, burst at once.
+        MinDuration, ///< Tail capture: only record spans that last at least minDuration.
+    };
+
+    Mode mode = Mode::All;
+    uint32_t every = 1;
+    double probability = 1;
+    double eventsPerSecond = 0;
+    double burst = 1;
+    std::chrono::nanoseconds minDuration{0};
+
+    static sampling_policy_t all() { return {}; }
+
+    static sampling_policy_t oneInN(uint32_t every)
+    {
+        sampling_policy_t policy;
+        policy.mode = Mode::OneInN;
+        policy.every = std::max<uint32_t>(1, every);
+        return policy;
+    }
+
+    static sampling_policy_t withProbability(double probability)
+    {
+        sampling_policy_t policy;
+        policy.mode = Mode::Probability;
+        policy.probability = std::clamp(probability, 0.0, 1.0);
+        return policy;
+    }
+
+    static sampling_policy_t rateLimit(double eventsPerSecond, double burst = 1)
+    {
+        sampling_policy_t policy;
+        policy.mode = Mode::RateLimit;
+        policy.eventsPerSecond = std::max(0.0, eventsPerSecond);
+        policy.burst = std::max(1.0, burst);
+        return policy;
+    }
+
+    static sampling_policy_t longerThan(std::chrono::nanoseconds minDuration)
+    {
+        sampling_policy_t policy;
+        policy.mode = Mode::MinDuration;
+        policy.minDuration = minDuration;
+        return policy;
+    }
+};
+
+/**
+ * @brief What to do with a span or counter.
+ */
+enum class SamplingDecision : uint8_t {
+    Record,
+    Drop,
+    Defer, ///< Keep the start of the span aside and decide at its stop, on its duration.
+};
+
+/**
+ * @brief Sampling state of one category on one thread.
+ *
+ * Decisions only touch this thread's state: a countdown, a xorshift generator or a token bucket.
+ * Single writer: only the owning thread decides, while any thread may read dropped.
+ */
+class Sampler
+{
+public:
+    Sampler(uint32_t category, const sampling_policy_t &policy, uint64_t seed) : category_(category) { reset(policy, seed); }
+
+    /**
+     * @brief Switch to another policy, restarting its state. Dropped counts are kept.
+     */
+    void reset(const sampling_policy_t &policy, uint64_t seed)
+    {
+        policy_ = policy;
+        sampled_.store(policy.mode != sampling_policy_t::Mode::All, std::memory_order_relaxed);
+        untilSample_ = {0, 0};
+        // splitmix64, so that close seeds still give unrelated sequences; xorshift must not start at 0.
+        seed += 0x9e3779b97f4a7c15ull;
+        seed = (seed ^ (seed >> 30)) * 0xbf58476d1ce4e5b9ull;
+        seed = (seed ^ (seed >> 27)) * 0x94d049bb133111ebull;
+        random_ = (seed ^ (seed >> 31)) | 1;
+        threshold_ = policy.probability >= 1 ? UINT64_MAX : static_cast<uint64_t>(policy.probability * 18446744073709551616.0);
+        tokens_ = policy.burst;
+        lastRefill_ = TraceClock::toEpochNanos(TraceClock::now());
+        minNanos_ = policy.minDuration.count();
+    }
+
+    uint32_t category() const { return category_; }
+
+    /**
+     * @brief Whether the policy drops anything. Safe to call from any thread.
+     */
+    bool sampled() const { return sampled_.load(std::memory_order_relaxed); }
+
+    /**
+     * @brief Decide on a span start or a counter.
+     *
+     * @param atNanos Epoch nanoseconds of the start or counter when deciding after the fact, for rate limits; now if negative.
+     */
+    SamplingDecision decide(bool counter, int64_t atNanos = -1)
+    {
+        switch (policy_.mode)
+        {
+        case sampling_policy_t::Mode::All:
+            return SamplingDecision::Record;
+        case sampling_policy_t::Mode::OneInN:
+            // Spans and counters count separately, so one cannot always take the other's turn.
+            if (untilSample_[counter] > 0)
+            {
+                --untilSample_[counter];
+                return _drop();
+            }
+            untilSample_[counter] = policy_.every - 1;
+            return SamplingDecision::Record;
+        case sampling_policy_t::Mode::Probability:
+            random_ ^= random_ << 13;
+            random_ ^= random_ >> 7;
+            random_ ^= random_ << 17;
+            return random_ < threshold_ ? SamplingDecision::Record : _drop();
+        case sampling_policy_t::Mode::RateLimit:
+        {
+            int64_t now = atNanos >= 0 ? atNanos : TraceClock::toEpochNanos(TraceClock::now());
+            tokens_ = std::min(policy_.burst, tokens_ + std::max<int64_t>(0, now - lastRefill_) * policy_.eventsPerSecond * 1e-9);
+            lastRefill_ = std::max(lastRefill_, now);
+            if (tokens_ < 1)
+                return _drop();
+            tokens_ -= 1;
+            return SamplingDecision::Record;
+        }
+        case sampling_policy_t::Mode::MinDuration:
+            return counter ? SamplingDecision::Record : SamplingDecision::Defer;
+        }
+        return SamplingDecision::Record;
+    }
+
+    /**
+     * @brief Decide on a deferred span at its stop, from its duration in nanoseconds.
+     */
+    bool keep(int64_t durationNanos)
+    {
+        if (durationNanos >= minNanos_)
+            return true;
+        _drop();
+        return false;
+    }
+
+    /**
+     * @brief Spans and counters dropped so far. Safe to call from any thread.
+     */
+    uint64_t dropped() const { return dropped_.load(std::memory_order_relaxed); }
+
+    Sampler *next = nullptr; // Per-thread list, only ever prepended to.
+
+private:
+    uint32_t category_;
+    sampling_policy_t policy_;
+    std::array<uint32_t, 2> untilSample_{}; // Spans, counters.
+    uint64_t random_ = 1;
+    uint64_t threshold_ = UINT64_MAX;
+    double tokens_ = 0;
+    int64_t lastRefill_ = 0;
+    int64_t minNanos_ = 0;
+    std::atomic<uint64_t> dropped_{0};
+    std::atomic<bool> sampled_{false};
+
+    SamplingDecision _drop()
+    {
+        dropped_.store(dropped_.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+        return SamplingDecision::Drop;
+    }
+};
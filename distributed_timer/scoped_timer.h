@@ -0,0 +1,53 @@
+#pragma once
+#include "timer.h"
+
+/**
+ * @brief RAII guard recording a start event on construction and the matching stop event on destruction.
+ *
+ * Category and name must be string literals (or other arrays with static storage duration):
+ * the timer caches their ids by address, so after the first call on a thread a scope costs two
+ * event records and no heap allocation. Prefer the DT_SCOPE macro, which compiles to nothing
+ * when DISTRIBUTED_TIMER_DISABLED is defined.
+ */
+class ScopedTimer
+{
+public:
+    template <size_t CategorySize, size_t NameSize>
+    ScopedTimer(Timer &timer, const char (&event_category)[CategorySize], const char (&event_name)[NameSize])
+        : timer_(timer.getOperation() != TimerOperation::Disabled ? &timer : nullptr), category_(event_category), name_(event_name)
+    {
+        if (timer_ != nullptr)
+            timer_->_startLiteral(category_, name_);
+    }
+
+    ~ScopedTimer()
+    {
+        if (timer_ != nullptr)
+            timer_->_stopLiteral(category_, name_);
+    }
+
+    ScopedTimer(const ScopedTimer &) = delete;
+    ScopedTimer &operator=(const ScopedTimer &) = delete;
+
+private:
+    Timer *timer_; // Null when the timer was disabled at construction.
+    const char *category_;
+    const char *name_;
+};
+
+#define DT_CONCAT_IMPL(a, b) a##b
+#define DT_CONCAT(a, b) DT_CONCAT_IMPL(a, b)
+
+/**
+ * @brief Time the rest of the enclosing scope as an event of `timer`.
+ *
+ * DT_SCOPE(timer, "Category", "Name"); Only string literals are accepted. With
+ * DISTRIBUTED_TIMER_DISABLED defined the macro expands to nothing and none of its
+ * arguments are evaluated.
+ */
+#ifdef DISTRIBUTED_TIMER_DISABLED
+#define DT_SCOPE(timer, event_category, event_name) static_cast<void>(0)
+#else
+#define DT_SCOPE(timer, event_category, event_name) \
+    ScopedTimer DT_CONCAT(dtScope_, __LINE__)((timer), "" event_category, "" event_name)
+#endif
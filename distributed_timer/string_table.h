@@ -0,0 +1,74 @@
+#pragma once
+#include <cstdint>
+#include <deque>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+/**
+ * @brief Thread-safe table that maps strings to dense 32-bit ids.
+ *
+ * Interned strings are never removed, so the ids and the views returned by
+ * snapshot() stay valid for the lifetime of the table.
+ */
+class StringTable
+{
+private:
+    mutable std::mutex mutex_;
+    std::deque<std::string> strings_; // deque keeps element addresses stable on growth
+    std::unordered_map<std::string_view, uint32_t> ids_;
+
+public:
+    /**
+     * @brief Get the id of a string, adding it to the table if needed.
+     *
+     * @param str The string to intern.
+     * @return uint32_t The id of the string.
+     */
+    uint32_t intern(std::string_view str)
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        auto it = ids_.find(str);
+        if (it != ids_.end())
+            return it->second;
+
+        uint32_t id = static_cast<uint32_t>(strings_.size());
+        strings_.emplace_back(str);
+        ids_.emplace(strings_.back(), id);
+        return id;
+    }
+
+    /**
+     * @brief Get a copy of an interned string.
+     *
+     * @param id Id returned by intern().
+     * @return std::string The interned string.
+     */
+    std::string get(uint32_t id) const
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        return strings_[id];
+    }
+
+    /**
+     * @brief Extend views, indexed by id, with every string interned since it was last extended.
+     *
+     * @param views Views into the table's storage, initially empty.
+     */
+    void snapshot(std::vector<std::string_view> &views) const
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        views.insert(views.end(), strings_.begin() + views.size(), strings_.end());
+    }
+
+    /**
+     * @brief Get the number of interned strings.
+     */
+    size_t size() const
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        return strings_.size();
+    }
+};
@@ -0,0 +1,80 @@
+#pragma once
+#include <condition_variable>
+#include <deque>
+#include <algorithm>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+/**
+ * @brief Fixed-size pool of worker threads running submitted tasks in FIFO order.
+ *
+ * Tasks still queued when the pool is destroyed are dropped; running tasks are joined.
+ */
+class ThreadPool
+{
+private:
+    std::vector<std::thread> workers_;
+    std::deque<std::function<void()>> tasks_;
+    std::mutex mutex_;
+    std::condition_variable wake_;
+    bool stop_ = false;
+
+    void _work()
+    {
+        while (true)
+        {
+            std::function<void()> task;
+            {
+                std::unique_lock<std::mutex> lock(mutex_);
+                wake_.wait(lock, [this]() { return stop_ || !tasks_.empty(); });
+                if (stop_)
+                    return;
+                task = std::move(tasks_.front());
+                tasks_.pop_front();
+            }
+            task();
+        }
+    }
+
+public:
+    /**
+     * @brief Construct a pool.
+     *
+     * @param numThreads Number of worker threads, at least one is started.
+     */
+    explicit ThreadPool(size_t numThreads)
+    {
+        for (size_t i = 0; i < std::max<size_t>(1, numThreads); ++i)
+            workers_.emplace_back(&ThreadPool::_work, this);
+    }
+
+    ~ThreadPool()
+    {
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            stop_ = true;
+        }
+        wake_.notify_all();
+        for (auto &worker : workers_)
+            worker.join();
+    }
+
+    /**
+     * @brief Queue a task.
+     */
+    void submit(std::function<void()> task)
+    {
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            tasks_.push_back(std::move(task));
+        }
+        wake_.notify_one();
+    }
+
+    /**
+     * @brief Number of worker threads.
+     */
+    size_t size() const { return workers_.size(); }
+};
@@ -1,73 +1,464 @@
 #include "timer.h"
-#include "utils.h" // getCurrentMemoryDraw
+#include "utils.h" // getCurrentMemoryDraw, thread and process ids
+#include "binary_format.h"
+#include "chrome_format.h"
+#include <algorithm>
+#include <random>
+#include <sstream>
+#include <tuple>
 
-void Timer::_start(const std::string &event_category, const std::string &event_name, const std::unordered_map<std::string, std::string> &argsMap) {
-    if (operation_ != TimerOperation::Disabled) {
-        int64_t ts_start_micros = ClockType::now().time_since_epoch().count() / 1000;
-        size_t categoryHash = std::hash<std::string>{}(event_category);
+namespace {
+std::atomic<uint64_t> nextTimerId{1};
 
-        raw_event_t event;
-        event.name = event_name;
-        event.cat = event_category;
-        event.pid = 1;
-        event.tid = categoryHash;
-        event.ts = ts_start_micros;
-        event.ph = 'B';
-        event.args = argsMap;
+// Trace ids: 24 random bits per process above a 40 bit counter.
+constexpr int kTraceIdCounterBits = 40;
+std::atomic<uint64_t> nextTraceId{1};
 
-        inMemoryLogs_.push_back(event);
+// Bytes a thread records before adding them to the shared pending counter.
+constexpr int64_t kReportBytes = 16 << 10;
+// Pending bytes past this many high-water marks mean the writer fell behind; new events are dropped.
+// Marks below kReportBytes count as kReportBytes, the step pending bytes grow by.
+constexpr int64_t kDropAboveMarks = 4;
+
+// Moves the arg block of one event from a thread's arg stream to the end of `out`.
+void takeArgs(EventBuffer<arg_slot_t> &stream, uint16_t argCount, std::vector<arg_slot_t> &out) {
+    auto append = [&out](arg_slot_t &slot) { out.push_back(slot); };
+    for (uint16_t i = 0; i < argCount; ++i) {
+        size_t header = out.size();
+        stream.drain(append, 1);
+        stream.drain(append, chrome_format::argSlots(out[header]) - 1);
     }
 }
 
-void Timer::_stop(const std::string &event_category, const std::string &event_name, const std::unordered_map<std::string, std::string> &argsMap) {
-    if (operation_ != TimerOperation::Disabled) {
-        int64_t ts_stop_micros = ClockType::now().time_since_epoch().count() / 1000;
-        size_t categoryHash = std::hash<std::string>{}(event_category);
+const char *const kSelfProfileApiNames[] = {"start", "stop", "addCounterEvent", "addClockSyncMarker", "addFlowEvent", "dumpLogs"};
+static_assert(std::size(kSelfProfileApiNames) == static_cast<size_t>(SelfProfileApi::Count), "name every SelfProfileApi");
 
-        raw_event_t event;
-        event.name = event_name;
-        event.cat = event_category;
-        event.pid = 1;
-        event.tid = categoryHash;
-        event.ts = ts_stop_micros;
-        event.ph = 'E';
-        event.args = argsMap;
+}
 
-        inMemoryLogs_.push_back(event);
+class Timer::ProfileScope {
+public:
+    ProfileScope(Timer &timer, ThreadBuffer &buffer, SelfProfileApi api) {
+        uint32_t every = timer.selfProfileEvery_.load(std::memory_order_relaxed);
+        if (every == 0)
+            return;
+        profile_ = buffer.profile.load(std::memory_order_relaxed);
+        if (profile_ == nullptr) {
+            profile_ = new SelfProfile;
+            buffer.profile.store(profile_, std::memory_order_release);
+        }
+        api_ = static_cast<size_t>(api);
+        profile_->calls[api_].store(profile_->calls[api_].load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+        if (profile_->untilSample[api_] > 0) {
+            --profile_->untilSample[api_];
+            profile_ = nullptr;
+            return;
+        }
+        profile_->untilSample[api_] = every - 1;
+        begin_ = _timestamp();
     }
+
+    ~ProfileScope() {
+        if (profile_ != nullptr)
+            profile_->nanos[api_].record(TraceClock::toEpochNanos(_timestamp()) - TraceClock::toEpochNanos(begin_));
+    }
+
+private:
+    SelfProfile *profile_ = nullptr; // Null unless this call is timed.
+    size_t api_ = 0;
+    int64_t begin_ = 0;
+};
+
+Timer::ThreadBuffer &Timer::_localBuffer() {
+    // Ids are never reused, so a stale entry left behind by a destroyed Timer can never match.
+    thread_local uint64_t cachedTimerId = 0;
+    thread_local ThreadBuffer *cachedBuffer = nullptr;
+    thread_local std::unordered_map<uint64_t, ThreadBuffer *> buffers;
+
+    if (cachedTimerId == timerId_)
+        return *cachedBuffer;
+
+    ThreadBuffer *&buffer = buffers[timerId_];
+    if (buffer == nullptr) {
+        auto threadBuffer = std::make_unique<ThreadBuffer>();
+        threadBuffer->tid = getCurrentThreadId();
+        // Threads inherit the OS name of their creator, which only says something when it was changed.
+        std::string osName = getCurrentThreadName();
+        if (osName != getCurrentProcessName().substr(0, osName.size()) || threadBuffer->tid == pid_)
+            threadBuffer->name = osName;
+        std::lock_guard<std::mutex> lock(registryMutex_);
+        threadBuffer->index = static_cast<uint32_t>(threadBuffers_.size());
+        if (ringEnabled_.load(std::memory_order_relaxed))
+            ring_->setThread(threadBuffer->index, threadBuffer->tid, threadBuffer->name);
+        threadBuffers_.push_back(std::move(threadBuffer));
+        buffer = threadBuffers_.back().get();
+    }
+    cachedTimerId = timerId_;
+    cachedBuffer = buffer;
+    return *buffer;
 }
 
+uint32_t Timer::_intern(ThreadBuffer &buffer, const std::string &str) {
+    auto it = buffer.ids.find(str);
+    if (it != buffer.ids.end())
+        return it->second;
+    uint32_t id = stringTable_.intern(str);
+    buffer.ids.emplace(str, id);
+    return id;
+}
 
-void Timer::_coreAddCounterEvent(const std::string &event_category, const std::string &event_name, size_t value, const std::unordered_map<std::string, std::string> &args) {
-    if (operation_ != TimerOperation::Disabled) {
-        int64_t ts_micros = ClockType::now().time_since_epoch().count() / 1000;
-        size_t categoryHash = std::hash<std::string>{}(event_category);
+uint32_t Timer::_literalId(ThreadBuffer &buffer, const char *literal) {
+    auto it = buffer.literalIds.find(literal);
+    if (it != buffer.literalIds.end())
+        return it->second;
+    uint32_t id = _intern(buffer, literal);
+    buffer.literalIds.emplace(literal, id);
+    return id;
+}
+
+uint32_t Timer::_memoryCounterId(ThreadBuffer &buffer, uint32_t event_category) {
+    auto it = buffer.memoryCounterIds.find(event_category);
+    if (it != buffer.memoryCounterIds.end())
+        return it->second;
+    uint32_t id = _intern(buffer, stringTable_.get(event_category) + " Memory");
+    buffer.memoryCounterIds.emplace(event_category, id);
+    return id;
+}
+
+int64_t Timer::_timestamp() {
+    return TraceClock::now();
+}
+
+uint64_t Timer::_memoryDraw() {
+    if (samplerRunning_.load(std::memory_order_relaxed))
+        return lastMemoryDraw_.load(std::memory_order_relaxed);
+    return getCurrentMemoryDraw();
+}
+
+void Timer::_reportPending(ThreadBuffer &buffer) {
+    int64_t pending = pendingBytes_.fetch_add(buffer.unreportedBytes, std::memory_order_relaxed) + buffer.unreportedBytes;
+    buffer.unreportedBytes = 0;
+    if (pending >= highWaterMarkBytes_)
+        writerWake_.notify_one();
+}
+
+bool Timer::_streamingFull() {
+    if (pendingBytes_.load(std::memory_order_relaxed) < dropAboveBytes_.load(std::memory_order_relaxed))
+        return false;
+    streamingDrops_.fetch_add(1, std::memory_order_relaxed);
+    return true;
+}
+
+const arg_block_t &Timer::_encodeArgs(ThreadBuffer &buffer, const std::unordered_map<std::string, std::string> &args) {
+    buffer.scratch.clear();
+    for (const auto &[key, argValue] : args)
+        buffer.scratch.append(_intern(buffer, key), ArgType::String, argValue.size(), argValue);
+    return buffer.scratch;
+}
+
+const arg_block_t &Timer::_encodeArgs(ThreadBuffer &buffer, const trace_arg_t *args, size_t count) {
+    buffer.scratch.clear();
+    for (size_t i = 0; i < count; ++i)
+        buffer.scratch.append(_literalId(buffer, args[i].key), args[i].type, args[i].value, args[i].text);
+    return buffer.scratch;
+}
+
+void Timer::_record(ThreadBuffer &buffer, char ph, uint32_t event_category, uint32_t event_name, uint64_t value, const arg_block_t &args) {
+    _recordAt(buffer, _timestamp(), ph, event_category, event_name, value, args);
+}
+
+void Timer::_recordAt(ThreadBuffer &buffer, int64_t ts, char ph, uint32_t event_category, uint32_t event_name, uint64_t value, const arg_block_t &args) {
+    raw_event_t event;
+    event.ts = ts;
+    event.value = value;
+    event.cat = event_category;
+    event.name = event_name;
+    event.args = buffer.argsWritten;
+    event.argCount = args.count;
+    event.ph = ph;
+
+    if (ringEnabled_.load(std::memory_order_relaxed)) {
+        _recordRing(buffer, event, args);
+        return;
+    }
+
+    // Arguments are published before the event so a consumer that sees the event also sees its args.
+    for (const arg_slot_t &slot : args.slots)
+        buffer.args.push(slot);
+    buffer.argsWritten += static_cast<uint32_t>(args.slots.size());
+
+    buffer.events.push(event);
+
+    if (streaming_.load(std::memory_order_relaxed)) {
+        // Shared counter is only touched every few KB to keep threads off each other's cache lines.
+        buffer.unreportedBytes += sizeof(raw_event_t) + sizeof(arg_slot_t) * args.slots.size();
+        if (buffer.unreportedBytes >= kReportBytes)
+            _reportPending(buffer);
+    }
+}
+
+void Timer::_recordRing(ThreadBuffer &buffer, raw_event_t &event, const arg_block_t &args) {
+    constexpr size_t kPayloadBytes = ring_format::MappedRing::payloadBytes();
+    uint32_t maxId = std::max(event.cat, event.name);
+    size_t bytes = sizeof(raw_event_t);
+    size_t slots = 0;
+    event.argCount = 0;
+    while (event.argCount < args.count) {
+        const arg_slot_t &header = args.slots[slots];
+        size_t argSlots = chrome_format::argSlots(header);
+        // Records never straddle blocks, so args that would not fit in an empty block are left out.
+        if (bytes + sizeof(arg_slot_t) * argSlots > kPayloadBytes)
+            break;
+        maxId = std::max(maxId, header.header.key);
+        bytes += sizeof(arg_slot_t) * argSlots;
+        slots += argSlots;
+        ++event.argCount;
+    }
+
+    ring_format::block_header_t *block = buffer.ringBlock;
+    uint32_t used = block != nullptr ? block->used.load(std::memory_order_relaxed) : 0;
+    if (block == nullptr || used + bytes > kPayloadBytes) {
+        if (block != nullptr)
+            ring_->release(block);
+        block = buffer.ringBlock = ring_->claim(buffer.index);
+        used = 0;
+        if (block == nullptr) {
+            ringDrops_.fetch_add(1, std::memory_order_relaxed);
+            return;
+        }
+    }
+
+    char *at = ring_format::MappedRing::payload(block) + used;
+    event.args = 0;
+    std::memcpy(at, &event, sizeof(event));
+    if (slots > 0)
+        std::memcpy(at + sizeof(event), args.slots.data(), sizeof(arg_slot_t) * slots);
+
+    // Strings go in first, so a committed event never refers to a string the file does not have yet.
+    if (maxId >= ringStrings_.load(std::memory_order_acquire))
+        _persistRingStrings(maxId);
+    block->used.store(static_cast<uint32_t>(used + bytes), std::memory_order_release);
+}
+
+void Timer::_persistRingStrings(uint32_t id) {
+    std::lock_guard<std::mutex> lock(ringStringsMutex_);
+    uint32_t next = ringStrings_.load(std::memory_order_relaxed);
+    for (; next <= id; ++next) {
+        if (!ring_->addString(stringTable_.get(next))) {
+            // The strings region is full: later ids are recovered as placeholders, so stop trying.
+            next = std::numeric_limits<uint32_t>::max();
+            break;
+        }
+    }
+    ringStrings_.store(next, std::memory_order_release);
+}
+
+Timer::SpanStats &Timer::_spanStats(ThreadBuffer &buffer, uint32_t event_category, uint32_t event_name, bool counter) {
+    uint64_t key = (uint64_t(event_category) << 32) | event_name;
+    SpanStats *&stats = (counter ? buffer.counterStats : buffer.spanStats)[key];
+    if (stats == nullptr) {
+        stats = new SpanStats{event_category, event_name, counter};
+        stats->next = buffer.spanStatsHead.load(std::memory_order_relaxed);
+        buffer.spanStatsHead.store(stats, std::memory_order_release);
+    }
+    return *stats;
+}
+
+void Timer::_recordStats(ThreadBuffer &buffer, char ph, uint32_t event_category, uint32_t event_name, uint64_t value) {
+    if (ph == 'C') {
+        _spanStats(buffer, event_category, event_name, true).histogram.record(value);
+        return;
+    }
+
+    uint64_t key = (uint64_t(event_category) << 32) | event_name;
+    int64_t now = _timestamp();
+    if (ph == 'B') {
+        buffer.openSpans.emplace_back(key, now);
+        return;
+    }
+
+    // Spans usually close in reverse order, so the match is almost always the last one. Unmatched stops are ignored.
+    for (auto it = buffer.openSpans.rbegin(); it != buffer.openSpans.rend(); ++it) {
+        if (it->first != key)
+            continue;
+        int64_t nanos = TraceClock::toEpochNanos(now) - TraceClock::toEpochNanos(it->second);
+        _spanStats(buffer, event_category, event_name, false).histogram.record(std::max<int64_t>(0, nanos));
+        buffer.openSpans.erase(std::next(it).base());
+        return;
+    }
+}
+
+Sampler &Timer::_sampler(ThreadBuffer &buffer, SamplerSet &samplers, uint32_t event_category) {
+    uint32_t version = samplingVersion_.load(std::memory_order_acquire);
+    if (samplers.version == version && event_category < samplers.byCategory.size() && samplers.byCategory[event_category] != nullptr)
+        return *samplers.byCategory[event_category];
+
+    std::lock_guard<std::mutex> lock(samplingMutex_);
+    auto policyOf = [this](uint32_t category) {
+        auto it = samplingPolicies_.find(category);
+        return it != samplingPolicies_.end() ? it->second : defaultSamplingPolicy_;
+    };
+    // Seeds differ per thread, category and set so probabilistic samplers do not drop the same calls.
+    uint64_t salt = &samplers == &buffer.siteSamplers ? uint64_t(1) << 63 : 0;
+    auto seedOf = [&buffer, salt](uint32_t category) { return ((uint64_t(buffer.tid) << 32) ^ category) | salt; };
+    if (samplers.version != version) {
+        for (Sampler *sampler : samplers.byCategory) {
+            if (sampler != nullptr)
+                sampler->reset(policyOf(sampler->category()), seedOf(sampler->category()));
+        }
+        samplers.version = version;
+    }
+    if (event_category >= samplers.byCategory.size())
+        samplers.byCategory.resize(event_category + 1, nullptr);
+    Sampler *&sampler = samplers.byCategory[event_category];
+    if (sampler == nullptr) {
+        sampler = new Sampler(event_category, policyOf(event_category), seedOf(event_category));
+        sampler->next = samplers.head.load(std::memory_order_relaxed);
+        samplers.head.store(sampler, std::memory_order_release);
+    }
+    return *sampler;
+}
+
+SamplingDecision Timer::_sample(ThreadBuffer &buffer, uint32_t event_category, bool counter) {
+    if (samplingVersion_.load(std::memory_order_relaxed) == 0)
+        return SamplingDecision::Record;
+    return _sampler(buffer, buffer.samplers, event_category).decide(counter);
+}
+
+void Timer::_start(ThreadBuffer &buffer, uint32_t event_category, uint32_t event_name, const arg_block_t &args, bool measureMemory) {
+    if (operation_ == TimerOperation::Stats) {
+        if (measureMemory)
+            _recordStats(buffer, 'C', event_category, _memoryCounterId(buffer, event_category), _memoryDraw());
+        _recordStats(buffer, 'B', event_category, event_name, 0);
+    } else if (operation_ != TimerOperation::Disabled) {
+        OpenSpan span{(uint64_t(event_category) << 32) | event_name,
+                      _streamingFull() ? SamplingDecision::Drop : _sample(buffer, event_category, false)};
+        if (span.decision == SamplingDecision::Record) {
+            if (measureMemory)
+                _record(buffer, 'C', event_category, _memoryCounterId(buffer, event_category), _memoryDraw(), args);
+            _record(buffer, 'B', event_category, event_name, 0, args);
+        } else if (span.decision == SamplingDecision::Defer) {
+            span.start = _timestamp();
+            span.memory = measureMemory ? _memoryDraw() : 0;
+            span.argsBegin = static_cast<uint32_t>(buffer.deferredArgs.size());
+            span.argCount = args.count;
+            buffer.deferredArgs.insert(buffer.deferredArgs.end(), args.slots.begin(), args.slots.end());
+            // Holds the streaming writer back, so the start written at the stop does not land after newer events.
+            if (buffer.deferredOpen++ == 0)
+                buffer.oldestDeferred.store(span.start, std::memory_order_release);
+        }
+        // Read last, so the counters leave out the cost of recording the start.
+        if (span.decision != SamplingDecision::Drop && perfEnabled_.load(std::memory_order_acquire)) {
+            PerfCounterGroup *perf = _perfGroup(buffer);
+            span.hasPerf = perf != nullptr && perf->read(span.perfStart);
+        }
+        buffer.spanStack.push_back(std::move(span));
+    }
+}
+
+void Timer::_closeSpan(ThreadBuffer &buffer, const OpenSpan &span, const arg_block_t &args, bool measureMemory) {
+    uint32_t event_category = static_cast<uint32_t>(span.key >> 32);
+    uint32_t event_name = static_cast<uint32_t>(span.key);
+    if (span.decision == SamplingDecision::Drop)
+        return;
+    // Read first, so the counters leave out the cost of recording the stop.
+    PerfCounterGroup::values_t perfEnd;
+    bool hasPerf = span.hasPerf && buffer.perf->read(perfEnd);
+    if (span.decision == SamplingDecision::Defer) {
+        int64_t now = _timestamp();
+        bool keep = _sampler(buffer, buffer.samplers, event_category).keep(TraceClock::toEpochNanos(now) - TraceClock::toEpochNanos(span.start));
+        // Inner spans close first, so this span's args are the top of the stack.
+        if (keep) {
+            buffer.deferredStart.slots.assign(buffer.deferredArgs.begin() + span.argsBegin, buffer.deferredArgs.end());
+            buffer.deferredStart.count = span.argCount;
+            // The start is written late, which dumpLogs() makes up for by sorting on timestamps.
+            if (span.memory != 0)
+                _recordAt(buffer, span.start, 'C', event_category, _memoryCounterId(buffer, event_category), span.memory, buffer.deferredStart);
+            _recordAt(buffer, span.start, 'B', event_category, event_name, 0, buffer.deferredStart);
+        }
+        buffer.deferredArgs.resize(span.argsBegin);
+        // Released after the start is published, so a writer that sees it released also drains the start.
+        if (--buffer.deferredOpen == 0)
+            buffer.oldestDeferred.store(std::numeric_limits<int64_t>::max(), std::memory_order_release);
+        if (!keep)
+            return;
+    }
+    if (measureMemory)
+        _record(buffer, 'C', event_category, _memoryCounterId(buffer, event_category), _memoryDraw(), args);
+    if (!hasPerf) {
+        _record(buffer, 'E', event_category, event_name, 0, args);
+        return;
+    }
+    buffer.perfArgs = args;
+    const std::vector<PerfCounter> &counters = buffer.perf->counters();
+    for (size_t i = 0; i < counters.size(); ++i)
+        buffer.perfArgs.append(_literalId(buffer, PerfCounterGroup::name(counters[i])), ArgType::Int64, perfEnd[i] - span.perfStart[i]);
+    _record(buffer, 'E', event_category, event_name, 0, buffer.perfArgs);
+}
+
+PerfCounterGroup *Timer::_perfGroup(ThreadBuffer &buffer) {
+    if (!buffer.perfOpened) {
+        buffer.perfOpened = true;
+        auto group = std::make_unique<PerfCounterGroup>();
+        std::string error;
+        bool opened = group->open(perfCounters_, error);
+        if (opened)
+            buffer.perf = std::move(group);
+        // One warning for the whole process: every thread usually fails for the same reason.
+        if (!error.empty() && !perfWarned_.exchange(true))
+            std::cerr << "Warning: " << (opened ? "some performance counters are unavailable" : "performance counters are unavailable")
+                      << " on thread " << buffer.tid << " (" << error << "), spans are recorded without them." << std::endl;
+    }
+    return buffer.perf.get();
+}
+
+void Timer::_stop(ThreadBuffer &buffer, uint32_t event_category, uint32_t event_name, const arg_block_t &args, bool measureMemory) {
+    if (operation_ == TimerOperation::Stats) {
+        if (measureMemory)
+            _recordStats(buffer, 'C', event_category, _memoryCounterId(buffer, event_category), _memoryDraw());
+        _recordStats(buffer, 'E', event_category, event_name, 0);
+    } else if (operation_ != TimerOperation::Disabled) {
+        uint64_t key = (uint64_t(event_category) << 32) | event_name;
+        auto open = std::find_if(buffer.spanStack.rbegin(), buffer.spanStack.rend(), [key](const OpenSpan &span) { return span.key == key; });
+        if (open == buffer.spanStack.rend()) {
+            unmatchedStops_.fetch_add(1, std::memory_order_relaxed);
+            return;
+        }
+        // Spans left open inside this one end with it, so the thread's timeline stays nested.
+        for (auto inner = buffer.spanStack.rbegin(); inner != open; ++inner) {
+            _closeSpan(buffer, *inner, arg_block_t(), false);
+            closedInner_.fetch_add(1, std::memory_order_relaxed);
+        }
+        _closeSpan(buffer, *open, args, measureMemory);
+        buffer.spanStack.erase(std::next(open).base(), buffer.spanStack.end());
+    }
+}
 
-        raw_event_t event;
-        event.name = event_name;
-        event.cat = event_category;
-        event.pid = 2;
-        event.tid = categoryHash;
-        event.ts = ts_micros;
-        event.ph = 'C';
-        event.args = args;
-        event.args[event_name] = std::to_string(value); // adding the counter value
 
-        inMemoryLogs_.push_back(event);
+void Timer::_coreAddCounterEvent(ThreadBuffer &buffer, uint32_t event_category, uint32_t event_name, size_t value, const arg_block_t &args) {
+    if (operation_ == TimerOperation::Stats) {
+        _recordStats(buffer, 'C', event_category, event_name, value);
+    } else if (operation_ != TimerOperation::Disabled && !_streamingFull() && _sample(buffer, event_category, true) != SamplingDecision::Drop) {
+        _record(buffer, 'C', event_category, event_name, value, args);
     }
 }
 
 
-Timer::Timer(const std::string &outputPath, TimerOperation operation) : outputPath_(fs::path(outputPath)), operation_(operation)
+Timer::Timer(const std::string &outputPath, TimerOperation operation)
+    : timerId_(nextTimerId.fetch_add(1)), outputPath_(fs::path(outputPath)), operation_(operation),
+      pid_(getCurrentProcessId()), processName_(getCurrentProcessName()),
+      samplingCategoryId_(stringTable_.intern("sampling")),
+      clockSyncCategoryId_(stringTable_.intern("clock_sync")),
+      clockSyncSendId_(stringTable_.intern("send")),
+      clockSyncReceiveId_(stringTable_.intern("receive"))
 {
     if (operation_ != TimerOperation::Disabled)
     {
-        _start("Timer", "Constructor", {});
+        // Calibrate now rather than when the first events are written.
+        TraceClock::calibrate();
         fs::create_directories(outputPath_.parent_path());
-        outputFile_.open(outputPath_);
+        outputFile_.open(outputPath_, std::ios::binary);
         if (!outputFile_.is_open())
             std::cerr << "Failed to open file: " << outputPath_ << ". Error: " << std::strerror(errno) << std::endl;
-        _stop("Timer", "Constructor", {});
     }
 }
 
@@ -79,14 +470,48 @@ TimerOperation Timer::getOperation() const {
     return operation_;
 }
 
+void Timer::setThreadName(const std::string &name) {
+    ThreadBuffer &buffer = _localBuffer();
+    std::lock_guard<std::mutex> lock(registryMutex_);
+    buffer.name = name;
+    if (ringEnabled_.load(std::memory_order_relaxed))
+        ring_->setThread(buffer.index, buffer.tid, buffer.name);
+}
+
+void Timer::setProcessName(const std::string &name) {
+    std::lock_guard<std::mutex> lock(registryMutex_);
+    processName_ = name;
+}
+
+void Timer::setSamplingPolicy(const std::string &event_category, const sampling_policy_t &policy) {
+    uint32_t categoryId = stringTable_.intern(event_category);
+    std::lock_guard<std::mutex> lock(samplingMutex_);
+    samplingPolicies_[categoryId] = policy;
+    samplingVersion_.fetch_add(1, std::memory_order_release);
+}
+
+void Timer::setSamplingPolicy(const sampling_policy_t &policy) {
+    std::lock_guard<std::mutex> lock(samplingMutex_);
+    defaultSamplingPolicy_ = policy;
+    samplingVersion_.fetch_add(1, std::memory_order_release);
+}
+
+void Timer::setTrackLayout(TrackLayout layout) {
+    trackLayout_ = layout;
+}
+
+process_info_t Timer::processInfo() {
+    std::lock_guard<std::mutex> lock(registryMutex_);
+    return _processInfo();
+}
+
 void Timer::addCounterEvent(const std::string &event_category, const std::string &event_name, size_t value, const std::unordered_map<std::string, std::string> &args)
 {
     if (operation_ != TimerOperation::Disabled)
     {
-        _start("Timer", "addCounterEvent Function", {});
-        std::lock_guard<std::mutex> lock(memoryMutex_);
-        _coreAddCounterEvent(event_category, event_name, value, args);
-        _stop("Timer", "addCounterEvent Function", {});
+        ThreadBuffer &buffer = _localBuffer();
+        ProfileScope profile(*this, buffer, SelfProfileApi::AddCounterEvent);
+        _coreAddCounterEvent(buffer, _intern(buffer, event_category), _intern(buffer, event_name), value, _encodeArgs(buffer, args));
     }
 }
 
@@ -94,18 +519,12 @@ void Timer::start(const std::string &event_category, const std::string &event_na
 {
     if (operation_ != TimerOperation::Disabled)
     {
-        _start("Timer", "start Function", {});
-        std::lock_guard<std::mutex> lock(memoryMutex_);
-        if (measureMemory)
-        {
-            size_t memoryDrawBytes = getCurrentMemoryDraw();
-            _coreAddCounterEvent(event_category, event_category + " Memory", memoryDrawBytes, args);
-        }
-        
-        std::string real_event_name = (operation_==TimerOperation::Firefox)? event_category: event_name; // To keep everything on the same line all event_names must be the same for firefox
-        
-        _start(event_category, real_event_name, args);
-        _stop("Timer", "start Function", {});
+        ThreadBuffer &buffer = _localBuffer();
+        ProfileScope profile(*this, buffer, SelfProfileApi::Start);
+        uint32_t categoryId = _intern(buffer, event_category);
+        uint32_t nameId = (operation_==TimerOperation::Firefox)? categoryId: _intern(buffer, event_name); // To keep everything on the same line all event_names must be the same for firefox
+
+        _start(buffer, categoryId, nameId, _encodeArgs(buffer, args), measureMemory);
     }
 }
 
@@ -113,49 +532,1078 @@ void Timer::stop(const std::string &event_category, const std::string &event_nam
 {
     if (operation_ != TimerOperation::Disabled)
     {
-        _start("Timer", "stop Function", {});
-        std::lock_guard<std::mutex> lock(memoryMutex_);
-        if (measureMemory)
+        ThreadBuffer &buffer = _localBuffer();
+        ProfileScope profile(*this, buffer, SelfProfileApi::Stop);
+        uint32_t categoryId = _intern(buffer, event_category);
+        uint32_t nameId = (operation_==TimerOperation::Firefox)? categoryId: _intern(buffer, event_name); // To keep everything on the same line all event_names must be the same for firefox
+        _stop(buffer, categoryId, nameId, _encodeArgs(buffer, args), measureMemory);
+    }
+}
+
+void Timer::_startLiteral(const char *event_category, const char *event_name)
+{
+    ThreadBuffer &buffer = _localBuffer();
+    ProfileScope profile(*this, buffer, SelfProfileApi::Start);
+    uint32_t categoryId = _literalId(buffer, event_category);
+    _start(buffer, categoryId, operation_ == TimerOperation::Firefox ? categoryId : _literalId(buffer, event_name));
+}
+
+void Timer::_stopLiteral(const char *event_category, const char *event_name)
+{
+    ThreadBuffer &buffer = _localBuffer();
+    ProfileScope profile(*this, buffer, SelfProfileApi::Stop);
+    uint32_t categoryId = _literalId(buffer, event_category);
+    _stop(buffer, categoryId, operation_ == TimerOperation::Firefox ? categoryId : _literalId(buffer, event_name));
+}
+
+span_handle_t Timer::handle(const std::string &event_category, const std::string &event_name)
+{
+    ThreadBuffer &buffer = _localBuffer();
+    return {_intern(buffer, event_category), _intern(buffer, event_name)};
+}
+
+void Timer::start(span_handle_t span)
+{
+    if (operation_ != TimerOperation::Disabled)
+    {
+        ThreadBuffer &buffer = _localBuffer();
+        ProfileScope profile(*this, buffer, SelfProfileApi::Start);
+        _start(buffer, span.category, operation_ == TimerOperation::Firefox ? span.category : span.name);
+    }
+}
+
+void Timer::stop(span_handle_t span)
+{
+    if (operation_ != TimerOperation::Disabled)
+    {
+        ThreadBuffer &buffer = _localBuffer();
+        ProfileScope profile(*this, buffer, SelfProfileApi::Stop);
+        _stop(buffer, span.category, operation_ == TimerOperation::Firefox ? span.category : span.name);
+    }
+}
+
+void Timer::_startTyped(const std::string &event_category, const std::string &event_name, const trace_arg_t *args, size_t count)
+{
+    if (operation_ != TimerOperation::Disabled)
+    {
+        ThreadBuffer &buffer = _localBuffer();
+        ProfileScope profile(*this, buffer, SelfProfileApi::Start);
+        uint32_t categoryId = _intern(buffer, event_category);
+        uint32_t nameId = operation_ == TimerOperation::Firefox ? categoryId : _intern(buffer, event_name);
+        _start(buffer, categoryId, nameId, _encodeArgs(buffer, args, count));
+    }
+}
+
+void Timer::_stopTyped(const std::string &event_category, const std::string &event_name, const trace_arg_t *args, size_t count)
+{
+    if (operation_ != TimerOperation::Disabled)
+    {
+        ThreadBuffer &buffer = _localBuffer();
+        ProfileScope profile(*this, buffer, SelfProfileApi::Stop);
+        uint32_t categoryId = _intern(buffer, event_category);
+        uint32_t nameId = operation_ == TimerOperation::Firefox ? categoryId : _intern(buffer, event_name);
+        _stop(buffer, categoryId, nameId, _encodeArgs(buffer, args, count));
+    }
+}
+
+void Timer::_startTyped(span_handle_t span, const trace_arg_t *args, size_t count)
+{
+    if (operation_ != TimerOperation::Disabled)
+    {
+        ThreadBuffer &buffer = _localBuffer();
+        ProfileScope profile(*this, buffer, SelfProfileApi::Start);
+        _start(buffer, span.category, operation_ == TimerOperation::Firefox ? span.category : span.name, _encodeArgs(buffer, args, count));
+    }
+}
+
+void Timer::_stopTyped(span_handle_t span, const trace_arg_t *args, size_t count)
+{
+    if (operation_ != TimerOperation::Disabled)
+    {
+        ThreadBuffer &buffer = _localBuffer();
+        ProfileScope profile(*this, buffer, SelfProfileApi::Stop);
+        _stop(buffer, span.category, operation_ == TimerOperation::Firefox ? span.category : span.name, _encodeArgs(buffer, args, count));
+    }
+}
+
+void Timer::_addCounterTyped(const std::string &event_category, const std::string &event_name, size_t value, const trace_arg_t *args, size_t count)
+{
+    if (operation_ != TimerOperation::Disabled)
+    {
+        ThreadBuffer &buffer = _localBuffer();
+        ProfileScope profile(*this, buffer, SelfProfileApi::AddCounterEvent);
+        _coreAddCounterEvent(buffer, _intern(buffer, event_category), _intern(buffer, event_name), value, _encodeArgs(buffer, args, count));
+    }
+}
+
+void Timer::takeEvents(std::vector<raw_event_t> &events, std::vector<std::string> &strings)
+{
+    std::vector<arg_slot_t> argSlots;
+    {
+        std::lock_guard<std::mutex> lock(registryMutex_);
+        _drainBuffers(events, argSlots);
+    }
+    std::stable_sort(events.begin(), events.end(),
+                     [](const raw_event_t &a, const raw_event_t &b) { return a.ts < b.ts; });
+    for (raw_event_t &event : events)
+        event.ts = TraceClock::toEpochNanos(event.ts);
+
+    std::vector<std::string_view> views;
+    stringTable_.snapshot(views);
+    strings.assign(views.begin(), views.end());
+}
+
+void Timer::addClockSyncMarker(const std::string &sync_id, ClockSyncPoint point)
+{
+    if (operation_ != TimerOperation::Disabled)
+    {
+        ThreadBuffer &buffer = _localBuffer();
+        ProfileScope profile(*this, buffer, SelfProfileApi::AddClockSyncMarker);
+        trace_arg_t syncId = traceArg("sync_id", sync_id);
+        _record(buffer, 'i', clockSyncCategoryId_, point == ClockSyncPoint::Send ? clockSyncSendId_ : clockSyncReceiveId_, 0, _encodeArgs(buffer, &syncId, 1));
+    }
+}
+
+uint64_t Timer::newTraceId()
+{
+    static const uint64_t prefix = (uint64_t(std::random_device{}()) & 0xffffff) << kTraceIdCounterBits;
+    return prefix | (nextTraceId.fetch_add(1, std::memory_order_relaxed) & ((uint64_t(1) << kTraceIdCounterBits) - 1));
+}
+
+void Timer::addFlowEvent(const std::string &event_category, const std::string &event_name, uint64_t id, FlowPoint point)
+{
+    if (operation_ != TimerOperation::Disabled && operation_ != TimerOperation::Stats)
+    {
+        ThreadBuffer &buffer = _localBuffer();
+        ProfileScope profile(*this, buffer, SelfProfileApi::AddFlowEvent);
+        if (_streamingFull())
+            return;
+        char ph = point == FlowPoint::Start ? 's' : point == FlowPoint::Step ? 't' : 'f';
+        _record(buffer, ph, _intern(buffer, event_category), _intern(buffer, event_name), id, {});
+    }
+}
+
+void Timer::startAsync(const std::string &event_category, const std::string &event_name, uint64_t id, const std::unordered_map<std::string, std::string> &args)
+{
+    if (operation_ != TimerOperation::Disabled && operation_ != TimerOperation::Stats)
+    {
+        ThreadBuffer &buffer = _localBuffer();
+        ProfileScope profile(*this, buffer, SelfProfileApi::Start);
+        if (_streamingFull())
+            return;
+        _record(buffer, 'b', _intern(buffer, event_category), _intern(buffer, event_name), id, _encodeArgs(buffer, args));
+    }
+}
+
+void Timer::stopAsync(const std::string &event_category, const std::string &event_name, uint64_t id, const std::unordered_map<std::string, std::string> &args)
+{
+    if (operation_ != TimerOperation::Disabled && operation_ != TimerOperation::Stats)
+    {
+        ThreadBuffer &buffer = _localBuffer();
+        ProfileScope profile(*this, buffer, SelfProfileApi::Stop);
+        if (_streamingFull())
+            return;
+        _record(buffer, 'e', _intern(buffer, event_category), _intern(buffer, event_name), id, _encodeArgs(buffer, args));
+    }
+}
+
+int64_t Timer::_drainBuffers(std::vector<raw_event_t> &events, std::vector<arg_slot_t> &argSlots) {
+    size_t firstEvent = events.size();
+    size_t firstSlot = argSlots.size();
+    for (raw_event_t &event : deferredEvents_) {
+        event.args += static_cast<uint32_t>(firstSlot);
+        events.push_back(event);
+    }
+    argSlots.insert(argSlots.end(), deferredSlots_.begin(), deferredSlots_.end());
+    deferredEvents_.clear();
+    deferredSlots_.clear();
+    for (size_t thread = 0; thread < threadBuffers_.size(); ++thread) {
+        ThreadBuffer &threadBuffer = *threadBuffers_[thread];
+        // Threads past the 16 bit index share the last one.
+        uint16_t index = static_cast<uint16_t>(std::min<size_t>(thread, std::numeric_limits<uint16_t>::max()));
+        threadBuffer.events.drain([&](raw_event_t &event) {
+            event.args = static_cast<uint32_t>(argSlots.size());
+            event.thread = index;
+            takeArgs(threadBuffer.args, event.argCount, argSlots);
+            events.push_back(event);
+        });
+        _materializeSites(threadBuffer, index, events, argSlots);
+    }
+    return (events.size() - firstEvent) * sizeof(raw_event_t) + (argSlots.size() - firstSlot) * sizeof(arg_slot_t);
+}
+
+void Timer::_readRing(std::vector<raw_event_t> &events, std::vector<arg_slot_t> &argSlots) {
+    if (!ringEnabled_.load(std::memory_order_relaxed))
+        return;
+    // Timestamps stay in ticks, and ids and thread indexes are the timer's own, so only args need rebasing.
+    // The cursors leave out the records of earlier dumps, which stay in the file for the recovery tool.
+    ring_format::ring_contents_t contents;
+    std::string error;
+    if (!ring_format::readRing(ring_->data(), ring_->size(), contents, false, error, &ringCursors_)) {
+        std::cerr << "Failed to read the mapped buffer: " << error << std::endl;
+        return;
+    }
+    uint32_t firstSlot = static_cast<uint32_t>(argSlots.size());
+    for (raw_event_t &event : contents.events) {
+        event.args += firstSlot;
+        events.push_back(event);
+    }
+    argSlots.insert(argSlots.end(), contents.slots.begin(), contents.slots.end());
+
+    uint64_t dropped = ringDrops_.exchange(0, std::memory_order_relaxed);
+    if (dropped > 0)
+        std::cerr << "Warning: " << dropped << " events were dropped because every block of the mapped buffer was being written to." << std::endl;
+    uint64_t overwritten = contents.claimedBlocks > contents.blockCount ? contents.claimedBlocks - contents.blockCount : 0;
+    if (overwritten > ringOverwritten_)
+        std::cerr << "Warning: the mapped buffer wrapped around, the oldest " << overwritten - ringOverwritten_
+                  << " blocks of events were overwritten." << std::endl;
+    ringOverwritten_ = overwritten;
+}
+
+process_info_t Timer::_processInfo() {
+    process_info_t process;
+    process.pid = pid_;
+    process.name = processName_;
+    process.threads.reserve(threadBuffers_.size());
+    for (const auto &threadBuffer : threadBuffers_)
+        process.threads.push_back({threadBuffer->tid, threadBuffer->name});
+    return process;
+}
+
+void Timer::_snapshotProcess() {
+    process_info_t process = _processInfo();
+    if (process == process_)
+        return;
+    process_ = std::move(process);
+    threadsChanged_ = true;
+}
+
+nlohmann::json Timer::_metadataEvents() {
+    if (trackLayout_ == TrackLayout::Threads)
+        return chrome_format::metadataEvents(process_);
+
+    process_info_t tracks = process_;
+    tracks.threads.clear();
+    for (const auto &[tid, category] : categoryTracks_)
+        tracks.threads.push_back({tid, std::string(strings_[category])});
+    return chrome_format::metadataEvents(tracks);
+}
+
+void Timer::_reportSampling(ThreadBuffer &buffer) {
+    uint64_t full = streamingDrops_.exchange(0, std::memory_order_relaxed);
+    if (full > 0) {
+        _record(buffer, 'C', samplingCategoryId_, _literalId(buffer, "streaming dropped"), full, {});
+        std::cerr << "Streaming dropped " << full << " spans and events because the writer fell behind." << std::endl;
+    }
+    if (samplingVersion_.load(std::memory_order_relaxed) == 0)
+        return;
+    std::map<uint32_t, uint64_t> dropped;
+    {
+        std::lock_guard<std::mutex> lock(registryMutex_);
+        for (const auto &threadBuffer : threadBuffers_) {
+            for (const SamplerSet *samplers : {&threadBuffer->samplers, &threadBuffer->siteSamplers}) {
+                for (const Sampler *sampler = samplers->head.load(std::memory_order_acquire); sampler != nullptr; sampler = sampler->next) {
+                    // Categories recorded in full are left out, unless they were sampled earlier.
+                    if (sampler->sampled() || sampler->dropped() > 0)
+                        dropped[sampler->category()] += sampler->dropped();
+                }
+            }
+        }
+    }
+    for (const auto &[category, count] : dropped) {
+        std::string name = stringTable_.get(category);
+        _record(buffer, 'C', samplingCategoryId_, _intern(buffer, name + " dropped"), count, {});
+        if (count > 0)
+            std::cerr << "Sampling dropped " << count << " spans and counters of " << name << "." << std::endl;
+    }
+}
+
+void Timer::_reportNesting() {
+    uint64_t unmatched = unmatchedStops_.exchange(0, std::memory_order_relaxed);
+    uint64_t closed = closedInner_.exchange(0, std::memory_order_relaxed);
+    if (unmatched > 0)
+        std::cerr << "Warning: " << unmatched << " stops had no matching open span on their thread and were dropped." << std::endl;
+    if (closed > 0)
+        std::cerr << "Warning: " << closed << " spans were still open when an enclosing span stopped and were closed with it." << std::endl;
+}
+
+void Timer::_releasePending(int64_t drained) {
+    // Bytes still held in the threads' unreported counts can make drained exceed pending.
+    int64_t pending = pendingBytes_.load(std::memory_order_relaxed);
+    while (!pendingBytes_.compare_exchange_weak(pending, std::max<int64_t>(0, pending - drained), std::memory_order_relaxed)) {}
+}
+
+void Timer::_openTrace() {
+    if (traceOpen_)
+        return;
+    traceOpen_ = true;
+    jsonEntries_ = false;
+    if (operation_ == TimerOperation::CSV) {
+        if (!countersFile_.is_open())
+            countersFile_.open(csv_format::countersPath(outputPath_), std::ios::binary);
+        outputFile_ << csv_format::kSpansHeader;
+        countersFile_ << csv_format::kCountersHeader;
+    }
+    else if (operation_ == TimerOperation::Binary)
+        outputFile_.write(binary_format::kMagic, sizeof(binary_format::kMagic));
+    else if (operation_ == TimerOperation::Chrome || operation_ == TimerOperation::Firefox)
+        outputFile_ << "[\n";
+}
+
+int64_t Timer::_writeCsv() {
+    struct span_row_t {
+        int64_t start;
+        int64_t duration;
+        uint32_t cat, name, thread;
+    };
+    struct counter_row_t {
+        int64_t ts;
+        uint64_t value;
+        uint32_t cat, name, thread;
+    };
+
+    std::vector<span_row_t> spans;
+    std::vector<counter_row_t> counters;
+    std::vector<arg_slot_t> argSlots; // Arguments are not exported but still have to leave the arg streams.
+    int64_t drained = 0;
+    for (auto &threadBuffer : threadBuffers_) {
+        ThreadBuffer &buffer = *threadBuffer;
+        buffer.events.drain([&](raw_event_t &event) {
+            takeArgs(buffer.args, event.argCount, argSlots);
+            drained += sizeof(raw_event_t) + argSlots.size() * sizeof(arg_slot_t);
+            argSlots.clear();
+            if (event.ph == 'B') {
+                buffer.csvOpenSpans.push_back(event);
+            } else if (event.ph == 'E') {
+                auto open = std::find_if(buffer.csvOpenSpans.rbegin(), buffer.csvOpenSpans.rend(), [&](const raw_event_t &start) {
+                    return start.cat == event.cat && start.name == event.name;
+                });
+                if (open == buffer.csvOpenSpans.rend())
+                    return;
+                int64_t start = TraceClock::toEpochNanos(open->ts);
+                spans.push_back({start, TraceClock::toEpochNanos(event.ts) - start, event.cat, event.name, buffer.tid});
+                buffer.csvOpenSpans.erase(std::next(open).base());
+            } else if (event.ph == 'C') {
+                counters.push_back({TraceClock::toEpochNanos(event.ts), event.value, event.cat, event.name, buffer.tid});
+            }
+        });
+    }
+    stringTable_.snapshot(strings_);
+
+    std::sort(spans.begin(), spans.end(), [](const span_row_t &a, const span_row_t &b) { return a.start < b.start; });
+    std::sort(counters.begin(), counters.end(), [](const counter_row_t &a, const counter_row_t &b) { return a.ts < b.ts; });
+
+    _openTrace();
+    {
+        csv_format::Writer writer(outputFile_);
+        for (const span_row_t &span : spans) {
+            writer.field(span.start).field(span.duration).field(csvStrings_.get(strings_, span.cat))
+                  .field(csvStrings_.get(strings_, span.name)).field(uint64_t(span.thread)).endRow();
+        }
+    }
+    {
+        csv_format::Writer writer(countersFile_);
+        for (const counter_row_t &counter : counters) {
+            writer.field(counter.ts).field(csvStrings_.get(strings_, counter.cat)).field(csvStrings_.get(strings_, counter.name))
+                  .field(counter.value).field(uint64_t(counter.thread)).endRow();
+        }
+    }
+    return drained;
+}
+
+void Timer::_writeBinary(std::ostream &out, const std::vector<raw_event_t> &events, const std::vector<arg_slot_t> &argSlots, size_t count) {
+    if (stringsWritten_ < strings_.size()) {
+        binary_format::writeStrings(out, strings_, stringsWritten_);
+        stringsWritten_ = static_cast<uint32_t>(strings_.size());
+    }
+    if (threadsChanged_) {
+        binary_format::writeThreads(out, process_);
+        threadsChanged_ = false;
+    }
+
+    // Blocks are capped so readers never hold more than one block per file in memory.
+    // Only the slots of a block's events go to the block, so their args are rebased onto it.
+    std::vector<raw_event_t> blockEvents;
+    std::vector<arg_slot_t> blockSlots;
+    for (size_t first = 0; first < count; first += binary_format::kMaxBlockEvents) {
+        blockEvents.assign(events.begin() + first, events.begin() + std::min(count, first + binary_format::kMaxBlockEvents));
+        blockSlots.clear();
+        for (raw_event_t &event : blockEvents) {
+            event.ts = TraceClock::toEpochNanos(event.ts);
+            const arg_slot_t *firstSlot = argSlots.data() + event.args;
+            event.args = static_cast<uint32_t>(blockSlots.size());
+            blockSlots.insert(blockSlots.end(), firstSlot, firstSlot + chrome_format::argBlockSlots(firstSlot, event.argCount));
+        }
+        binary_format::writeEvents(out, blockEvents.data(), static_cast<uint32_t>(blockEvents.size()),
+                                   blockSlots.data(), static_cast<uint32_t>(blockSlots.size()));
+    }
+}
+
+void Timer::_sendBatch(const std::vector<raw_event_t> &events, const std::vector<arg_slot_t> &argSlots, size_t count, int64_t watermark) {
+    stringTable_.snapshot(strings_);
+    std::ostringstream batch;
+    batch.write(binary_format::kMagic, sizeof(binary_format::kMagic));
+    threadsChanged_ = true; // Every batch is read on its own, so each carries the thread table.
+    _writeBinary(batch, events, argSlots, count);
+    // A dropped batch may have carried new strings, so the next one repeats all of them.
+    if (!sink_->write(batch.str(), count, watermark))
+        stringsWritten_ = 0;
+}
+
+void Timer::_writePerfetto(const std::vector<raw_event_t> &events, const std::vector<arg_slot_t> &argSlots, size_t count) {
+    using perfetto_format::EventType;
+    static constexpr size_t kFlushBytes = 1 << 20;
+
+    std::string packets;
+    uint32_t pid = process_.pid;
+    if (threadsChanged_) {
+        // Sequences are numbered after their thread; the merge tool renumbers them when combining traces.
+        for (size_t i = perfettoSequences_.size(); i < std::max<size_t>(1, process_.threads.size()); ++i) {
+            uint64_t track = trackLayout_ == TrackLayout::Threads && i < process_.threads.size() ? perfetto_format::threadUuid(pid, process_.threads[i].tid) : 0;
+            perfettoSequences_.emplace_back(static_cast<uint32_t>(i + 1), track);
+        }
+        perfettoSequences_.front().processTrack(packets, pid, process_.name);
+        if (trackLayout_ == TrackLayout::Threads) {
+            for (size_t i = 0; i < process_.threads.size(); ++i)
+                perfettoSequences_[i].threadTrack(packets, pid, process_.threads[i].tid, process_.threads[i].name);
+        }
+        threadsChanged_ = false;
+    }
+
+    for (size_t i = 0; i < count; ++i) {
+        const raw_event_t &event = events[i];
+        perfetto_format::Encoder &sequence = perfettoSequences_[event.thread < perfettoSequences_.size() ? event.thread : 0];
+        perfetto_format::track_event_t trackEvent;
+        trackEvent.ts = TraceClock::toEpochNanos(event.ts);
+        trackEvent.category = strings_[event.cat];
+        trackEvent.name = strings_[event.name];
+        switch (event.ph) {
+        case 'B': case 'b': trackEvent.type = EventType::SliceBegin; break;
+        case 'E': case 'e': trackEvent.type = EventType::SliceEnd; break;
+        case 'C': trackEvent.type = EventType::Counter; break;
+        default: trackEvent.type = EventType::Instant; break;
+        }
+
+        if (event.ph == 'C') {
+            trackEvent.track = sequence.counterTrack(packets, pid, trackEvent.name);
+            trackEvent.counter = static_cast<int64_t>(event.value);
+            trackEvent.name = {}; // The track is named after the counter.
+        } else if (event.ph == 'b' || event.ph == 'e') {
+            trackEvent.track = sequence.asyncTrack(packets, event.value, trackEvent.name);
+        } else if (trackLayout_ == TrackLayout::Categories) {
+            uint32_t track = chrome_format::categoryTid(trackEvent.category);
+            if (categoryTracks_.emplace(track, event.cat).second)
+                sequence.threadTrack(packets, pid, track, trackEvent.category);
+            trackEvent.track = perfetto_format::threadUuid(pid, track);
+        } else {
+            trackEvent.track = perfetto_format::threadUuid(pid, process_.tid(event)); // Described above.
+        }
+        if (event.ph == 's' || event.ph == 't' || event.ph == 'f') {
+            trackEvent.flow = event.value;
+            trackEvent.terminatesFlow = event.ph == 'f';
+        }
+        if (event.ph == 'E' || event.ph == 'e')
+            trackEvent.name = {}; // Ends close the last slice begun on their track.
+
+        const arg_slot_t *slot = argSlots.data() + event.args;
+        for (uint8_t arg = 0; arg < event.argCount; ++arg) {
+            sequence.arg(strings_[slot->header.key], slot->header.type, slot->header.value,
+                        std::string_view(slot[1].bytes, slot->header.type == ArgType::String ? slot->header.value : 0));
+            slot += chrome_format::argSlots(*slot);
+        }
+        sequence.event(packets, trackEvent);
+
+        if (packets.size() >= kFlushBytes) {
+            outputFile_.write(packets.data(), static_cast<std::streamsize>(packets.size()));
+            packets.clear();
+        }
+    }
+    outputFile_.write(packets.data(), static_cast<std::streamsize>(packets.size()));
+}
+
+void Timer::_writeEvents(const std::vector<raw_event_t> &events, const std::vector<arg_slot_t> &argSlots, size_t count) {
+    // Every id referenced by a drained event was interned before the event was published.
+    stringTable_.snapshot(strings_);
+
+    _openTrace();
+    if (operation_ == TimerOperation::Perfetto) {
+        _writePerfetto(events, argSlots, count);
+        return;
+    }
+
+    if (operation_ == TimerOperation::Binary) {
+        _writeBinary(outputFile_, events, argSlots, count);
+        return;
+    }
+
+    for (size_t i = 0; i < count; ++i) {
+        raw_event_t event = events[i];
+        event.ts = TraceClock::toEpochNanos(event.ts);
+        nlohmann::json jEvent = chrome_format::toJson(event, argSlots.data(), strings_, process_);
+        if (trackLayout_ == TrackLayout::Categories) {
+            uint32_t track = chrome_format::categoryTid(strings_[event.cat]);
+            categoryTracks_.emplace(track, event.cat);
+            jEvent["tid"] = track;
+        }
+        // Entries are separated before, not after, so a truncated file only lacks the closing bracket.
+        outputFile_ << (jsonEntries_ ? ",\n" : "") << chrome_format::dump(jEvent, event.ts);
+        jsonEntries_ = true;
+    }
+}
+
+void Timer::_writeSummary() {
+    std::map<std::tuple<bool, std::string, std::string>, LogHistogram::snapshot_t> summaries;
+    {
+        std::lock_guard<std::mutex> lock(registryMutex_);
+        for (auto &threadBuffer : threadBuffers_) {
+            for (const SpanStats *stats = threadBuffer->spanStatsHead.load(std::memory_order_acquire); stats != nullptr; stats = stats->next)
+                stats->histogram.snapshot(summaries[{stats->counter, stringTable_.get(stats->category), stringTable_.get(stats->name)}]);
+        }
+    }
+
+    nlohmann::json jSummary = nlohmann::json::array();
+    for (const auto &[key, histogram] : summaries) {
+        const auto &[counter, category, name] = key;
+        if (histogram.count == 0)
+            continue;
+        nlohmann::json jEntry;
+        jEntry["cat"] = category;
+        jEntry["name"] = name;
+        jEntry["type"] = counter ? "counter" : "span";
+        jEntry["unit"] = counter ? "value" : "ns";
+        jEntry["count"] = histogram.count;
+        jEntry["min"] = histogram.min;
+        jEntry["max"] = histogram.max;
+        jEntry["mean"] = histogram.mean();
+        jEntry["p50"] = histogram.quantile(0.5);
+        jEntry["p90"] = histogram.quantile(0.9);
+        jEntry["p99"] = histogram.quantile(0.99);
+        jEntry["p999"] = histogram.quantile(0.999);
+        jSummary.push_back(jEntry);
+    }
+
+    // Written next to the output and renamed over it, so readers never see a partial summary.
+    fs::path tmpPath = outputPath_;
+    tmpPath += ".tmp";
+    {
+        std::ofstream summaryFile(tmpPath, std::ios::binary);
+        summaryFile << jSummary.dump(1) << "\n";
+        if (!summaryFile) {
+            std::cerr << "Failed to write summary: " << tmpPath << std::endl;
+            return;
+        }
+    }
+    std::error_code error;
+    fs::rename(tmpPath, outputPath_, error);
+    if (error)
+        std::cerr << "Failed to write summary: " << outputPath_ << ". Error: " << error.message() << std::endl;
+}
+
+void Timer::_closeTrace() {
+    if (operation_ == TimerOperation::Stats) {
+        _writeSummary();
+        return;
+    }
+    _openTrace();
+    if (operation_ == TimerOperation::Perfetto) {
+        // Packets are self-contained, there is nothing to terminate; names are in the track descriptors.
+        for (perfetto_format::Encoder &sequence : perfettoSequences_)
+            sequence.reset();
+    }
+    else if (operation_ != TimerOperation::Binary) {
+        // Names only need to appear somewhere in the trace, so they go last where every thread is known.
+        for (const auto &entry : _metadataEvents()) {
+            outputFile_ << (jsonEntries_ ? ",\n" : "") << entry.dump();
+            jsonEntries_ = true;
+        }
+        outputFile_ << (jsonEntries_ ? "\n]\n" : "]\n");
+    }
+    outputFile_.flush();
+    if (countersFile_.is_open())
+        countersFile_.flush();
+    traceOpen_ = false;
+    stringsWritten_ = 0;
+    threadsChanged_ = true;
+    categoryTracks_.clear();
+}
+
+void Timer::_writerLoop() {
+    std::vector<raw_event_t> events;
+    std::vector<arg_slot_t> argSlots;
+    std::vector<arg_slot_t> keptSlots;
+    auto byTimestamp = [](const raw_event_t &a, const raw_event_t &b) { return a.ts < b.ts; };
+    int64_t lastPass = std::numeric_limits<int64_t>::min();
+
+    while (true) {
+        bool stop;
         {
-            size_t memoryDrawBytes = getCurrentMemoryDraw();
-            _coreAddCounterEvent(event_category, event_category + " Memory", memoryDrawBytes, args);
+            std::unique_lock<std::mutex> lock(writerMutex_);
+            writerWake_.wait_for(lock, flushInterval_, [this]() {
+                return writerStop_ || pendingBytes_.load(std::memory_order_relaxed) >= highWaterMarkBytes_;
+            });
+            stop = writerStop_;
+        }
+
+        // Spans are paired per thread as they are drained, so CSV batches need no watermark.
+        if (operation_ == TimerOperation::CSV && !sink_) {
+            {
+                std::lock_guard<std::mutex> lock(registryMutex_);
+                _releasePending(_writeCsv());
+            }
+            outputFile_.flush();
+            countersFile_.flush();
+            if (stop)
+                return;
+            continue;
+        }
+
+        // Nothing is buffered in stats mode, the summary is rewritten instead. _closeTrace writes the last one.
+        if (operation_ == TimerOperation::Stats) {
+            if (stop)
+                return;
+            _writeSummary();
+            continue;
+        }
+
+        // Events are published right after being stamped, so almost everything stamped before the drain
+        // started is already visible. Holding back newer events keeps the file sorted across batches.
+        int64_t now = _timestamp();
+        int64_t watermark = now;
+        {
+            std::lock_guard<std::mutex> lock(registryMutex_);
+            // Deferred starts are only recorded at their stop, so nothing after the oldest open one is ready yet.
+            // Read before draining, so the start of a span released since is drained with this batch.
+            for (const auto &threadBuffer : threadBuffers_)
+                watermark = std::min(watermark, threadBuffer->oldestDeferred.load(std::memory_order_acquire));
+            _releasePending(_drainBuffers(events, argSlots));
+            // Deferred site starts are held by the consumer, which just caught up with every queued record.
+            for (const auto &threadBuffer : threadBuffers_) {
+                auto deferred = std::find_if(threadBuffer->siteStack.begin(), threadBuffer->siteStack.end(),
+                                             [](const OpenSite &open) { return open.decision == SamplingDecision::Defer; });
+                if (deferred != threadBuffer->siteStack.end())
+                    watermark = std::min(watermark, deferred->start);
+            }
+            _snapshotProcess();
+        }
+        // A tail-capture span can stay open for the whole run. Nothing is held for more than one pass, at most a
+        // flush interval, so its start is written late and out of order instead of holding back the stream.
+        watermark = std::max(watermark, lastPass);
+        lastPass = now;
+        std::stable_sort(events.begin(), events.end(), byTimestamp);
+        size_t ready = stop ? events.size()
+                            : std::upper_bound(events.begin(), events.end(), raw_event_t{watermark}, byTimestamp) - events.begin();
+        if (sink_) {
+            _sendBatch(events, argSlots, ready, stop ? std::numeric_limits<int64_t>::max() : TraceClock::toEpochNanos(watermark));
+        } else {
+            _writeEvents(events, argSlots, ready);
+            outputFile_.flush();
+        }
+
+        // Keep the held back events and their args for the next batch.
+        events.erase(events.begin(), events.begin() + ready);
+        keptSlots.clear();
+        for (raw_event_t &event : events) {
+            const arg_slot_t *first = argSlots.data() + event.args;
+            event.args = static_cast<uint32_t>(keptSlots.size());
+            keptSlots.insert(keptSlots.end(), first, first + chrome_format::argBlockSlots(first, event.argCount));
+        }
+        argSlots.swap(keptSlots);
+
+        if (stop)
+            return;
+    }
+}
+
+void Timer::enableStreaming(size_t highWaterMarkBytes, std::chrono::milliseconds flushInterval) {
+    if (operation_ == TimerOperation::Disabled || streaming_ || ringEnabled_)
+        return;
+    if (!outputFile_.is_open()) {
+        std::cerr << "Output file is not open. Cannot stream logs." << std::endl;
+        return;
+    }
+    highWaterMarkBytes_ = static_cast<int64_t>(highWaterMarkBytes);
+    dropAboveBytes_.store(std::max(highWaterMarkBytes_, kReportBytes) * kDropAboveMarks, std::memory_order_relaxed);
+    flushInterval_ = flushInterval;
+    // Written up front, so the file is a loadable trace even if the process dies before the first batch.
+    _openTrace();
+    outputFile_.flush();
+    writerStop_ = false;
+    streaming_ = true;
+    writerThread_ = std::thread(&Timer::_writerLoop, this);
+}
+
+void Timer::enableStreaming(std::shared_ptr<TraceSink> sink, size_t highWaterMarkBytes, std::chrono::milliseconds flushInterval) {
+    if (operation_ == TimerOperation::Disabled || streaming_ || ringEnabled_ || !sink)
+        return;
+    if (operation_ == TimerOperation::Stats) {
+        std::cerr << "The stats operation records no events. Cannot stream to a sink." << std::endl;
+        return;
+    }
+    sink_ = std::move(sink);
+    highWaterMarkBytes_ = static_cast<int64_t>(highWaterMarkBytes);
+    dropAboveBytes_.store(std::max(highWaterMarkBytes_, kReportBytes) * kDropAboveMarks, std::memory_order_relaxed);
+    flushInterval_ = flushInterval;
+    writerStop_ = false;
+    streaming_ = true;
+    writerThread_ = std::thread(&Timer::_writerLoop, this);
+}
+
+void Timer::_stopStreaming() {
+    {
+        std::lock_guard<std::mutex> lock(writerMutex_);
+        writerStop_ = true;
+    }
+    writerWake_.notify_one();
+    writerThread_.join();
+    streaming_ = false;
+    dropAboveBytes_.store(std::numeric_limits<int64_t>::max(), std::memory_order_relaxed);
+    if (sink_) {
+        sink_->close();
+        sink_.reset();
+        stringsWritten_ = 0;
+        return;
+    }
+    _closeTrace();
+}
+
+bool Timer::enablePerfCounters(const std::vector<PerfCounter> &counters) {
+    if (operation_ == TimerOperation::Disabled || perfEnabled_ || counters.empty())
+        return false;
+    if (operation_ == TimerOperation::Stats) {
+        std::cerr << "The stats operation records no span args. Cannot attach performance counters." << std::endl;
+        return false;
+    }
+    perfCounters_ = counters;
+    ThreadBuffer &buffer = _localBuffer();
+    if (_perfGroup(buffer) == nullptr)
+        return false;
+    perfEnabled_.store(true, std::memory_order_release);
+    return true;
+}
+
+bool Timer::enableMappedBuffer(const std::string &path, size_t bytes) {
+    if (operation_ == TimerOperation::Disabled || ringEnabled_)
+        return false;
+    if (operation_ == TimerOperation::CSV || operation_ == TimerOperation::Stats || streaming_ || deferred_) {
+        std::cerr << "The mapped buffer only works with the Chrome and binary operations, without streaming or deferred recording." << std::endl;
+        return false;
+    }
+
+    // Ticks map linearly to epoch nanoseconds, so two points are enough for the recovery tool.
+    constexpr int64_t kSpan = 1000000000;
+    int64_t tickOrigin = _timestamp();
+    int64_t epochOrigin = TraceClock::toEpochNanos(tickOrigin);
+    double nanosPerTick = static_cast<double>(TraceClock::toEpochNanos(tickOrigin + kSpan) - epochOrigin) / kSpan;
+
+    std::lock_guard<std::mutex> lock(registryMutex_);
+    auto ring = std::make_unique<ring_format::MappedRing>();
+    std::string error;
+    if (!ring->open(path, bytes, pid_, processName_, tickOrigin, epochOrigin, nanosPerTick, error)) {
+        std::cerr << "Failed to create mapped buffer " << path << ": " << error << std::endl;
+        return false;
+    }
+    for (const auto &threadBuffer : threadBuffers_)
+        ring->setThread(threadBuffer->index, threadBuffer->tid, threadBuffer->name);
+    ring_ = std::move(ring);
+    ringEnabled_.store(true, std::memory_order_release);
+    return true;
+}
+
+trace_site_t Timer::site(const std::string &event_category, const std::string &event_name, const std::string &argKey, bool measureMemory) {
+    ThreadBuffer &buffer = _localBuffer();
+    trace_site_t site{0, _intern(buffer, event_category), _intern(buffer, event_name),
+                      argKey.empty() ? std::numeric_limits<uint32_t>::max() : _intern(buffer, argKey), measureMemory};
+    uint32_t memoryName = _memoryCounterId(buffer, site.category);
+    std::lock_guard<std::mutex> lock(registryMutex_);
+    site.id = static_cast<uint32_t>(sites_.size());
+    sites_.push_back({site, memoryName});
+    return site;
+}
+
+void Timer::start(trace_site_t site, int64_t arg) {
+    _recordSite(site, 'B', arg);
+}
+
+void Timer::stop(trace_site_t site, int64_t arg) {
+    _recordSite(site, 'E', arg);
+}
+
+void Timer::_recordSite(trace_site_t site, char ph, int64_t arg) {
+    if (deferred_.load(std::memory_order_relaxed)) {
+        _localBuffer().sites.push({_timestamp(), arg, site.id, ph});
+        return;
+    }
+    if (operation_ == TimerOperation::Disabled)
+        return;
+    ThreadBuffer &buffer = _localBuffer();
+    ProfileScope profile(*this, buffer, ph == 'B' ? SelfProfileApi::Start : SelfProfileApi::Stop);
+    buffer.scratch.clear();
+    if (site.argKey != std::numeric_limits<uint32_t>::max())
+        buffer.scratch.append(site.argKey, ArgType::Int64, static_cast<uint64_t>(arg));
+    uint32_t nameId = operation_ == TimerOperation::Firefox ? site.category : site.name;
+    if (ph == 'B')
+        _start(buffer, site.category, nameId, buffer.scratch, site.measureMemory);
+    else
+        _stop(buffer, site.category, nameId, buffer.scratch, site.measureMemory);
+}
+
+void Timer::_materializeSites(ThreadBuffer &buffer, uint16_t index, std::vector<raw_event_t> &events, std::vector<arg_slot_t> &argSlots) {
+    // Appends a span event of a site, preceded by a memory counter unless memory is 0.
+    auto emit = [&](const site_info_t &info, int64_t ts, char ph, const int64_t *arg, uint64_t memory) {
+        raw_event_t event;
+        event.ts = ts;
+        event.thread = index;
+        event.argCount = 0;
+        event.args = static_cast<uint32_t>(argSlots.size());
+        event.cat = info.site.category;
+        if (memory != 0) {
+            event.value = memory;
+            event.name = info.memoryName;
+            event.ph = 'C';
+            events.push_back(event);
         }
-        std::string real_event_name = (operation_==TimerOperation::Firefox)? event_category: event_name; // To keep everything on the same line all event_names must be the same for firefox
-        _stop(event_category, real_event_name, args);
-        _stop("Timer", "stop Function", {});
+        event.value = 0;
+        event.name = operation_ == TimerOperation::Firefox ? info.site.category : info.site.name;
+        event.ph = ph;
+        if (arg != nullptr && info.site.argKey != std::numeric_limits<uint32_t>::max()) {
+            arg_slot_t slot;
+            slot.header.key = info.site.argKey;
+            slot.header.type = ArgType::Int64;
+            slot.header.value = static_cast<uint64_t>(*arg);
+            argSlots.push_back(slot);
+            event.argCount = 1;
+        }
+        events.push_back(event);
+    };
+    // Ends an open site span with the stop of a site, first writing its start if it was deferred and lasted long enough.
+    auto close = [&](const OpenSite &open, const site_info_t &stop, int64_t ts, const int64_t *arg, bool measureMemory) {
+        if (open.decision == SamplingDecision::Drop)
+            return;
+        const site_info_t &start = sites_[open.site];
+        if (open.decision == SamplingDecision::Defer) {
+            if (!_sampler(buffer, buffer.siteSamplers, start.site.category).keep(TraceClock::toEpochNanos(ts) - TraceClock::toEpochNanos(open.start)))
+                return;
+            emit(start, open.start, 'B', &open.arg, open.memory);
+        }
+        emit(stop, ts, 'E', arg, measureMemory ? _memoryDraw() : 0);
+    };
+
+    buffer.sites.drain([&](site_record_t &record) {
+        const site_info_t &info = sites_[record.site];
+        uint32_t nameId = operation_ == TimerOperation::Firefox ? info.site.category : info.site.name;
+        uint64_t key = (uint64_t(info.site.category) << 32) | nameId;
+        if (record.ph == 'B') {
+            // Decided at the recorded time, so rate limits see the calls as they were made.
+            OpenSite open{key, record.site, SamplingDecision::Record, record.ts, record.arg};
+            if (_streamingFull())
+                open.decision = SamplingDecision::Drop;
+            else if (samplingVersion_.load(std::memory_order_relaxed) != 0)
+                open.decision = _sampler(buffer, buffer.siteSamplers, info.site.category).decide(false, TraceClock::toEpochNanos(record.ts));
+            if (open.decision != SamplingDecision::Drop && info.site.measureMemory)
+                open.memory = _memoryDraw();
+            if (open.decision == SamplingDecision::Record)
+                emit(info, record.ts, 'B', &record.arg, open.memory);
+            buffer.siteStack.push_back(open);
+            return;
+        }
+
+        // Same rules as _stop(), on the stack of site spans.
+        auto open = std::find_if(buffer.siteStack.rbegin(), buffer.siteStack.rend(), [key](const OpenSite &site) { return site.key == key; });
+        if (open == buffer.siteStack.rend()) {
+            unmatchedStops_.fetch_add(1, std::memory_order_relaxed);
+            return;
+        }
+        for (auto inner = buffer.siteStack.rbegin(); inner != open; ++inner) {
+            close(*inner, sites_[inner->site], record.ts, nullptr, false);
+            closedInner_.fetch_add(1, std::memory_order_relaxed);
+        }
+        close(*open, info, record.ts, &record.arg, info.site.measureMemory);
+        buffer.siteStack.erase(std::next(open).base(), buffer.siteStack.end());
+    });
+}
+
+bool Timer::enableDeferredRecording(std::chrono::microseconds interval) {
+    if (operation_ == TimerOperation::Disabled || consumerThread_.joinable())
+        return false;
+    if (operation_ == TimerOperation::CSV || operation_ == TimerOperation::Stats || ringEnabled_) {
+        std::cerr << "Deferred recording only works with the Chrome, Firefox, binary and Perfetto operations, without a mapped buffer." << std::endl;
+        return false;
     }
+    consumerInterval_ = interval;
+    consumerStop_ = false;
+    consumerThread_ = std::thread(&Timer::_consumerLoop, this);
+    deferred_.store(true, std::memory_order_release);
+    return true;
+}
+
+void Timer::_consumeSites() {
+    size_t firstEvent = deferredEvents_.size();
+    size_t firstSlot = deferredSlots_.size();
+    for (size_t thread = 0; thread < threadBuffers_.size(); ++thread) {
+        uint16_t index = static_cast<uint16_t>(std::min<size_t>(thread, std::numeric_limits<uint16_t>::max()));
+        _materializeSites(*threadBuffers_[thread], index, deferredEvents_, deferredSlots_);
+    }
+    if (streaming_.load(std::memory_order_relaxed)) {
+        int64_t bytes = (deferredEvents_.size() - firstEvent) * sizeof(raw_event_t) + (deferredSlots_.size() - firstSlot) * sizeof(arg_slot_t);
+        if (pendingBytes_.fetch_add(bytes, std::memory_order_relaxed) + bytes >= highWaterMarkBytes_)
+            writerWake_.notify_one();
+    }
+}
+
+void Timer::_consumerLoop() {
+    std::unique_lock<std::mutex> lock(consumerMutex_);
+    while (!consumerWake_.wait_for(lock, consumerInterval_, [this]() { return consumerStop_; })) {
+        std::lock_guard<std::mutex> registryLock(registryMutex_);
+        _consumeSites();
+    }
+}
+
+void Timer::_stopConsumer() {
+    if (!consumerThread_.joinable())
+        return;
+    // Later site calls record synchronously. What is queued is materialized now, so its sampling
+    // drops and nesting errors are counted before dumpLogs() reports them.
+    deferred_.store(false, std::memory_order_relaxed);
+    {
+        std::lock_guard<std::mutex> lock(consumerMutex_);
+        consumerStop_ = true;
+    }
+    consumerWake_.notify_one();
+    consumerThread_.join();
+    std::lock_guard<std::mutex> lock(registryMutex_);
+    _consumeSites();
+}
+
+void Timer::enableMemorySampler(std::chrono::milliseconds interval) {
+    if (operation_ == TimerOperation::Disabled || samplerThread_.joinable())
+        return;
+    process_stats_t stats;
+    getProcessStats(stats);
+    lastMemoryDraw_.store(stats.residentBytes, std::memory_order_relaxed);
+    samplerInterval_ = interval;
+    samplerStop_ = false;
+    samplerRunning_ = true;
+    samplerThread_ = std::thread(&Timer::_samplerLoop, this);
+}
+
+void Timer::_samplerLoop() {
+    ThreadBuffer &buffer = _localBuffer();
+    uint32_t categoryId = _intern(buffer, "Process");
+    const std::pair<uint32_t, uint64_t process_stats_t::*> counters[] = {
+        {_intern(buffer, "Resident Memory"), &process_stats_t::residentBytes},
+        {_intern(buffer, "Virtual Memory"), &process_stats_t::virtualBytes},
+        {_intern(buffer, "Shared Memory"), &process_stats_t::sharedBytes},
+        {_intern(buffer, "Minor Page Faults"), &process_stats_t::minorFaults},
+        {_intern(buffer, "Major Page Faults"), &process_stats_t::majorFaults},
+        {_intern(buffer, "User CPU ms"), &process_stats_t::userMillis},
+        {_intern(buffer, "System CPU ms"), &process_stats_t::systemMillis},
+        {_intern(buffer, "Threads"), &process_stats_t::threads},
+    };
+
+    std::unique_lock<std::mutex> lock(samplerMutex_);
+    while (!samplerStop_) {
+        process_stats_t stats;
+        if (getProcessStats(stats)) {
+            lastMemoryDraw_.store(stats.residentBytes, std::memory_order_relaxed);
+            for (const auto &[nameId, field] : counters)
+                _coreAddCounterEvent(buffer, categoryId, nameId, stats.*field);
+        }
+        samplerWake_.wait_for(lock, samplerInterval_, [this]() { return samplerStop_; });
+    }
+}
+
+void Timer::_stopSampler() {
+    if (!samplerThread_.joinable())
+        return;
+    {
+        std::lock_guard<std::mutex> lock(samplerMutex_);
+        samplerStop_ = true;
+    }
+    samplerWake_.notify_one();
+    samplerThread_.join();
+    samplerRunning_ = false;
+}
+
+Timer::~Timer() {
+    _stopConsumer();
+    _stopSampler();
+    if (streaming_)
+        _stopStreaming();
 }
 
 void Timer::dumpLogs() {
     if (operation_ != TimerOperation::Disabled) {
-        _start("Timer", "dumpLogs Function", {});
+        ThreadBuffer &buffer = _localBuffer();
+        ProfileScope profile(*this, buffer, SelfProfileApi::DumpLogs);
 
         if (!outputFile_.is_open()) {
             std::cerr << "Output file is not open. Cannot dump logs." << std::endl;
             return;
         }
 
-        std::lock_guard<std::mutex> lock(memoryMutex_);
+        // The sampler's last events must be recorded before the buffers are drained.
+        _stopSampler();
+        _stopConsumer();
+        _reportNesting();
+        _reportSampling(buffer);
+
+        if (streaming_) {
+            _stopStreaming();
+            return;
+        }
 
-        nlohmann::json jsonLogs = nlohmann::json::array();
-        for (const raw_event_t& event : inMemoryLogs_) {
-            nlohmann::json jEvent;
-            jEvent["pid"] = event.pid;
-            jEvent["tid"] = event.tid;
-            jEvent["ts"] = event.ts;
-            jEvent["ph"] = std::string(1,event.ph);
-            jEvent["name"] = event.name;
-            jEvent["cat"] = event.cat;
+        // Nothing is buffered in stats mode, and the summary takes the registry lock itself.
+        if (operation_ == TimerOperation::Stats) {
+            _closeTrace();
+            return;
+        }
 
-            // Given that args is now an unordered_map, this becomes simpler
-            jEvent["args"] = event.args;
+        std::lock_guard<std::mutex> lock(registryMutex_);
 
-            jsonLogs.push_back(jEvent);
+        if (operation_ == TimerOperation::CSV) {
+            _writeCsv();
+            _closeTrace();
+            return;
         }
 
-        outputFile_ << jsonLogs.dump(4);
-        inMemoryLogs_.clear();
+        // Collect every thread's buffer, then merge them into a single timeline.
+        std::vector<raw_event_t> events;
+        std::vector<arg_slot_t> argSlots;
+        _drainBuffers(events, argSlots);
+        _readRing(events, argSlots);
+        _snapshotProcess();
+        std::stable_sort(events.begin(), events.end(),
+                         [](const raw_event_t &a, const raw_event_t &b) { return a.ts < b.ts; });
+
+        _writeEvents(events, argSlots, events.size());
+        _closeTrace();
+    }
+}
+
+void Timer::enableSelfProfiling(uint32_t sampleEvery) {
+    selfProfileEvery_.store(sampleEvery, std::memory_order_relaxed);
+}
 
-        _stop("Timer", "dumpLogs Function", {});
+std::vector<api_profile_t> Timer::selfProfile() {
+    std::vector<api_profile_t> profiles;
+    std::lock_guard<std::mutex> lock(registryMutex_);
+    for (size_t api = 0; api < SelfProfile::kApis; ++api) {
+        api_profile_t profile;
+        profile.api = kSelfProfileApiNames[api];
+        LogHistogram::snapshot_t nanos;
+        for (auto &threadBuffer : threadBuffers_) {
+            const SelfProfile *threadProfile = threadBuffer->profile.load(std::memory_order_acquire);
+            if (threadProfile == nullptr)
+                continue;
+            profile.calls += threadProfile->calls[api].load(std::memory_order_relaxed);
+            threadProfile->nanos[api].snapshot(nanos);
+        }
+        profile.sampled = nanos.count;
+        if (nanos.count > 0)
+            profile.totalNanos = static_cast<uint64_t>(static_cast<long double>(nanos.total) * profile.calls / nanos.count);
+        profile.p50Nanos = nanos.quantile(0.5);
+        profile.p99Nanos = nanos.quantile(0.99);
+        profiles.push_back(profile);
     }
-}
\ No newline at end of file
+    return profiles;
+}
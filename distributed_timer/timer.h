@@ -10,24 +10,28 @@
 #include <thread>
 #include <filesystem>
 #include <cstring>
+#include <array>
+#include <atomic>
+#include <memory>
+#include <unordered_map>
+#include <condition_variable>
 #include <nlohmann/json.hpp>
+#include "clock.h"
+#include "csv_format.h"
+#include "event_buffer.h"
+#include "histogram.h"
+#include "perf_counters.h"
+#include "perfetto_format.h"
+#include "ring_format.h"
+#include "sampling.h"
+#include "string_table.h"
+#include "trace_args.h"
+#include "trace_context.h"
+#include "trace_event.h"
+#include "trace_sink.h"
 
-using ClockType = std::chrono::high_resolution_clock;
 namespace fs = std::filesystem;
 
-struct raw_event_t {
-    std::string name;
-    std::string cat;
-    void *id;
-    int64_t ts;
-    uint32_t pid;
-    uint32_t tid;
-    char ph;
-    std::unordered_map<std::string, std::string> args; 
-};
-
-
-
 /**
  * @brief Enumeration of timer operation types.
  */
@@ -35,7 +39,79 @@ enum class TimerOperation{
     Disabled, ///< Timer operation is disabled.
     Chrome,   ///< Timer operation type is Chrome.
     Firefox,  ///< Timer operation type is Firefox.
-    CSV       ///< Timer operation type is CSV.
+    CSV,      ///< Timer operation type is CSV.
+    Binary,   ///< Timer operation type is the compact binary format of binary_format.h.
+    Stats,    ///< Only per (category, name) duration and counter histograms are kept; a JSON summary is written.
+    Perfetto  ///< Timer operation type is Perfetto's protobuf trace format, see perfetto_format.h.
+};
+
+/**
+ * @brief Point of a request/reply exchange marked by Timer::addClockSyncMarker.
+ */
+enum class ClockSyncPoint{
+    Send,    ///< The message is about to be sent.
+    Receive  ///< The message has just been received.
+};
+
+/**
+ * @brief How Chrome traces lay out events on timelines.
+ */
+enum class TrackLayout{
+    Threads,   ///< One timeline per recording thread, named after the name it registered.
+    Categories ///< One timeline per category, whatever the thread.
+};
+
+/**
+ * @brief Point of a flow recorded by Timer::addFlowEvent.
+ */
+enum class FlowPoint{
+    Start, ///< The flow leaves the enclosing span, e.g. a request is sent.
+    Step,  ///< The flow passes through the enclosing span, e.g. a request is forwarded.
+    End    ///< The flow arrives in the enclosing span, e.g. a reply is received.
+};
+
+/**
+ * @brief Public Timer calls measured by the self-profiling mode.
+ */
+enum class SelfProfileApi{
+    Start,
+    Stop,
+    AddCounterEvent,
+    AddClockSyncMarker,
+    AddFlowEvent,
+    DumpLogs,
+    Count ///< Number of measured calls, not a call.
+};
+
+/**
+ * @brief Overhead of one Timer call as measured by the self-profiling mode.
+ */
+struct api_profile_t {
+    std::string api;
+    uint64_t calls = 0;      ///< Calls made while self-profiling was enabled.
+    uint64_t sampled = 0;    ///< Calls that were timed.
+    uint64_t totalNanos = 0; ///< Time spent in all calls, extrapolated from the timed ones.
+    uint64_t p50Nanos = 0;
+    uint64_t p99Nanos = 0;
+};
+
+/**
+ * @brief Interned (category, name) of a span, made by Timer::handle(). Only valid with the timer that made it.
+ */
+struct span_handle_t {
+    uint32_t category;
+    uint32_t name;
+};
+
+/**
+ * @brief A span site registered with Timer::site(), whose start and stop can be deferred. Only valid with the timer that made it.
+ */
+struct trace_site_t {
+    uint32_t id;
+    uint32_t category;
+    uint32_t name;
+    uint32_t argKey;    ///< Id of the key of the int64 arg, or the max uint32_t value for sites without one.
+    bool measureMemory;
 };
 
 /**
@@ -44,20 +120,373 @@ enum class TimerOperation{
 class Timer
 {
 private:
-    std::mutex memoryMutex_;
+    // Self-profiling counters of one thread, allocated when the thread first makes a profiled call.
+    struct SelfProfile {
+        static constexpr size_t kApis = static_cast<size_t>(SelfProfileApi::Count);
+        std::array<std::atomic<uint64_t>, kApis> calls{};
+        std::array<LogHistogram, kApis> nanos;
+        std::array<uint32_t, kApis> untilSample{}; // Calls to skip before the next timed one.
+    };
+
+    // Histogram of the durations of one span, or of the values of one counter, recorded by one thread.
+    struct SpanStats {
+        uint32_t category;
+        uint32_t name;
+        bool counter;
+        LogHistogram histogram;
+        SpanStats *next = nullptr;
+    };
+
+    // A span started on a thread and not stopped yet.
+    struct OpenSpan {
+        uint64_t key;                                            // Category id << 32 | name id.
+        SamplingDecision decision;
+        int64_t start = 0;                                       // Deferred spans: what the start would have recorded.
+        uint64_t memory = 0;
+        uint32_t argsBegin = 0;                                  // Deferred spans: first slot of their args in deferredArgs.
+        uint8_t argCount = 0;
+        bool hasPerf = false;                                    // Whether perfStart holds the counters at the start.
+        PerfCounterGroup::values_t perfStart;
+    };
+
+    // Samplers of one thread, by category. Only one thread at a time decides with them.
+    struct SamplerSet {
+        ~SamplerSet() {
+            for (Sampler *sampler = head.load(std::memory_order_relaxed); sampler != nullptr;) {
+                Sampler *next = sampler->next;
+                delete sampler;
+                sampler = next;
+            }
+        }
+
+        uint32_t version = 0;                 // samplingVersion_ the samplers were set up for.
+        std::vector<Sampler *> byCategory;    // Category id -> sampler.
+        std::atomic<Sampler *> head{nullptr}; // Same samplers, for readers of the drop counts.
+    };
+
+    // A site span opened by a deferred record and not closed yet, as tracked by the consumer.
+    struct OpenSite {
+        uint64_t key;                 // Category id << 32 | name id, as for OpenSpan.
+        uint32_t site;
+        SamplingDecision decision;
+        int64_t start = 0;            // Deferred spans: the start, written with the stop.
+        int64_t arg = 0;
+        uint64_t memory = 0;
+    };
+
+    // A start or stop of a site, as recorded by the calling thread when recording is deferred.
+    struct site_record_t {
+        int64_t ts;
+        int64_t arg;
+        uint32_t site;
+        char ph;
+    };
+
+    // What the consumer needs to know of a site to turn its records into events.
+    struct site_info_t {
+        trace_site_t site;
+        uint32_t memoryName; // "<category> Memory".
+    };
+
+    // Everything owned by one recording thread. Only that thread writes to it; dumpLogs drains it.
+    struct ThreadBuffer {
+        ~ThreadBuffer() {
+            delete profile.load(std::memory_order_relaxed);
+            for (SpanStats *stats = spanStatsHead.load(std::memory_order_relaxed); stats != nullptr;) {
+                SpanStats *next = stats->next;
+                delete stats;
+                stats = next;
+            }
+        }
+
+        EventBuffer<raw_event_t> events;
+        EventBuffer<arg_slot_t> args;
+        EventBuffer<site_record_t> sites;                         // Deferred site records, turned into events when drained.
+        std::vector<OpenSite> siteStack;                          // Open deferred site spans, innermost last, guarded by registryMutex_.
+        SamplerSet siteSamplers;                                  // Samplers of deferred sites, guarded by registryMutex_.
+        uint32_t argsWritten = 0;                                 // Offset of the next arg slot.
+        arg_block_t scratch;                                      // Args of the current call, encoded.
+        arg_block_t perfArgs;                                     // Args of a stop, with its counter deltas.
+        int64_t unreportedBytes = 0;                              // Streamed bytes not yet added to pendingBytes_.
+        std::unordered_map<std::string, uint32_t> ids;            // Thread-local cache of stringTable_.
+        std::unordered_map<uint32_t, uint32_t> memoryCounterIds;  // Category id -> "<category> Memory" id.
+        std::unordered_map<const char *, uint32_t> literalIds;    // Ids of string literals, keyed by address.
+        std::atomic<SelfProfile *> profile{nullptr};
+        std::vector<OpenSpan> spanStack;                          // Open spans, innermost last.
+        std::vector<arg_slot_t> deferredArgs;                     // Start args of open deferred spans, a stack like spanStack.
+        arg_block_t deferredStart;                                // Args of a deferred start being written.
+        uint32_t deferredOpen = 0;                                // Open deferred spans.
+        std::atomic<int64_t> oldestDeferred{std::numeric_limits<int64_t>::max()}; // Start of the outermost open deferred span.
+        SamplerSet samplers;                                      // Owner thread only.
+        std::unique_ptr<PerfCounterGroup> perf;                   // Null until the thread's first span with counters enabled.
+        bool perfOpened = false;                                  // Whether opening perf was attempted.
+        uint32_t tid = 0;                                         // OS id of the thread.
+        uint32_t index = 0;                                       // Position in threadBuffers_.
+        ring_format::block_header_t *ringBlock = nullptr;         // Block of the mapped buffer being filled.
+        std::string name;                                         // Registered name, guarded by registryMutex_.
+
+        // Stats operation. Histograms are only ever prepended to the list, so readers can walk it without a lock.
+        std::vector<std::pair<uint64_t, int64_t>> openSpans;       // Key and start timestamp of unfinished spans.
+        std::unordered_map<uint64_t, SpanStats *> spanStats;        // Key -> histogram, owner thread only.
+        std::unordered_map<uint64_t, SpanStats *> counterStats;     // Key -> histogram, owner thread only.
+        std::atomic<SpanStats *> spanStatsHead{nullptr};
+
+        // CSV operation, writer side: drained starts still waiting for their stop.
+        std::vector<raw_event_t> csvOpenSpans;
+    };
+
+    // Times one public call when self-profiling is enabled.
+    class ProfileScope;
+
+    const uint64_t timerId_;
+    std::mutex registryMutex_; // Guards threadBuffers_ and serializes draining them.
+    std::vector<std::unique_ptr<ThreadBuffer>> threadBuffers_;
+    StringTable stringTable_;
     fs::path outputPath_;
     std::ofstream outputFile_;
-    std::vector<raw_event_t> inMemoryLogs_;
     TimerOperation operation_;
+    TrackLayout trackLayout_ = TrackLayout::Threads;
+    const uint32_t pid_;
+    std::string processName_; // Guarded by registryMutex_.
+
+    // Stops that did not match the innermost open span of their thread.
+    std::atomic<uint64_t> unmatchedStops_{0}; // No open span matched, the stop was dropped.
+    std::atomic<uint64_t> closedInner_{0};    // Inner spans closed early by the stop of an enclosing span.
+
+    // Streaming state. The writer thread owns the output file while streaming is enabled.
+    std::atomic<bool> streaming_{false};
+    std::atomic<int64_t> pendingBytes_{0}; // Recorded but not yet written bytes, reported in batches.
+    int64_t highWaterMarkBytes_ = 0;
+    std::atomic<int64_t> dropAboveBytes_{std::numeric_limits<int64_t>::max()}; // Pending bytes past which events are dropped.
+    std::atomic<uint64_t> streamingDrops_{0};  // Spans and events dropped since the writer fell behind.
+    std::chrono::milliseconds flushInterval_{0};
+    std::thread writerThread_;
+    std::mutex writerMutex_;
+    std::condition_variable writerWake_;
+    bool writerStop_ = false;
+    std::shared_ptr<TraceSink> sink_; // Receives the batches instead of the output file when set.
+
+    // Mapped buffer state. Events go to ring_ instead of the thread buffers while it is enabled.
+    std::atomic<bool> ringEnabled_{false};
+    std::unique_ptr<ring_format::MappedRing> ring_;
+    std::mutex ringStringsMutex_;              // Serializes appending strings to ring_.
+    std::atomic<uint32_t> ringStrings_{0};     // Ids below this are stored in ring_, or will never be.
+    std::atomic<uint64_t> ringDrops_{0};       // Events dropped because every block was being written to.
+    std::vector<ring_format::block_cursor_t> ringCursors_; // Records of ring_ already dumped, guarded by registryMutex_.
+    uint64_t ringOverwritten_ = 0;             // Overwritten blocks already reported, guarded by registryMutex_.
+
+    // Deferred recording state. Sites are only appended to, under registryMutex_, which also guards
+    // the events the consumer thread already built from site records.
+    std::atomic<bool> deferred_{false};
+    std::vector<site_info_t> sites_;
+    std::vector<raw_event_t> deferredEvents_;
+    std::vector<arg_slot_t> deferredSlots_;
+    std::chrono::microseconds consumerInterval_{0};
+    std::thread consumerThread_;
+    std::mutex consumerMutex_;
+    std::condition_variable consumerWake_;
+    bool consumerStop_ = false;
+
+    // Memory sampler state. While it runs, memory counters of spans reuse its last sample.
+    std::atomic<bool> samplerRunning_{false};
+    std::atomic<uint64_t> lastMemoryDraw_{0};
+    std::chrono::milliseconds samplerInterval_{0};
+    std::thread samplerThread_;
+    std::mutex samplerMutex_;
+    std::condition_variable samplerWake_;
+    bool samplerStop_ = false;
+
+    // State of the trace being written to the output file.
+    bool traceOpen_ = false;                // The header of the trace (JSON bracket, binary magic, CSV headers) is written.
+    bool jsonEntries_ = false;              // A JSON entry was written since the opening bracket.
+    uint32_t stringsWritten_ = 0;           // Strings already in the binary trace.
+    std::vector<std::string_view> strings_; // Writer's view of stringTable_.
+    std::ofstream countersFile_;            // Counters table of the CSV operation.
+    csv_format::EscapedStrings csvStrings_;
+    process_info_t process_;                // Writer's view of the process and its threads.
+    bool threadsChanged_ = true;            // process_ changed since the binary or Perfetto trace last listed it.
+    std::map<uint32_t, uint32_t> categoryTracks_; // Category view: track id -> category id, to name the tracks.
+    std::vector<perfetto_format::Encoder> perfettoSequences_; // Perfetto trace: one sequence per thread of process_.
+
+    // Sampling policies. Threads rebuild their samplers when samplingVersion_ changes; 0 means no policy was ever set.
+    std::mutex samplingMutex_;
+    std::unordered_map<uint32_t, sampling_policy_t> samplingPolicies_; // Category id -> policy.
+    sampling_policy_t defaultSamplingPolicy_;
+    std::atomic<uint32_t> samplingVersion_{0};
+    const uint32_t samplingCategoryId_;
 
-    // Starts logging an event.
-    void _start(const std::string &event_category, const std::string &event_name, const std::unordered_map<std::string, std::string> &args={});
+    // Performance counters attached to spans. perfCounters_ is set once, before perfEnabled_.
+    std::atomic<bool> perfEnabled_{false};
+    std::vector<PerfCounter> perfCounters_;
+    std::atomic<bool> perfWarned_{false};  // A thread failed to open its counters and said so.
 
-    // Stops logging an event.
-    void _stop(const std::string &event_category, const std::string &event_name, const std::unordered_map<std::string, std::string> &args={});
+    // One in selfProfileEvery_ profiled calls is timed, 0 disables self-profiling.
+    std::atomic<uint32_t> selfProfileEvery_{0};
+
+    // Ids of clock sync markers.
+    const uint32_t clockSyncCategoryId_;
+    const uint32_t clockSyncSendId_;
+    const uint32_t clockSyncReceiveId_;
+
+    // Returns the calling thread's event buffer, registering it on first use.
+    ThreadBuffer &_localBuffer();
+
+    // Returns the id of a string, going to the shared string table only on a thread cache miss.
+    uint32_t _intern(ThreadBuffer &buffer, const std::string &str);
+
+    // Returns the id of a string literal, keyed by its address so hits never touch the characters.
+    uint32_t _literalId(ThreadBuffer &buffer, const char *literal);
+
+    // Returns the id of the memory counter name of a category.
+    uint32_t _memoryCounterId(ThreadBuffer &buffer, uint32_t event_category);
+
+    // Encodes args into the thread's scratch block, interning their keys.
+    const arg_block_t &_encodeArgs(ThreadBuffer &buffer, const std::unordered_map<std::string, std::string> &args);
+    const arg_block_t &_encodeArgs(ThreadBuffer &buffer, const trace_arg_t *args, size_t count);
+
+    // Appends an event and its arguments to the thread's buffer.
+    void _record(ThreadBuffer &buffer, char ph, uint32_t event_category, uint32_t event_name, uint64_t value, const arg_block_t &args = arg_block_t());
+
+    // Same, with the timestamp of an event that happened earlier.
+    void _recordAt(ThreadBuffer &buffer, int64_t ts, char ph, uint32_t event_category, uint32_t event_name, uint64_t value, const arg_block_t &args);
+
+    // Returns a thread's sampler of a category, creating it or applying new policies as needed.
+    Sampler &_sampler(ThreadBuffer &buffer, SamplerSet &samplers, uint32_t event_category);
+
+    // Returns the decision on a span start or counter of a category, Record when no policy is set.
+    SamplingDecision _sample(ThreadBuffer &buffer, uint32_t event_category, bool counter);
+
+    // Returns the thread's counter group, opening it on first use, or null if it has no counters.
+    PerfCounterGroup *_perfGroup(ThreadBuffer &buffer);
+
+    // Records the end of a span and, for deferred spans long enough to keep, its start.
+    void _closeSpan(ThreadBuffer &buffer, const OpenSpan &span, const arg_block_t &args, bool measureMemory);
+
+    // Returns whether the writer fell behind so far that a new event must be dropped, and counts it.
+    bool _streamingFull();
+
+    // Records the streaming drop count and the drop count of every sampled category as counters, and prints them.
+    void _reportSampling(ThreadBuffer &buffer);
+
+    // Appends an event and its arguments to the thread's block of the mapped buffer.
+    void _recordRing(ThreadBuffer &buffer, raw_event_t &event, const arg_block_t &args);
+
+    // Stores every string up to id in the mapped buffer.
+    void _persistRingStrings(uint32_t id);
+
+    // Appends the events of the mapped buffer not appended by an earlier call to events, with args
+    // rebased onto argSlots. Caller must hold registryMutex_.
+    void _readRing(std::vector<raw_event_t> &events, std::vector<arg_slot_t> &argSlots);
+
+    // Returns the thread's histogram of a span or counter, creating and publishing it on first use.
+    SpanStats &_spanStats(ThreadBuffer &buffer, uint32_t event_category, uint32_t event_name, bool counter);
+
+    // Feeds a start, stop or counter into the thread's histograms instead of recording it.
+    void _recordStats(ThreadBuffer &buffer, char ph, uint32_t event_category, uint32_t event_name, uint64_t value);
+
+    // Replaces the output file with a summary of the histograms of every thread. Takes registryMutex_.
+    void _writeSummary();
+
+    // Raw TraceClock timestamp, converted to epoch nanoseconds when written.
+    static int64_t _timestamp();
+
+    // Memory draw recorded by spans: the sampler's last sample, or a fresh read when it is not running.
+    uint64_t _memoryDraw();
+
+    // Body of the memory sampler thread.
+    void _samplerLoop();
+
+    // Stops the memory sampler thread, if running.
+    void _stopSampler();
+
+    // Records a start or stop of a site: a timestamped record when deferred, a regular event otherwise.
+    void _recordSite(trace_site_t site, char ph, int64_t arg);
+
+    // Turns a thread's site records into events and arg slots, sampling and nesting them like
+    // start() and stop() would have. Caller must hold registryMutex_.
+    void _materializeSites(ThreadBuffer &buffer, uint16_t index, std::vector<raw_event_t> &events, std::vector<arg_slot_t> &argSlots);
+
+    // Turns the site records queued by every thread into deferredEvents_. Caller must hold registryMutex_.
+    void _consumeSites();
+
+    // Body of the consumer thread of deferred recording.
+    void _consumerLoop();
+
+    // Stops the consumer thread and deferred recording, if running.
+    void _stopConsumer();
+
+    // Adds a thread's recorded bytes to pendingBytes_ and wakes the writer past the high-water mark.
+    void _reportPending(ThreadBuffer &buffer);
+
+    // Moves every published event of every thread into events, with args rebased onto argSlots.
+    // Returns the number of bytes drained. Caller must hold registryMutex_.
+    int64_t _drainBuffers(std::vector<raw_event_t> &events, std::vector<arg_slot_t> &argSlots);
+
+    // Returns the process and its threads, in the order of threadBuffers_. Caller must hold registryMutex_.
+    process_info_t _processInfo();
+
+    // Refreshes process_, noting in threadsChanged_ whether it changed. Caller must hold registryMutex_.
+    void _snapshotProcess();
+
+    // Metadata events naming the process and the tracks written so far.
+    nlohmann::json _metadataEvents();
+
+    // Prints how many stops did not match the innermost open span, if any.
+    void _reportNesting();
+
+    // Subtracts written bytes from pendingBytes_.
+    void _releasePending(int64_t drained);
+
+    // Writes the header of the trace if not done yet: the opening JSON bracket, the binary magic,
+    // or the CSV headers after opening the counters table.
+    void _openTrace();
+
+    // Drains every thread and appends its completed spans and counters to the CSV tables.
+    // Returns the number of bytes drained. Caller must hold registryMutex_.
+    int64_t _writeCsv();
+
+    // Writes the new strings and the first count events as binary blocks, without the magic.
+    void _writeBinary(std::ostream &out, const std::vector<raw_event_t> &events, const std::vector<arg_slot_t> &argSlots, size_t count);
+
+    // Hands the first count events to sink_ as one binary batch.
+    void _sendBatch(const std::vector<raw_event_t> &events, const std::vector<arg_slot_t> &argSlots, size_t count, int64_t watermark);
+
+    // Appends the first count events to the output file as Perfetto packets.
+    void _writePerfetto(const std::vector<raw_event_t> &events, const std::vector<arg_slot_t> &argSlots, size_t count);
+
+    // Appends the first count events to the output file in the format of the operation.
+    void _writeEvents(const std::vector<raw_event_t> &events, const std::vector<arg_slot_t> &argSlots, size_t count);
+
+    // Terminates the trace and flushes the output file.
+    void _closeTrace();
+
+    // Body of the streaming writer thread.
+    void _writerLoop();
+
+    // Stops the writer thread and writes everything still buffered.
+    void _stopStreaming();
+
+    // Starts logging an event, preceded by a memory counter if measureMemory.
+    void _start(ThreadBuffer &buffer, uint32_t event_category, uint32_t event_name, const arg_block_t &args=arg_block_t(), bool measureMemory=false);
+
+    // Stops logging an event, preceded by a memory counter if measureMemory.
+    void _stop(ThreadBuffer &buffer, uint32_t event_category, uint32_t event_name, const arg_block_t &args=arg_block_t(), bool measureMemory=false);
+
+    // Start, stop and counter calls with typed args.
+    void _startTyped(const std::string &event_category, const std::string &event_name, const trace_arg_t *args, size_t count);
+    void _stopTyped(const std::string &event_category, const std::string &event_name, const trace_arg_t *args, size_t count);
+    void _startTyped(span_handle_t span, const trace_arg_t *args, size_t count);
+    void _stopTyped(span_handle_t span, const trace_arg_t *args, size_t count);
+    void _addCounterTyped(const std::string &event_category, const std::string &event_name, size_t value, const trace_arg_t *args, size_t count);
+
+    // Start and stop of an event named by string literals, used by ScopedTimer.
+    void _startLiteral(const char *event_category, const char *event_name);
+    void _stopLiteral(const char *event_category, const char *event_name);
 
     // Core function to add counter event.
-    void _coreAddCounterEvent(const std::string &event_category, const std::string &event_name, size_t value, const std::unordered_map<std::string, std::string> &args={});
+    void _coreAddCounterEvent(ThreadBuffer &buffer, uint32_t event_category, uint32_t event_name, size_t value, const arg_block_t &args=arg_block_t());
+
+    friend class ScopedTimer;
 
 public:
     /**
@@ -68,6 +497,169 @@ public:
      */
     Timer(const std::string &outputPath, TimerOperation operation=TimerOperation::Chrome);
 
+    /**
+     * @brief Destroy the Timer object, finishing the output file if streaming is enabled.
+     */
+    ~Timer();
+
+    /**
+     * @brief Stream events to the output file from a background thread instead of keeping them until dumpLogs().
+     *
+     * Events are written in batches as an incrementally appended Chrome JSON array whose closing
+     * bracket is only added by dumpLogs(). The array format allows the bracket to be missing, so the
+     * file stays loadable if the process dies; the opening bracket is written right away. Binary traces are
+     * appended block by block. Once the writer falls four high-water marks behind, new spans and events are
+     * dropped until it catches up, so buffered memory stays bounded. dumpLogs() records the number dropped as the
+     * "streaming dropped" counter of the sampling category.
+     *
+     * @param highWaterMarkBytes Buffered event bytes that trigger an immediate flush.
+     * @param flushInterval Maximum time between two flushes.
+     */
+    void enableStreaming(size_t highWaterMarkBytes = 4 << 20, std::chrono::milliseconds flushInterval = std::chrono::milliseconds(100));
+
+    /**
+     * @brief Stream events to a sink instead of the output file, e.g. a ZmqSink feeding distributed_timer_collector.
+     *
+     * Batches are encoded in the binary format whatever the operation, and sent from the background
+     * thread every flushInterval (empty ones included, as heartbeats) or past highWaterMarkBytes.
+     * dumpLogs() sends the remaining events and closes the sink. Events past four high-water marks behind
+     * are dropped and counted as with the file.
+     *
+     * @param sink Destination of the batches.
+     * @param highWaterMarkBytes Buffered event bytes that trigger an immediate batch.
+     * @param flushInterval Maximum time between two batches.
+     */
+    void enableStreaming(std::shared_ptr<TraceSink> sink, size_t highWaterMarkBytes = 4 << 20,
+                         std::chrono::milliseconds flushInterval = std::chrono::milliseconds(100));
+
+    /**
+     * @brief Record events into a pre-allocated memory-mapped file instead of heap buffers, so they survive a crash.
+     *
+     * The file is created at its full size and every page is faulted in up front; recording then
+     * only copies into the mapping, with no allocation or system call. Each thread fills 32 KB
+     * blocks which are reused oldest first once the file is full, so the file keeps the most recent
+     * events. If the process dies, the OS still writes the mapping back and
+     * distributed_timer_recover turns the file into a Chrome trace. dumpLogs() writes the events
+     * recorded since the previous dump as usual, but takeEvents() does not see the events recorded into the file.
+     * Not available with the CSV and stats operations, with streaming, or on Windows.
+     *
+     * @param path Path of the file, replaced if it exists.
+     * @param bytes Size of the file.
+     * @return bool False if the file could not be created or the operation does not allow it.
+     */
+    bool enableMappedBuffer(const std::string &path, size_t bytes = 64 << 20);
+
+    /**
+     * @brief Sample the spans and counters of a category, to bound the cost of tracing under load.
+     *
+     * Policies record one in N, with a probability, at most a rate per thread (token bucket), or
+     * only the spans lasting at least a duration (tail capture: the start is kept aside and written
+     * with the stop). Each decision only touches the calling thread's state. A span's stop and
+     * memory counters follow the decision taken at its start; flow, async and clock sync events
+     * are never sampled, and neither is the stats operation. dumpLogs() reports the drops of each
+     * category as "<category> dropped" counters of the "sampling" category. While streaming, events
+     * newer than the oldest open tail-capture span are held back for up to a flush interval; starts of
+     * spans that last longer are written late, out of timestamp order. Can be called at any time.
+     *
+     * @param event_category Category the policy applies to.
+     * @param policy E.g. sampling_policy_t::oneInN(100) or sampling_policy_t::longerThan(std::chrono::microseconds(500)).
+     */
+    void setSamplingPolicy(const std::string &event_category, const sampling_policy_t &policy);
+
+    /**
+     * @brief Sample the categories that have no policy of their own, see setSamplingPolicy().
+     */
+    void setSamplingPolicy(const sampling_policy_t &policy);
+
+    /**
+     * @brief Attach hardware and software performance counters to spans (Linux perf_event_open).
+     *
+     * Every recording thread opens its own counter group on its first span and reads it, with one
+     * system call, at each start and stop. The stop carries the differences as args named after the
+     * counters (e.g. "cycles", "context_switches"), so they show among the span's args. Counters
+     * the kernel refuses, e.g. hardware events in a VM or any event in a container without perf
+     * access, are left out with a warning and spans are recorded as before. Not available with the stats operation.
+     *
+     * @param counters Counters to read.
+     * @return bool Whether the calling thread could open at least one of them.
+     */
+    bool enablePerfCounters(const std::vector<PerfCounter> &counters = {PerfCounter::Cycles, PerfCounter::Instructions,
+                                                                        PerfCounter::CacheMisses, PerfCounter::BranchMisses,
+                                                                        PerfCounter::ContextSwitches});
+
+    /**
+     * @brief Register a span site, for start(trace_site_t) and stop(trace_site_t).
+     *
+     * @param event_category The category of the event.
+     * @param event_name Name of the event.
+     * @param argKey Key of the int64 arg passed to start and stop, none if empty.
+     * @param measureMemory Whether to add memory counters to the site's starts and stops.
+     * @return trace_site_t The site.
+     */
+    trace_site_t site(const std::string &event_category, const std::string &event_name, const std::string &argKey = "", bool measureMemory = false);
+
+    /**
+     * @brief Start a span at a registered site. Once enableDeferredRecording() was called, this only
+     * stamps the time and queues it; otherwise it records like start(span_handle_t).
+     *
+     * @param site The site.
+     * @param arg Value of the site's arg, ignored by sites without one.
+     */
+    void start(trace_site_t site, int64_t arg = 0);
+
+    /**
+     * @brief Stop a span at a registered site, see start(trace_site_t).
+     */
+    void stop(trace_site_t site, int64_t arg = 0);
+
+    /**
+     * @brief Defer the work of site starts and stops to a consumer thread.
+     *
+     * The calling thread then only writes the site id, a timestamp and the arg into its own
+     * lock-free queue. Every interval, and whenever the events are drained, the consumer turns the
+     * queued records into events: it resolves the site's names, builds the arg and reads the memory
+     * counters of sites that measure memory, so these are sampled up to an interval late. The consumer
+     * also applies the sampling policies, at the recorded timestamps, and keeps each thread's stack
+     * of open site spans, so site spans are nested as in stop(). They are only nested among
+     * themselves, not with the thread's other spans. Deferred spans skip performance counters and do
+     * not wake a streaming writer before its flush interval. Only with the Chrome, Firefox, binary and
+     * Perfetto operations and without a mapped buffer; the consumer stops in dumpLogs().
+     *
+     * @param interval Time between two runs of the consumer.
+     * @return bool False if the operation does not allow it.
+     */
+    bool enableDeferredRecording(std::chrono::microseconds interval = std::chrono::milliseconds(1));
+
+    /**
+     * @brief Sample the process' resource usage from a background thread.
+     *
+     * Every interval the sampler reads the resident, virtual and shared memory, page faults,
+     * CPU times and thread count of the process and records them as counters of the "Process"
+     * category, which get their own timeline. While it runs, the memory counters recorded by
+     * start() and stop() use its last sample, so spans never read /proc themselves.
+     * The sampler stops in dumpLogs().
+     *
+     * @param interval Time between two samples.
+     */
+    void enableMemorySampler(std::chrono::milliseconds interval = std::chrono::milliseconds(10));
+
+    /**
+     * @brief Measure the overhead of the timer's own calls.
+     *
+     * Every call is counted and one in sampleEvery is timed into a per-thread histogram.
+     * Nothing is added to the trace; read the results with selfProfile().
+     *
+     * @param sampleEvery Time one call in this many, 0 turns self-profiling off.
+     */
+    void enableSelfProfiling(uint32_t sampleEvery = 1);
+
+    /**
+     * @brief Overhead of each Timer call measured since self-profiling was enabled, summed over all threads.
+     *
+     * @return std::vector<api_profile_t> One entry per SelfProfileApi.
+     */
+    std::vector<api_profile_t> selfProfile();
+
     /**
      * @brief Set the operation type of the timer.
      * 
@@ -104,6 +696,10 @@ public:
 
     /**
      * @brief Stop timing and logging an event.
+     *
+     * Each thread keeps a stack of its open spans, so traces are always properly nested. A stop
+     * closes the innermost open span of the same category and name; spans opened inside it and still
+     * open are closed with it. A stop without a matching open span is dropped. dumpLogs() reports both.
      * 
      * @param event_category The category of the event.
      * @param event_name Name of the event.
@@ -112,8 +708,172 @@ public:
      */
     void stop(const std::string &event_category, const std::string &event_name, const std::unordered_map<std::string, std::string> &args, bool measureMemory=true);
 
+    /**
+     * @brief Start an event with typed arguments built by traceArg(), without memory measurement.
+     *
+     * Unlike the map overload nothing is hashed or allocated per call: keys are cached by address, so
+     * they must be string literals, and numbers and booleans are stored inline and written to Chrome
+     * traces as JSON numbers and booleans.
+     *
+     * @code
+     * timer.start("io", "read", traceArg("bytes", size), traceArg("path", path));
+     * @endcode
+     */
+    template <typename... Args, typename = std::enable_if_t<(sizeof...(Args) > 0) && std::conjunction_v<std::is_same<Args, trace_arg_t>...>>>
+    void start(const std::string &event_category, const std::string &event_name, const Args &...args)
+    {
+        const trace_arg_t typed[] = {args...};
+        _startTyped(event_category, event_name, typed, sizeof...(Args));
+    }
+
+    /**
+     * @brief Stop an event with typed arguments built by traceArg(), without memory measurement.
+     */
+    template <typename... Args, typename = std::enable_if_t<(sizeof...(Args) > 0) && std::conjunction_v<std::is_same<Args, trace_arg_t>...>>>
+    void stop(const std::string &event_category, const std::string &event_name, const Args &...args)
+    {
+        const trace_arg_t typed[] = {args...};
+        _stopTyped(event_category, event_name, typed, sizeof...(Args));
+    }
+
+    /**
+     * @brief Add a counter event with typed arguments built by traceArg().
+     */
+    template <typename... Args, typename = std::enable_if_t<(sizeof...(Args) > 0) && std::conjunction_v<std::is_same<Args, trace_arg_t>...>>>
+    void addCounterEvent(const std::string &event_category, const std::string &event_name, size_t value, const Args &...args)
+    {
+        const trace_arg_t typed[] = {args...};
+        _addCounterTyped(event_category, event_name, value, typed, sizeof...(Args));
+    }
+
+    /**
+     * @brief Intern a category and name once, so that start(span_handle_t) and stop(span_handle_t) skip all string work.
+     *
+     * @param event_category The category of the event.
+     * @param event_name Name of the event.
+     * @return span_handle_t Handle to pass to start() and stop().
+     */
+    span_handle_t handle(const std::string &event_category, const std::string &event_name);
+
+    /**
+     * @brief Start an event from a handle, without arguments or memory measurement.
+     */
+    void start(span_handle_t span);
+
+    /**
+     * @brief Stop an event from a handle, without arguments or memory measurement.
+     */
+    void stop(span_handle_t span);
+
+    /**
+     * @brief Start an event from a handle, with typed arguments built by traceArg().
+     */
+    template <typename... Args, typename = std::enable_if_t<(sizeof...(Args) > 0) && std::conjunction_v<std::is_same<Args, trace_arg_t>...>>>
+    void start(span_handle_t span, const Args &...args)
+    {
+        const trace_arg_t typed[] = {args...};
+        _startTyped(span, typed, sizeof...(Args));
+    }
+
+    /**
+     * @brief Stop an event from a handle, with typed arguments built by traceArg().
+     */
+    template <typename... Args, typename = std::enable_if_t<(sizeof...(Args) > 0) && std::conjunction_v<std::is_same<Args, trace_arg_t>...>>>
+    void stop(span_handle_t span, const Args &...args)
+    {
+        const trace_arg_t typed[] = {args...};
+        _stopTyped(span, typed, sizeof...(Args));
+    }
+
+    /**
+     * @brief Move every event recorded so far out of the timer, for in-process analysis instead of dumpLogs().
+     *
+     * Events are sorted by timestamp, which is converted to nanoseconds since the epoch. Their cat and
+     * name index into strings. Arguments are dropped: args and argCount no longer refer to anything.
+     * Taken events are not written by dumpLogs().
+     *
+     * @param events Receives the events.
+     * @param strings Receives the string table.
+     */
+    void takeEvents(std::vector<raw_event_t> &events, std::vector<std::string> &strings);
+
+    /**
+     * @brief Mark a send or receive of a message exchanged with another traced process.
+     *
+     * Both processes mark the request and the reply with the same sync id, which must be unique
+     * per exchange (e.g. a request id carried in the message). The merge tool pairs the markers
+     * of all exchanges to estimate each process' clock offset and drift and aligns their timestamps.
+     *
+     * @param sync_id Id of the exchange, shared by both processes.
+     * @param point Whether this process is sending or receiving.
+     */
+    void addClockSyncMarker(const std::string &sync_id, ClockSyncPoint point);
+
+    /**
+     * @brief Name the calling thread in the trace. The thread keeps its OS name, if it set one, otherwise.
+     */
+    void setThreadName(const std::string &name);
+
+    /**
+     * @brief Name the process in the trace. Defaults to the name of the executable.
+     */
+    void setProcessName(const std::string &name);
+
+    /**
+     * @brief Choose whether Chrome traces get one timeline per thread (the default) or per category.
+     *
+     * The merge tool can also switch a merged trace to the category view with --by-category.
+     */
+    void setTrackLayout(TrackLayout layout);
+
+    /**
+     * @brief The process and the threads that recorded events so far; raw_event_t::thread of the
+     * events returned by takeEvents() indexes into its threads.
+     */
+    process_info_t processInfo();
+
+    /**
+     * @brief Create an id for a flow or an async span, to embed in the messages it follows.
+     *
+     * Ids are unique within the process and prefixed with random bits, so ids created by different
+     * processes do not collide. trace_context::format() and trace_context::parse() convert them to text.
+     */
+    static uint64_t newTraceId();
+
+    /**
+     * @brief Record a point of a flow, drawn as an arrow between spans that may belong to different processes.
+     *
+     * The point binds to the span enclosing it on the same timeline: the calling thread's innermost
+     * open span, or with TrackLayout::Categories the open span of event_category. Every point of a
+     * flow uses the same name and id. Not recorded in Stats mode.
+     *
+     * @param event_category The category of the event.
+     * @param event_name Name of the flow.
+     * @param id Id of the flow, from newTraceId() here or parsed from a received message.
+     * @param point Whether the flow starts, passes through or ends here.
+     */
+    void addFlowEvent(const std::string &event_category, const std::string &event_name, uint64_t id, FlowPoint point);
+
+    /**
+     * @brief Start an async span: a span identified by id rather than by its thread, which may be stopped
+     * by another thread or another process. Not recorded in Stats mode.
+     *
+     * @param event_category The category of the event.
+     * @param event_name Name of the event.
+     * @param id Id of the span, shared with the matching stopAsync().
+     * @param args Additional arguments to be logged.
+     */
+    void startAsync(const std::string &event_category, const std::string &event_name, uint64_t id, const std::unordered_map<std::string, std::string> &args={});
+
+    /**
+     * @brief Stop an async span started by startAsync() with the same category, name and id.
+     */
+    void stopAsync(const std::string &event_category, const std::string &event_name, uint64_t id, const std::unordered_map<std::string, std::string> &args={});
+
     /**
      * @brief Dump all logged events to the output file.
+     *
+     * When streaming, stops the writer thread, writes the remaining events and terminates the trace.
      */
     void dumpLogs();
 };
@@ -0,0 +1,464 @@
+#pragma once
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <iomanip>
+#include <limits>
+#include <map>
+#include <ostream>
+#include <sstream>
+#include <string>
+#include <tuple>
+#include <unordered_map>
+#include <vector>
+#include <nlohmann/json.hpp>
+#include "histogram.h"
+
+/**
+ * @brief Queries on the spans of a trace: duration stats, slowest spans and a critical path estimate.
+ *
+ * The merge tool's --analyze mode reads traces once into a SpanIndex, one row per span, and answers
+ * every query from its columns, so even traces too large for chrome://tracing can be explored.
+ */
+namespace trace_analysis {
+
+constexpr uint32_t kNone = std::numeric_limits<uint32_t>::max();
+
+/**
+ * @brief Which spans and events a query or a reduced trace keeps.
+ */
+struct filter_t {
+    double from = -std::numeric_limits<double>::infinity(); ///< Microseconds since the start of the trace.
+    double to = std::numeric_limits<double>::infinity();    ///< Same, spans overlapping [from, to] are kept.
+    std::vector<std::string> categories;                    ///< Kept categories, all when empty.
+    std::string name;                                       ///< Kept span name, all when empty. Ignored by non-span events.
+};
+
+/**
+ * @brief Assigns every span of a trace an id, in the order the spans start, from its events.
+ *
+ * B and E events are paired per thread the way Chrome does, an E closing the innermost open span;
+ * X events are spans on their own and b/e async spans are paired by name and id. The ids only depend
+ * on the order of the events, so reading the same trace again gives the same ids.
+ */
+class SpanPairer {
+public:
+    enum class Role : uint8_t {
+        None,     ///< Not a span event.
+        Begin,    ///< Starts the span.
+        End,      ///< Ends the span.
+        Complete, ///< X event, the whole span.
+        Orphan,   ///< E or e event without an open span.
+    };
+
+    /**
+     * @brief The role of an event and the id of its span.
+     */
+    std::pair<Role, uint32_t> pair(const nlohmann::json &event) {
+        auto ph = event.find("ph");
+        if (ph == event.end() || !ph->is_string() || ph->get_ref<const std::string &>().size() != 1)
+            return {Role::None, kNone};
+        switch (ph->get_ref<const std::string &>()[0]) {
+        case 'B':
+            stacks_[thread(event)].push_back(next_);
+            return {Role::Begin, next_++};
+        case 'E': {
+            std::vector<uint32_t> &stack = stacks_[thread(event)];
+            if (stack.empty())
+                return {Role::Orphan, kNone};
+            uint32_t span = stack.back();
+            stack.pop_back();
+            return {Role::End, span};
+        }
+        case 'X':
+            return {Role::Complete, next_++};
+        case 'b':
+            async_[asyncKey(event)].push_back(next_);
+            return {Role::Begin, next_++};
+        case 'e': {
+            auto open = async_.find(asyncKey(event));
+            if (open == async_.end() || open->second.empty())
+                return {Role::Orphan, kNone};
+            uint32_t span = open->second.back();
+            open->second.pop_back();
+            return {Role::End, span};
+        }
+        default:
+            return {Role::None, kNone};
+        }
+    }
+
+    /**
+     * @brief The innermost span open on the thread of an event, kNone if there is none.
+     */
+    uint32_t openSpan(const nlohmann::json &event) const {
+        auto stack = stacks_.find(thread(event));
+        return stack == stacks_.end() || stack->second.empty() ? kNone : stack->second.back();
+    }
+
+    static std::pair<uint64_t, uint64_t> thread(const nlohmann::json &event) {
+        return {number(event, "pid"), number(event, "tid")};
+    }
+
+    /**
+     * @brief An unsigned field of an event, 0 when missing or not a number.
+     */
+    static uint64_t number(const nlohmann::json &event, const char *field) {
+        auto it = event.find(field);
+        return it != event.end() && it->is_number() ? it->get<uint64_t>() : 0;
+    }
+
+    static std::string asyncKey(const nlohmann::json &event) {
+        const char *field = event.contains("id2") ? "id2" : "id";
+        return event.value("name", std::string()) + '\n' + (event.contains(field) ? event[field].dump() : std::string());
+    }
+
+private:
+    struct thread_hash {
+        size_t operator()(const std::pair<uint64_t, uint64_t> &thread) const { return std::hash<uint64_t>()(thread.first * 0x9e3779b97f4a7c15ull ^ thread.second); }
+    };
+
+    uint32_t next_ = 0;
+    std::unordered_map<std::pair<uint64_t, uint64_t>, std::vector<uint32_t>, thread_hash> stacks_;
+    std::unordered_map<std::string, std::vector<uint32_t>> async_;
+};
+
+/**
+ * @brief Per (category, name) duration stats, in microseconds.
+ */
+struct span_stats_t {
+    std::string category;
+    std::string name;
+    uint64_t count = 0;
+    double total = 0;
+    double mean = 0;
+    double p50 = 0;
+    double p99 = 0;
+    double max = 0;
+};
+
+/**
+ * @brief Part of the critical path spent in a span itself rather than in anything it waited on.
+ */
+struct path_segment_t {
+    uint32_t span;
+    double start;
+    double end;
+};
+
+/**
+ * @brief Columnar index of the spans of one or more traces.
+ *
+ * Feed every event with add(), in file order, then call finish(). Each span is one row of the
+ * columns below; strings are interned once in a table of their own.
+ */
+class SpanIndex {
+public:
+    enum Flags : uint8_t {
+        Async = 1, ///< b/e span, identified by id rather than by its thread.
+        Open = 2,  ///< Never ended; it ends at the last timestamp of the trace.
+    };
+
+    // Columns, one row per span id.
+    std::vector<double> start;       ///< Microseconds, as in the trace.
+    std::vector<double> end;
+    std::vector<uint32_t> category;  ///< Interned, see string().
+    std::vector<uint32_t> name;
+    std::vector<uint64_t> pid;
+    std::vector<uint64_t> tid;
+    std::vector<uint32_t> parent;    ///< Enclosing span on the same thread, kNone for roots and async spans.
+    std::vector<uint8_t> flags;
+
+    /**
+     * @brief Add the next event of a trace. The events of each thread must be in timestamp order.
+     */
+    void add(const nlohmann::json &event) {
+        if (event.value("ph", std::string()) == "M")
+            return;
+        double ts = event.value("ts", 0.0);
+        origin_ = std::min(origin_, ts);
+        last_ = std::max(last_, ts);
+
+        uint32_t enclosing = pairer_.openSpan(event);
+        auto [role, span] = pairer_.pair(event);
+        switch (role) {
+        case SpanPairer::Role::Begin:
+        case SpanPairer::Role::Complete: {
+            bool async = event.value("ph", std::string()) == "b";
+            start.push_back(ts);
+            end.push_back(role == SpanPairer::Role::Complete ? ts + event.value("dur", 0.0) : ts);
+            category.push_back(intern(event.value("cat", std::string())));
+            name.push_back(intern(event.value("name", std::string())));
+            pid.push_back(SpanPairer::number(event, "pid"));
+            tid.push_back(SpanPairer::number(event, "tid"));
+            parent.push_back(async ? kNone : enclosing);
+            flags.push_back(role == SpanPairer::Role::Begin ? Open | (async ? Async : 0) : 0);
+            last_ = std::max(last_, end.back());
+            break;
+        }
+        case SpanPairer::Role::End:
+            end[span] = std::max(ts, start[span]);
+            flags[span] &= ~Open;
+            break;
+        case SpanPairer::Role::Orphan:
+            ++orphans_;
+            break;
+        case SpanPairer::Role::None: {
+            // Flow points, linked to the span they were recorded in.
+            std::string ph = event.value("ph", std::string());
+            if ((ph == "s" || ph == "t" || ph == "f") && event.contains("id") && enclosing != kNone)
+                flows_.push_back({intern(event["id"].dump()), ts, enclosing});
+            break;
+        }
+        }
+    }
+
+    /**
+     * @brief End the spans left open and link the spans connected by flows. Call once all events are added.
+     */
+    void finish() {
+        for (size_t span = 0; span < size(); ++span) {
+            if (flags[span] & Open)
+                end[span] = last_;
+        }
+
+        // Each point of a flow waited on the previous one: the span of the previous point becomes a
+        // predecessor of the span of the next, which is how the critical path crosses processes.
+        std::stable_sort(flows_.begin(), flows_.end(), [](const flow_point_t &a, const flow_point_t &b) {
+            return std::tie(a.id, a.ts) < std::tie(b.id, b.ts);
+        });
+        std::vector<std::pair<uint32_t, uint32_t>> edges; // Span, span it waited on.
+        for (size_t i = 0; i < size(); ++i) {
+            if (parent[i] != kNone)
+                edges.push_back({parent[i], static_cast<uint32_t>(i)});
+        }
+        for (size_t i = 1; i < flows_.size(); ++i) {
+            if (flows_[i].id == flows_[i - 1].id && flows_[i].span != flows_[i - 1].span)
+                edges.push_back({flows_[i].span, flows_[i - 1].span});
+        }
+        std::sort(edges.begin(), edges.end());
+        edges.erase(std::unique(edges.begin(), edges.end()), edges.end());
+        waitedOnOffsets_.assign(size() + 1, 0);
+        for (const auto &edge : edges)
+            ++waitedOnOffsets_[edge.first + 1];
+        for (size_t i = 1; i < waitedOnOffsets_.size(); ++i)
+            waitedOnOffsets_[i] += waitedOnOffsets_[i - 1];
+        waitedOn_.resize(edges.size());
+        for (size_t i = 0; i < edges.size(); ++i)
+            waitedOn_[i] = edges[i].second;
+        flows_.clear();
+        flows_.shrink_to_fit();
+    }
+
+    size_t size() const { return start.size(); }
+
+    /**
+     * @brief Timestamp of the first event, which filter_t::from and filter_t::to are relative to.
+     */
+    double origin() const { return std::isinf(origin_) ? 0 : origin_; }
+
+    /**
+     * @brief E and e events that had no span to end.
+     */
+    size_t orphans() const { return orphans_; }
+
+    const std::string &string(uint32_t id) const { return strings_[id]; }
+
+    double duration(uint32_t span) const { return end[span] - start[span]; }
+
+    bool matches(uint32_t span, const filter_t &filter) const {
+        if (end[span] < origin() + filter.from || start[span] > origin() + filter.to)
+            return false;
+        if (!filter.name.empty() && string(name[span]) != filter.name)
+            return false;
+        return filter.categories.empty() || std::find(filter.categories.begin(), filter.categories.end(), string(category[span])) != filter.categories.end();
+    }
+
+    /**
+     * @brief Duration stats of the ended spans matching a filter, by (category, name), longest total first.
+     */
+    std::vector<span_stats_t> stats(const filter_t &filter) const {
+        std::map<std::pair<uint32_t, uint32_t>, LogHistogram> histograms;
+        for (uint32_t span = 0; span < size(); ++span) {
+            if (!(flags[span] & Open) && matches(span, filter))
+                histograms[{category[span], name[span]}].record(static_cast<uint64_t>(duration(span) * 1000)); // us -> ns
+        }
+        std::vector<span_stats_t> result;
+        for (const auto &[key, histogram] : histograms) {
+            LogHistogram::snapshot_t snapshot;
+            histogram.snapshot(snapshot);
+            result.push_back({string(key.first), string(key.second), snapshot.count, snapshot.total / 1000.0, snapshot.mean() / 1000,
+                              snapshot.quantile(0.5) / 1000.0, snapshot.quantile(0.99) / 1000.0, snapshot.max / 1000.0});
+        }
+        std::stable_sort(result.begin(), result.end(), [](const span_stats_t &a, const span_stats_t &b) { return a.total > b.total; });
+        return result;
+    }
+
+    /**
+     * @brief The count longest spans matching a filter, longest first.
+     */
+    std::vector<uint32_t> top(size_t count, const filter_t &filter) const {
+        std::vector<uint32_t> spans;
+        for (uint32_t span = 0; span < size(); ++span) {
+            if (matches(span, filter))
+                spans.push_back(span);
+        }
+        auto longer = [this](uint32_t a, uint32_t b) { return duration(a) != duration(b) ? duration(a) > duration(b) : a < b; };
+        count = std::min(count, spans.size());
+        std::partial_sort(spans.begin(), spans.begin() + count, spans.end(), longer);
+        spans.resize(count);
+        return spans;
+    }
+
+    /**
+     * @brief The span a critical path starts from: the longest span matching the filter, among the
+     * thread roots unless the filter names the span.
+     */
+    uint32_t criticalRoot(const filter_t &filter) const {
+        uint32_t root = kNone;
+        for (uint32_t span = 0; span < size(); ++span) {
+            if ((flags[span] & Async) || (filter.name.empty() && parent[span] != kNone) || !matches(span, filter))
+                continue;
+            if (root == kNone || duration(span) > duration(root))
+                root = span;
+        }
+        return root;
+    }
+
+    /**
+     * @brief Estimate the critical path of a span: walking back from its end, the time goes to the
+     * child or flow predecessor that finished last, recursively, and to the span itself in between.
+     *
+     * @return std::vector<path_segment_t> Segments in time order. Their durations add up to the span's.
+     */
+    std::vector<path_segment_t> criticalPath(uint32_t root) const {
+        std::vector<path_segment_t> path;
+        std::vector<bool> onPath(size(), false);
+        _walk(root, start[root], end[root], path, onPath);
+        std::reverse(path.begin(), path.end());
+        return path;
+    }
+
+    uint32_t intern(const std::string &text) {
+        auto [it, inserted] = ids_.try_emplace(text, static_cast<uint32_t>(strings_.size()));
+        if (inserted)
+            strings_.push_back(text);
+        return it->second;
+    }
+
+private:
+    struct flow_point_t {
+        uint32_t id;
+        double ts;
+        uint32_t span;
+    };
+
+    SpanPairer pairer_;
+    std::vector<std::string> strings_;
+    std::unordered_map<std::string, uint32_t> ids_;
+    std::vector<flow_point_t> flows_;
+    std::vector<uint32_t> waitedOnOffsets_; // CSR: children and flow predecessors of each span.
+    std::vector<uint32_t> waitedOn_;
+    size_t orphans_ = 0;
+    double origin_ = std::numeric_limits<double>::infinity();
+    double last_ = -std::numeric_limits<double>::infinity();
+
+    // Appends, latest first, the segments of span's critical path within [from, to].
+    void _walk(uint32_t span, double from, double to, std::vector<path_segment_t> &path, std::vector<bool> &onPath) const {
+        onPath[span] = true;
+        std::vector<uint32_t> waited(waitedOn_.begin() + waitedOnOffsets_[span], waitedOn_.begin() + waitedOnOffsets_[span + 1]);
+        std::sort(waited.begin(), waited.end(), [this](uint32_t a, uint32_t b) { return end[a] > end[b]; });
+        double cursor = to;
+        for (uint32_t other : waited) {
+            double otherEnd = std::min(end[other], cursor);
+            double otherStart = std::max(start[other], from);
+            // Already on the path (flows can loop back), or entirely after the part of the path found so far.
+            if (onPath[other] || otherEnd <= otherStart)
+                continue;
+            if (cursor > otherEnd)
+                path.push_back({span, otherEnd, cursor});
+            _walk(other, otherStart, otherEnd, path, onPath);
+            cursor = otherStart;
+            if (cursor <= from)
+                break;
+        }
+        if (cursor > from)
+            path.push_back({span, from, cursor});
+        onPath[span] = false;
+    }
+};
+
+/**
+ * @brief Per (category, name) time on a critical path, longest first.
+ */
+inline std::vector<std::tuple<std::string, std::string, double>> pathSummary(const SpanIndex &index, const std::vector<path_segment_t> &path) {
+    std::map<std::pair<uint32_t, uint32_t>, double> totals;
+    for (const path_segment_t &segment : path)
+        totals[{index.category[segment.span], index.name[segment.span]}] += segment.end - segment.start;
+    std::vector<std::tuple<std::string, std::string, double>> summary;
+    for (const auto &[key, total] : totals)
+        summary.emplace_back(index.string(key.first), index.string(key.second), total);
+    std::stable_sort(summary.begin(), summary.end(), [](const auto &a, const auto &b) { return std::get<2>(a) > std::get<2>(b); });
+    return summary;
+}
+
+/**
+ * @brief Merge the consecutive segments of the same span.
+ */
+inline std::vector<path_segment_t> mergeSegments(const std::vector<path_segment_t> &path) {
+    std::vector<path_segment_t> merged;
+    for (const path_segment_t &segment : path) {
+        if (!merged.empty() && merged.back().span == segment.span && merged.back().end == segment.start)
+            merged.back().end = segment.end;
+        else
+            merged.push_back(segment);
+    }
+    return merged;
+}
+
+/**
+ * @brief A row of a span table or JSON result: identity, start relative to the trace, duration.
+ */
+inline nlohmann::json spanJson(const SpanIndex &index, uint32_t span) {
+    return {{"cat", index.string(index.category[span])}, {"name", index.string(index.name[span])}, {"pid", index.pid[span]}, {"tid", index.tid[span]},
+            {"start", index.start[span] - index.origin()}, {"dur", index.duration(span)}, {"open", (index.flags[span] & SpanIndex::Open) != 0},
+            {"async", (index.flags[span] & SpanIndex::Async) != 0}};
+}
+
+/**
+ * @brief Prints rows as a text table, each column as wide as its widest cell. Numbers are right aligned.
+ */
+class Table {
+public:
+    explicit Table(std::vector<std::string> header) : rows_{std::move(header)} {}
+
+    void add(std::vector<std::string> row) { rows_.push_back(std::move(row)); }
+
+    static std::string number(double value, int precision = 1) {
+        std::ostringstream text;
+        text << std::fixed << std::setprecision(precision) << value;
+        return text.str();
+    }
+
+    void print(std::ostream &out) const {
+        std::vector<size_t> widths;
+        for (const auto &row : rows_) {
+            widths.resize(std::max(widths.size(), row.size()), 0);
+            for (size_t i = 0; i < row.size(); ++i)
+                widths[i] = std::max(widths[i], row[i].size());
+        }
+        for (size_t r = 0; r < rows_.size(); ++r) {
+            for (size_t i = 0; i < rows_[r].size(); ++i) {
+                bool numeric = r > 0 && !rows_[r][i].empty() && (std::isdigit(static_cast<unsigned char>(rows_[r][i][0])) || rows_[r][i][0] == '-');
+                bool last = i + 1 == rows_[r].size();
+                out << "  " << (numeric ? std::right : std::left) << std::setw(last && !numeric ? 0 : static_cast<int>(widths[i])) << rows_[r][i];
+            }
+            out << '\n';
+        }
+    }
+
+private:
+    std::vector<std::vector<std::string>> rows_;
+};
+
+} // namespace trace_analysis
@@ -0,0 +1,102 @@
+#pragma once
+#include <cstdint>
+#include <cstring>
+#include <limits>
+#include <string>
+#include <string_view>
+#include <type_traits>
+#include <vector>
+#include "trace_event.h"
+
+/**
+ * @brief A typed event argument, built with traceArg() and passed to the variadic Timer calls.
+ *
+ * Numbers and booleans are stored inline in the arg header and written to Chrome traces as JSON
+ * numbers and booleans. The key is cached by address, so it must be a string literal (or another
+ * string that lives, unchanged, as long as the timer). String values are copied when recorded.
+ */
+struct trace_arg_t {
+    const char *key;
+    ArgType type;
+    uint64_t value;        ///< Bits of the int64, double or bool.
+    std::string_view text; ///< String value.
+};
+
+inline trace_arg_t traceArg(const char *key, std::string_view text)
+{
+    return {key, ArgType::String, text.size(), text};
+}
+
+inline trace_arg_t traceArg(const char *key, const char *text)
+{
+    return traceArg(key, std::string_view(text));
+}
+
+inline trace_arg_t traceArg(const char *key, const std::string &text)
+{
+    return traceArg(key, std::string_view(text));
+}
+
+inline trace_arg_t traceArg(const char *key, bool value)
+{
+    return {key, ArgType::Bool, value ? 1u : 0u, {}};
+}
+
+inline trace_arg_t traceArg(const char *key, double value)
+{
+    trace_arg_t arg{key, ArgType::Double, 0, {}};
+    std::memcpy(&arg.value, &value, sizeof(value));
+    return arg;
+}
+
+template <typename T, std::enable_if_t<std::is_integral_v<T> && !std::is_same_v<T, bool>, int> = 0>
+trace_arg_t traceArg(const char *key, T value)
+{
+    // Unsigned values above the int64 range wrap, which only the largest 64 bit values can do.
+    return {key, ArgType::Int64, static_cast<uint64_t>(static_cast<int64_t>(value)), {}};
+}
+
+template <typename T, std::enable_if_t<std::is_floating_point_v<T>, int> = 0>
+trace_arg_t traceArg(const char *key, T value)
+{
+    return traceArg(key, static_cast<double>(value));
+}
+
+/**
+ * @brief The args of one event, encoded in the layout of the arg stream.
+ *
+ * Timer encodes every call's args into a per-thread block whose capacity is reused, so encoding
+ * allocates only while the block grows to the largest args seen.
+ */
+struct arg_block_t {
+    std::vector<arg_slot_t> slots;
+    uint8_t count = 0;
+
+    void clear()
+    {
+        slots.clear();
+        count = 0;
+    }
+
+    /**
+     * @brief Append an arg. Events hold at most 255, later ones are dropped.
+     *
+     * @param key Interned key id.
+     * @param type Type of the value.
+     * @param value Inline value, or payload size in bytes for strings.
+     * @param text Payload of string values.
+     */
+    void append(uint32_t key, ArgType type, uint64_t value, std::string_view text = {})
+    {
+        if (count == std::numeric_limits<decltype(count)>::max())
+            return;
+        size_t at = slots.size();
+        slots.resize(at + 1 + (text.size() + sizeof(arg_slot_t) - 1) / sizeof(arg_slot_t));
+        slots[at].header.key = key;
+        slots[at].header.type = type;
+        slots[at].header.value = value;
+        if (!text.empty())
+            std::memcpy(slots[at + 1].bytes, text.data(), text.size()); // Payload slots are contiguous.
+        ++count;
+    }
+};
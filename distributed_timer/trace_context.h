@@ -0,0 +1,40 @@
+#pragma once
+#include <charconv>
+#include <cstdint>
+#include <string>
+#include <string_view>
+
+/**
+ * @brief Text form of the trace ids created by Timer::newTraceId.
+ *
+ * Ids are written as "0x" followed by lowercase hex digits, which is both compact enough to
+ * embed in a message header and the form Chrome expects in the "id" field of flow and async events.
+ */
+namespace trace_context {
+
+/**
+ * @brief Format an id, e.g. 0x2a5f000000000003.
+ */
+inline std::string format(uint64_t id)
+{
+    char digits[2 + 16] = {'0', 'x'};
+    char *end = std::to_chars(digits + 2, digits + sizeof(digits), id, 16).ptr;
+    return std::string(digits, end);
+}
+
+/**
+ * @brief Parse an id written by format(). The "0x" prefix is optional.
+ *
+ * @return bool False if text is not a hex number that fits in 64 bits.
+ */
+inline bool parse(std::string_view text, uint64_t &id)
+{
+    if (text.size() > 2 && text[0] == '0' && (text[1] == 'x' || text[1] == 'X'))
+        text.remove_prefix(2);
+    if (text.empty())
+        return false;
+    auto [end, error] = std::from_chars(text.data(), text.data() + text.size(), id, 16);
+    return error == std::errc() && end == text.data() + text.size();
+}
+
+} // namespace trace_context
@@ -0,0 +1,83 @@
+#pragma once
+#include <cstdint>
+#include <string>
+#include <type_traits>
+#include <vector>
+
+/**
+ * @brief Compact, trivially-copyable record of a single trace event.
+ *
+ * Category and name are ids into the Timer's StringTable. Arguments live in a
+ * separate per-thread arg stream; the record only keeps where they start and how many there are.
+ * The recording thread is not stored when recording: events are drained thread by thread, which
+ * is when thread is set to the index of its buffer in the process' thread table.
+ */
+struct raw_event_t {
+    int64_t ts;         ///< TraceClock ticks in memory, nanoseconds since the epoch once written.
+    uint64_t value;     ///< Counter value for 'C' events, flow or async span id for 's', 't', 'f', 'b' and 'e' events.
+    uint32_t cat;       ///< Interned category id.
+    uint32_t name;      ///< Interned name id.
+    uint32_t args;      ///< Offset of the first arg slot in the recording thread's arg stream.
+    uint16_t thread;    ///< Index of the recording thread in process_info_t::threads, once drained.
+    uint8_t argCount;   ///< Number of arguments attached to the event.
+    char ph;            ///< Chrome trace phase ('B', 'E', 'C', ...).
+};
+
+/**
+ * @brief A thread that recorded events: its OS id and the name it registered, if any.
+ */
+struct thread_info_t {
+    uint32_t tid = 0;
+    std::string name;
+
+    bool operator==(const thread_info_t &other) const { return tid == other.tid && name == other.name; }
+};
+
+/**
+ * @brief The process that recorded a trace, and its threads indexed by raw_event_t::thread.
+ */
+struct process_info_t {
+    uint32_t pid = 0;
+    std::string name;
+    std::vector<thread_info_t> threads;
+
+    bool operator==(const process_info_t &other) const {
+        return pid == other.pid && name == other.name && threads == other.threads;
+    }
+
+    /**
+     * @brief OS id of the thread that recorded an event, or its index when it is not in the table.
+     */
+    uint32_t tid(const raw_event_t &event) const {
+        return event.thread < threads.size() ? threads[event.thread].tid : event.thread;
+    }
+};
+
+/**
+ * @brief Type tag of an argument stored in the arg stream.
+ */
+enum class ArgType : uint8_t {
+    String, ///< Value is `header.value` bytes stored in the slots following the header.
+    Int64,  ///< Value is the bits of an int64_t.
+    Double, ///< Value is the bits of a double.
+    Bool,   ///< Value is 0 or 1.
+};
+
+/**
+ * @brief One 16 byte slot of the per-thread arg stream.
+ *
+ * Every argument starts with a header slot. Numbers and booleans are stored inline in it;
+ * string payloads follow the header as raw bytes spread over ceil(size / sizeof(arg_slot_t)) slots.
+ */
+union arg_slot_t {
+    struct {
+        uint32_t key;   ///< Interned key id.
+        ArgType type;   ///< Type of the value.
+        uint64_t value; ///< Inline value, or payload size in bytes for strings.
+    } header;
+    char bytes[16];
+};
+
+static_assert(std::is_trivially_copyable<raw_event_t>::value, "raw_event_t must stay trivially copyable");
+static_assert(sizeof(raw_event_t) == 32, "raw_event_t is expected to be 32 bytes");
+static_assert(sizeof(arg_slot_t) == 16, "arg_slot_t is expected to be 16 bytes");
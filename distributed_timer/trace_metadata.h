@@ -0,0 +1,64 @@
+#pragma once
+#include <cstddef>
+#include <map>
+#include <string>
+#include <tuple>
+#include <nlohmann/json.hpp>
+
+/**
+ * @brief Collects the process_name and thread_name metadata of the events it is shown.
+ *
+ * Traces carry the names their processes and threads registered as metadata events, which the
+ * collector keeps once per (pid, tid, name) so they can be written together at the end of a merged
+ * trace. In the category view every category has its own track, named after the category instead.
+ */
+class MetadataCollector {
+private:
+    using key_t = std::tuple<size_t, size_t, std::string>; // pid, tid, metadata name
+
+    bool byCategory_;
+    std::map<key_t, nlohmann::json> metadata_;
+
+public:
+    explicit MetadataCollector(bool byCategory = false) : byCategory_(byCategory) {}
+
+    /**
+     * @brief Show an event to the collector.
+     *
+     * @return bool True for metadata events, which the collector takes over and should not be written as is.
+     */
+    bool add(const nlohmann::json& event) {
+        if (event.value("ph", std::string()) == "M") {
+            std::string name = event.value("name", std::string());
+            // Threads have no track of their own in the category view.
+            if (!byCategory_ || name != "thread_name")
+                metadata_.emplace(key_t{event.value("pid", size_t(0)), event.value("tid", size_t(0)), name}, event);
+            return true;
+        }
+        if (byCategory_) {
+            key_t key{event.value("pid", size_t(0)), event.value("tid", size_t(0)), "thread_name"};
+            if (metadata_.find(key) == metadata_.end()) {
+                metadata_.emplace(key, nlohmann::json{
+                    {"cat", "__metadata"},
+                    {"name", "thread_name"},
+                    {"ph", "M"},
+                    {"pid", std::get<0>(key)},
+                    {"tid", std::get<1>(key)},
+                    {"args", {{"name", event.value("cat", std::string())}}}
+                });
+            }
+        }
+        return false;
+    }
+
+    void merge(const MetadataCollector& other) {
+        metadata_.insert(other.metadata_.begin(), other.metadata_.end());
+    }
+
+    nlohmann::json toJson() const {
+        nlohmann::json metadataList = nlohmann::json::array();
+        for (const auto& [key, entry] : metadata_)
+            metadataList.push_back(entry);
+        return metadataList;
+    }
+};
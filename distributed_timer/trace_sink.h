@@ -0,0 +1,32 @@
+#pragma once
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+/**
+ * @brief Destination of a streaming Timer other than its output file, e.g. a remote collector.
+ *
+ * The timer's writer thread hands every batch to write(); no other thread calls the sink while
+ * streaming. Implementations decide whether to block or drop when the destination is slow.
+ */
+class TraceSink
+{
+public:
+    virtual ~TraceSink() = default;
+
+    /**
+     * @brief Send one batch.
+     *
+     * @param batch A binary trace (see binary_format.h) whose string ids continue those of the
+     *              previous batches. It is empty apart from the magic when there was nothing to send.
+     * @param eventCount Number of events in the batch.
+     * @param watermarkNanos Later batches only hold events at or after this time (epoch nanoseconds).
+     * @return bool False if the batch was dropped. The next batch then repeats every string.
+     */
+    virtual bool write(const std::string &batch, size_t eventCount, int64_t watermarkNanos) = 0;
+
+    /**
+     * @brief Called once, after the last batch.
+     */
+    virtual void close() {}
+};
@@ -0,0 +1,369 @@
+#pragma once
+#include <cctype>
+#include <cmath>
+#include <deque>
+#include <fstream>
+#include <iostream>
+#include <memory>
+#include <string>
+#include <unordered_set>
+#include <vector>
+#include <nlohmann/json.hpp>
+#include "binary_format.h"
+#include "chrome_format.h"
+#include "perfetto_format.h"
+
+/**
+ * @brief Pull-based reader of the events of one trace file, in file order.
+ */
+class TraceSource {
+protected:
+    std::string category_; // Only events of this category are returned when not empty.
+
+public:
+    virtual ~TraceSource() = default;
+
+    /**
+     * @brief Only return the events of a category, skipping the others as cheaply as the format allows.
+     *
+     * @param category The category to keep.
+     */
+    void setCategoryFilter(const std::string& category) { category_ = category; }
+
+    /**
+     * @brief Read the next event.
+     *
+     * @param event Receives the event, its "ts" in microseconds.
+     * @param nanos Receives the exact timestamp of the event in nanoseconds, 0 if it has none.
+     * @return bool False once the file is exhausted.
+     */
+    virtual bool next(nlohmann::json& event, int64_t& nanos) = 0;
+
+    bool next(nlohmann::json& event) {
+        int64_t nanos;
+        return next(event, nanos);
+    }
+};
+
+/**
+ * @brief Reads a Chrome JSON array one element at a time.
+ *
+ * Only the text of the current element is held in memory and parsed on its own. A file cut
+ * short by a crash, missing its closing bracket or ending in a torn element, yields every
+ * complete element before the cut.
+ */
+class JsonTraceSource : public TraceSource {
+private:
+    std::ifstream input_;
+    std::string path_;
+    std::string element_;
+    bool inArray_ = false;
+
+    // Copies the next top-level element of the array into element_.
+    bool _nextElement() {
+        std::istreambuf_iterator<char> it(input_), end;
+        if (!inArray_) {
+            while (it != end && *it != '[')
+                ++it;
+            if (it == end)
+                return false;
+            ++it;
+            inArray_ = true;
+        }
+        while (it != end && (std::isspace(static_cast<unsigned char>(*it)) || *it == ','))
+            ++it;
+        if (it == end || (*it != '{' && *it != '['))
+            return false;
+
+        element_.clear();
+        int depth = 0;
+        bool inString = false;
+        bool escaped = false;
+        for (; it != end; ++it) {
+            char c = *it;
+            element_.push_back(c);
+            if (inString) {
+                if (escaped)
+                    escaped = false;
+                else if (c == '\\')
+                    escaped = true;
+                else if (c == '"')
+                    inString = false;
+            }
+            else if (c == '"')
+                inString = true;
+            else if (c == '{' || c == '[')
+                ++depth;
+            else if ((c == '}' || c == ']') && --depth == 0) {
+                ++it;
+                return true;
+            }
+        }
+        return false;
+    }
+
+    // Reads the top-level "ts" of element_ from its text, which keeps the digits a double would round off.
+    bool _timestamp(int64_t& nanos) const {
+        int depth = 0;
+        bool inString = false;
+        bool escaped = false;
+        size_t stringStart = 0;
+        for (size_t i = 0; i < element_.size(); ++i) {
+            char c = element_[i];
+            if (inString) {
+                if (escaped)
+                    escaped = false;
+                else if (c == '\\')
+                    escaped = true;
+                else if (c == '"') {
+                    inString = false;
+                    if (depth != 1 || element_.compare(stringStart, i - stringStart, "ts") != 0)
+                        continue;
+                    size_t colon = element_.find_first_not_of(" \t\r\n", i + 1);
+                    if (colon == std::string::npos || element_[colon] != ':')
+                        continue;
+                    size_t number = element_.find_first_not_of(" \t\r\n", colon + 1);
+                    return number != std::string::npos && chrome_format::parseMicros(std::string_view(element_).substr(number), nanos);
+                }
+            }
+            else if (c == '"') {
+                inString = true;
+                stringStart = i + 1;
+            }
+            else if (c == '{' || c == '[')
+                ++depth;
+            else if (c == '}' || c == ']')
+                --depth;
+        }
+        return false;
+    }
+
+public:
+    JsonTraceSource(const std::string& path) : input_(path, std::ios::binary), path_(path) {}
+
+    bool next(nlohmann::json& event, int64_t& nanos) override {
+        while (_nextElement()) {
+            // Filtered out elements are rejected on their text before paying for a parse.
+            if (!category_.empty() && element_.find('"' + category_ + '"') == std::string::npos)
+                continue;
+            event = nlohmann::json::parse(element_, nullptr, false);
+            if (event.is_discarded()) {
+                std::cerr << "Skipping malformed event in " << path_ << '\n';
+                continue;
+            }
+            if (category_.empty() || event.value("cat", std::string()) == category_) {
+                if (!_timestamp(nanos))
+                    nanos = std::llround(event.value("ts", 0.0) * 1000);
+                return true;
+            }
+        }
+        return false;
+    }
+};
+
+/**
+ * @brief Reads a binary trace one block at a time.
+ */
+class BinaryTraceSource : public TraceSource {
+private:
+    std::ifstream input_;
+    binary_format::Reader reader_;
+    std::vector<raw_event_t> events_;
+    std::vector<arg_slot_t> slots_;
+    size_t position_ = 0;
+    nlohmann::json metadata_; // Process and thread names, returned once the events are exhausted.
+    size_t metadataPosition_ = 0;
+    bool exhausted_ = false;
+
+public:
+    BinaryTraceSource(const std::string& path) : input_(path, std::ios::binary), reader_(input_) {}
+
+    bool next(nlohmann::json& event, int64_t& nanos) override {
+        while (!exhausted_) {
+            while (position_ == events_.size()) {
+                if (!reader_.next(events_, slots_)) {
+                    exhausted_ = true;
+                    metadata_ = chrome_format::metadataEvents(reader_.process());
+                    break;
+                }
+                position_ = 0;
+            }
+            if (exhausted_)
+                break;
+            const raw_event_t& record = events_[position_++];
+            if (category_.empty() || reader_.strings()[record.cat] == category_) {
+                event = chrome_format::toJson(record, slots_.data(), reader_.strings(), reader_.process());
+                nanos = record.ts;
+                return true;
+            }
+        }
+        if (!category_.empty() || metadataPosition_ == metadata_.size())
+            return false;
+        event = metadata_[metadataPosition_++];
+        nanos = 0;
+        return true;
+    }
+};
+
+/**
+ * @brief Reads a Perfetto trace one packet at a time, turning its track events back into Chrome events.
+ *
+ * Slices on thread tracks become 'B'/'E' events and slices on other tracks async 'b'/'e' events.
+ * Counters become 'C' events named after their track. Flow ids become flow points, the first
+ * one of each id in the file being its start; instants only carrying flow ids are not kept.
+ */
+class PerfettoTraceSource : public TraceSource {
+private:
+    using track_info_t = perfetto_format::track_info_t;
+
+    std::ifstream input_;
+    perfetto_format::Reader reader_;
+    perfetto_format::decoded_event_t decoded_;
+    std::deque<nlohmann::json> pending_;
+    std::unordered_set<uint64_t> flows_; // Flow ids already started.
+    nlohmann::json metadata_;
+    size_t metadataPosition_ = 0;
+    bool exhausted_ = false;
+
+    nlohmann::json _event(char ph, uint32_t pid, uint32_t tid) const {
+        nlohmann::json event;
+        event["pid"] = pid;
+        event["tid"] = tid;
+        event["ts"] = decoded_.ts / 1000.0;
+        event["ph"] = std::string(1, ph);
+        event["name"] = decoded_.name;
+        event["cat"] = decoded_.category;
+        return event;
+    }
+
+    nlohmann::json _args() const {
+        nlohmann::json args = nlohmann::json::object();
+        for (const perfetto_format::decoded_arg_t& arg : decoded_.args) {
+            nlohmann::json& value = args[std::string(arg.key)];
+            switch (arg.type) {
+            case ArgType::Int64: value = static_cast<int64_t>(arg.value); break;
+            case ArgType::Double: {
+                double number;
+                std::memcpy(&number, &arg.value, sizeof(number));
+                value = number;
+                break;
+            }
+            case ArgType::Bool: value = arg.value != 0; break;
+            default: value = std::string(arg.text); break;
+            }
+        }
+        return args;
+    }
+
+    void _convert() {
+        static const track_info_t unknown;
+        auto it = reader_.tracks().find(decoded_.track);
+        const track_info_t& track = it != reader_.tracks().end() ? it->second : unknown;
+        bool onThread = track.kind == track_info_t::Kind::Thread;
+        uint32_t pid = track.kind == track_info_t::Kind::Other ? reader_.sequencePid() : track.pid;
+        uint32_t tid = onThread ? track.tid : 0;
+
+        if (decoded_.type == perfetto_format::EventType::Counter || track.kind == track_info_t::Kind::Counter) {
+            if (!decoded_.hasCounter)
+                return;
+            std::string name = track.name.empty() ? std::string(decoded_.name) : track.name;
+            nlohmann::json event = _event('C', pid, tid);
+            event["name"] = name;
+            event["args"] = _args();
+            if (decoded_.isDouble)
+                event["args"][name] = decoded_.doubleCounter;
+            else
+                event["args"][name] = decoded_.counter;
+            pending_.push_back(std::move(event));
+            return;
+        }
+
+        bool flowOnly = decoded_.type == perfetto_format::EventType::Instant && (!decoded_.flows.empty() || !decoded_.terminatingFlows.empty());
+        if (!flowOnly) {
+            char ph = 'i';
+            if (decoded_.type == perfetto_format::EventType::SliceBegin)
+                ph = onThread ? 'B' : 'b';
+            else if (decoded_.type == perfetto_format::EventType::SliceEnd)
+                ph = onThread ? 'E' : 'e';
+            nlohmann::json event = _event(ph, pid, tid);
+            event["args"] = _args();
+            if (ph == 'b' || ph == 'e')
+                event["id2"]["global"] = trace_context::format(perfetto_format::asyncId(decoded_.track));
+            pending_.push_back(std::move(event));
+        }
+
+        auto addFlow = [&](char ph, uint64_t id) {
+            nlohmann::json event = _event(ph, pid, tid);
+            event["args"] = flowOnly ? _args() : nlohmann::json::object();
+            event["id"] = trace_context::format(id);
+            if (ph != 's')
+                event["bp"] = "e";
+            pending_.push_back(std::move(event));
+        };
+        for (uint64_t id : decoded_.flows)
+            addFlow(flows_.insert(id).second ? 's' : 't', id);
+        for (uint64_t id : decoded_.terminatingFlows)
+            addFlow('f', id);
+    }
+
+    nlohmann::json _metadata() const {
+        nlohmann::json metadata = nlohmann::json::array();
+        for (const auto& [uuid, track] : reader_.tracks()) {
+            if (track.name.empty())
+                continue;
+            if (track.kind == track_info_t::Kind::Process)
+                metadata.push_back({{"name", "process_name"}, {"ph", "M"}, {"pid", track.pid}, {"tid", 0}, {"args", {{"name", track.name}}}});
+            else if (track.kind == track_info_t::Kind::Thread)
+                metadata.push_back({{"name", "thread_name"}, {"ph", "M"}, {"pid", track.pid}, {"tid", track.tid}, {"args", {{"name", track.name}}}});
+        }
+        return metadata;
+    }
+
+public:
+    PerfettoTraceSource(const std::string& path) : input_(path, std::ios::binary), reader_(input_) {}
+
+    bool next(nlohmann::json& event, int64_t& nanos) override {
+        while (pending_.empty() && !exhausted_) {
+            if (!reader_.next(decoded_)) {
+                exhausted_ = true;
+                metadata_ = _metadata();
+                break;
+            }
+            if (category_.empty() || decoded_.category == category_)
+                _convert();
+        }
+        if (!pending_.empty()) {
+            // Every pending event comes from the current packet.
+            event = std::move(pending_.front());
+            pending_.pop_front();
+            nanos = decoded_.ts;
+            return true;
+        }
+        if (!category_.empty() || metadataPosition_ == metadata_.size())
+            return false;
+        event = metadata_[metadataPosition_++];
+        nanos = 0;
+        return true;
+    }
+};
+
+/**
+ * @brief Open a JSON, binary or Perfetto trace, detected from its content.
+ *
+ * @param path Path of the trace.
+ * @return std::unique_ptr<TraceSource> The source, or nullptr if the file cannot be opened.
+ */
+inline std::unique_ptr<TraceSource> openTraceSource(const std::string& path)
+{
+    std::ifstream inputFile(path, std::ios::binary);
+    if (!inputFile)
+    {
+        std::cerr << "Failed to open file: " << path << '\n';
+        return nullptr;
+    }
+    if (binary_format::isBinaryTrace(inputFile))
+        return std::make_unique<BinaryTraceSource>(path);
+    if (perfetto_format::isPerfettoTrace(inputFile))
+        return std::make_unique<PerfettoTraceSource>(path);
+    return std::make_unique<JsonTraceSource>(path);
+}
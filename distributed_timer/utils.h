@@ -1,11 +1,18 @@
 #pragma once
+#include <cstdio>
+#include <cstring>
+#include <cstdint>
+#include <iostream>
+#include <string>
 
 #ifdef _WIN32
 #include <windows.h>
 #include <psapi.h>
 #else
 #include <unistd.h>
+#include <pthread.h>
 #include <sys/resource.h>
+#include <sys/syscall.h>
 #endif
 
 /**
@@ -46,4 +53,145 @@ size_t getCurrentMemoryDraw()
     fclose(fp);
     return (size_t)rss * (size_t)sysconf(_SC_PAGESIZE);
 #endif
-}
\ No newline at end of file
+}
+
+/**
+ * @brief Resource usage of the process, as sampled by the timer's memory sampler.
+ */
+struct process_stats_t {
+    uint64_t residentBytes = 0;  ///< Resident set size.
+    uint64_t virtualBytes = 0;   ///< Virtual memory size.
+    uint64_t sharedBytes = 0;    ///< Resident pages backed by files (Linux only).
+    uint64_t minorFaults = 0;    ///< Page faults served without I/O since the process started.
+    uint64_t majorFaults = 0;    ///< Page faults that needed I/O since the process started.
+    uint64_t userMillis = 0;     ///< CPU time spent in user mode.
+    uint64_t systemMillis = 0;   ///< CPU time spent in the kernel.
+    uint64_t threads = 0;        ///< Number of threads (Linux only).
+};
+
+/**
+ * @brief Get the current resource usage of the process.
+ *
+ * On Windows, it uses GetProcessMemoryInfo and GetProcessTimes.
+ * On Linux, it reads /proc/self/statm and /proc/self/stat.
+ *
+ * @param stats Filled with the current values. Fields that could not be read are left untouched.
+ * @return bool Returns false if the information could not be read.
+ */
+bool getProcessStats(process_stats_t &stats)
+{
+#ifdef _WIN32
+    PROCESS_MEMORY_COUNTERS pmc;
+    FILETIME creation, exit, kernel, user;
+    if (!GetProcessMemoryInfo(GetCurrentProcess(), &pmc, sizeof(pmc)) ||
+        !GetProcessTimes(GetCurrentProcess(), &creation, &exit, &kernel, &user))
+    {
+        return false;
+    }
+    auto millis = [](const FILETIME &time) { return ((uint64_t(time.dwHighDateTime) << 32) | time.dwLowDateTime) / 10000; };
+    stats.residentBytes = pmc.WorkingSetSize;
+    stats.virtualBytes = pmc.PagefileUsage;
+    stats.minorFaults = pmc.PageFaultCount;
+    stats.userMillis = millis(user);
+    stats.systemMillis = millis(kernel);
+    return true;
+#else
+    static const uint64_t pageSize = sysconf(_SC_PAGESIZE);
+    static const uint64_t ticksPerSecond = sysconf(_SC_CLK_TCK);
+
+    unsigned long long size = 0, resident = 0, shared = 0;
+    FILE *fp = NULL;
+    if ((fp = fopen("/proc/self/statm", "r")) == NULL)
+        return false;
+    int read = fscanf(fp, "%llu %llu %llu", &size, &resident, &shared);
+    fclose(fp);
+    if (read != 3)
+        return false;
+    stats.virtualBytes = size * pageSize;
+    stats.residentBytes = resident * pageSize;
+    stats.sharedBytes = shared * pageSize;
+
+    // The command name may contain spaces, the fields of interest follow its closing parenthesis.
+    char buffer[1024];
+    if ((fp = fopen("/proc/self/stat", "r")) == NULL)
+        return false;
+    size_t length = fread(buffer, 1, sizeof(buffer) - 1, fp);
+    fclose(fp);
+    buffer[length] = '\0';
+    const char *fields = strrchr(buffer, ')');
+    unsigned long long minorFaults = 0, majorFaults = 0, user = 0, system = 0, threads = 0;
+    if (fields == NULL ||
+        sscanf(fields + 1, " %*c %*d %*d %*d %*d %*d %*u %llu %*u %llu %*u %llu %llu %*d %*d %*d %*d %llu",
+               &minorFaults, &majorFaults, &user, &system, &threads) != 5)
+    {
+        return false;
+    }
+    stats.minorFaults = minorFaults;
+    stats.majorFaults = majorFaults;
+    stats.userMillis = user * 1000 / ticksPerSecond;
+    stats.systemMillis = system * 1000 / ticksPerSecond;
+    stats.threads = threads;
+    return true;
+#endif
+}
+
+/**
+ * @brief Get the id of the calling thread as shown by the OS (gettid on Linux, GetCurrentThreadId on Windows).
+ */
+uint32_t getCurrentThreadId()
+{
+#ifdef _WIN32
+    return GetCurrentThreadId();
+#else
+    return static_cast<uint32_t>(syscall(SYS_gettid));
+#endif
+}
+
+/**
+ * @brief Get the id of the process.
+ */
+uint32_t getCurrentProcessId()
+{
+#ifdef _WIN32
+    return GetCurrentProcessId();
+#else
+    return static_cast<uint32_t>(getpid());
+#endif
+}
+
+/**
+ * @brief Get the name the OS knows the calling thread by, e.g. set by pthread_setname_np.
+ *
+ * @return std::string The name, or an empty string if it cannot be read (always on Windows).
+ */
+std::string getCurrentThreadName()
+{
+#ifdef _WIN32
+    return std::string();
+#else
+    char name[64] = {};
+    if (pthread_getname_np(pthread_self(), name, sizeof(name)) != 0)
+        return std::string();
+    return name;
+#endif
+}
+
+/**
+ * @brief Get the name of the process' executable, without its directory.
+ *
+ * @return std::string The name, or an empty string if it cannot be read.
+ */
+std::string getCurrentProcessName()
+{
+#ifdef _WIN32
+    char path[MAX_PATH] = {};
+    DWORD length = GetModuleFileNameA(NULL, path, MAX_PATH);
+    std::string name(path, length);
+#else
+    char path[4096] = {};
+    ssize_t length = readlink("/proc/self/exe", path, sizeof(path) - 1);
+    std::string name(path, length > 0 ? length : 0);
+#endif
+    size_t separator = name.find_last_of("/\\");
+    return separator == std::string::npos ? name : name.substr(separator + 1);
+}
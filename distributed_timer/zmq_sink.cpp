@@ -0,0 +1,55 @@
+#include "zmq_sink.h"
+#include <unistd.h>
+#include <climits>
+#include <iostream>
+
+namespace {
+
+std::string defaultSource()
+{
+    char hostname[HOST_NAME_MAX + 1] = {};
+    gethostname(hostname, sizeof(hostname) - 1);
+    return std::string(hostname) + ":" + std::to_string(getpid());
+}
+
+}
+
+ZmqSink::ZmqSink(const std::string &endpoint, std::string source, int sendHighWaterMark)
+    : context_(1), socket_(context_, zmq::socket_type::push), source_(source.empty() ? defaultSource() : std::move(source))
+{
+    socket_.setsockopt(ZMQ_SNDHWM, sendHighWaterMark);
+    // Queued batches get a moment to reach the collector when the sink closes, but never hold up the process.
+    socket_.setsockopt(ZMQ_LINGER, 1000);
+    socket_.connect(endpoint);
+}
+
+bool ZmqSink::_send(int64_t watermarkNanos, uint32_t flags, const std::string &batch)
+{
+    collector_protocol::batch_header_t header{sequence_, watermarkNanos, droppedBatches(), droppedEvents(), flags, 0};
+    zmq::message_t sourceFrame(source_.data(), source_.size());
+    // The high-water mark is only checked on the first frame; the rest of an accepted message always follows.
+    if (!socket_.send(sourceFrame, zmq::send_flags::sndmore | zmq::send_flags::dontwait))
+        return false;
+    zmq::message_t headerFrame(&header, sizeof(header));
+    socket_.send(headerFrame, zmq::send_flags::sndmore);
+    zmq::message_t batchFrame(batch.data(), batch.size());
+    socket_.send(batchFrame, zmq::send_flags::none);
+    ++sequence_;
+    return true;
+}
+
+bool ZmqSink::write(const std::string &batch, size_t eventCount, int64_t watermarkNanos)
+{
+    if (_send(watermarkNanos, 0, batch))
+        return true;
+    droppedBatches_.fetch_add(1, std::memory_order_relaxed);
+    droppedEvents_.fetch_add(eventCount, std::memory_order_relaxed);
+    return false;
+}
+
+void ZmqSink::close()
+{
+    if (!_send(INT64_MAX, collector_protocol::kLastBatch, std::string()))
+        std::cerr << "Failed to tell the collector that " << source_ << " is done: its queue is full." << std::endl;
+    socket_.close();
+}
@@ -0,0 +1,67 @@
+#pragma once
+#include <atomic>
+#include <cstdint>
+#include <string>
+#include <zmq.hpp>
+#include "trace_sink.h"
+
+/**
+ * @brief Messages sent by ZmqSink to distributed_timer_collector.
+ *
+ * Every batch is one three-frame message: the source name, a batch_header_t, and the batch itself,
+ * a binary trace whose string ids continue those of the source's previous batches.
+ */
+namespace collector_protocol {
+
+constexpr uint32_t kLastBatch = 1; ///< The source sends nothing after this batch.
+
+struct batch_header_t {
+    uint64_t sequence;       ///< Index of the batch among the source's sent batches. Gaps are batches lost in transit.
+    int64_t watermarkNanos;  ///< Later batches only hold events at or after this time.
+    uint64_t droppedBatches; ///< Batches the source dropped so far because the collector was not keeping up.
+    uint64_t droppedEvents;  ///< Events in those batches.
+    uint32_t flags;
+    uint32_t reserved;
+};
+
+static_assert(sizeof(batch_header_t) == 40, "batch_header_t is expected to be 40 bytes");
+
+} // namespace collector_protocol
+
+/**
+ * @brief TraceSink pushing batches to distributed_timer_collector over a ZMQ PUSH socket.
+ *
+ * Sends never block: once sendHighWaterMark batches are queued for a collector that is not
+ * keeping up, further batches are dropped and counted, and the counts travel with the next batch.
+ */
+class ZmqSink : public TraceSink
+{
+public:
+    /**
+     * @brief Connect to a collector.
+     *
+     * @param endpoint Endpoint the collector is bound to, e.g. tcp://localhost:5555.
+     * @param source Name of this process in the collector's statistics, hostname:pid by default.
+     * @param sendHighWaterMark Batches queued before new ones are dropped.
+     */
+    ZmqSink(const std::string &endpoint, std::string source = "", int sendHighWaterMark = 64);
+
+    bool write(const std::string &batch, size_t eventCount, int64_t watermarkNanos) override;
+
+    void close() override;
+
+    uint64_t droppedBatches() const { return droppedBatches_.load(std::memory_order_relaxed); }
+
+    uint64_t droppedEvents() const { return droppedEvents_.load(std::memory_order_relaxed); }
+
+private:
+    zmq::context_t context_;
+    zmq::socket_t socket_;
+    std::string source_;
+    uint64_t sequence_ = 0;
+    std::atomic<uint64_t> droppedBatches_{0};
+    std::atomic<uint64_t> droppedEvents_{0};
+
+    // Sends one message without blocking. Returns false if the queue is full.
+    bool _send(int64_t watermarkNanos, uint32_t flags, const std::string &batch);
+};
@@ -1,4 +1,5 @@
-#include "timer.h"
+#include "scoped_timer.h"
+#include "zmq_sink.h"
 #include <iostream>
 #include <thread>
 #include <zmq.hpp>
@@ -26,6 +27,7 @@ int main(int argc, char **argv)
     std::unordered_map<std::string, std::string> emptyArgs;
 
     // Initialize a ZMQ context
+    timer.start("ZMQ Setup", "Setup", emptyArgs);
     zmq::context_t context(1);
 
     // Create a ZMQ socket for request-reply
@@ -33,12 +35,17 @@ int main(int argc, char **argv)
 
     // Check for command-line arguments to determine network
     std::string server_address = "tcp://localhost:12345"; // Default to localhost
-    if (argc ==2 && std::strcmp(argv[1], "--docker") == 0)
+    for (int i = 1; i < argc; ++i)
     {
-        server_address = "tcp://server:12345"; // Use Docker network
-    }
-    else{
-        server_address = "tcp://localhost:12345";
+        if (std::strcmp(argv[i], "--docker") == 0)
+        {
+            server_address = "tcp://server:12345"; // Use Docker network
+        }
+        else if (std::strcmp(argv[i], "--collector") == 0 && i + 1 < argc)
+        {
+            // Stream the events to a distributed_timer_collector as they are recorded
+            timer.enableStreaming(std::make_shared<ZmqSink>(argv[++i]));
+        }
     }
 
     while (true)
@@ -57,25 +64,35 @@ int main(int argc, char **argv)
 
     for (int i = 0; i < numIters; ++i)
     {
+        DT_SCOPE(timer, "Client Loop", "Iteration");
 
         unsigned int size = size_gen(gen);
         std::unordered_map<std::string, std::string> args = {{"iteration", std::to_string(i)}, {"size", std::to_string(size)}};
-        timer.start("Client Processing", std::to_string(i), args);
+        timer.start("Client Processing", std::to_string(i), traceArg("iteration", i), traceArg("size", size));
         double result = processing(size);
-        timer.stop("Client Processing", std::to_string(i), args);
+        timer.stop("Client Processing", std::to_string(i), traceArg("iteration", i), traceArg("size", size));
 
-        // Send the result
-        std::string message = "RESULT: " + std::to_string(result);
+        // Send the result, with the id that links the request's events in both processes
+        uint64_t traceId = Timer::newTraceId();
+        timer.startAsync("Client Request", "Request", traceId, args);
+        std::string message = "RESULT: " + std::to_string(result) + " TRACE: " + trace_context::format(traceId);
         zmq::message_t request(message.size());
         memcpy(request.data(), message.c_str(), message.size());
         timer.start("Client Send", std::to_string(i), args);
+        timer.addFlowEvent("Client Send", "Request", traceId, FlowPoint::Start);
+        timer.addClockSyncMarker(std::to_string(i), ClockSyncPoint::Send);
         socket.send(request, zmq::send_flags::none);
+        timer.stop("Client Send", std::to_string(i), args);
 
         // Receive a response from the server (optional based on server's behavior)
         zmq::message_t reply;
         auto _ = socket.recv(reply, zmq::recv_flags::none);
-        timer.stop("Server Send", std::to_string(i), args);
+        timer.addClockSyncMarker(std::to_string(i), ClockSyncPoint::Receive);
+        timer.start("Client Receive", std::to_string(i), args);
+        timer.addFlowEvent("Client Receive", "Request", traceId, FlowPoint::End);
         std::string replyStr(static_cast<char *>(reply.data()), reply.size());
+        timer.stop("Client Receive", std::to_string(i), args);
+        timer.stopAsync("Client Request", "Request", traceId, args);
 
         std::cout << "Server replied with: " << replyStr << std::endl;
     }
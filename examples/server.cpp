@@ -1,4 +1,6 @@
 #include "timer.h"
+#include "zmq_sink.h"
+#include <cstring>
 #include <iostream>
 #include <zmq.hpp>
 #include <map>
@@ -14,6 +16,11 @@ double server_processing(double client_result, int n) {
 int main(int argc, char** argv) {
     constexpr int numIters = 100;
     Timer timer("../logs/server-times.json", TimerOperation::Chrome);
+    for (int i = 1; i + 1 < argc; ++i) {
+        // Stream the events to a distributed_timer_collector as they are recorded
+        if (std::strcmp(argv[i], "--collector") == 0)
+            timer.enableStreaming(std::make_shared<ZmqSink>(argv[i + 1]));
+    }
 
     // Initialize a ZMQ context
     std::unordered_map<std::string, std::string> emptyArgs;
@@ -28,6 +35,7 @@ int main(int argc, char** argv) {
 
     // Bind to the specified address
     socket.bind(bind_address);
+    timer.stop("ZMQ Setup", "Setup", emptyArgs);
 
     for (int i = 0; i < numIters; ++i) {
         std::cout << "Awaiting client result..." << std::endl;
@@ -36,14 +44,19 @@ int main(int argc, char** argv) {
         // Receive client's "RESULT"
         zmq::message_t request;
         auto _ = socket.recv(request, zmq::recv_flags::none);
-        timer.stop("Client Send", std::to_string(i), args);
+        timer.addClockSyncMarker(std::to_string(i), ClockSyncPoint::Receive);
         std::string requestStr(static_cast<char*>(request.data()), request.size());
 
         if (requestStr.find("RESULT:") == 0) {
-            // Extract the result value from the received string
+            // Extract the result value and the client's trace id from the received string
             double client_result = std::stod(requestStr.substr(8));
+            uint64_t traceId = 0;
+            size_t tracePos = requestStr.find(" TRACE: ");
+            bool traced = tracePos != std::string::npos && trace_context::parse(requestStr.substr(tracePos + 8), traceId);
 
             timer.start("Server Processing", std::to_string(i), args);
+            if (traced)
+                timer.addFlowEvent("Server Processing", "Request", traceId, FlowPoint::Step);
             // Process the client's result and get the server's result
             double server_result = server_processing(client_result, i);
             timer.stop("Server Processing", std::to_string(i), args);
@@ -53,7 +66,9 @@ int main(int argc, char** argv) {
             zmq::message_t reply(resultStr.size());
             memcpy(reply.data(), resultStr.c_str(), resultStr.size());
             timer.start("Server Send", std::to_string(i), args);
+            timer.addClockSyncMarker(std::to_string(i), ClockSyncPoint::Send);
             socket.send(reply, zmq::send_flags::none);
+            timer.stop("Server Send", std::to_string(i), args);
 
         }
     }